@@ -0,0 +1,463 @@
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <getopt.h>
+#include <stdbool.h>
+
+#include "sparse.h"
+#include "util.h"
+#include "format.h"
+#include "key.h"
+#include "crc.h"
+#include "radix.h"
+#include "bitmap.h"
+#include "popcount.h"
+#include "pex.h"
+
+/*
+ * Microbenchmarks of the helpers that dominate the cpu time of commands
+ * that scan entire volumes.  Each benchmark runs its operation over
+ * synthetic inputs that are generated from a fixed seed so that results
+ * are comparable across builds.
+ *
+ * The number of iterations is calibrated by doubling until a run takes
+ * the target time, or can be fixed on the command line.  Each
+ * benchmark is run a number of times and the fastest and median runs
+ * are reported.
+ */
+
+#define NR_KEYS		4096
+#define NR_BLOCKS	16
+#define NR_PEX		64
+#define BITMAP_BITS	SCOUTFS_RADIX_BITS
+#define MAX_RUNS	100
+#define RADIX_HEIGHT	3
+
+#define NSEC_PER_MSEC	1000000ULL
+#define NSEC_PER_SEC	1000000000ULL
+
+struct bench {
+	char *name;
+	/* bytes processed by each op for GB/s, 0 if it doesn't apply */
+	u64 bytes;
+	u64 (*func)(u64 iters);
+};
+
+static u64 seed = 0x5c0f75eedULL;
+
+static struct scoutfs_key keys[NR_KEYS];
+static struct scoutfs_key_be be_keys[NR_KEYS];
+static char *blocks;
+static u8 pex_buf[NR_PEX * (sizeof(struct scoutfs_packed_extent) + 8)];
+static unsigned pex_len;
+static u64 bits[NR_KEYS];
+static unsigned long *bitmap;
+
+/* results are accumulated here so that the ops can't be optimized out */
+static volatile u64 sink;
+
+/* xorshift64, the inputs only need to be repeatable */
+static u64 next_rand(void)
+{
+	seed ^= seed << 13;
+	seed ^= seed >> 7;
+	seed ^= seed << 17;
+	return seed;
+}
+
+static u64 now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+static u64 bench_crc32c_64(u64 iters)
+{
+	u32 crc = ~0;
+	u64 i;
+
+	for (i = 0; i < iters; i++)
+		crc = crc32c(crc, blocks + ((i % NR_BLOCKS) * SCOUTFS_BLOCK_SIZE),
+			     64);
+
+	return crc;
+}
+
+static u64 bench_crc32c_4k(u64 iters)
+{
+	u32 crc = ~0;
+	u64 i;
+
+	for (i = 0; i < iters; i++)
+		crc = crc32c(crc, blocks + ((i % NR_BLOCKS) * SCOUTFS_BLOCK_SIZE),
+			     SCOUTFS_BLOCK_SIZE);
+
+	return crc;
+}
+
+static u64 bench_crc_block(u64 iters)
+{
+	u64 ret = 0;
+	u64 i;
+
+	for (i = 0; i < iters; i++)
+		ret += crc_block((void *)blocks +
+				 ((i % NR_BLOCKS) * SCOUTFS_BLOCK_SIZE));
+
+	return ret;
+}
+
+static u64 bench_key_compare(u64 iters)
+{
+	u64 ret = 0;
+	u64 i;
+
+	for (i = 0; i < iters; i++)
+		ret += scoutfs_key_compare(&keys[i % NR_KEYS],
+					   &keys[(i + 1) % NR_KEYS]);
+
+	return ret;
+}
+
+static u64 bench_key_to_be(u64 iters)
+{
+	u64 i;
+
+	for (i = 0; i < iters; i++)
+		scoutfs_key_to_be(&be_keys[i % NR_KEYS], &keys[i % NR_KEYS]);
+
+	return be_keys[iters % NR_KEYS].sk_type;
+}
+
+static u64 bench_key_from_be(u64 iters)
+{
+	u64 i;
+
+	for (i = 0; i < iters; i++)
+		scoutfs_key_from_be(&keys[i % NR_KEYS], &be_keys[i % NR_KEYS]);
+
+	return keys[iters % NR_KEYS].sk_type;
+}
+
+/* decode all the packed extents in an item, as print and fsck do */
+static u64 bench_pex_decode(u64 iters)
+{
+	struct pex_decoder dec;
+	struct pex_extent ext;
+	u64 ret = 0;
+	u64 i;
+
+	for (i = 0; i < iters; i++) {
+		pex_decode_start(&dec, 0);
+		pex_decode_item(&dec, pex_buf, pex_len);
+		while (pex_decode_next(&dec, &ext) > 0)
+			ret += ext.blkno;
+	}
+
+	return ret;
+}
+
+static u64 bench_radix_calc_level_inds(u64 iters)
+{
+	int inds[RADIX_HEIGHT];
+	u64 ret = 0;
+	u64 i;
+
+	for (i = 0; i < iters; i++) {
+		radix_calc_level_inds(inds, RADIX_HEIGHT, bits[i % NR_KEYS]);
+		ret += inds[0];
+	}
+
+	return ret;
+}
+
+/* iterate over all the set bits in a sparsely populated radix leaf */
+static u64 bench_find_next_set_bit(u64 iters)
+{
+	u64 ret = 0;
+	u64 nr;
+	u64 i;
+
+	for (i = 0; i < iters; i++) {
+		nr = 0;
+		while ((nr = find_next_set_bit(bitmap, nr, BITMAP_BITS)) <
+		       BITMAP_BITS) {
+			ret += nr;
+			nr++;
+		}
+	}
+
+	return ret;
+}
+
+/* count the bits in full blocks, like bloom and radix bitmaps */
+static u64 bench_popcount_4k(u64 iters)
+{
+	u64 ret = 0;
+	u64 i;
+
+	for (i = 0; i < iters; i++)
+		ret += popcount_words(blocks +
+				      ((i % NR_BLOCKS) * SCOUTFS_BLOCK_SIZE),
+				      SCOUTFS_BLOCK_SIZE / sizeof(u64));
+
+	return ret;
+}
+
+/* calculate the totals of full radix leaf blocks */
+static u64 bench_radix_leaf_totals(u64 iters)
+{
+	struct radix_totals tot;
+	u64 ret = 0;
+	u64 i;
+
+	for (i = 0; i < iters; i++) {
+		radix_leaf_totals((void *)blocks +
+				  ((i % NR_BLOCKS) * SCOUTFS_BLOCK_SIZE), &tot);
+		ret += tot.sm_total + tot.lg_total;
+	}
+
+	return ret;
+}
+
+static struct bench benches[] = {
+	{ "crc32c_64", 64, bench_crc32c_64 },
+	{ "crc32c_4k", SCOUTFS_BLOCK_SIZE, bench_crc32c_4k },
+	{ "crc_block", SCOUTFS_BLOCK_SIZE, bench_crc_block },
+	{ "key_compare", 2 * sizeof(struct scoutfs_key), bench_key_compare },
+	{ "key_to_be", sizeof(struct scoutfs_key), bench_key_to_be },
+	{ "key_from_be", sizeof(struct scoutfs_key), bench_key_from_be },
+	/* bytes set once the extents are packed */
+	{ "pex_decode", 0, bench_pex_decode },
+	{ "radix_calc_level_inds", 0, bench_radix_calc_level_inds },
+	{ "find_next_set_bit", BITMAP_BITS / 8, bench_find_next_set_bit },
+	{ "popcount_4k", SCOUTFS_BLOCK_SIZE, bench_popcount_4k },
+	{ "radix_leaf_totals", SCOUTFS_BLOCK_SIZE, bench_radix_leaf_totals },
+};
+
+/*
+ * Keys are mostly in the fs zone with nearby inode numbers so that
+ * comparisons often have to look past the first fields.
+ */
+static int setup_inputs(void)
+{
+	struct pex_encoder enc;
+	struct pex_extent ext;
+	u64 blkno;
+	s64 delta;
+	u64 r;
+	int i;
+
+	blocks = malloc(NR_BLOCKS * SCOUTFS_BLOCK_SIZE);
+	bitmap = alloc_bits(BITMAP_BITS);
+	if (!blocks || !bitmap) {
+		fprintf(stderr, "failed to allocate inputs\n");
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < (NR_BLOCKS * SCOUTFS_BLOCK_SIZE) / sizeof(u64); i++)
+		((u64 *)blocks)[i] = next_rand();
+
+	for (i = 0; i < NR_KEYS; i++) {
+		r = next_rand();
+		memset(&keys[i], 0, sizeof(keys[i]));
+		keys[i].sk_zone = (r & 15) ? SCOUTFS_FS_ZONE :
+					     SCOUTFS_INODE_INDEX_ZONE;
+		keys[i]._sk_first = cpu_to_le64(1000 + ((r >> 4) & 7));
+		keys[i].sk_type = (r >> 8) & 7;
+		keys[i]._sk_second = cpu_to_le64((r >> 12) & 3);
+		keys[i]._sk_third = cpu_to_le64(r >> 16);
+		keys[i]._sk_fourth = r >> 56;
+		scoutfs_key_to_be(&be_keys[i], &keys[i]);
+
+		bits[i] = next_rand() % (SCOUTFS_RADIX_BITS *
+					 SCOUTFS_RADIX_REFS *
+					 SCOUTFS_RADIX_REFS);
+	}
+
+	pex_encode_start(&enc, 0);
+	pex_encode_item(&enc, pex_buf, sizeof(pex_buf));
+	blkno = 1ULL << 40;
+	for (i = 0; i < NR_PEX; i++) {
+		r = next_rand();
+		ext.iblock = enc.iblock;
+		ext.count = 1 + (r & 255);
+		ext.flags = 0;
+		ext.final = (i == NR_PEX - 1);
+
+		/* mostly small forward and backward seeks */
+		delta = (r >> 8) & ((1ULL << (8 * (1 + ((r >> 60) & 3)))) - 1);
+		if (r & (1ULL << 63))
+			delta = -delta;
+		ext.blkno = delta ? blkno + delta : 0;
+		if (ext.blkno)
+			blkno = ext.blkno + ext.count - 1;
+
+		pex_encode_next(&enc, &ext);
+	}
+	pex_len = enc.len;
+
+	for (i = 0; i < array_size(benches); i++) {
+		if (benches[i].func == bench_pex_decode)
+			benches[i].bytes = pex_len;
+	}
+
+	for (i = 0; i < BITMAP_BITS / 64; i++) {
+		r = next_rand();
+		set_bit(bitmap, (i * 64) + (r & 63));
+	}
+
+	return 0;
+}
+
+static int cmp_u64(const void *A, const void *B)
+{
+	const u64 *a = A;
+	const u64 *b = B;
+
+	return scoutfs_cmp(*a, *b);
+}
+
+static void run_bench(struct bench *bn, u64 target_ns, u64 fixed_iters,
+		      int nr_runs)
+{
+	u64 runs[MAX_RUNS];
+	u64 iters;
+	u64 start;
+	u64 ns;
+	double best;
+	double med;
+	int i;
+
+	/* double the iterations until a run takes the target time */
+	iters = fixed_iters;
+	if (!iters) {
+		for (iters = 1; ; iters *= 2) {
+			start = now_ns();
+			sink += bn->func(iters);
+			if (now_ns() - start >= target_ns)
+				break;
+		}
+	}
+
+	for (i = 0; i < nr_runs; i++) {
+		start = now_ns();
+		sink += bn->func(iters);
+		runs[i] = now_ns() - start;
+	}
+
+	qsort(runs, nr_runs, sizeof(runs[0]), cmp_u64);
+
+	best = (double)runs[0] / iters;
+	med = (double)runs[nr_runs / 2] / iters;
+
+	printf("%-24s %12llu %10.2f %10.2f", bn->name, iters, best, med);
+	if (bn->bytes) {
+		ns = runs[0] ? runs[0] : 1;
+		printf(" %8.2f", (double)bn->bytes * iters / ns);
+	}
+	printf("\n");
+}
+
+static void usage(void)
+{
+	int i;
+
+	fprintf(stderr, "usage: bench [-i iters] [-r runs] [-t msecs] [name ...]\n"
+		"  -i  fixed number of iterations per run\n"
+		"  -r  number of runs of each benchmark (default 5)\n"
+		"  -t  target milliseconds per run when calibrating (default 200)\n"
+		"benchmarks:\n");
+	for (i = 0; i < array_size(benches); i++)
+		fprintf(stderr, "  %s\n", benches[i].name);
+}
+
+static struct option long_ops[] = {
+	{ "iters", 1, NULL, 'i' },
+	{ "runs", 1, NULL, 'r' },
+	{ "time", 1, NULL, 't' },
+	{ NULL, 0, NULL, 0}
+};
+
+int main(int argc, char **argv)
+{
+	u64 target_ns = 200 * NSEC_PER_MSEC;
+	u64 fixed_iters = 0;
+	int nr_runs = 5;
+	bool found;
+	char *end;
+	int ret;
+	int c;
+	int i;
+	int j;
+
+	while ((c = getopt_long(argc, argv, "i:r:t:", long_ops, NULL)) != -1) {
+		switch (c) {
+		case 'i':
+			fixed_iters = strtoull(optarg, &end, 0);
+			if (*end != '\0' || fixed_iters == 0) {
+				fprintf(stderr, "invalid iterations '%s'\n", optarg);
+				return 1;
+			}
+			break;
+		case 'r':
+			nr_runs = strtol(optarg, &end, 0);
+			if (*end != '\0' || nr_runs < 1 || nr_runs > MAX_RUNS) {
+				fprintf(stderr, "runs must be between 1 and %u\n",
+					MAX_RUNS);
+				return 1;
+			}
+			break;
+		case 't':
+			target_ns = strtoull(optarg, &end, 0) * NSEC_PER_MSEC;
+			if (*end != '\0' || target_ns == 0) {
+				fprintf(stderr, "invalid target time '%s'\n", optarg);
+				return 1;
+			}
+			break;
+		case '?':
+		default:
+			usage();
+			return 1;
+		}
+	}
+
+	for (i = optind; i < argc; i++) {
+		found = false;
+		for (j = 0; j < array_size(benches); j++) {
+			if (strcmp(argv[i], benches[j].name) == 0)
+				found = true;
+		}
+		if (!found) {
+			fprintf(stderr, "unknown benchmark '%s'\n", argv[i]);
+			usage();
+			return 1;
+		}
+	}
+
+	ret = setup_inputs();
+	if (ret)
+		return 1;
+
+	printf("%-24s %12s %10s %10s %8s\n",
+	       "name", "iters", "best ns/op", "med ns/op", "GB/s");
+
+	for (j = 0; j < array_size(benches); j++) {
+		found = optind == argc;
+		for (i = optind; i < argc; i++) {
+			if (strcmp(argv[i], benches[j].name) == 0)
+				found = true;
+		}
+		if (found)
+			run_bench(&benches[j], target_ns, fixed_iters, nr_runs);
+	}
+
+	free(blocks);
+	free(bitmap);
+	return 0;
+}
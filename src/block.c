@@ -0,0 +1,578 @@
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "sparse.h"
+#include "util.h"
+#include "format.h"
+#include "list.h"
+#include "workq.h"
+#include "dev.h"
+#include "block.h"
+
+/*
+ * A simple cache of metadata blocks read from a device.  Commands that
+ * walk metadata structures read the same blocks over and over, most
+ * notably the upper levels of btrees as they're walked, so we keep
+ * blocks around in a hash table and only read them from the device
+ * once.
+ *
+ * Blocks are reference counted.  Callers get a reference from
+ * block_read() and drop it with block_put().  Only blocks without
+ * references are put on the lru and can be evicted as the cache grows
+ * past its limit.  If all the blocks are referenced then the cache
+ * grows past its limit until references are dropped.
+ *
+ * Walkers can tell the cache about blocks that they'll read soon with
+ * block_readahead().  The blocks are inserted in the cache and queued
+ * for a background thread which submits them to the device in large
+ * batches so that many reads can be in flight while the walker is
+ * working through blocks in order.  block_read() waits for blocks that
+ * are still being read.  Readahead is best effort, any problems reading
+ * the block are reported by the later block_read().
+ *
+ * The cache is protected by a single mutex that isn't held during the
+ * reads.
+ *
+ * A cache can also be created that maps the whole device or image file.
+ * Its blocks point into the mapping instead of having their contents
+ * copied into allocated buffers and readahead just advises the kernel.
+ * This is much cheaper for images that are already in the page cache.
+ * Blocks outside the mapping fail to read instead of faulting.
+ */
+
+#define BLOCK_FLAG_READING	(1 << 0)
+#define BLOCK_FLAG_ERROR	(1 << 1)
+
+struct block {
+	struct list_head hash_head;
+	struct list_head lru_head; /* also pending readahead */
+	u64 blkno;
+	unsigned int refcount;
+	unsigned int flags;
+	void *data;
+};
+
+struct block_cache {
+	pthread_mutex_t mutex;
+	pthread_cond_t read_cond;
+	struct workq *wq;
+	struct dev_ioq *ioq;
+	struct work ra_work;
+	struct list_head ra_pending;
+	bool ra_queued;
+	struct block *ra_blocks[BLOCK_READAHEAD_DEPTH];
+	struct dev_io ra_ios[BLOCK_READAHEAD_DEPTH];
+	int fd;
+	void *map;
+	u64 map_blocks;
+	u64 nr_blocks;
+	u64 nr_cached;
+	u64 nr_readahead;
+	unsigned int hash_bits;
+	struct list_head *hash;
+	struct list_head lru;
+
+	u64 hits;
+	u64 misses;
+	u64 readaheads;
+	u64 evictions;
+};
+
+static struct list_head *hash_bucket(struct block_cache *bc, u64 blkno)
+{
+	/* golden ratio multiplicative hash, blknos are often sequential */
+	u64 h = blkno * 0x61c8864680b583ebULL;
+
+	return &bc->hash[h >> (64 - bc->hash_bits)];
+}
+
+static void readahead_work(struct work *work);
+
+static struct block_cache *alloc_cache(int fd, u64 nr_blocks)
+{
+	struct block_cache *bc;
+	int i;
+
+	bc = calloc(1, sizeof(struct block_cache));
+	if (!bc)
+		return NULL;
+
+	pthread_mutex_init(&bc->mutex, NULL);
+	pthread_cond_init(&bc->read_cond, NULL);
+	bc->fd = fd;
+	bc->nr_blocks = max(nr_blocks, 1ULL);
+	bc->hash_bits = max(flsll(bc->nr_blocks), 1);
+	INIT_LIST_HEAD(&bc->lru);
+	INIT_LIST_HEAD(&bc->ra_pending);
+	work_init(&bc->ra_work, readahead_work);
+
+	bc->hash = malloc(sizeof(bc->hash[0]) << bc->hash_bits);
+	if (!bc->hash) {
+		free(bc);
+		return NULL;
+	}
+
+	for (i = 0; i < (1 << bc->hash_bits); i++)
+		INIT_LIST_HEAD(&bc->hash[i]);
+
+	return bc;
+}
+
+/*
+ * Create a cache of blocks read from the given fd.  The caller still
+ * owns the fd and is responsible for closing it after destroying the
+ * cache.
+ */
+struct block_cache *block_cache_create(int fd, u64 nr_blocks)
+{
+	struct block_cache *bc;
+
+	bc = alloc_cache(fd, nr_blocks);
+	if (!bc)
+		return NULL;
+
+	bc->wq = workq_create(1);
+	bc->ioq = dev_ioq_create(fd, BLOCK_READAHEAD_DEPTH);
+	if (!bc->wq || !bc->ioq) {
+		block_cache_destroy(bc);
+		return NULL;
+	}
+
+	return bc;
+}
+
+/*
+ * Create a cache whose blocks point into a read-only mapping of the
+ * first size bytes of the fd.
+ */
+struct block_cache *block_cache_create_mmap(int fd, u64 size)
+{
+	struct block_cache *bc;
+	void *map;
+
+	if (size < SCOUTFS_BLOCK_SIZE) {
+		fprintf(stderr, "%llu byte device too small to map\n", size);
+		return NULL;
+	}
+
+	bc = alloc_cache(fd, BLOCK_CACHE_DEFAULT_BLOCKS);
+	if (!bc)
+		return NULL;
+
+	bc->map_blocks = size >> SCOUTFS_BLOCK_SHIFT;
+	map = mmap(NULL, bc->map_blocks << SCOUTFS_BLOCK_SHIFT, PROT_READ,
+		   MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		fprintf(stderr, "failed to mmap %llu bytes: %s (%d)\n",
+			bc->map_blocks << SCOUTFS_BLOCK_SHIFT,
+			strerror(errno), errno);
+		block_cache_destroy(bc);
+		return NULL;
+	}
+
+	/* walks jump around, don't let the kernel read around faults */
+	madvise(map, bc->map_blocks << SCOUTFS_BLOCK_SHIFT, MADV_RANDOM);
+	bc->map = map;
+
+	return bc;
+}
+
+/*
+ * Create the cache that offline commands use to read the device or
+ * image file at the given path, optionally mapping the whole thing.
+ */
+struct block_cache *block_cache_open(char *path, int fd, bool use_mmap)
+{
+	u64 size;
+
+	if (!use_mmap)
+		return block_cache_create(fd, BLOCK_CACHE_DEFAULT_BLOCKS);
+
+	if (device_size(path, fd, &size))
+		return NULL;
+
+	return block_cache_create_mmap(fd, size);
+}
+
+static struct block *alloc_block(struct block_cache *bc, u64 blkno)
+{
+	struct block *bl;
+
+	bl = calloc(1, sizeof(struct block));
+	if (bl && bc->map) {
+		bl->data = bc->map + (blkno << SCOUTFS_BLOCK_SHIFT);
+	} else if (bl) {
+		bl->data = malloc(SCOUTFS_BLOCK_SIZE);
+		if (!bl->data) {
+			free(bl);
+			bl = NULL;
+		}
+	}
+	if (!bl)
+		return NULL;
+
+	INIT_LIST_HEAD(&bl->hash_head);
+	INIT_LIST_HEAD(&bl->lru_head);
+	bl->blkno = blkno;
+
+	return bl;
+}
+
+static void free_block(struct block_cache *bc, struct block *bl)
+{
+	if (!bc->map)
+		free(bl->data);
+	free(bl);
+}
+
+static void insert_block(struct block_cache *bc, struct block *bl)
+{
+	list_add(&bl->hash_head, hash_bucket(bc, bl->blkno));
+	bc->nr_cached++;
+}
+
+static void remove_block(struct block_cache *bc, struct block *bl)
+{
+	list_del_init(&bl->hash_head);
+	bc->nr_cached--;
+}
+
+/*
+ * Evict the least recently used unreferenced blocks until the cache is
+ * back under its limit.
+ */
+static void shrink_cache(struct block_cache *bc)
+{
+	struct block *bl;
+
+	while (bc->nr_cached > bc->nr_blocks && !list_empty(&bc->lru)) {
+		bl = list_first_entry(&bc->lru, struct block, lru_head);
+		list_del_init(&bl->lru_head);
+		remove_block(bc, bl);
+		free_block(bc, bl);
+		bc->evictions++;
+	}
+}
+
+/*
+ * Destroy the cache and free all its blocks.  The caller must have
+ * dropped all their references.  Any readahead still in flight is
+ * waited for.  The cache's statistics are printed to stderr so that
+ * they don't interfere with command output.
+ */
+void block_cache_destroy(struct block_cache *bc)
+{
+	struct block *bl;
+	struct block *tmp;
+	int i;
+
+	if (!bc)
+		return;
+
+	workq_destroy(bc->wq);
+	dev_ioq_destroy(bc->ioq);
+	if (bc->map)
+		munmap(bc->map, bc->map_blocks << SCOUTFS_BLOCK_SHIFT);
+
+	for (i = 0; i < (1 << bc->hash_bits); i++) {
+		list_for_each_entry_safe(bl, tmp, &bc->hash[i], hash_head) {
+			if (bl->refcount)
+				fprintf(stderr, "block cache: blkno %llu still has %u references\n",
+					bl->blkno, bl->refcount);
+			remove_block(bc, bl);
+			free_block(bc, bl);
+		}
+	}
+
+	if (bc->hits || bc->misses)
+		fprintf(stderr, "block cache: hits %llu misses %llu readaheads %llu evictions %llu\n",
+			bc->hits, bc->misses, bc->readaheads, bc->evictions);
+
+	pthread_mutex_destroy(&bc->mutex);
+	pthread_cond_destroy(&bc->read_cond);
+	free(bc->hash);
+	free(bc);
+}
+
+static struct block *find_block(struct block_cache *bc, u64 blkno)
+{
+	struct block *bl;
+
+	list_for_each_entry(bl, hash_bucket(bc, blkno), hash_head) {
+		if (bl->blkno == blkno)
+			return bl;
+	}
+
+	return NULL;
+}
+
+static int read_block_data(struct block_cache *bc, struct block *bl)
+{
+	ssize_t ret;
+
+	ret = pread(bc->fd, bl->data, SCOUTFS_BLOCK_SIZE,
+		    bl->blkno << SCOUTFS_BLOCK_SHIFT);
+	if (ret != SCOUTFS_BLOCK_SIZE)
+		return ret < 0 ? -errno : -EIO;
+
+	return 0;
+}
+
+/*
+ * Drop a reference with the mutex held.  Blocks that failed readahead
+ * have already been removed from the hash and are freed by the final
+ * reference.
+ */
+static void put_block_locked(struct block_cache *bc, struct block *bl)
+{
+	if (--bl->refcount == 0) {
+		if (bl->flags & BLOCK_FLAG_ERROR) {
+			free_block(bc, bl);
+		} else {
+			list_add_tail(&bl->lru_head, &bc->lru);
+			shrink_cache(bc);
+		}
+	}
+}
+
+/*
+ * Return a referenced block with the contents of the given block
+ * number, reading it from the device if it isn't cached.  NULL is
+ * returned if the block couldn't be allocated or read.
+ */
+struct block *block_read(struct block_cache *bc, u64 blkno)
+{
+	struct block *bl;
+	int ret;
+
+	pthread_mutex_lock(&bc->mutex);
+retry:
+	bl = find_block(bc, blkno);
+	if (bl) {
+		if (bl->refcount++ == 0)
+			list_del_init(&bl->lru_head);
+
+		while (bl->flags & BLOCK_FLAG_READING)
+			pthread_cond_wait(&bc->read_cond, &bc->mutex);
+
+		/* try reading ourselves if readahead failed */
+		if (bl->flags & BLOCK_FLAG_ERROR) {
+			put_block_locked(bc, bl);
+			goto retry;
+		}
+
+		bc->hits++;
+		pthread_mutex_unlock(&bc->mutex);
+		return bl;
+	}
+
+	bc->misses++;
+
+	if (bc->map && blkno >= bc->map_blocks) {
+		pthread_mutex_unlock(&bc->mutex);
+		fprintf(stderr, "blkno %llu is past the end of the %llu block mapping\n",
+			blkno, bc->map_blocks);
+		return NULL;
+	}
+
+	bl = alloc_block(bc, blkno);
+	if (!bl) {
+		pthread_mutex_unlock(&bc->mutex);
+		fprintf(stderr, "failed to allocate block %llu\n", blkno);
+		return NULL;
+	}
+
+	/* mapped blocks are always uptodate */
+	if (bc->map) {
+		bl->refcount = 1;
+		insert_block(bc, bl);
+		shrink_cache(bc);
+		pthread_mutex_unlock(&bc->mutex);
+		return bl;
+	}
+
+	/* concurrent readers wait for our read */
+	bl->refcount = 1;
+	bl->flags = BLOCK_FLAG_READING;
+	insert_block(bc, bl);
+	pthread_mutex_unlock(&bc->mutex);
+
+	ret = read_block_data(bc, bl);
+
+	pthread_mutex_lock(&bc->mutex);
+	bl->flags &= ~BLOCK_FLAG_READING;
+	if (ret < 0) {
+		bl->flags |= BLOCK_FLAG_ERROR;
+		remove_block(bc, bl);
+	}
+	pthread_cond_broadcast(&bc->read_cond);
+	if (ret < 0) {
+		put_block_locked(bc, bl);
+		bl = NULL;
+	} else {
+		shrink_cache(bc);
+	}
+	pthread_mutex_unlock(&bc->mutex);
+
+	if (ret < 0)
+		fprintf(stderr, "read blkno %llu failed: %s (%d)\n",
+			blkno, strerror(-ret), -ret);
+
+	return bl;
+}
+
+/*
+ * Read a block and check that its header has the magic that the
+ * caller expects and the blkno that it was read from.  Walkers use this
+ * before trusting any of the block's contents so that a bad reference
+ * in a corrupt image is reported instead of being parsed as the wrong
+ * type of block.  NULL is returned if the block couldn't be read or
+ * its header didn't match.
+ */
+struct block *block_read_hdr(struct block_cache *bc, u64 blkno, u32 magic)
+{
+	struct scoutfs_block_header *hdr;
+	struct block *bl;
+
+	bl = block_read(bc, blkno);
+	if (!bl)
+		return NULL;
+
+	hdr = bl->data;
+	if (le32_to_cpu(hdr->magic) != magic ||
+	    le64_to_cpu(hdr->blkno) != blkno) {
+		fprintf(stderr, "blkno %llu has magic %08x blkno %llu, expected magic %08x\n",
+			blkno, le32_to_cpu(hdr->magic),
+			le64_to_cpu(hdr->blkno), magic);
+		block_put(bc, bl);
+		return NULL;
+	}
+
+	return bl;
+}
+
+/*
+ * Submit batches of pending readahead blocks until there aren't any
+ * left.  There's only one readahead work so we can use the arrays in
+ * the cache to build the batches.
+ */
+static void readahead_work(struct work *work)
+{
+	struct block_cache *bc = container_of(work, struct block_cache,
+					      ra_work);
+	struct block *bl;
+	int nr;
+	int i;
+
+	for (;;) {
+		pthread_mutex_lock(&bc->mutex);
+		nr = 0;
+		while (nr < BLOCK_READAHEAD_DEPTH &&
+		       !list_empty(&bc->ra_pending)) {
+			bl = list_first_entry(&bc->ra_pending, struct block,
+					      lru_head);
+			list_del_init(&bl->lru_head);
+			bc->ra_blocks[nr] = bl;
+			bc->ra_ios[nr].blkno = bl->blkno;
+			bc->ra_ios[nr].buf = bl->data;
+			bc->ra_ios[nr].ret = 0;
+			nr++;
+		}
+		if (nr == 0)
+			bc->ra_queued = false;
+		pthread_mutex_unlock(&bc->mutex);
+
+		if (nr == 0)
+			break;
+
+		if (dev_ioq_rw(bc->ioq, bc->ra_ios, nr, false) < 0) {
+			for (i = 0; i < nr; i++)
+				bc->ra_ios[i].ret = -EIO;
+		}
+
+		pthread_mutex_lock(&bc->mutex);
+		for (i = 0; i < nr; i++) {
+			bl = bc->ra_blocks[i];
+			bl->flags &= ~BLOCK_FLAG_READING;
+			if (bc->ra_ios[i].ret < 0) {
+				bl->flags |= BLOCK_FLAG_ERROR;
+				remove_block(bc, bl);
+			}
+			bc->nr_readahead--;
+			put_block_locked(bc, bl);
+		}
+		pthread_cond_broadcast(&bc->read_cond);
+		pthread_mutex_unlock(&bc->mutex);
+	}
+}
+
+/*
+ * Start reading a block that the caller is going to read soon.  The
+ * readahead holds a reference to the block until its read completes.
+ * We limit the amount of readahead in flight so that it can't evict
+ * the blocks that were read ahead before they're used.
+ */
+void block_readahead(struct block_cache *bc, u64 blkno)
+{
+	struct block *bl;
+	bool queue;
+
+	if (bc->map) {
+		if (blkno < bc->map_blocks)
+			madvise(bc->map + (blkno << SCOUTFS_BLOCK_SHIFT),
+				SCOUTFS_BLOCK_SIZE, MADV_WILLNEED);
+		return;
+	}
+
+	pthread_mutex_lock(&bc->mutex);
+
+	if (find_block(bc, blkno) ||
+	    bc->nr_readahead >= max(bc->nr_blocks / 4, 1ULL) ||
+	    !(bl = alloc_block(bc, blkno))) {
+		pthread_mutex_unlock(&bc->mutex);
+		return;
+	}
+
+	bl->refcount = 1;
+	bl->flags = BLOCK_FLAG_READING;
+	insert_block(bc, bl);
+	list_add_tail(&bl->lru_head, &bc->ra_pending);
+	bc->nr_readahead++;
+	bc->readaheads++;
+	queue = !bc->ra_queued;
+	bc->ra_queued = true;
+	pthread_mutex_unlock(&bc->mutex);
+
+	if (queue)
+		workq_queue(bc->wq, &bc->ra_work);
+}
+
+/*
+ * Drop a reference to a block.  The final reference puts it at the
+ * tail of the lru where it will be the last to be evicted.
+ */
+void block_put(struct block_cache *bc, struct block *bl)
+{
+	if (!bl)
+		return;
+
+	pthread_mutex_lock(&bc->mutex);
+	put_block_locked(bc, bl);
+	pthread_mutex_unlock(&bc->mutex);
+}
+
+void *block_data(struct block *bl)
+{
+	return bl->data;
+}
+
+u64 block_blkno(struct block *bl)
+{
+	return bl->blkno;
+}
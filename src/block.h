@@ -0,0 +1,34 @@
+#ifndef _BLOCK_H_
+#define _BLOCK_H_
+
+#include <stdbool.h>
+
+/*
+ * The default number of blocks that a cache will hold before it starts
+ * evicting unreferenced blocks.  64MB of 4k blocks.
+ */
+#define BLOCK_CACHE_DEFAULT_BLOCKS (16 * 1024)
+
+/*
+ * The number of readahead reads that are submitted to the device in
+ * each batch.  Walkers are usually limited by device latency so this
+ * is the queue depth that readahead can keep in flight.
+ */
+#define BLOCK_READAHEAD_DEPTH 64
+
+struct block_cache;
+struct block;
+
+struct block_cache *block_cache_create(int fd, u64 nr_blocks);
+struct block_cache *block_cache_create_mmap(int fd, u64 size);
+struct block_cache *block_cache_open(char *path, int fd, bool use_mmap);
+void block_cache_destroy(struct block_cache *bc);
+
+struct block *block_read(struct block_cache *bc, u64 blkno);
+struct block *block_read_hdr(struct block_cache *bc, u64 blkno, u32 magic);
+void block_readahead(struct block_cache *bc, u64 blkno);
+void block_put(struct block_cache *bc, struct block *bl);
+void *block_data(struct block *bl);
+u64 block_blkno(struct block *bl);
+
+#endif
@@ -0,0 +1,218 @@
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <getopt.h>
+#include <stdbool.h>
+#include <math.h>
+
+#include "sparse.h"
+#include "util.h"
+#include "format.h"
+#include "cmd.h"
+#include "popcount.h"
+#include "block.h"
+#include "btree.h"
+
+/*
+ * bloom reports how full the bloom filter block of each log tree is.
+ * Reads of keys covered by a lock search every log tree whose bloom
+ * filter has the lock's bits set.  As a filter fills up it matches more
+ * locks that were never written to its tree and reads end up searching
+ * trees that can't contain their items.
+ *
+ * With k hash functions a lock that wasn't added to the filter matches
+ * if all k of its bits happen to be set, so the false positive rate is
+ * the fraction of set bits to the kth power.  The number of locks that
+ * were added can be estimated from the fill as -(m/k) * ln(1 - fill)
+ * for m bits.
+ */
+
+/* by default warn about filters that match more than 1% of other locks */
+#define BLOOM_DEFAULT_WARN_FP 1.0
+
+struct bloom_info {
+	struct block_cache *bc;
+	double warn_fp;
+	u64 trees;
+	u64 warnings;
+	u64 mismatches;
+};
+
+static int print_bloom(void *key, unsigned key_len, void *val,
+		       unsigned val_len, u64 blkno, void *arg)
+{
+	struct scoutfs_log_trees_key *ltk = key;
+	struct scoutfs_log_trees_val *ltv = val;
+	struct bloom_info *bi = arg;
+	struct scoutfs_bloom_block *bb;
+	struct block *bl;
+	double locks;
+	double fill;
+	double fp;
+	u64 set;
+
+	if (key_len != sizeof(*ltk) || val_len != sizeof(*ltv)) {
+		fprintf(stderr, "logs_root blkno %llu: item key_len %u val_len %u aren't log trees\n",
+			blkno, key_len, val_len);
+		return -EIO;
+	}
+
+	bi->trees++;
+	blkno = le64_to_cpu(ltv->bloom_ref.blkno);
+	if (blkno == 0) {
+		printf("%016llx.%-4llu %10s\n", be64_to_cpu(ltk->rid),
+		       be64_to_cpu(ltk->nr), "no bloom");
+		return 0;
+	}
+
+	bl = block_read(bi->bc, blkno);
+	if (!bl)
+		return -EIO;
+	bb = block_data(bl);
+
+	if (le32_to_cpu(bb->hdr.magic) != SCOUTFS_BLOCK_MAGIC_BLOOM ||
+	    le64_to_cpu(bb->hdr.blkno) != blkno) {
+		fprintf(stderr, "bloom blkno %llu: magic %08x blkno %llu aren't a bloom block\n",
+			blkno, le32_to_cpu(bb->hdr.magic),
+			le64_to_cpu(bb->hdr.blkno));
+		block_put(bi->bc, bl);
+		return -EIO;
+	}
+
+	set = popcount_words(bb->bits, SCOUTFS_FOREST_BLOOM_BITS / 64);
+	fill = (double)set / SCOUTFS_FOREST_BLOOM_BITS;
+	fp = pow(fill, SCOUTFS_FOREST_BLOOM_NRS) * 100.0;
+	locks = set == SCOUTFS_FOREST_BLOOM_BITS ? INFINITY :
+		-((double)SCOUTFS_FOREST_BLOOM_BITS / SCOUTFS_FOREST_BLOOM_NRS) *
+		log(1.0 - fill);
+
+	printf("%016llx.%-4llu %10llu %10llu %10llu %7.2f%% %10.0f %9.4f%%",
+	       be64_to_cpu(ltk->rid), be64_to_cpu(ltk->nr), blkno, set,
+	       le64_to_cpu(bb->total_set), fill * 100.0, locks, fp);
+
+	if (set != le64_to_cpu(bb->total_set)) {
+		printf(" total_set mismatch");
+		bi->mismatches++;
+	}
+	if (fp >= bi->warn_fp) {
+		printf(" near saturation");
+		bi->warnings++;
+	}
+	printf("\n");
+
+	block_put(bi->bc, bl);
+	return 0;
+}
+
+static int bloom_report(struct bloom_info *bi)
+{
+	struct scoutfs_super_block *super;
+	struct block *bl;
+	int ret;
+
+	bl = block_read(bi->bc, SCOUTFS_SUPER_BLKNO);
+	if (!bl)
+		return -EIO;
+	super = block_data(bl);
+
+	if (le32_to_cpu(super->hdr.magic) != SCOUTFS_BLOCK_MAGIC_SUPER) {
+		fprintf(stderr, "super block magic %08x != expected %08x\n",
+			le32_to_cpu(super->hdr.magic),
+			SCOUTFS_BLOCK_MAGIC_SUPER);
+		ret = -EIO;
+		goto out;
+	}
+
+	printf("bloom filters have %u bits and %u hash functions\n",
+	       (unsigned)SCOUTFS_FOREST_BLOOM_BITS, SCOUTFS_FOREST_BLOOM_NRS);
+	printf("%-21s %10s %10s %10s %8s %10s %10s\n",
+	       "log tree", "blkno", "set", "total_set", "fill", "est_locks",
+	       "false_pos");
+
+	ret = btree_walk(bi->bc, &super->logs_root, NULL, 0, NULL, 0,
+			 print_bloom, bi);
+	if (ret == 0)
+		printf("%llu log trees, %llu near saturation, %llu with mismatched total_set\n",
+		       bi->trees, bi->warnings, bi->mismatches);
+out:
+	block_put(bi->bc, bl);
+	return ret;
+}
+
+static struct option long_ops[] = {
+	{ "mmap", 0, NULL, 'm' },
+	{ "warn-fp", 1, NULL, 'w' },
+	{ NULL, 0, NULL, 0}
+};
+
+static int bloom_cmd(int argc, char **argv)
+{
+	struct bloom_info bi = {
+		.warn_fp = BLOOM_DEFAULT_WARN_FP,
+	};
+	bool use_mmap = false;
+	char *path;
+	char *end;
+	int ret;
+	int fd;
+	int c;
+
+	while ((c = getopt_long(argc, argv, "mw:", long_ops, NULL)) != -1) {
+		switch (c) {
+		case 'm':
+			use_mmap = true;
+			break;
+		case 'w':
+			bi.warn_fp = strtod(optarg, &end);
+			if (*end != '\0' || bi.warn_fp < 0 || bi.warn_fp > 100) {
+				fprintf(stderr, "invalid false positive percentage '%s'\n",
+					optarg);
+				return -EINVAL;
+			}
+			break;
+		case '?':
+		default:
+			return -EINVAL;
+		}
+	}
+
+	if (optind != argc - 1) {
+		printf("scoutfs bloom: a single path argument is required\n");
+		return -EINVAL;
+	}
+	path = argv[optind];
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		ret = -errno;
+		fprintf(stderr, "failed to open '%s': %s (%d)\n",
+			path, strerror(errno), errno);
+		return ret;
+	}
+
+	bi.bc = block_cache_open(path, fd, use_mmap);
+	if (!bi.bc) {
+		close(fd);
+		return -ENOMEM;
+	}
+
+	ret = bloom_report(&bi);
+	if (ret == 0 && bi.mismatches)
+		ret = -EIO;
+
+	block_cache_destroy(bi.bc);
+	close(fd);
+	return ret;
+}
+
+static void __attribute__((constructor)) bloom_ctor(void)
+{
+	cmd_register("bloom", "[--mmap] [--warn-fp percent] <device>",
+		     "report the fill and false positive rates of log tree bloom filters",
+		     bloom_cmd);
+}
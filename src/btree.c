@@ -0,0 +1,440 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <stdbool.h>
+
+#include "sparse.h"
+#include "util.h"
+#include "format.h"
+#include "block.h"
+#include "btree.h"
+
+/*
+ * Offline readers of btrees.  The trees aren't modified so these are
+ * simple descents through the block cache.
+ *
+ * Each parent item's key is the greatest key in its child so a child
+ * covers the keys after the previous item's key up to and including
+ * its own key.  Descents only read children whose ranges intersect the
+ * keys that are being searched for.
+ */
+
+static struct scoutfs_btree_item *item_at(struct scoutfs_btree_block *bt,
+					  int i)
+{
+	return (void *)bt + le32_to_cpu(bt->item_hdrs[i].off);
+}
+
+static void *item_key(struct scoutfs_btree_item *item)
+{
+	return (void *)(item + 1);
+}
+
+static void *item_val(struct scoutfs_btree_item *item)
+{
+	return (void *)(item + 1) + le16_to_cpu(item->key_len);
+}
+
+/*
+ * Return true if all of the block's items are inside the block and it's
+ * at the level that its parent expects.  Parent item values must be
+ * child refs.  Descents check each block before trusting its offsets
+ * and lengths so that corrupt images can't read past blocks or send
+ * children back up to their ancestors.
+ */
+bool btree_block_valid(struct scoutfs_btree_block *bt, int level)
+{
+	struct scoutfs_btree_item *item;
+	unsigned nr = le32_to_cpu(bt->nr_items);
+	unsigned off;
+	unsigned i;
+
+	if (bt->level != level || level >= SCOUTFS_BTREE_MAX_HEIGHT ||
+	    nr > (SCOUTFS_BLOCK_SIZE -
+		  offsetof(struct scoutfs_btree_block, item_hdrs)) /
+		 sizeof(bt->item_hdrs[0]))
+		return false;
+
+	for (i = 0; i < nr; i++) {
+		off = le32_to_cpu(bt->item_hdrs[i].off);
+		if (off > SCOUTFS_BLOCK_SIZE - sizeof(*item))
+			return false;
+
+		item = (void *)bt + off;
+		if (le16_to_cpu(item->key_len) + le16_to_cpu(item->val_len) >
+		    SCOUTFS_BLOCK_SIZE - off - sizeof(*item))
+			return false;
+
+		if (level > 0 && le16_to_cpu(item->val_len) !=
+				 sizeof(struct scoutfs_btree_ref))
+			return false;
+	}
+
+	return true;
+}
+
+/* read a block that a parent at level + 1 references */
+static struct block *read_btree_block(struct block_cache *bc,
+				      struct scoutfs_btree_ref *ref, int level)
+{
+	u64 blkno = le64_to_cpu(ref->blkno);
+	struct block *bl;
+
+	bl = block_read_hdr(bc, blkno, SCOUTFS_BLOCK_MAGIC_BTREE);
+	if (bl && !btree_block_valid(block_data(bl), level)) {
+		fprintf(stderr, "btree blkno %llu has invalid items or level\n",
+			blkno);
+		block_put(bc, bl);
+		bl = NULL;
+	}
+
+	return bl;
+}
+
+/*
+ * Return the index of the first item whose key is greater than or
+ * equal to the key, or nr_items if all the items are less than the key.
+ */
+static int find_pos(struct scoutfs_btree_block *bt, void *key,
+		    unsigned key_len)
+{
+	struct scoutfs_btree_item *item;
+	int start = 0;
+	int end = le32_to_cpu(bt->nr_items);
+	int mid;
+
+	while (start < end) {
+		mid = start + (end - start) / 2;
+		item = item_at(bt, mid);
+
+		if (memcmp_lens(item_key(item), le16_to_cpu(item->key_len),
+				key, key_len) < 0)
+			start = mid + 1;
+		else
+			end = mid;
+	}
+
+	return start;
+}
+
+static int walk_block(struct block_cache *bc, struct scoutfs_btree_ref *ref,
+		      int level, void *first, unsigned first_len, void *last,
+		      unsigned last_len, btree_item_func func, void *arg)
+{
+	struct scoutfs_btree_item *item;
+	struct scoutfs_btree_block *bt;
+	struct scoutfs_btree_ref *child;
+	struct block *bl;
+	int start;
+	int cmp;
+	int ret;
+	int nr;
+	int i;
+
+	bl = read_btree_block(bc, ref, level);
+	if (!bl)
+		return -EIO;
+	bt = block_data(bl);
+	nr = le32_to_cpu(bt->nr_items);
+
+	start = first ? find_pos(bt, first, first_len) : 0;
+
+	if (bt->level > 0) {
+		for (i = start; i < nr; i++) {
+			item = item_at(bt, i);
+			child = item_val(item);
+			block_readahead(bc, le64_to_cpu(child->blkno));
+			if (last && memcmp_lens(item_key(item),
+						le16_to_cpu(item->key_len),
+						last, last_len) >= 0)
+				break;
+		}
+	}
+
+	ret = 0;
+	for (i = start; i < nr; i++) {
+		item = item_at(bt, i);
+		cmp = last ? memcmp_lens(item_key(item),
+					 le16_to_cpu(item->key_len),
+					 last, last_len) : -1;
+
+		if (bt->level > 0) {
+			ret = walk_block(bc, item_val(item), level - 1, first,
+					 first_len, last, last_len, func, arg);
+		} else if (cmp <= 0) {
+			ret = func(item_key(item), le16_to_cpu(item->key_len),
+				   item_val(item), le16_to_cpu(item->val_len),
+				   le64_to_cpu(ref->blkno), arg);
+		}
+
+		/* the child containing last was the final child to walk */
+		if (ret || cmp >= 0)
+			break;
+	}
+
+	block_put(bc, bl);
+	return ret;
+}
+
+/*
+ * Call the function for all the leaf items from first to last,
+ * inclusive, in key order.  Null keys leave that end of the range
+ * unbounded.  Each child must be one level below its parent so the
+ * recursion is no deeper than the root's height.
+ */
+int btree_walk(struct block_cache *bc, struct scoutfs_btree_root *root,
+	       void *first, unsigned first_len, void *last,
+	       unsigned last_len, btree_item_func func, void *arg)
+{
+	if (root->height == 0 || root->ref.blkno == 0)
+		return 0;
+
+	return walk_block(bc, &root->ref, root->height - 1, first, first_len,
+			  last, last_len, func, arg);
+}
+
+/*
+ * Call the function with the keys of parent items that divide the range
+ * from first to last into at least nr pieces, if the tree has enough
+ * parents.  The parent levels are searched from the root down and the
+ * keys of the first level with enough items in the range are given in
+ * order.  Keys are the last key in their child so each piece ends with
+ * one of the keys and the next piece starts after it.  The value is
+ * null and blkno is the parent block that contains the key.
+ */
+int btree_split(struct block_cache *bc, struct scoutfs_btree_root *root,
+		void *first, unsigned first_len, void *last,
+		unsigned last_len, int nr, btree_item_func func, void *arg)
+{
+	struct scoutfs_btree_ref *children = NULL;
+	struct scoutfs_btree_ref *refs = NULL;
+	struct scoutfs_btree_ref *grown;
+	struct scoutfs_btree_item *item;
+	struct scoutfs_btree_block *bt;
+	struct block *bl;
+	int nr_children;
+	int nr_keys;
+	int nr_refs;
+	int level;
+	int ret;
+	int r;
+	int i;
+
+	if (root->height < 2 || root->ref.blkno == 0)
+		return 0;
+
+	refs = malloc(sizeof(*refs));
+	if (!refs)
+		return -ENOMEM;
+	refs[0] = root->ref;
+	nr_refs = 1;
+
+	for (level = root->height - 1; level > 0; level--) {
+		nr_keys = 0;
+		nr_children = 0;
+		children = NULL;
+
+		/* count the keys in the range and collect their children */
+		for (r = 0; r < nr_refs; r++) {
+			bl = read_btree_block(bc, &refs[r], level);
+			if (!bl) {
+				ret = -EIO;
+				goto out;
+			}
+			bt = block_data(bl);
+
+			grown = realloc(children, (nr_children + 1 +
+					le32_to_cpu(bt->nr_items)) *
+					sizeof(*children));
+			if (!grown) {
+				block_put(bc, bl);
+				ret = -ENOMEM;
+				goto out;
+			}
+			children = grown;
+
+			for (i = find_pos(bt, first, first_len);
+			     i < le32_to_cpu(bt->nr_items); i++) {
+				item = item_at(bt, i);
+				children[nr_children++] =
+					*(struct scoutfs_btree_ref *)
+					item_val(item);
+				if (memcmp_lens(item_key(item),
+						le16_to_cpu(item->key_len),
+						last, last_len) >= 0)
+					break;
+				nr_keys++;
+			}
+			block_put(bc, bl);
+		}
+
+		if (nr_keys + 1 >= nr || level == 1)
+			break;
+
+		free(refs);
+		refs = children;
+		nr_refs = nr_children;
+		children = NULL;
+	}
+
+	/* call the function with the keys from the final level */
+	ret = 0;
+	for (r = 0; r < nr_refs && ret == 0; r++) {
+		bl = read_btree_block(bc, &refs[r], level);
+		if (!bl) {
+			ret = -EIO;
+			break;
+		}
+		bt = block_data(bl);
+
+		for (i = find_pos(bt, first, first_len);
+		     i < le32_to_cpu(bt->nr_items); i++) {
+			item = item_at(bt, i);
+			if (memcmp_lens(item_key(item),
+					le16_to_cpu(item->key_len),
+					last, last_len) >= 0)
+				break;
+			ret = func(item_key(item), le16_to_cpu(item->key_len),
+				   NULL, 0, le64_to_cpu(refs[r].blkno), arg);
+			if (ret)
+				break;
+		}
+		block_put(bc, bl);
+	}
+
+out:
+	free(children);
+	free(refs);
+	return ret;
+}
+
+/*
+ * A cursor returns the leaf items from first to last in order, one at
+ * a time, while holding the blocks in the path from the root to the
+ * current leaf.  This lets callers merge the items from many trees
+ * without walking each tree in a separate call.
+ */
+static int cursor_descend(struct btree_cursor *cur,
+			  struct scoutfs_btree_ref *ref, int level,
+			  void *first, unsigned first_len)
+{
+	struct scoutfs_btree_block *bt;
+	struct scoutfs_btree_item *item;
+	struct btree_cursor_level *cl;
+	struct block *bl;
+	int i;
+
+	for (;;) {
+		if (cur->nr == SCOUTFS_BTREE_MAX_HEIGHT)
+			return -EIO;
+
+		bl = read_btree_block(cur->bc, ref, level);
+		if (!bl)
+			return -EIO;
+		bt = block_data(bl);
+
+		cl = &cur->path[cur->nr++];
+		cl->bl = bl;
+		cl->pos = first ? find_pos(bt, first, first_len) : 0;
+
+		if (bt->level == 0)
+			return 0;
+
+		for (i = cl->pos; i < le32_to_cpu(bt->nr_items); i++) {
+			item = item_at(bt, i);
+			block_readahead(cur->bc, le64_to_cpu(
+				((struct scoutfs_btree_ref *)
+				 item_val(item))->blkno));
+			if (cur->last && memcmp_lens(item_key(item),
+						le16_to_cpu(item->key_len),
+						cur->last, cur->last_len) >= 0)
+				break;
+		}
+
+		if (cl->pos == le32_to_cpu(bt->nr_items))
+			return 0;
+		ref = item_val(item_at(bt, cl->pos));
+		level--;
+	}
+}
+
+int btree_cursor_start(struct btree_cursor *cur, struct block_cache *bc,
+		       struct scoutfs_btree_root *root, void *first,
+		       unsigned first_len, void *last, unsigned last_len)
+{
+	memset(cur, 0, sizeof(*cur));
+	cur->bc = bc;
+	cur->last = last;
+	cur->last_len = last_len;
+
+	if (root->height == 0 || root->ref.blkno == 0)
+		return 0;
+
+	return cursor_descend(cur, &root->ref, root->height - 1, first,
+			      first_len);
+}
+
+/*
+ * Return 1 and set the key and value of the next item, or return 0
+ * when there are no more items in the range.  The item is only valid
+ * until the next call.
+ */
+int btree_cursor_next(struct btree_cursor *cur, void **key,
+		      unsigned *key_len, void **val, unsigned *val_len)
+{
+	struct scoutfs_btree_block *bt;
+	struct scoutfs_btree_item *item;
+	struct btree_cursor_level *cl;
+	int ret;
+
+	while (cur->nr > 0) {
+		cl = &cur->path[cur->nr - 1];
+		bt = block_data(cl->bl);
+
+		if (cl->pos >= le32_to_cpu(bt->nr_items)) {
+			block_put(cur->bc, cl->bl);
+			cur->nr--;
+			if (cur->nr > 0)
+				cur->path[cur->nr - 1].pos++;
+			continue;
+		}
+
+		item = item_at(bt, cl->pos);
+
+		/* the child containing last was the final child to walk */
+		if (cur->last && memcmp_lens(item_key(item),
+					     le16_to_cpu(item->key_len),
+					     cur->last, cur->last_len) > 0) {
+			if (bt->level == 0 || (cl->pos > 0 &&
+			    memcmp_lens(item_key(item_at(bt, cl->pos - 1)),
+					le16_to_cpu(item_at(bt, cl->pos - 1)->key_len),
+					cur->last, cur->last_len) >= 0)) {
+				btree_cursor_stop(cur);
+				return 0;
+			}
+		}
+
+		if (bt->level > 0) {
+			ret = cursor_descend(cur, item_val(item),
+					     bt->level - 1, NULL, 0);
+			if (ret < 0)
+				return ret;
+			continue;
+		}
+
+		*key = item_key(item);
+		*key_len = le16_to_cpu(item->key_len);
+		*val = item_val(item);
+		*val_len = le16_to_cpu(item->val_len);
+		cl->pos++;
+		return 1;
+	}
+
+	return 0;
+}
+
+void btree_cursor_stop(struct btree_cursor *cur)
+{
+	while (cur->nr > 0)
+		block_put(cur->bc, cur->path[--cur->nr].bl);
+}
@@ -0,0 +1,43 @@
+#ifndef _BTREE_H_
+#define _BTREE_H_
+
+struct block_cache;
+struct block;
+
+/*
+ * Called for each leaf item that's found.  blkno is the leaf block
+ * that contains the item.  Returning non-zero stops the walk and is
+ * returned to the caller.
+ */
+typedef int (*btree_item_func)(void *key, unsigned key_len, void *val,
+			       unsigned val_len, u64 blkno, void *arg);
+
+bool btree_block_valid(struct scoutfs_btree_block *bt, int level);
+int btree_walk(struct block_cache *bc, struct scoutfs_btree_root *root,
+	       void *first, unsigned first_len, void *last,
+	       unsigned last_len, btree_item_func func, void *arg);
+int btree_split(struct block_cache *bc, struct scoutfs_btree_root *root,
+		void *first, unsigned first_len, void *last,
+		unsigned last_len, int nr, btree_item_func func, void *arg);
+
+struct btree_cursor_level {
+	struct block *bl;
+	int pos;
+};
+
+struct btree_cursor {
+	struct block_cache *bc;
+	void *last;
+	unsigned last_len;
+	int nr;
+	struct btree_cursor_level path[SCOUTFS_BTREE_MAX_HEIGHT];
+};
+
+int btree_cursor_start(struct btree_cursor *cur, struct block_cache *bc,
+		       struct scoutfs_btree_root *root, void *first,
+		       unsigned first_len, void *last, unsigned last_len);
+int btree_cursor_next(struct btree_cursor *cur, void **key,
+		      unsigned *key_len, void **val, unsigned *val_len);
+void btree_cursor_stop(struct btree_cursor *cur);
+
+#endif
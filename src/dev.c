@@ -6,8 +6,19 @@
 #include <sys/ioctl.h>
 #include <linux/fs.h>
 #include <errno.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
 
 #include "sparse.h"
+#include "util.h"
+#include "format.h"
+#include "workq.h"
 #include "dev.h"
 
 int device_size(char *path, int fd, u64 *size)
@@ -40,3 +51,391 @@ int device_size(char *path, int fd, u64 *size)
         return 0;
 }
 
+/*
+ * Read or write all of a buffer.  A negative offset uses the file
+ * position so that streams can be pipes.  Reaching the end of a file
+ * before the buffer is full returns -ENODATA.
+ */
+int rw_full(int fd, void *buf, size_t size, off_t off, bool wr)
+{
+	size_t done;
+	ssize_t ret;
+
+	for (done = 0; done < size; done += ret) {
+		if (off < 0)
+			ret = wr ? write(fd, buf + done, size - done) :
+				   read(fd, buf + done, size - done);
+		else
+			ret = wr ? pwrite(fd, buf + done, size - done,
+					  off + done) :
+				   pread(fd, buf + done, size - done,
+					 off + done);
+		if (ret < 0 && errno == EINTR) {
+			ret = 0;
+			continue;
+		}
+		if (ret < 0)
+			return -errno;
+		if (ret == 0)
+			return -ENODATA;
+	}
+
+	return 0;
+}
+
+
+/*
+ * Commands that scan metadata read and write lots of independent
+ * blocks.  A dev_ioq lets them submit batches of block IOs that are
+ * all in flight at once.  We use io_uring when the kernel supports it
+ * and fall back to issuing the IOs from a pool of threads when it
+ * doesn't.  Batches are serialized on a queue, callers that want more
+ * concurrency than the queue depth can use more queues.
+ */
+struct dev_ioq {
+	pthread_mutex_t mutex;
+	int fd;
+	unsigned int depth;
+
+	/* io_uring */
+	int ring_fd;
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int *sq_mask;
+	unsigned int *sq_array;
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_ring;
+	size_t sq_ring_len;
+	void *cq_ring;
+	size_t cq_ring_len;
+	size_t sqes_len;
+	struct iovec *iovs;
+
+	/* thread pool fallback */
+	struct workq *wq;
+	pthread_cond_t done_cond;
+	unsigned int pending;
+};
+
+/* the fallback doesn't need very many threads to saturate most devices */
+#define DEV_IOQ_MAX_THREADS 32
+
+static int sync_rw(int fd, struct dev_io *io, bool write)
+{
+	off_t off = io->blkno << SCOUTFS_BLOCK_SHIFT;
+	ssize_t ret;
+
+	if (write)
+		ret = pwrite(fd, io->buf, SCOUTFS_BLOCK_SIZE, off);
+	else
+		ret = pread(fd, io->buf, SCOUTFS_BLOCK_SIZE, off);
+
+	if (ret != SCOUTFS_BLOCK_SIZE)
+		return ret < 0 ? -errno : -EIO;
+
+	return 0;
+}
+
+static void unmap_ring(struct dev_ioq *q)
+{
+	if (q->sqes)
+		munmap(q->sqes, q->sqes_len);
+	if (q->cq_ring && q->cq_ring != q->sq_ring)
+		munmap(q->cq_ring, q->cq_ring_len);
+	if (q->sq_ring)
+		munmap(q->sq_ring, q->sq_ring_len);
+	if (q->ring_fd >= 0)
+		close(q->ring_fd);
+	free(q->iovs);
+	q->ring_fd = -1;
+}
+
+/*
+ * Try to set up an io_uring and map its rings.  Returns false if the
+ * kernel doesn't support io_uring, or won't let us use it, and we
+ * should use the thread pool instead.
+ */
+static bool setup_ring(struct dev_ioq *q)
+{
+	struct io_uring_params p;
+	void *ptr;
+
+	memset(&p, 0, sizeof(p));
+	q->ring_fd = syscall(__NR_io_uring_setup, q->depth, &p);
+	if (q->ring_fd < 0)
+		return false;
+
+	q->depth = p.sq_entries;
+	q->sq_ring_len = p.sq_off.array + p.sq_entries * sizeof(u32);
+	q->cq_ring_len = p.cq_off.cqes +
+			 p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		q->sq_ring_len = q->cq_ring_len =
+			max(q->sq_ring_len, q->cq_ring_len);
+
+	ptr = mmap(NULL, q->sq_ring_len, PROT_READ | PROT_WRITE,
+		   MAP_SHARED | MAP_POPULATE, q->ring_fd, IORING_OFF_SQ_RING);
+	if (ptr == MAP_FAILED)
+		goto fail;
+	q->sq_ring = ptr;
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		q->cq_ring = q->sq_ring;
+	} else {
+		ptr = mmap(NULL, q->cq_ring_len, PROT_READ | PROT_WRITE,
+			   MAP_SHARED | MAP_POPULATE, q->ring_fd,
+			   IORING_OFF_CQ_RING);
+		if (ptr == MAP_FAILED)
+			goto fail;
+		q->cq_ring = ptr;
+	}
+
+	q->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	ptr = mmap(NULL, q->sqes_len, PROT_READ | PROT_WRITE,
+		   MAP_SHARED | MAP_POPULATE, q->ring_fd, IORING_OFF_SQES);
+	if (ptr == MAP_FAILED)
+		goto fail;
+	q->sqes = ptr;
+
+	q->iovs = calloc(q->depth, sizeof(struct iovec));
+	if (!q->iovs)
+		goto fail;
+
+	q->sq_head = q->sq_ring + p.sq_off.head;
+	q->sq_tail = q->sq_ring + p.sq_off.tail;
+	q->sq_mask = q->sq_ring + p.sq_off.ring_mask;
+	q->sq_array = q->sq_ring + p.sq_off.array;
+	q->cq_head = q->cq_ring + p.cq_off.head;
+	q->cq_tail = q->cq_ring + p.cq_off.tail;
+	q->cq_mask = q->cq_ring + p.cq_off.ring_mask;
+	q->cqes = q->cq_ring + p.cq_off.cqes;
+
+	return true;
+fail:
+	unmap_ring(q);
+	return false;
+}
+
+/*
+ * Create a queue that can have depth block IOs in flight on the fd.
+ * The caller still owns the fd.
+ */
+struct dev_ioq *dev_ioq_create(int fd, unsigned int depth)
+{
+	struct dev_ioq *q;
+
+	q = calloc(1, sizeof(struct dev_ioq));
+	if (!q)
+		return NULL;
+
+	pthread_mutex_init(&q->mutex, NULL);
+	pthread_cond_init(&q->done_cond, NULL);
+	q->fd = fd;
+	q->depth = max(depth, 1U);
+	q->ring_fd = -1;
+
+	if (!setup_ring(q)) {
+		q->wq = workq_create(min(q->depth, DEV_IOQ_MAX_THREADS));
+		if (!q->wq) {
+			free(q);
+			return NULL;
+		}
+	}
+
+	return q;
+}
+
+void dev_ioq_destroy(struct dev_ioq *q)
+{
+	if (!q)
+		return;
+
+	if (q->ring_fd >= 0)
+		unmap_ring(q);
+	workq_destroy(q->wq);
+	pthread_mutex_destroy(&q->mutex);
+	pthread_cond_destroy(&q->done_cond);
+	free(q);
+}
+
+bool dev_ioq_uring(struct dev_ioq *q)
+{
+	return q->ring_fd >= 0;
+}
+
+/*
+ * Submit a batch of up to depth IOs to the ring and wait for them all
+ * to complete.  IOs that come back short, which shouldn't happen for
+ * aligned blocks but might for files, are retried synchronously so
+ * that they return a meaningful errno.
+ *
+ * If io_uring_enter fails we can't return while the kernel might still
+ * be reading into the callers' buffers or leave sqes and cqes in the
+ * ring for the next batch.  The kernel consumes sqes in order so we
+ * take back the ones it didn't consume and perform them synchronously,
+ * and then keep reaping until all the submitted IOs have completed.
+ */
+static int uring_batch(struct dev_ioq *q, struct dev_io *ios,
+		       unsigned int nr, bool write)
+{
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe *cqe;
+	unsigned int submitted;
+	unsigned int start;
+	unsigned int tail;
+	unsigned int head;
+	unsigned int done;
+	unsigned int idx;
+	bool failed;
+	int ret;
+	int i;
+
+	start = *q->sq_tail;
+	tail = start;
+	for (i = 0; i < nr; i++) {
+		idx = tail & *q->sq_mask;
+		sqe = &q->sqes[idx];
+
+		q->iovs[i].iov_base = ios[i].buf;
+		q->iovs[i].iov_len = SCOUTFS_BLOCK_SIZE;
+
+		memset(sqe, 0, sizeof(*sqe));
+		sqe->opcode = write ? IORING_OP_WRITEV : IORING_OP_READV;
+		sqe->fd = q->fd;
+		sqe->off = ios[i].blkno << SCOUTFS_BLOCK_SHIFT;
+		sqe->addr = (unsigned long)&q->iovs[i];
+		sqe->len = 1;
+		sqe->user_data = i;
+
+		q->sq_array[idx] = idx;
+		tail++;
+	}
+	__atomic_store_n(q->sq_tail, tail, __ATOMIC_RELEASE);
+
+	submitted = 0;
+	done = 0;
+	failed = false;
+	while (done < submitted || (!failed && submitted < nr)) {
+		ret = syscall(__NR_io_uring_enter, q->ring_fd,
+			      failed ? 0 : nr - submitted, 1,
+			      IORING_ENTER_GETEVENTS, NULL, 0);
+		if (ret < 0 && errno != EINTR) {
+			if (!failed) {
+				fprintf(stderr, "io_uring_enter failed: %s (%d)\n",
+					strerror(errno), errno);
+				failed = true;
+				submitted = __atomic_load_n(q->sq_head,
+							    __ATOMIC_ACQUIRE) -
+					    start;
+				__atomic_store_n(q->sq_tail, start + submitted,
+						 __ATOMIC_RELEASE);
+				for (i = submitted; i < nr; i++)
+					ios[i].ret = sync_rw(q->fd, &ios[i],
+							     write);
+			} else {
+				/* completions are posted without entering */
+				sched_yield();
+			}
+		} else if (ret > 0 && !failed) {
+			submitted += ret;
+		}
+
+		head = *q->cq_head;
+		while (head != __atomic_load_n(q->cq_tail, __ATOMIC_ACQUIRE)) {
+			cqe = &q->cqes[head & *q->cq_mask];
+			i = cqe->user_data;
+			if (cqe->res == SCOUTFS_BLOCK_SIZE)
+				ios[i].ret = 0;
+			else
+				ios[i].ret = sync_rw(q->fd, &ios[i], write);
+			head++;
+			done++;
+		}
+		__atomic_store_n(q->cq_head, head, __ATOMIC_RELEASE);
+	}
+
+	return 0;
+}
+
+struct pool_io {
+	struct work work;
+	struct dev_ioq *q;
+	struct dev_io *io;
+	bool write;
+};
+
+static void pool_io_work(struct work *work)
+{
+	struct pool_io *pio = container_of(work, struct pool_io, work);
+	struct dev_ioq *q = pio->q;
+
+	pio->io->ret = sync_rw(q->fd, pio->io, pio->write);
+
+	pthread_mutex_lock(&q->mutex);
+	if (--q->pending == 0)
+		pthread_cond_signal(&q->done_cond);
+	pthread_mutex_unlock(&q->mutex);
+}
+
+/* the caller holds the queue mutex */
+static int pool_batch(struct dev_ioq *q, struct dev_io *ios,
+		      unsigned int nr, bool write)
+{
+	struct pool_io *pios;
+	int i;
+
+	pios = calloc(nr, sizeof(struct pool_io));
+	if (!pios)
+		return -ENOMEM;
+
+	q->pending = nr;
+	for (i = 0; i < nr; i++) {
+		work_init(&pios[i].work, pool_io_work);
+		pios[i].q = q;
+		pios[i].io = &ios[i];
+		pios[i].write = write;
+		workq_queue(q->wq, &pios[i].work);
+	}
+
+	while (q->pending)
+		pthread_cond_wait(&q->done_cond, &q->mutex);
+
+	free(pios);
+	return 0;
+}
+
+/*
+ * Read or write all the blocks described by the ios, keeping up to the
+ * queue's depth of them in flight.  Each io's ret describes its
+ * result.  The returned error is only for failures of the queue
+ * itself, callers have to check each io's ret.
+ */
+int dev_ioq_rw(struct dev_ioq *q, struct dev_io *ios, unsigned int nr,
+	       bool write)
+{
+	unsigned int part;
+	int ret = 0;
+
+	pthread_mutex_lock(&q->mutex);
+
+	while (nr > 0) {
+		part = min(nr, q->depth);
+		if (q->ring_fd >= 0)
+			ret = uring_batch(q, ios, part, write);
+		else
+			ret = pool_batch(q, ios, part, write);
+		if (ret < 0)
+			break;
+
+		ios += part;
+		nr -= part;
+	}
+
+	pthread_mutex_unlock(&q->mutex);
+
+	return ret;
+}
@@ -1,6 +1,27 @@
 #ifndef _DEV_H_
 #define _DEV_H_
 
+#include <stdbool.h>
+
 int device_size(char *path, int fd, u64 *size);
+int rw_full(int fd, void *buf, size_t size, off_t off, bool wr);
+
+/*
+ * A single block read or write in a batch.  ret is set to 0 or a
+ * negative errno as the batch completes.
+ */
+struct dev_io {
+	u64 blkno;
+	void *buf;
+	int ret;
+};
+
+struct dev_ioq;
+
+struct dev_ioq *dev_ioq_create(int fd, unsigned int depth);
+void dev_ioq_destroy(struct dev_ioq *q);
+int dev_ioq_rw(struct dev_ioq *q, struct dev_io *ios, unsigned int nr,
+	       bool write);
+bool dev_ioq_uring(struct dev_ioq *q);
 
 #endif
@@ -0,0 +1,679 @@
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <getopt.h>
+#include <stdbool.h>
+
+#include "sparse.h"
+#include "util.h"
+#include "format.h"
+#include "cmd.h"
+#include "key.h"
+#include "radix.h"
+#include "block.h"
+#include "btree.h"
+
+/*
+ * diff reports the metadata items that differ between two volumes,
+ * typically images of the same volume taken at different times.
+ *
+ * Blocks are never modified in place, a block with a given blkno and
+ * seq always has the same contents.  The trees in the two volumes are
+ * walked in lockstep and whenever both walks are positioned at refs to
+ * the same blkno and seq the entire subtree is skipped without being
+ * read.  The number of blocks read scales with the amount of change
+ * between the volumes rather than their size.
+ */
+
+struct diff_info {
+	struct block_cache *bc[2];
+	struct scoutfs_super_block super[2];
+	u64 blocks;
+	u64 added;
+	u64 removed;
+	u64 changed;
+	u64 radix_set;
+	u64 radix_cleared;
+};
+
+typedef void (*diff_key_func)(void *key, unsigned key_len);
+typedef int (*diff_item_func)(struct diff_info *di, void *key,
+			      unsigned key_len, void *a, unsigned a_len,
+			      void *b, unsigned b_len);
+
+struct diff_tree {
+	char name[64];
+	diff_key_func key_func;
+	diff_item_func item_func;
+};
+
+/*
+ * A cursor is positioned at an item in the path of blocks from the root
+ * to the current block.  Items in parents are refs to subtrees that
+ * can be skipped or descended into.
+ */
+struct diff_cursor {
+	struct diff_info *di;
+	struct block_cache *bc;
+	int depth;
+	struct {
+		struct block *bl;
+		struct scoutfs_btree_block *bt;
+		int pos;
+	} path[SCOUTFS_BTREE_MAX_HEIGHT];
+};
+
+static struct scoutfs_btree_item *cursor_item(struct diff_cursor *dc)
+{
+	struct scoutfs_btree_block *bt = dc->path[dc->depth - 1].bt;
+
+	return (void *)bt +
+	       le32_to_cpu(bt->item_hdrs[dc->path[dc->depth - 1].pos].off);
+}
+
+static u8 cursor_level(struct diff_cursor *dc)
+{
+	return dc->path[dc->depth - 1].bt->level;
+}
+
+static void *cursor_key(struct diff_cursor *dc, unsigned *key_len)
+{
+	struct scoutfs_btree_item *item = cursor_item(dc);
+
+	*key_len = le16_to_cpu(item->key_len);
+	return item + 1;
+}
+
+static void *cursor_val(struct diff_cursor *dc, unsigned *val_len)
+{
+	struct scoutfs_btree_item *item = cursor_item(dc);
+
+	*val_len = le16_to_cpu(item->val_len);
+	return (void *)(item + 1) + le16_to_cpu(item->key_len);
+}
+
+static struct scoutfs_btree_ref *cursor_ref(struct diff_cursor *dc)
+{
+	unsigned val_len;
+
+	return cursor_val(dc, &val_len);
+}
+
+/* pop exhausted blocks until the cursor is at an item or is done */
+static void cursor_settle(struct diff_cursor *dc)
+{
+	while (dc->depth > 0 &&
+	       dc->path[dc->depth - 1].pos >=
+	       le32_to_cpu(dc->path[dc->depth - 1].bt->nr_items)) {
+		block_put(dc->bc, dc->path[dc->depth - 1].bl);
+		dc->depth--;
+		if (dc->depth > 0)
+			dc->path[dc->depth - 1].pos++;
+	}
+}
+
+static int cursor_push(struct diff_cursor *dc, struct scoutfs_btree_ref *ref,
+		       int level)
+{
+	struct scoutfs_btree_block *bt;
+	struct block *bl;
+	u64 blkno = le64_to_cpu(ref->blkno);
+
+	if (dc->depth == SCOUTFS_BTREE_MAX_HEIGHT) {
+		fprintf(stderr, "btree blkno %llu is deeper than the max height\n",
+			blkno);
+		return -EIO;
+	}
+
+	bl = block_read(dc->bc, blkno);
+	if (!bl)
+		return -EIO;
+	bt = block_data(bl);
+	dc->di->blocks++;
+
+	if (le32_to_cpu(bt->hdr.magic) != SCOUTFS_BLOCK_MAGIC_BTREE ||
+	    le64_to_cpu(bt->hdr.seq) != le64_to_cpu(ref->seq) ||
+	    !btree_block_valid(bt, level)) {
+		fprintf(stderr, "btree blkno %llu doesn't match its ref\n",
+			blkno);
+		block_put(dc->bc, bl);
+		return -EIO;
+	}
+
+	dc->path[dc->depth].bl = bl;
+	dc->path[dc->depth].bt = bt;
+	dc->path[dc->depth].pos = 0;
+	dc->depth++;
+	cursor_settle(dc);
+	return 0;
+}
+
+static int cursor_init(struct diff_cursor *dc, struct diff_info *di,
+		       struct block_cache *bc, struct scoutfs_btree_root *root)
+{
+	dc->di = di;
+	dc->bc = bc;
+	dc->depth = 0;
+
+	if (!root || root->height == 0 || root->ref.blkno == 0)
+		return 0;
+
+	return cursor_push(dc, &root->ref, root->height - 1);
+}
+
+static int cursor_descend(struct diff_cursor *dc)
+{
+	return cursor_push(dc, cursor_ref(dc), cursor_level(dc) - 1);
+}
+
+static void cursor_advance(struct diff_cursor *dc)
+{
+	dc->path[dc->depth - 1].pos++;
+	cursor_settle(dc);
+}
+
+static void cursor_destroy(struct diff_cursor *dc)
+{
+	while (dc->depth > 0) {
+		block_put(dc->bc, dc->path[dc->depth - 1].bl);
+		dc->depth--;
+	}
+}
+
+static void report(struct diff_tree *tree, char op, void *key,
+		   unsigned key_len)
+{
+	printf("%s %c ", tree->name, op);
+	tree->key_func(key, key_len);
+	printf("\n");
+}
+
+/*
+ * Report the differences between the items in two btrees.  Either root
+ * can be null if the tree only exists in one of the volumes.
+ */
+static int diff_btree(struct diff_info *di, struct diff_tree *tree,
+		      struct scoutfs_btree_root *root_a,
+		      struct scoutfs_btree_root *root_b)
+{
+	struct diff_cursor a;
+	struct diff_cursor b;
+	struct scoutfs_btree_ref *ref_a;
+	struct scoutfs_btree_ref *ref_b;
+	unsigned a_key_len;
+	unsigned b_key_len;
+	unsigned a_len;
+	unsigned b_len;
+	void *a_key;
+	void *b_key;
+	void *a_val;
+	void *b_val;
+	int cmp;
+	int ret;
+
+	if (root_a && root_b && root_a->height == root_b->height &&
+	    root_a->ref.blkno == root_b->ref.blkno &&
+	    root_a->ref.seq == root_b->ref.seq)
+		return 0;
+
+	ret = cursor_init(&a, di, di->bc[0], root_a);
+	if (ret == 0)
+		ret = cursor_init(&b, di, di->bc[1], root_b);
+	else
+		b.depth = 0;
+
+	while (ret == 0 && (a.depth > 0 || b.depth > 0)) {
+		/* descend refs until both are at items or identical refs */
+		if (a.depth > 0 && b.depth > 0 &&
+		    cursor_level(&a) > 0 && cursor_level(&b) > 0) {
+			ref_a = cursor_ref(&a);
+			ref_b = cursor_ref(&b);
+			if (ref_a->blkno == ref_b->blkno &&
+			    ref_a->seq == ref_b->seq) {
+				cursor_advance(&a);
+				cursor_advance(&b);
+			} else if (cursor_level(&a) > cursor_level(&b)) {
+				ret = cursor_descend(&a);
+			} else if (cursor_level(&b) > cursor_level(&a)) {
+				ret = cursor_descend(&b);
+			} else {
+				ret = cursor_descend(&a) ?: cursor_descend(&b);
+			}
+			continue;
+		}
+
+		if (a.depth > 0 && cursor_level(&a) > 0) {
+			ret = cursor_descend(&a);
+			continue;
+		}
+		if (b.depth > 0 && cursor_level(&b) > 0) {
+			ret = cursor_descend(&b);
+			continue;
+		}
+
+		/* both at leaf items, or one is done */
+		if (a.depth == 0)
+			cmp = 1;
+		else if (b.depth == 0)
+			cmp = -1;
+		else {
+			a_key = cursor_key(&a, &a_key_len);
+			b_key = cursor_key(&b, &b_key_len);
+			cmp = memcmp_lens(a_key, a_key_len, b_key, b_key_len);
+		}
+
+		if (cmp < 0) {
+			a_key = cursor_key(&a, &a_key_len);
+			a_val = cursor_val(&a, &a_len);
+			report(tree, '-', a_key, a_key_len);
+			di->removed++;
+			if (tree->item_func)
+				ret = tree->item_func(di, a_key, a_key_len,
+						      a_val, a_len, NULL, 0);
+			cursor_advance(&a);
+
+		} else if (cmp > 0) {
+			b_key = cursor_key(&b, &b_key_len);
+			b_val = cursor_val(&b, &b_len);
+			report(tree, '+', b_key, b_key_len);
+			di->added++;
+			if (tree->item_func)
+				ret = tree->item_func(di, b_key, b_key_len,
+						      NULL, 0, b_val, b_len);
+			cursor_advance(&b);
+
+		} else {
+			a_val = cursor_val(&a, &a_len);
+			b_val = cursor_val(&b, &b_len);
+			if (a_len != b_len || memcmp(a_val, b_val, a_len)) {
+				report(tree, '~', a_key, a_key_len);
+				di->changed++;
+				if (tree->item_func)
+					ret = tree->item_func(di, a_key,
+							      a_key_len,
+							      a_val, a_len,
+							      b_val, b_len);
+			}
+			cursor_advance(&a);
+			cursor_advance(&b);
+		}
+	}
+
+	cursor_destroy(&a);
+	cursor_destroy(&b);
+	return ret;
+}
+
+static void report_bits(struct diff_info *di, char *name, u64 first,
+			u64 last, bool set)
+{
+	printf("%s blknos %llu - %llu %s\n", name, first, last,
+	       set ? "set" : "cleared");
+	if (set)
+		di->radix_set += last - first + 1;
+	else
+		di->radix_cleared += last - first + 1;
+}
+
+/* report differing runs of bits in two leaves, null leaves are full or empty */
+static void diff_radix_bits(struct diff_info *di, char *name, u64 first_bit,
+			    struct scoutfs_radix_block *a,
+			    struct scoutfs_radix_block *b,
+			    bool a_full, bool b_full)
+{
+	u64 start = 0;
+	bool in_run = false;
+	bool run_set = false;
+	bool set;
+	u64 wa;
+	u64 wb;
+	u64 x;
+	int bit;
+	int i;
+
+	for (i = 0; i < SCOUTFS_RADIX_BITS / 64; i++) {
+		wa = a ? le64_to_cpu(a->bits[i]) : a_full ? U64_MAX : 0;
+		wb = b ? le64_to_cpu(b->bits[i]) : b_full ? U64_MAX : 0;
+		x = wa ^ wb;
+
+		if (!x && !in_run)
+			continue;
+
+		for (bit = 0; bit < 64; bit++) {
+			if (x & (1ULL << bit)) {
+				set = !!(wb & (1ULL << bit));
+				if (in_run && set == run_set)
+					continue;
+				if (in_run)
+					report_bits(di, name, start,
+						    first_bit + (i * 64) + bit - 1,
+						    run_set);
+				in_run = true;
+				run_set = set;
+				start = first_bit + (i * 64) + bit;
+			} else if (in_run) {
+				report_bits(di, name, start,
+					    first_bit + (i * 64) + bit - 1,
+					    run_set);
+				in_run = false;
+			}
+		}
+	}
+
+	if (in_run)
+		report_bits(di, name, start,
+			    first_bit + SCOUTFS_RADIX_BITS - 1, run_set);
+}
+
+static int read_radix(struct diff_info *di, int which,
+		      struct scoutfs_radix_ref *ref, struct block **bl_ret)
+{
+	struct scoutfs_radix_block *rdx;
+	struct block *bl;
+	u64 blkno = le64_to_cpu(ref->blkno);
+
+	*bl_ret = NULL;
+	if (blkno == 0 || blkno == U64_MAX)
+		return 0;
+
+	bl = block_read(di->bc[which], blkno);
+	if (!bl)
+		return -EIO;
+	rdx = block_data(bl);
+	di->blocks++;
+
+	if (le32_to_cpu(rdx->hdr.magic) != SCOUTFS_BLOCK_MAGIC_RADIX ||
+	    le64_to_cpu(rdx->hdr.seq) != le64_to_cpu(ref->seq)) {
+		fprintf(stderr, "radix blkno %llu doesn't match its ref\n",
+			blkno);
+		block_put(di->bc[which], bl);
+		return -EIO;
+	}
+
+	*bl_ret = bl;
+	return 0;
+}
+
+/*
+ * Report the runs of bits that differ in two radix subtrees.  Full and
+ * empty refs don't have blocks, their subtrees are entirely full or
+ * empty refs.
+ */
+static int diff_radix_ref(struct diff_info *di, char *name,
+			  struct scoutfs_radix_ref *ra,
+			  struct scoutfs_radix_ref *rb, int level,
+			  u64 first_bit)
+{
+	struct scoutfs_radix_block *rdx_a = NULL;
+	struct scoutfs_radix_block *rdx_b = NULL;
+	struct scoutfs_radix_ref empty_ref = {
+		.blkno = cpu_to_le64(0),
+	};
+	struct scoutfs_radix_ref full_ref = {
+		.blkno = cpu_to_le64(U64_MAX),
+	};
+	struct scoutfs_radix_ref *ca;
+	struct scoutfs_radix_ref *cb;
+	struct block *bl_a;
+	struct block *bl_b = NULL;
+	u64 full;
+	int ret;
+	int i;
+
+	if (ra->blkno == rb->blkno && ra->seq == rb->seq)
+		return 0;
+
+	ret = read_radix(di, 0, ra, &bl_a) ?: read_radix(di, 1, rb, &bl_b);
+	if (ret < 0)
+		goto out;
+	if (bl_a)
+		rdx_a = block_data(bl_a);
+	if (bl_b)
+		rdx_b = block_data(bl_b);
+
+	if (level == 0) {
+		diff_radix_bits(di, name, first_bit, rdx_a, rdx_b,
+				le64_to_cpu(ra->blkno) == U64_MAX,
+				le64_to_cpu(rb->blkno) == U64_MAX);
+		goto out;
+	}
+
+	full = radix_full_subtree_total(level - 1);
+	for (i = 0; i < SCOUTFS_RADIX_REFS && ret == 0; i++) {
+		ca = rdx_a ? &rdx_a->refs[i] :
+		     ra->blkno ? &full_ref : &empty_ref;
+		cb = rdx_b ? &rdx_b->refs[i] :
+		     rb->blkno ? &full_ref : &empty_ref;
+		ret = diff_radix_ref(di, name, ca, cb, level - 1,
+				     first_bit + (i * full));
+	}
+
+out:
+	if (bl_a)
+		block_put(di->bc[0], bl_a);
+	if (bl_b)
+		block_put(di->bc[1], bl_b);
+	return ret;
+}
+
+static int diff_radix(struct diff_info *di, char *name,
+		      struct scoutfs_radix_root *a,
+		      struct scoutfs_radix_root *b)
+{
+	if (a->height != b->height) {
+		printf("%s radix height %u != %u, not compared\n",
+		       name, a->height, b->height);
+		return 0;
+	}
+
+	if (a->height == 0)
+		return 0;
+
+	return diff_radix_ref(di, name, &a->ref, &b->ref, a->height - 1, 0);
+}
+
+static void fs_key(void *key, unsigned key_len)
+{
+	struct scoutfs_key item_key;
+
+	scoutfs_key_from_be(&item_key, key);
+	printf(SK_FMT, SK_ARG(&item_key));
+}
+
+static void log_trees_key(void *key, unsigned key_len)
+{
+	struct scoutfs_log_trees_key *ltk = key;
+
+	printf("rid %016llx nr %llu", be64_to_cpu(ltk->rid),
+	       be64_to_cpu(ltk->nr));
+}
+
+static void rid_key(void *key, unsigned key_len)
+{
+	__be64 *rid = key;
+
+	printf("rid %016llx", be64_to_cpu(*rid));
+}
+
+static void trans_seqs_key(void *key, unsigned key_len)
+{
+	struct scoutfs_trans_seq_btree_key *tsk = key;
+
+	printf("trans_seq %llu rid %016llx", be64_to_cpu(tsk->trans_seq),
+	       be64_to_cpu(tsk->rid));
+}
+
+/*
+ * Log trees that differ have their items and allocators compared.  A
+ * log tree that's only in one volume has all its items added or
+ * removed.
+ */
+static int diff_log_trees(struct diff_info *di, void *key, unsigned key_len,
+			  void *a, unsigned a_len, void *b, unsigned b_len)
+{
+	struct scoutfs_log_trees_key *ltk = key;
+	struct scoutfs_log_trees_val *ltv_a = a;
+	struct scoutfs_log_trees_val *ltv_b = b;
+	struct diff_tree tree = {
+		.key_func = fs_key,
+	};
+	int ret;
+
+	if ((a && a_len != sizeof(*ltv_a)) || (b && b_len != sizeof(*ltv_b)))
+		return 0;
+
+	snprintf(tree.name, sizeof(tree.name), "log tree rid %016llx nr %llu",
+		 be64_to_cpu(ltk->rid), be64_to_cpu(ltk->nr));
+
+	ret = diff_btree(di, &tree, ltv_a ? &ltv_a->item_root : NULL,
+			 ltv_b ? &ltv_b->item_root : NULL);
+	if (ret < 0 || !ltv_a || !ltv_b)
+		return ret;
+
+	return diff_radix(di, "log meta_avail", &ltv_a->meta_avail,
+			  &ltv_b->meta_avail) ?:
+	       diff_radix(di, "log meta_freed", &ltv_a->meta_freed,
+			  &ltv_b->meta_freed) ?:
+	       diff_radix(di, "log data_avail", &ltv_a->data_avail,
+			  &ltv_b->data_avail) ?:
+	       diff_radix(di, "log data_freed", &ltv_a->data_freed,
+			  &ltv_b->data_freed);
+}
+
+static int read_super(struct diff_info *di, int which, char *path)
+{
+	struct scoutfs_super_block *super = &di->super[which];
+	struct block *bl;
+
+	bl = block_read(di->bc[which], SCOUTFS_SUPER_BLKNO);
+	if (!bl)
+		return -EIO;
+	memcpy(super, block_data(bl), sizeof(*super));
+	block_put(di->bc[which], bl);
+	di->blocks++;
+
+	if (le32_to_cpu(super->hdr.magic) != SCOUTFS_BLOCK_MAGIC_SUPER ||
+	    le64_to_cpu(super->format_hash) != SCOUTFS_FORMAT_HASH) {
+		fprintf(stderr, "'%s' doesn't have a supported super block\n",
+			path);
+		return -EIO;
+	}
+
+	return 0;
+}
+
+static int diff_volumes(struct diff_info *di)
+{
+	struct scoutfs_super_block *a = &di->super[0];
+	struct scoutfs_super_block *b = &di->super[1];
+	struct diff_tree trees[] = {
+		{ "fs_root", fs_key, NULL },
+		{ "logs_root", log_trees_key, diff_log_trees },
+		{ "lock_clients", rid_key, NULL },
+		{ "trans_seqs", trans_seqs_key, NULL },
+		{ "mounted_clients", rid_key, NULL },
+	};
+	int ret;
+
+	if (a->hdr.fsid != b->hdr.fsid)
+		printf("volumes have different fsids %016llx and %016llx\n",
+		       le64_to_cpu(a->hdr.fsid), le64_to_cpu(b->hdr.fsid));
+
+	ret = diff_btree(di, &trees[0], &a->fs_root, &b->fs_root) ?:
+	      diff_btree(di, &trees[1], &a->logs_root, &b->logs_root) ?:
+	      diff_btree(di, &trees[2], &a->lock_clients, &b->lock_clients) ?:
+	      diff_btree(di, &trees[3], &a->trans_seqs, &b->trans_seqs) ?:
+	      diff_btree(di, &trees[4], &a->mounted_clients,
+			 &b->mounted_clients) ?:
+	      diff_radix(di, "core_meta_avail", &a->core_meta_avail,
+			 &b->core_meta_avail) ?:
+	      diff_radix(di, "core_meta_freed", &a->core_meta_freed,
+			 &b->core_meta_freed) ?:
+	      diff_radix(di, "core_data_avail", &a->core_data_avail,
+			 &b->core_data_avail) ?:
+	      diff_radix(di, "core_data_freed", &a->core_data_freed,
+			 &b->core_data_freed);
+
+	return ret;
+}
+
+static struct option long_ops[] = {
+	{ "mmap", 0, NULL, 'm' },
+	{ NULL, 0, NULL, 0}
+};
+
+static int diff_cmd(int argc, char **argv)
+{
+	struct diff_info di = { { NULL, } };
+	bool use_mmap = false;
+	char *paths[2];
+	int fds[2] = { -1, -1 };
+	int ret;
+	int c;
+	int i;
+
+	while ((c = getopt_long(argc, argv, "m", long_ops, NULL)) != -1) {
+		switch (c) {
+		case 'm':
+			use_mmap = true;
+			break;
+		case '?':
+		default:
+			return -EINVAL;
+		}
+	}
+
+	if (optind != argc - 2) {
+		printf("scoutfs diff: two path arguments are required\n");
+		return -EINVAL;
+	}
+	paths[0] = argv[optind];
+	paths[1] = argv[optind + 1];
+
+	for (i = 0; i < 2; i++) {
+		fds[i] = open(paths[i], O_RDONLY);
+		if (fds[i] < 0) {
+			ret = -errno;
+			fprintf(stderr, "failed to open '%s': %s (%d)\n",
+				paths[i], strerror(errno), errno);
+			goto out;
+		}
+
+		di.bc[i] = block_cache_open(paths[i], fds[i], use_mmap);
+		if (!di.bc[i]) {
+			ret = -ENOMEM;
+			goto out;
+		}
+
+		ret = read_super(&di, i, paths[i]);
+		if (ret)
+			goto out;
+	}
+
+	ret = diff_volumes(&di);
+	if (ret == 0)
+		printf("%llu items added, %llu removed, %llu changed, %llu blknos set, %llu cleared, read %llu blocks\n",
+		       di.added, di.removed, di.changed, di.radix_set,
+		       di.radix_cleared, di.blocks);
+
+out:
+	for (i = 0; i < 2; i++) {
+		if (di.bc[i])
+			block_cache_destroy(di.bc[i]);
+		if (fds[i] >= 0)
+			close(fds[i]);
+	}
+	return ret;
+}
+
+static void __attribute__((constructor)) diff_ctor(void)
+{
+	cmd_register("diff", "[--mmap] <device a> <device b>",
+		     "print metadata items that differ between two volumes",
+		     diff_cmd);
+}
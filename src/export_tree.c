@@ -0,0 +1,921 @@
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <getopt.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "sparse.h"
+#include "util.h"
+#include "format.h"
+#include "cmd.h"
+#include "key.h"
+#include "parse.h"
+#include "dev.h"
+#include "block.h"
+#include "forest.h"
+#include "workq.h"
+#include "list.h"
+#include "pex.h"
+#include "fs_items.h"
+
+/*
+ * export-tree writes a directory tree from an unmounted device or image
+ * to stdout as a POSIX pax tar stream.  The tree is walked in readdir
+ * order by reading the dirent, inode, symlink, and xattr items.  Each
+ * entry gets a ustar header that's preceded by a pax extended header
+ * when it has xattrs, high precision times, or fields that don't fit
+ * in the ustar header.
+ *
+ * The walk and the reading of file data are pipelined.  The walk
+ * decodes each regular file's packed extents into chunks of the file's
+ * data that are read from the device by a pool of threads.  Headers and
+ * chunks are kept in stream order and the oldest is written once it's
+ * ready, with a limited number in flight.  Holes and unwritten extents
+ * are written as zeros.
+ */
+
+#define TAR_BLOCK_SIZE		512
+/* file data is read in chunks of up to this many blocks */
+#define EXPORT_CHUNK_BLOCKS	256
+/* ustar octal fields can store values up to this size */
+#define TAR_SIZE_MAX		077777777777ULL
+#define TAR_ID_MAX		07777777ULL
+
+struct tar_header {
+	char name[100];
+	char mode[8];
+	char uid[8];
+	char gid[8];
+	char size[12];
+	char mtime[12];
+	char chksum[8];
+	char typeflag;
+	char linkname[100];
+	char magic[6];
+	char version[2];
+	char uname[32];
+	char gname[32];
+	char devmajor[8];
+	char devminor[8];
+	char prefix[155];
+	char pad[12];
+} __packed;
+
+/* a directory in the path from the top to the entry being exported */
+struct export_parent {
+	u64 ino;
+	struct export_parent *parent;
+};
+
+struct export_info {
+	struct block_cache *bc;
+	struct forest *fo;
+	struct workq *wq;
+	int dev_fd;
+	int out_fd;
+	u64 first_data_blkno;
+	u64 last_data_blkno;
+	bool offline_holes;
+
+	struct list_head chunks;
+	int nr_chunks;
+	int max_chunks;
+
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	int err;
+
+	u64 bytes;
+	u64 entries;
+	u64 skipped;
+
+	struct export_parent *parent;
+};
+
+struct export_run {
+	u64 iblock;
+	u64 blkno;
+	u64 count;
+};
+
+/*
+ * A chunk is a contiguous piece of the stream.  Headers are built by
+ * the walk and are ready as they're queued.  File data chunks are
+ * filled by workers that read their runs of mapped blocks.
+ */
+struct export_chunk {
+	struct work work;
+	struct list_head head;
+	struct export_info *ei;
+	void *buf;
+	size_t len;
+	bool done;
+
+	u64 iblock;
+	int nr_runs;
+	struct export_run runs[EXPORT_CHUNK_BLOCKS];
+};
+
+/* a growing buffer of pax extended header records */
+struct pax_records {
+	char *buf;
+	size_t len;
+	size_t size;
+};
+
+struct xattr_args {
+	struct pax_records *pr;
+	u8 *buf;
+	unsigned len;
+	unsigned total;
+};
+
+/* the first error stops the export and is returned by the command */
+static void set_error(struct export_info *ei, int err)
+{
+	pthread_mutex_lock(&ei->mutex);
+	if (!ei->err)
+		ei->err = err;
+	pthread_mutex_unlock(&ei->mutex);
+}
+
+static int get_error(struct export_info *ei)
+{
+	return __atomic_load_n(&ei->err, __ATOMIC_RELAXED);
+}
+
+static void chunk_worker(struct work *work)
+{
+	struct export_chunk *ec = container_of(work, struct export_chunk,
+					       work);
+	struct export_info *ei = ec->ei;
+	struct export_run *run;
+	int ret = 0;
+	int i;
+
+	for (i = 0; i < ec->nr_runs && ret == 0; i++) {
+		run = &ec->runs[i];
+		ret = rw_full(ei->dev_fd, ec->buf +
+			      ((run->iblock - ec->iblock) << SCOUTFS_BLOCK_SHIFT),
+			      run->count << SCOUTFS_BLOCK_SHIFT,
+			      run->blkno << SCOUTFS_BLOCK_SHIFT, false);
+	}
+
+	if (ret < 0) {
+		fprintf(stderr, "error reading data blocks: %s (%d)\n",
+			strerror(-ret), -ret);
+		set_error(ei, ret);
+	}
+
+	pthread_mutex_lock(&ei->mutex);
+	ec->done = true;
+	pthread_cond_broadcast(&ei->cond);
+	pthread_mutex_unlock(&ei->mutex);
+}
+
+/* write the oldest chunk once it's ready */
+static int write_oldest_chunk(struct export_info *ei)
+{
+	struct export_chunk *ec;
+	int ret;
+
+	ec = list_first_entry(&ei->chunks, struct export_chunk, head);
+
+	pthread_mutex_lock(&ei->mutex);
+	while (!ec->done)
+		pthread_cond_wait(&ei->cond, &ei->mutex);
+	pthread_mutex_unlock(&ei->mutex);
+
+	ret = get_error(ei);
+	if (ret == 0) {
+		/* the stream is written to a pipe so it doesn't use offsets */
+		ret = rw_full(ei->out_fd, ec->buf, ec->len, -1, true);
+		if (ret < 0) {
+			fprintf(stderr, "writing tar stream failed: %s (%d)\n",
+				strerror(-ret), -ret);
+			set_error(ei, ret);
+		} else {
+			ei->bytes += ec->len;
+		}
+	}
+
+	list_del(&ec->head);
+	ei->nr_chunks--;
+	free(ec->buf);
+	free(ec);
+	return ret;
+}
+
+/*
+ * Allocate a chunk at the tail of the stream, first writing the oldest
+ * chunks to make room.  The buffer is zeroed and padded to the tar
+ * block size.  Only data chunks need their array of runs.
+ */
+static struct export_chunk *alloc_chunk(struct export_info *ei, size_t len,
+					bool data)
+{
+	struct export_chunk *ec;
+	size_t size;
+	int ret;
+
+	while (ei->nr_chunks >= ei->max_chunks) {
+		ret = write_oldest_chunk(ei);
+		if (ret < 0)
+			return NULL;
+	}
+
+	size = round_up(len, TAR_BLOCK_SIZE);
+	ec = calloc(1, data ? sizeof(*ec) :
+			      offsetof(struct export_chunk, runs));
+	if (ec)
+		ec->buf = calloc(1, data ? EXPORT_CHUNK_BLOCKS <<
+					   SCOUTFS_BLOCK_SHIFT : size);
+	if (!ec || !ec->buf) {
+		free(ec);
+		set_error(ei, -ENOMEM);
+		return NULL;
+	}
+
+	ec->ei = ei;
+	ec->len = size;
+	list_add_tail(&ec->head, &ei->chunks);
+	ei->nr_chunks++;
+	return ec;
+}
+
+static int queue_buf(struct export_info *ei, void *buf, size_t len)
+{
+	struct export_chunk *ec;
+
+	ec = alloc_chunk(ei, len, false);
+	if (!ec)
+		return get_error(ei);
+
+	memcpy(ec->buf, buf, len);
+	ec->done = true;
+	return 0;
+}
+
+static int pax_add(struct pax_records *pr, char *kw, void *val, size_t len)
+{
+	size_t rec;
+	size_t dig;
+	char *buf;
+
+	/* the record length includes the digits of the length itself */
+	rec = 1 + strlen(kw) + 1 + len + 1;
+	for (dig = 1; snprintf(NULL, 0, "%zu", rec + dig) != dig; dig++)
+		;
+	rec += dig;
+
+	if (pr->len + rec > pr->size) {
+		pr->size = max(pr->size * 2, pr->len + rec);
+		buf = realloc(pr->buf, pr->size);
+		if (!buf)
+			return -ENOMEM;
+		pr->buf = buf;
+	}
+
+	buf = pr->buf + pr->len;
+	buf += sprintf(buf, "%zu %s=", rec, kw);
+	memcpy(buf, val, len);
+	buf[len] = '\n';
+	pr->len += rec;
+	return 0;
+}
+
+static int pax_add_str(struct pax_records *pr, char *kw, char *str)
+{
+	return pax_add(pr, kw, str, strlen(str));
+}
+
+static int pax_add_u64(struct pax_records *pr, char *kw, u64 val)
+{
+	char str[24];
+
+	snprintf(str, sizeof(str), "%llu", val);
+	return pax_add_str(pr, kw, str);
+}
+
+static int pax_add_time(struct pax_records *pr, char *kw,
+			struct scoutfs_timespec *ts)
+{
+	char str[40];
+
+	snprintf(str, sizeof(str), "%llu.%09u",
+		 le64_to_cpu(ts->sec), le32_to_cpu(ts->nsec));
+	return pax_add_str(pr, kw, str);
+}
+
+/*
+ * Xattr items are sorted by name hash, id, and part so each xattr's
+ * parts are found in order.  The xattr is recorded once all of its
+ * name and value bytes have been gathered.
+ */
+static int add_xattr_part(struct scoutfs_key *key, void *val,
+			  unsigned val_len, void *arg)
+{
+	struct xattr_args *xa = arg;
+	struct scoutfs_xattr *xat;
+	char kw[sizeof("SCHILY.xattr.") + SCOUTFS_XATTR_MAX_NAME_LEN];
+	int ret;
+
+	if (key->skx_part == 0) {
+		xat = val;
+		if (xa->len != xa->total || val_len < sizeof(*xat)) {
+			fprintf(stderr, "xattr item "SK_FMT" is missing parts or its header\n",
+				SK_ARG(key));
+			return -EIO;
+		}
+		xa->total = sizeof(*xat) + xat->name_len +
+			    le16_to_cpu(xat->val_len);
+		xa->len = 0;
+	}
+
+	if (xa->len + val_len > xa->total) {
+		fprintf(stderr, "xattr item "SK_FMT" has %u bytes past its value\n",
+			SK_ARG(key), xa->len + val_len - xa->total);
+		return -EIO;
+	}
+
+	memcpy(xa->buf + xa->len, val, val_len);
+	xa->len += val_len;
+
+	if (xa->len == xa->total) {
+		xat = (void *)xa->buf;
+		snprintf(kw, sizeof(kw), "SCHILY.xattr.%.*s",
+			 xat->name_len, xat->name);
+		ret = pax_add(xa->pr, kw, xat->name + xat->name_len,
+			      le16_to_cpu(xat->val_len));
+		if (ret < 0)
+			return ret;
+	}
+
+	return 0;
+}
+
+static int add_xattrs(struct export_info *ei, u64 ino,
+		      struct pax_records *pr)
+{
+	struct xattr_args xa = {
+		.pr = pr,
+	};
+	struct scoutfs_key first;
+	struct scoutfs_key last;
+	int ret;
+
+	xa.buf = malloc(sizeof(struct scoutfs_xattr) +
+			SCOUTFS_XATTR_MAX_NAME_LEN +
+			SCOUTFS_XATTR_MAX_VAL_LEN);
+	if (!xa.buf)
+		return -ENOMEM;
+
+	fs_init_key(&first, ino, SCOUTFS_XATTR_TYPE);
+	last = first;
+	last.skx_name_hash = cpu_to_le64(U64_MAX);
+	last.skx_id = cpu_to_le64(U64_MAX);
+	last.skx_part = U8_MAX;
+
+	ret = forest_walk(ei->fo, &first, &last, add_xattr_part, &xa);
+	if (ret == 0 && xa.len != xa.total) {
+		fprintf(stderr, "ino %llu last xattr is missing parts\n", ino);
+		ret = -EIO;
+	}
+
+	free(xa.buf);
+	return ret;
+}
+
+/* fields are zero padded octal with a trailing nul */
+static void set_octal(char *field, size_t size, u64 val)
+{
+	char str[24];
+
+	snprintf(str, sizeof(str), "%0*llo", (int)size - 1, val);
+	memcpy(field, str, size);
+}
+
+/* names that fill the field aren't terminated */
+static void set_name(char *field, size_t size, char *name)
+{
+	memcpy(field, name, min(strlen(name), size));
+}
+
+/*
+ * Queue the headers for an entry.  Values that don't fit in the ustar
+ * header are only stored in the pax records, which readers prefer.
+ */
+static int queue_headers(struct export_info *ei, u64 ino, char *path,
+			 char typeflag, struct scoutfs_inode *inode,
+			 u64 size, char *linkname)
+{
+	struct pax_records pr = {NULL,};
+	struct tar_header hdr;
+	char pax_name[100];
+	u32 rdev = le32_to_cpu(inode->rdev);
+	u32 uid = le32_to_cpu(inode->uid);
+	u32 gid = le32_to_cpu(inode->gid);
+	unsigned int sum;
+	int ret;
+	int i;
+
+	ret = add_xattrs(ei, ino, &pr) ?:
+	      pax_add_time(&pr, "mtime", &inode->mtime) ?:
+	      pax_add_time(&pr, "atime", &inode->atime) ?:
+	      (strlen(path) >= sizeof(hdr.name) ?
+		pax_add_str(&pr, "path", path) : 0) ?:
+	      (linkname && strlen(linkname) >= sizeof(hdr.linkname) ?
+		pax_add_str(&pr, "linkpath", linkname) : 0) ?:
+	      (size > TAR_SIZE_MAX ? pax_add_u64(&pr, "size", size) : 0) ?:
+	      (uid > TAR_ID_MAX ? pax_add_u64(&pr, "uid", uid) : 0) ?:
+	      (gid > TAR_ID_MAX ? pax_add_u64(&pr, "gid", gid) : 0);
+	if (ret < 0)
+		goto out;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, "ustar", 6);
+	memcpy(hdr.version, "00", 2);
+	set_octal(hdr.mode, sizeof(hdr.mode), 0644);
+	set_octal(hdr.uid, sizeof(hdr.uid), 0);
+	set_octal(hdr.gid, sizeof(hdr.gid), 0);
+	set_octal(hdr.mtime, sizeof(hdr.mtime), le64_to_cpu(inode->mtime.sec));
+
+	if (pr.len) {
+		snprintf(pax_name, sizeof(pax_name), "./PaxHeaders/%llu", ino);
+		set_name(hdr.name, sizeof(hdr.name), pax_name);
+		set_octal(hdr.size, sizeof(hdr.size), pr.len);
+		hdr.typeflag = 'x';
+
+		memset(hdr.chksum, ' ', sizeof(hdr.chksum));
+		for (i = 0, sum = 0; i < sizeof(hdr); i++)
+			sum += ((unsigned char *)&hdr)[i];
+		set_octal(hdr.chksum, sizeof(hdr.chksum) - 1, sum);
+
+		ret = queue_buf(ei, &hdr, sizeof(hdr)) ?:
+		      queue_buf(ei, pr.buf, pr.len);
+		if (ret < 0)
+			goto out;
+	}
+
+	memset(hdr.name, 0, sizeof(hdr.name));
+	set_name(hdr.name, sizeof(hdr.name), path);
+	set_octal(hdr.mode, sizeof(hdr.mode), le32_to_cpu(inode->mode) & 07777);
+	set_octal(hdr.uid, sizeof(hdr.uid), min(uid, (u32)TAR_ID_MAX));
+	set_octal(hdr.gid, sizeof(hdr.gid), min(gid, (u32)TAR_ID_MAX));
+	set_octal(hdr.size, sizeof(hdr.size), min(size, TAR_SIZE_MAX));
+	hdr.typeflag = typeflag;
+	if (linkname)
+		set_name(hdr.linkname, sizeof(hdr.linkname), linkname);
+	if (typeflag == '3' || typeflag == '4') {
+		set_octal(hdr.devmajor, sizeof(hdr.devmajor), major(rdev));
+		set_octal(hdr.devminor, sizeof(hdr.devminor), minor(rdev));
+	}
+
+	memset(hdr.chksum, ' ', sizeof(hdr.chksum));
+	for (i = 0, sum = 0; i < sizeof(hdr); i++)
+		sum += ((unsigned char *)&hdr)[i];
+	set_octal(hdr.chksum, sizeof(hdr.chksum) - 1, sum);
+
+	ret = queue_buf(ei, &hdr, sizeof(hdr));
+out:
+	free(pr.buf);
+	return ret;
+}
+
+/*
+ * Queue the chunk of file data that starts at the iblock.  The last
+ * chunk only contains the bytes up to the file size.
+ */
+static struct export_chunk *queue_data_chunk(struct export_info *ei,
+					     struct export_chunk *ec,
+					     u64 iblock, u64 size)
+{
+	u64 nr_blocks = EXPORT_CHUNK_BLOCKS;
+	size_t len;
+
+	if (ec) {
+		work_init(&ec->work, chunk_worker);
+		if (ec->nr_runs)
+			workq_queue(ei->wq, &ec->work);
+		else
+			ec->done = true;
+	}
+
+	if (iblock << SCOUTFS_BLOCK_SHIFT >= size)
+		return NULL;
+
+	len = min(nr_blocks << SCOUTFS_BLOCK_SHIFT,
+		  size - (iblock << SCOUTFS_BLOCK_SHIFT));
+
+	ec = alloc_chunk(ei, len, true);
+	if (ec)
+		ec->iblock = iblock;
+	return ec;
+}
+
+/*
+ * Decode a regular file's packed extents into chunks of its data.
+ * Every chunk up to the file size is queued, those without runs of
+ * mapped blocks are holes that are written as zeros.
+ */
+static int queue_file_data(struct export_info *ei, u64 ino, u64 size)
+{
+	struct export_chunk *ec = NULL;
+	struct forest_iter *it = NULL;
+	struct export_run *run;
+	struct pex_decoder dec = {{0,}};
+	struct pex_extent ext;
+	struct scoutfs_key first;
+	struct scoutfs_key last;
+	struct scoutfs_key *key;
+	unsigned val_len;
+	void *val;
+	u64 iblock;
+	u64 blkno;
+	u64 count;
+	u64 nr;
+	int ret;
+
+	fs_init_key(&first, ino, SCOUTFS_PACKED_EXTENT_TYPE);
+	fs_init_key(&last, ino, SCOUTFS_PACKED_EXTENT_TYPE);
+	last.skpe_base = cpu_to_le64(U64_MAX);
+	last._sk_third = cpu_to_le64(U64_MAX);
+	last.skpe_part = U8_MAX;
+
+	ec = queue_data_chunk(ei, NULL, 0, size);
+	if (!ec && size)
+		return get_error(ei) ?: -ENOMEM;
+
+	ret = forest_iter_start(ei->fo, &first, &last, &it);
+	if (ret < 0)
+		goto out;
+
+	while (ec && (ret = forest_iter_next(it, &key, &val, &val_len)) > 0) {
+		ret = pex_decode_key(&dec, key, val, val_len);
+		if (ret < 0) {
+			fprintf(stderr, "packed extent item "SK_FMT" doesn't follow previous part\n",
+				SK_ARG(key));
+			break;
+		}
+
+		while (ec && (ret = pex_decode_next(&dec, &ext)) > 0) {
+			if ((ext.flags & SEF_OFFLINE) && !ei->offline_holes) {
+				fprintf(stderr, "ino %llu has offline extents after its header was written\n",
+					ino);
+				ret = -EIO;
+				goto out;
+			}
+			if (ext.blkno == 0 || ext.flags)
+				continue;
+
+			if (ext.blkno < ei->first_data_blkno ||
+			    ext.blkno + ext.count - 1 > ei->last_data_blkno) {
+				fprintf(stderr, "ino %llu extent at iblock %llu blkno %llu count %u is outside data blocks\n",
+					ino, ext.iblock, ext.blkno, ext.count);
+				ret = -EIO;
+				goto out;
+			}
+
+			iblock = ext.iblock;
+			blkno = ext.blkno;
+			count = ext.count;
+			while (ec && count > 0) {
+				if (iblock >= ec->iblock + EXPORT_CHUNK_BLOCKS) {
+					ec = queue_data_chunk(ei, ec,
+						ec->iblock + EXPORT_CHUNK_BLOCKS,
+						size);
+					continue;
+				}
+
+				nr = min(count, ec->iblock +
+					 EXPORT_CHUNK_BLOCKS - iblock);
+				run = &ec->runs[ec->nr_runs];
+				if (ec->nr_runs &&
+				    run[-1].iblock + run[-1].count == iblock &&
+				    run[-1].blkno + run[-1].count == blkno) {
+					run[-1].count += nr;
+				} else {
+					run->iblock = iblock;
+					run->blkno = blkno;
+					run->count = nr;
+					ec->nr_runs++;
+				}
+				iblock += nr;
+				blkno += nr;
+				count -= nr;
+			}
+		}
+		if (ret < 0) {
+			fprintf(stderr, "packed extent item "SK_FMT" is malformed at off %u\n",
+				SK_ARG(key), dec.off);
+			break;
+		}
+	}
+
+	/* queue the chunks after the last extent, ending in a NULL chunk */
+	while (ret == 0 && ec)
+		ec = queue_data_chunk(ei, ec, ec->iblock + EXPORT_CHUNK_BLOCKS,
+				      size);
+out:
+	forest_iter_stop(it);
+	if (ret == 0)
+		ret = get_error(ei);
+	/* a partially filled chunk is never written once there's an error */
+	if (ec) {
+		set_error(ei, ret ?: -EIO);
+		ec->done = true;
+	}
+	return ret;
+}
+
+static int export_dir(struct export_info *ei, u64 ino, char *path,
+		      struct scoutfs_inode *inode);
+
+static bool is_parent(struct export_info *ei, u64 ino)
+{
+	struct export_parent *ep;
+
+	for (ep = ei->parent; ep; ep = ep->parent) {
+		if (ep->ino == ino)
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * Export an entry with the path relative to the top directory.  Errors
+ * that would leave the stream inconsistent stop the export.
+ */
+static int export_entry(struct export_info *ei, u64 ino, char *path)
+{
+	char target[SCOUTFS_SYMLINK_MAX_SIZE + 1];
+	struct scoutfs_inode inode;
+	mode_t mode;
+	int ret;
+
+	/* dangling entries are skipped before anything is queued */
+	ret = fs_lookup_inode(ei->fo, ino, &inode);
+	if (ret == -ENOENT) {
+		fprintf(stderr, "skipping '%s' without an inode\n", path);
+		ei->skipped++;
+		return 0;
+	}
+	if (ret < 0)
+		return ret;
+
+	mode = le32_to_cpu(inode.mode);
+
+	/* corrupt entries that loop back to a parent would never end */
+	if (S_ISDIR(mode) && is_parent(ei, ino)) {
+		fprintf(stderr, "skipping '%s' for ino %llu which is one of its parent directories\n",
+			path, ino);
+		ei->skipped++;
+		return 0;
+	}
+
+	ei->entries++;
+
+	if (S_ISDIR(mode))
+		return export_dir(ei, ino, path, &inode);
+
+	if (S_ISREG(mode)) {
+		if (inode.offline_blocks && !ei->offline_holes) {
+			fprintf(stderr, "skipping ino %llu '%s' with offline blocks that must be staged\n",
+				ino, path);
+			ei->entries--;
+			ei->skipped++;
+			return 0;
+		}
+		return queue_headers(ei, ino, path, '0', &inode,
+				     le64_to_cpu(inode.size), NULL) ?:
+		       queue_file_data(ei, ino, le64_to_cpu(inode.size));
+	}
+
+	if (S_ISLNK(mode))
+		return fs_read_symlink(ei->fo, ino, &inode, target) ?:
+		       queue_headers(ei, ino, path, '2', &inode, 0, target);
+	if (S_ISCHR(mode))
+		return queue_headers(ei, ino, path, '3', &inode, 0, NULL);
+	if (S_ISBLK(mode))
+		return queue_headers(ei, ino, path, '4', &inode, 0, NULL);
+	if (S_ISFIFO(mode))
+		return queue_headers(ei, ino, path, '6', &inode, 0, NULL);
+
+	fprintf(stderr, "skipping ino %llu '%s' with mode 0%o\n",
+		ino, path, mode);
+	ei->entries--;
+	ei->skipped++;
+	return 0;
+}
+
+static int export_dir(struct export_info *ei, u64 ino, char *path,
+		      struct scoutfs_inode *inode)
+{
+	struct export_parent ep = {
+		.ino = ino,
+		.parent = ei->parent,
+	};
+	struct fs_dent *dents = NULL;
+	char *child = NULL;
+	size_t len;
+	u64 nr = 0;
+	int ret;
+	u64 i;
+
+	len = strlen(path);
+	child = malloc(len + 1 + SCOUTFS_NAME_LEN + 1);
+	if (!child)
+		return -ENOMEM;
+
+	/* directory names end in a slash */
+	snprintf(child, len + 2, "%s/", path);
+	ret = queue_headers(ei, ino, child, '5', inode, 0, NULL);
+	if (ret < 0)
+		goto out;
+
+	ret = fs_readdir(ei->fo, ino, &dents, &nr);
+	if (ret < 0)
+		goto out;
+
+	ei->parent = &ep;
+
+	for (i = 0; i < nr; i++) {
+		/* like dangling entries, corrupt names are skipped */
+		if (!dirent_name_valid(dents[i].name)) {
+			fprintf(stderr, "skipping entry in '%s' for ino %llu with invalid name '%s'\n",
+				path, dents[i].ino, dents[i].name);
+			ei->skipped++;
+			continue;
+		}
+
+		sprintf(child, "%s/%s", path, dents[i].name);
+		ret = export_entry(ei, dents[i].ino, child);
+		if (ret < 0)
+			goto out;
+	}
+out:
+	ei->parent = ep.parent;
+	free(child);
+	free(dents);
+	return ret;
+}
+
+static int export_tree(struct export_info *ei, u64 ino, int nr_threads)
+{
+	struct scoutfs_super_block *super;
+	struct scoutfs_inode inode;
+	char zeros[TAR_BLOCK_SIZE * 2] = {0,};
+	struct block *bl;
+	int ret;
+	int err;
+
+	bl = block_read(ei->bc, SCOUTFS_SUPER_BLKNO);
+	if (!bl)
+		return -EIO;
+	super = block_data(bl);
+
+	if (le32_to_cpu(super->hdr.magic) != SCOUTFS_BLOCK_MAGIC_SUPER) {
+		fprintf(stderr, "super block magic %08x != expected %08x\n",
+			le32_to_cpu(super->hdr.magic),
+			SCOUTFS_BLOCK_MAGIC_SUPER);
+		ret = -EIO;
+		goto out;
+	}
+
+	ei->first_data_blkno = le64_to_cpu(super->first_data_blkno);
+	ei->last_data_blkno = le64_to_cpu(super->last_data_blkno);
+	ei->max_chunks = nr_threads * 4;
+
+	ei->wq = workq_create(nr_threads);
+	if (!ei->wq) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	ret = forest_open(ei->bc, super, &ei->fo) ?:
+	      fs_lookup_inode(ei->fo, ino, &inode);
+	if (ret < 0)
+		goto out;
+
+	if (!S_ISDIR(le32_to_cpu(inode.mode))) {
+		fprintf(stderr, "ino %llu isn't a directory\n", ino);
+		ret = -ENOTDIR;
+		goto out;
+	}
+
+	ret = export_dir(ei, ino, ".", &inode) ?:
+	      queue_buf(ei, zeros, sizeof(zeros));
+
+	/* drain the remaining chunks after errors */
+	while (ei->nr_chunks > 0) {
+		err = write_oldest_chunk(ei);
+		if (err && !ret)
+			ret = err;
+	}
+	workq_wait(ei->wq);
+
+	if (ret == 0)
+		fprintf(stderr, "exported %llu entries in %llu bytes, skipped %llu\n",
+			ei->entries, ei->bytes, ei->skipped);
+out:
+	forest_close(ei->fo);
+	workq_destroy(ei->wq);
+	block_put(ei->bc, bl);
+	return ret;
+}
+
+static struct option long_ops[] = {
+	{ "mmap", 0, NULL, 'm' },
+	{ "offline-holes", 0, NULL, 'o' },
+	{ "threads", 1, NULL, 't' },
+	{ NULL, 0, NULL, 0}
+};
+
+static int export_tree_cmd(int argc, char **argv)
+{
+	struct export_info ei = {
+		.out_fd = STDOUT_FILENO,
+		.chunks = LIST_HEAD_INIT(ei.chunks),
+		.mutex = PTHREAD_MUTEX_INITIALIZER,
+		.cond = PTHREAD_COND_INITIALIZER,
+	};
+	bool use_mmap = false;
+	int nr_threads = 0;
+	char *path;
+	u64 ino;
+	int ret;
+	int c;
+
+	while ((c = getopt_long(argc, argv, "mot:", long_ops, NULL)) != -1) {
+		switch (c) {
+		case 'm':
+			use_mmap = true;
+			break;
+		case 'o':
+			ei.offline_holes = true;
+			break;
+		case 't':
+			ret = parse_threads(optarg, &nr_threads);
+			if (ret)
+				return ret;
+			break;
+		case '?':
+		default:
+			return -EINVAL;
+		}
+	}
+
+	if (optind != argc - 2) {
+		printf("scoutfs export-tree: device and directory inode arguments are required\n");
+		return -EINVAL;
+	}
+	path = argv[optind];
+
+	ret = parse_u64(argv[optind + 1], &ino);
+	if (ret < 0)
+		return ret;
+
+	if (isatty(ei.out_fd)) {
+		fprintf(stderr, "not writing a tar stream to a terminal\n");
+		return -EINVAL;
+	}
+
+	ei.dev_fd = open(path, O_RDONLY);
+	if (ei.dev_fd < 0) {
+		ret = -errno;
+		fprintf(stderr, "failed to open '%s': %s (%d)\n",
+			path, strerror(errno), errno);
+		return ret;
+	}
+
+	if (nr_threads == 0)
+		nr_threads = workq_nr_threads();
+
+	ei.bc = block_cache_open(path, ei.dev_fd, use_mmap);
+	if (!ei.bc) {
+		close(ei.dev_fd);
+		return -ENOMEM;
+	}
+
+	ret = export_tree(&ei, ino, nr_threads);
+
+	block_cache_destroy(ei.bc);
+	close(ei.dev_fd);
+	return ret;
+}
+
+static void __attribute__((constructor)) export_tree_ctor(void)
+{
+	cmd_register("export-tree",
+		     "[--mmap] [--offline-holes] [--threads nr] <device> <dir_ino>",
+		     "write a directory tree to stdout as a pax tar stream",
+		     export_tree_cmd);
+}
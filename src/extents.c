@@ -0,0 +1,220 @@
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <getopt.h>
+#include <stdbool.h>
+
+#include "sparse.h"
+#include "util.h"
+#include "format.h"
+#include "cmd.h"
+#include "key.h"
+#include "parse.h"
+#include "block.h"
+#include "forest.h"
+#include "pex.h"
+
+/*
+ * extents prints the extents that map an inode's file data from an
+ * unmounted device or image.  Only the inode's packed extent items are
+ * read by iterating over their key range in the fs_root merged with
+ * the log trees.  Each region's parts are decoded in order and the
+ * extents that are split across regions and parts are joined back
+ * together before they're printed.
+ */
+
+struct extents_info {
+	struct pex_extent pending;
+	u64 extents;
+	u64 blocks;
+	u64 offline;
+	u64 unwritten;
+};
+
+/* indexed by the offline and unwritten flags */
+static char *flag_strs[] = {
+	"", "offline", "unwritten", "offline,unwritten",
+};
+
+static void print_pending(struct extents_info *ei)
+{
+	struct pex_extent *ext = &ei->pending;
+
+	if (ext->count == 0)
+		return;
+
+	printf("%16llu %10u %16llu %s\n",
+	       ext->iblock, ext->count, ext->blkno,
+	       flag_strs[ext->flags & (SEF_OFFLINE | SEF_UNWRITTEN)]);
+
+	ei->extents++;
+	ei->blocks += ext->blkno ? ext->count : 0;
+	ei->offline += (ext->flags & SEF_OFFLINE) ? ext->count : 0;
+	ei->unwritten += (ext->flags & SEF_UNWRITTEN) ? ext->count : 0;
+	ext->count = 0;
+}
+
+/* sparse extents aren't printed, they end the pending extent */
+static void add_extent(struct extents_info *ei, struct pex_extent *ext)
+{
+	struct pex_extent *pend = &ei->pending;
+
+	if (pend->count && pend->iblock + pend->count == ext->iblock &&
+	    pend->flags == ext->flags &&
+	    (pend->blkno ? pend->blkno + pend->count == ext->blkno :
+			   ext->blkno == 0) &&
+	    (u64)pend->count + ext->count <= U32_MAX) {
+		pend->count += ext->count;
+		return;
+	}
+
+	print_pending(ei);
+	if (ext->blkno || ext->flags)
+		*pend = *ext;
+}
+
+static int print_extents(struct block_cache *bc, u64 ino)
+{
+	struct scoutfs_super_block *super;
+	struct extents_info ei = {{0,}};
+	struct forest_iter *it = NULL;
+	struct forest *fo = NULL;
+	struct pex_decoder dec = {{0,}};
+	struct pex_extent ext;
+	struct scoutfs_key first;
+	struct scoutfs_key last;
+	struct scoutfs_key *key;
+	struct block *bl;
+	unsigned val_len;
+	void *val;
+	u64 items = 0;
+	int ret;
+
+	bl = block_read(bc, SCOUTFS_SUPER_BLKNO);
+	if (!bl)
+		return -EIO;
+	super = block_data(bl);
+
+	if (le32_to_cpu(super->hdr.magic) != SCOUTFS_BLOCK_MAGIC_SUPER) {
+		fprintf(stderr, "super block magic %08x != expected %08x\n",
+			le32_to_cpu(super->hdr.magic),
+			SCOUTFS_BLOCK_MAGIC_SUPER);
+		ret = -EIO;
+		goto out;
+	}
+
+	scoutfs_key_set_zeros(&first);
+	first.sk_zone = SCOUTFS_FS_ZONE;
+	first.skpe_ino = cpu_to_le64(ino);
+	first.sk_type = SCOUTFS_PACKED_EXTENT_TYPE;
+	last = first;
+	last.skpe_base = cpu_to_le64(U64_MAX);
+	last._sk_third = cpu_to_le64(U64_MAX);
+	last.skpe_part = U8_MAX;
+
+	ret = forest_open(bc, super, &fo) ?:
+	      forest_iter_start(fo, &first, &last, &it);
+	if (ret < 0)
+		goto out;
+
+	printf("%16s %10s %16s %s\n", "iblock", "count", "blkno", "flags");
+
+	while ((ret = forest_iter_next(it, &key, &val, &val_len)) > 0) {
+		items++;
+
+		ret = pex_decode_key(&dec, key, val, val_len);
+		if (ret < 0) {
+			fprintf(stderr, "packed extent item "SK_FMT" doesn't follow previous part\n",
+				SK_ARG(key));
+			break;
+		}
+
+		while ((ret = pex_decode_next(&dec, &ext)) > 0)
+			add_extent(&ei, &ext);
+		if (ret < 0) {
+			fprintf(stderr, "packed extent item "SK_FMT" is malformed at off %u\n",
+				SK_ARG(key), dec.off);
+			break;
+		}
+	}
+
+	if (ret == 0) {
+		print_pending(&ei);
+		printf("%llu extents in %llu items, %llu blocks mapped, %llu offline, %llu unwritten\n",
+		       ei.extents, items, ei.blocks, ei.offline, ei.unwritten);
+	}
+out:
+	forest_iter_stop(it);
+	forest_close(fo);
+	block_put(bc, bl);
+	return ret;
+}
+
+static struct option long_ops[] = {
+	{ "mmap", 0, NULL, 'm' },
+	{ NULL, 0, NULL, 0}
+};
+
+static int extents_cmd(int argc, char **argv)
+{
+	struct block_cache *bc;
+	bool use_mmap = false;
+	char *path;
+	u64 ino;
+	int ret;
+	int fd;
+	int c;
+
+	while ((c = getopt_long(argc, argv, "m", long_ops, NULL)) != -1) {
+		switch (c) {
+		case 'm':
+			use_mmap = true;
+			break;
+		case '?':
+		default:
+			return -EINVAL;
+		}
+	}
+
+	if (optind != argc - 2) {
+		printf("scoutfs extents: an inode number and path are required\n");
+		return -EINVAL;
+	}
+
+	ret = parse_u64(argv[optind], &ino);
+	if (ret < 0)
+		return ret;
+	path = argv[optind + 1];
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		ret = -errno;
+		fprintf(stderr, "failed to open '%s': %s (%d)\n",
+			path, strerror(errno), errno);
+		return ret;
+	}
+
+	bc = block_cache_open(path, fd, use_mmap);
+	if (!bc) {
+		close(fd);
+		return -ENOMEM;
+	}
+
+	ret = print_extents(bc, ino);
+
+	block_cache_destroy(bc);
+	close(fd);
+	return ret;
+}
+
+static void __attribute__((constructor)) extents_ctor(void)
+{
+	cmd_register("extents", "[--mmap] <ino> <device>",
+		     "print the extents that map an inode's file data",
+		     extents_cmd);
+}
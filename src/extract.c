@@ -0,0 +1,772 @@
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <limits.h>
+#include <getopt.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "sparse.h"
+#include "util.h"
+#include "format.h"
+#include "cmd.h"
+#include "parse.h"
+#include "key.h"
+#include "crc.h"
+#include "dev.h"
+#include "block.h"
+#include "forest.h"
+#include "workq.h"
+#include "pex.h"
+#include "fs_items.h"
+
+/*
+ * extract copies files out of an unmounted device or image so that
+ * their data can be recovered without mounting.  The inode to extract
+ * is given by number or by a path that's resolved by looking up the
+ * hashed dirent items from the root directory.
+ *
+ * A regular file's packed extents are decoded and contiguous extents
+ * are joined so that the data is copied from the device in large
+ * chunks, with copy_file_range when the files support it.  Only mapped
+ * blocks are written so the holes in the file, and unwritten extents
+ * that would read as zeros, are left sparse when the file is truncated
+ * to its size.  Offline extents have no blocks on the device.  Files
+ * with offline extents aren't extracted unless holes are explicitly
+ * allowed in their place.
+ *
+ * Directories are extracted recursively.  The tree is walked and
+ * directories and symlinks are created by the calling thread while
+ * regular files are extracted by a pool of threads.  Directory
+ * ownership, modes, and times are set once all their entries are
+ * created.
+ */
+
+/* data is copied in chunks of up to this many blocks */
+#define EXTRACT_COPY_BLOCKS	256
+/* the tree walk waits for files once this many are queued */
+#define EXTRACT_MAX_QUEUED	4096
+
+struct extract_dir_attrs {
+	char *path;
+	struct scoutfs_inode inode;
+};
+
+struct extract_info {
+	struct block_cache *bc;
+	struct forest *fo;
+	struct workq *wq;
+	int dev_fd;
+	u64 first_data_blkno;
+	u64 last_data_blkno;
+	bool offline_holes;
+	bool set_owner;
+	int nr_queued;
+
+	struct extract_dir_attrs *dirs;
+	u64 nr_dirs;
+	u64 alloced_dirs;
+
+	pthread_mutex_t mutex;
+	u64 files;
+	u64 blocks;
+	u64 offline;
+	u64 symlinks;
+	u64 skipped;
+	u64 failed;
+};
+
+struct extract_file {
+	struct work work;
+	struct extract_info *ei;
+	u64 ino;
+	char *path;
+};
+
+struct extract_copy {
+	struct extract_info *ei;
+	int fd;
+	bool use_cfr;
+	void *buf;
+	u64 iblock;
+	u64 blkno;
+	u64 count;
+	u64 blocks;
+	u64 offline;
+};
+
+struct lookup_args {
+	char *name;
+	unsigned name_len;
+	u64 ino;
+};
+
+static int match_dirent(struct scoutfs_key *key, void *val, unsigned val_len,
+			void *arg)
+{
+	struct scoutfs_dirent *dent = val;
+	struct lookup_args *la = arg;
+
+	if (val_len == sizeof(*dent) + la->name_len &&
+	    memcmp(dent->name, la->name, la->name_len) == 0) {
+		la->ino = le64_to_cpu(dent->ino);
+		return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Resolve a path from the root directory one name at a time by looking
+ * up the dirent items at the hash of each name.
+ */
+static int resolve_path(struct extract_info *ei, char *path, u64 *ino_ret)
+{
+	struct scoutfs_inode inode;
+	struct lookup_args la;
+	struct scoutfs_key first;
+	struct scoutfs_key last;
+	u64 hash;
+	u64 ino = SCOUTFS_ROOT_INO;
+	char *str;
+	char *name;
+	char *save;
+	int ret = 0;
+
+	str = strdup(path);
+	if (!str)
+		return -ENOMEM;
+
+	for (name = strtok_r(str, "/", &save); name;
+	     name = strtok_r(NULL, "/", &save)) {
+
+		ret = fs_lookup_inode(ei->fo, ino, &inode);
+		if (ret < 0)
+			break;
+		if (!S_ISDIR(le32_to_cpu(inode.mode))) {
+			fprintf(stderr, "ino %llu before '%s' isn't a directory\n",
+				ino, name);
+			ret = -ENOTDIR;
+			break;
+		}
+
+		la.name = name;
+		la.name_len = strlen(name);
+		hash = crc32c_64(~0, name, la.name_len);
+
+		fs_init_key(&first, ino, SCOUTFS_DIRENT_TYPE);
+		first.skd_major = cpu_to_le64(hash);
+		last = first;
+		last.skd_minor = cpu_to_le64(U64_MAX);
+		last._sk_fourth = U8_MAX;
+
+		ret = forest_walk(ei->fo, &first, &last, match_dirent, &la);
+		if (ret < 0)
+			break;
+		if (ret == 0) {
+			fprintf(stderr, "no entry '%s' in directory ino %llu\n",
+				name, ino);
+			ret = -ENOENT;
+			break;
+		}
+
+		ino = la.ino;
+		ret = 0;
+	}
+
+	free(str);
+	*ino_ret = ino;
+	return ret;
+}
+
+/*
+ * Restore the inode's ownership, mode, and times to the extracted
+ * path.  Ownership is only set when we're privileged.
+ */
+static int set_attrs(struct extract_info *ei, char *path,
+		     struct scoutfs_inode *inode)
+{
+	struct timespec ts[2];
+	mode_t mode = le32_to_cpu(inode->mode);
+
+	ts[0].tv_sec = le64_to_cpu(inode->atime.sec);
+	ts[0].tv_nsec = le32_to_cpu(inode->atime.nsec);
+	ts[1].tv_sec = le64_to_cpu(inode->mtime.sec);
+	ts[1].tv_nsec = le32_to_cpu(inode->mtime.nsec);
+
+	if ((ei->set_owner &&
+	     fchownat(AT_FDCWD, path, le32_to_cpu(inode->uid),
+		      le32_to_cpu(inode->gid), AT_SYMLINK_NOFOLLOW)) ||
+	    (!S_ISLNK(mode) && chmod(path, mode & 07777)) ||
+	    utimensat(AT_FDCWD, path, ts, AT_SYMLINK_NOFOLLOW)) {
+		fprintf(stderr, "failed to set attributes of '%s': %s (%d)\n",
+			path, strerror(errno), errno);
+		return -errno;
+	}
+
+	return 0;
+}
+
+/*
+ * Copy the pending run of contiguous blocks from the device into the
+ * file.  We try copy_file_range first and fall back to reading and
+ * writing through a buffer if the files don't support it.
+ */
+static int copy_run(struct extract_copy *ec)
+{
+	struct extract_info *ei = ec->ei;
+	size_t bytes;
+	loff_t in;
+	loff_t out;
+	ssize_t cr;
+	u64 nr;
+	int ret;
+
+	while (ec->count > 0) {
+		nr = min(ec->count, (u64)EXTRACT_COPY_BLOCKS);
+		bytes = nr << SCOUTFS_BLOCK_SHIFT;
+		in = ec->blkno << SCOUTFS_BLOCK_SHIFT;
+		out = ec->iblock << SCOUTFS_BLOCK_SHIFT;
+
+		while (ec->use_cfr && bytes > 0) {
+			cr = copy_file_range(ei->dev_fd, &in, ec->fd, &out,
+					     bytes, 0);
+			if (cr < 0 && errno == EINTR)
+				continue;
+			if (cr < 0 && bytes == (nr << SCOUTFS_BLOCK_SHIFT) &&
+			    (errno == EXDEV || errno == EINVAL ||
+			     errno == ENOSYS || errno == EOPNOTSUPP)) {
+				ec->use_cfr = false;
+				break;
+			}
+			if (cr < 0)
+				return -errno;
+			if (cr == 0)
+				return -ENODATA;
+			bytes -= cr;
+		}
+
+		if (!ec->use_cfr) {
+			ret = rw_full(ei->dev_fd, ec->buf, bytes, in, false) ?:
+			      rw_full(ec->fd, ec->buf, bytes, out, true);
+			if (ret < 0)
+				return ret;
+		}
+
+		ec->blocks += nr;
+		ec->iblock += nr;
+		ec->blkno += nr;
+		ec->count -= nr;
+	}
+
+	return 0;
+}
+
+/*
+ * Add a decoded extent that's inside the file size.  Only mapped
+ * written extents are copied, joined with the pending run when
+ * they're contiguous.
+ */
+static int add_extent(struct extract_copy *ec, struct pex_extent *ext,
+		      u64 count)
+{
+	struct extract_info *ei = ec->ei;
+	int ret;
+
+	if (ext->flags & SEF_OFFLINE) {
+		ec->offline += count;
+		return ei->offline_holes ? 0 : -ENODATA;
+	}
+
+	if (ext->blkno == 0 || (ext->flags & SEF_UNWRITTEN))
+		return 0;
+
+	if (ext->blkno < ei->first_data_blkno ||
+	    ext->blkno + count - 1 > ei->last_data_blkno) {
+		fprintf(stderr, "extent at iblock %llu blkno %llu count %llu is outside data blocks %llu - %llu\n",
+			ext->iblock, ext->blkno, count, ei->first_data_blkno,
+			ei->last_data_blkno);
+		return -EIO;
+	}
+
+	if (ec->count && ec->iblock + ec->count == ext->iblock &&
+	    ec->blkno + ec->count == ext->blkno) {
+		ec->count += count;
+		return 0;
+	}
+
+	ret = copy_run(ec);
+	if (ret < 0)
+		return ret;
+
+	ec->iblock = ext->iblock;
+	ec->blkno = ext->blkno;
+	ec->count = count;
+	return 0;
+}
+
+static int copy_extents(struct extract_copy *ec, u64 ino, u64 size)
+{
+	struct extract_info *ei = ec->ei;
+	struct forest_iter *it = NULL;
+	struct pex_decoder dec = {{0,}};
+	struct pex_extent ext;
+	struct scoutfs_key first;
+	struct scoutfs_key last;
+	struct scoutfs_key *key;
+	unsigned val_len;
+	void *val;
+	u64 size_blocks = DIV_ROUND_UP(size, SCOUTFS_BLOCK_SIZE);
+	int ret;
+
+	fs_init_key(&first, ino, SCOUTFS_PACKED_EXTENT_TYPE);
+	fs_init_key(&last, ino, SCOUTFS_PACKED_EXTENT_TYPE);
+	last.skpe_base = cpu_to_le64(U64_MAX);
+	last._sk_third = cpu_to_le64(U64_MAX);
+	last.skpe_part = U8_MAX;
+
+	ret = forest_iter_start(ei->fo, &first, &last, &it);
+	if (ret < 0)
+		goto out;
+
+	while ((ret = forest_iter_next(it, &key, &val, &val_len)) > 0) {
+		ret = pex_decode_key(&dec, key, val, val_len);
+		if (ret < 0) {
+			fprintf(stderr, "packed extent item "SK_FMT" doesn't follow previous part\n",
+				SK_ARG(key));
+			break;
+		}
+
+		while ((ret = pex_decode_next(&dec, &ext)) > 0) {
+			if (ext.iblock >= size_blocks)
+				continue;
+			ret = add_extent(ec, &ext,
+					 min((u64)ext.count,
+					     size_blocks - ext.iblock));
+			if (ret < 0)
+				goto out;
+		}
+		if (ret < 0) {
+			fprintf(stderr, "packed extent item "SK_FMT" is malformed at off %u\n",
+				SK_ARG(key), dec.off);
+			break;
+		}
+	}
+
+	if (ret == 0)
+		ret = copy_run(ec);
+out:
+	forest_iter_stop(it);
+	return ret;
+}
+
+static int extract_file(struct extract_info *ei, u64 ino, char *path)
+{
+	struct extract_copy ec = {
+		.ei = ei,
+		.fd = -1,
+		.use_cfr = true,
+	};
+	struct scoutfs_inode inode;
+	bool created = false;
+	int ret;
+
+	ret = fs_lookup_inode(ei->fo, ino, &inode);
+	if (ret < 0)
+		goto out;
+
+	if (inode.offline_blocks && !ei->offline_holes) {
+		ec.offline = le64_to_cpu(inode.offline_blocks);
+		ret = -ENODATA;
+		goto out;
+	}
+
+	ec.buf = malloc(EXTRACT_COPY_BLOCKS * SCOUTFS_BLOCK_SIZE);
+	if (!ec.buf) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	ec.fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0600);
+	if (ec.fd < 0) {
+		ret = -errno;
+		fprintf(stderr, "failed to create '%s': %s (%d)\n",
+			path, strerror(errno), errno);
+		goto out;
+	}
+	created = true;
+
+	ret = copy_extents(&ec, ino, le64_to_cpu(inode.size));
+	if (ret == 0 && ftruncate(ec.fd, le64_to_cpu(inode.size)))
+		ret = -errno;
+	if (ret < 0 && ret != -ENODATA && ret != -EIO)
+		fprintf(stderr, "error copying ino %llu data to '%s': %s (%d)\n",
+			ino, path, strerror(-ret), -ret);
+	if (ret == 0)
+		ret = set_attrs(ei, path, &inode);
+out:
+	if (ret == -ENODATA && ec.offline)
+		fprintf(stderr, "ino %llu '%s' has offline blocks that must be staged, --offline-holes extracts holes in their place\n",
+			ino, path);
+	if (ec.fd >= 0)
+		close(ec.fd);
+	if (ret < 0 && created)
+		unlink(path);
+	free(ec.buf);
+
+	pthread_mutex_lock(&ei->mutex);
+	if (ret < 0) {
+		ei->failed++;
+	} else {
+		ei->files++;
+		ei->blocks += ec.blocks;
+		ei->offline += ec.offline;
+	}
+	pthread_mutex_unlock(&ei->mutex);
+
+	return ret;
+}
+
+static void extract_file_worker(struct work *work)
+{
+	struct extract_file *ef = container_of(work, struct extract_file,
+					       work);
+
+	extract_file(ef->ei, ef->ino, ef->path);
+	free(ef->path);
+	free(ef);
+}
+
+/*
+ * Queue a file to be extracted by the threads.  Failures are counted
+ * and reported once all the files have been extracted.
+ */
+static int queue_file(struct extract_info *ei, u64 ino, char *path)
+{
+	struct extract_file *ef;
+
+	if (ei->nr_queued >= EXTRACT_MAX_QUEUED) {
+		workq_wait(ei->wq);
+		ei->nr_queued = 0;
+	}
+
+	ef = malloc(sizeof(*ef));
+	if (ef)
+		ef->path = strdup(path);
+	if (!ef || !ef->path) {
+		free(ef);
+		return -ENOMEM;
+	}
+
+	work_init(&ef->work, extract_file_worker);
+	ef->ei = ei;
+	ef->ino = ino;
+	workq_queue(ei->wq, &ef->work);
+	ei->nr_queued++;
+	return 0;
+}
+
+static int extract_symlink(struct extract_info *ei, u64 ino, char *path)
+{
+	char target[SCOUTFS_SYMLINK_MAX_SIZE + 1];
+	struct scoutfs_inode inode;
+	int ret;
+
+	ret = fs_lookup_inode(ei->fo, ino, &inode) ?:
+	      fs_read_symlink(ei->fo, ino, &inode, target);
+	if (ret < 0)
+		goto out;
+
+	if (symlink(target, path)) {
+		ret = -errno;
+		fprintf(stderr, "failed to create symlink '%s': %s (%d)\n",
+			path, strerror(errno), errno);
+		goto out;
+	}
+
+	ret = set_attrs(ei, path, &inode);
+out:
+	pthread_mutex_lock(&ei->mutex);
+	if (ret < 0)
+		ei->failed++;
+	else
+		ei->symlinks++;
+	pthread_mutex_unlock(&ei->mutex);
+	return ret;
+}
+
+static int extract_dir(struct extract_info *ei, u64 ino, char *path);
+
+static int extract_ino(struct extract_info *ei, u64 ino, u8 type, char *path)
+{
+	switch (type) {
+	case SCOUTFS_DT_DIR:
+		return extract_dir(ei, ino, path);
+	case SCOUTFS_DT_REG:
+		return queue_file(ei, ino, path);
+	case SCOUTFS_DT_LNK:
+		return extract_symlink(ei, ino, path);
+	default:
+		fprintf(stderr, "skipping ino %llu '%s' of type %u\n",
+			ino, path, type);
+		ei->skipped++;
+		return 0;
+	}
+}
+
+/*
+ * Create the directory and extract its entries in readdir order.  Only
+ * errors creating the tree stop the walk, errors extracting individual
+ * files and symlinks are counted and reported.
+ */
+static int extract_dir(struct extract_info *ei, u64 ino, char *path)
+{
+	struct extract_dir_attrs *eda;
+	struct fs_dent *dents = NULL;
+	char *child = NULL;
+	u64 nr = 0;
+	int ret;
+	u64 i;
+
+	if (ei->nr_dirs == ei->alloced_dirs) {
+		ei->alloced_dirs = max(ei->alloced_dirs * 2, 64ULL);
+		eda = realloc(ei->dirs, ei->alloced_dirs * sizeof(ei->dirs[0]));
+		if (!eda)
+			return -ENOMEM;
+		ei->dirs = eda;
+	}
+
+	eda = &ei->dirs[ei->nr_dirs];
+	ret = fs_lookup_inode(ei->fo, ino, &eda->inode);
+	if (ret < 0)
+		return ret;
+
+	if (mkdir(path, 0700) && (errno != EEXIST || ei->nr_dirs > 0)) {
+		ret = -errno;
+		fprintf(stderr, "failed to create directory '%s': %s (%d)\n",
+			path, strerror(errno), errno);
+		return ret;
+	}
+
+	eda->path = strdup(path);
+	child = malloc(PATH_MAX);
+	if (!eda->path || !child) {
+		free(eda->path);
+		ret = -ENOMEM;
+		goto out;
+	}
+	ei->nr_dirs++;
+
+	ret = fs_readdir(ei->fo, ino, &dents, &nr);
+	if (ret < 0)
+		goto out;
+
+	for (i = 0; i < nr; i++) {
+		if (!dirent_name_valid(dents[i].name)) {
+			fprintf(stderr, "dir ino %llu entry for ino %llu has invalid name '%s'\n",
+				ino, dents[i].ino, dents[i].name);
+			pthread_mutex_lock(&ei->mutex);
+			ei->failed++;
+			pthread_mutex_unlock(&ei->mutex);
+			continue;
+		}
+
+		if (snprintf(child, PATH_MAX, "%s/%s", path, dents[i].name)
+		    >= PATH_MAX) {
+			fprintf(stderr, "path of '%s' in '%s' is too long\n",
+				dents[i].name, path);
+			ret = -ENAMETOOLONG;
+			goto out;
+		}
+
+		ret = extract_ino(ei, dents[i].ino, dents[i].type, child);
+		if (ret < 0)
+			goto out;
+	}
+out:
+	free(child);
+	free(dents);
+	return ret;
+}
+
+static int extract_dest(struct extract_info *ei, u64 ino, char *dest)
+{
+	struct scoutfs_inode inode;
+	mode_t mode;
+	int ret;
+	int err;
+	u64 i;
+
+	ret = fs_lookup_inode(ei->fo, ino, &inode);
+	if (ret < 0)
+		return ret;
+
+	mode = le32_to_cpu(inode.mode);
+	if (S_ISDIR(mode))
+		ret = extract_dir(ei, ino, dest);
+	else if (S_ISREG(mode))
+		ret = queue_file(ei, ino, dest);
+	else if (S_ISLNK(mode))
+		ret = extract_symlink(ei, ino, dest);
+	else {
+		fprintf(stderr, "ino %llu with mode 0%o can't be extracted\n",
+			ino, mode);
+		ret = -EINVAL;
+	}
+
+	workq_wait(ei->wq);
+
+	/* set attrs of the deepest directories first */
+	for (i = ei->nr_dirs; i > 0; i--) {
+		err = set_attrs(ei, ei->dirs[i - 1].path,
+				&ei->dirs[i - 1].inode);
+		if (err && !ret)
+			ret = err;
+		free(ei->dirs[i - 1].path);
+	}
+	free(ei->dirs);
+
+	printf("extracted %llu files with %llu blocks, %llu directories, %llu symlinks",
+	       ei->files, ei->blocks, ei->nr_dirs, ei->symlinks);
+	if (ei->offline)
+		printf(", %llu offline blocks left as holes", ei->offline);
+	if (ei->skipped)
+		printf(", skipped %llu", ei->skipped);
+	if (ei->failed)
+		printf(", %llu failed", ei->failed);
+	printf("\n");
+
+	if (ret == 0 && ei->failed)
+		ret = -EIO;
+	return ret;
+}
+
+static int extract(struct extract_info *ei, char *what, char *dest,
+		   int nr_threads)
+{
+	struct scoutfs_super_block *super;
+	struct block *bl;
+	char *end;
+	u64 ino;
+	int ret;
+
+	bl = block_read(ei->bc, SCOUTFS_SUPER_BLKNO);
+	if (!bl)
+		return -EIO;
+	super = block_data(bl);
+
+	if (le32_to_cpu(super->hdr.magic) != SCOUTFS_BLOCK_MAGIC_SUPER) {
+		fprintf(stderr, "super block magic %08x != expected %08x\n",
+			le32_to_cpu(super->hdr.magic),
+			SCOUTFS_BLOCK_MAGIC_SUPER);
+		ret = -EIO;
+		goto out;
+	}
+
+	ei->first_data_blkno = le64_to_cpu(super->first_data_blkno);
+	ei->last_data_blkno = le64_to_cpu(super->last_data_blkno);
+
+	ei->wq = workq_create(nr_threads);
+	if (!ei->wq) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	ret = forest_open(ei->bc, super, &ei->fo);
+	if (ret < 0)
+		goto out;
+
+	/* a number is an inode, a name can be given as a path from / */
+	ino = strtoull(what, &end, 0);
+	if (*what == '\0' || *end != '\0')
+		ret = resolve_path(ei, what, &ino);
+	if (ret == 0)
+		ret = extract_dest(ei, ino, dest);
+out:
+	forest_close(ei->fo);
+	workq_destroy(ei->wq);
+	block_put(ei->bc, bl);
+	return ret;
+}
+
+static struct option long_ops[] = {
+	{ "mmap", 0, NULL, 'm' },
+	{ "offline-holes", 0, NULL, 'o' },
+	{ "threads", 1, NULL, 't' },
+	{ NULL, 0, NULL, 0}
+};
+
+static int extract_cmd(int argc, char **argv)
+{
+	struct extract_info ei = {
+		.mutex = PTHREAD_MUTEX_INITIALIZER,
+		.set_owner = geteuid() == 0,
+	};
+	bool use_mmap = false;
+	int nr_threads = 0;
+	char *path;
+	int ret;
+	int c;
+
+	while ((c = getopt_long(argc, argv, "mot:", long_ops, NULL)) != -1) {
+		switch (c) {
+		case 'm':
+			use_mmap = true;
+			break;
+		case 'o':
+			ei.offline_holes = true;
+			break;
+		case 't':
+			ret = parse_threads(optarg, &nr_threads);
+			if (ret)
+				return ret;
+			break;
+		case '?':
+		default:
+			return -EINVAL;
+		}
+	}
+
+	if (optind != argc - 3) {
+		printf("scoutfs extract: inode or path, device, and destination arguments are required\n");
+		return -EINVAL;
+	}
+	path = argv[optind + 1];
+
+	ei.dev_fd = open(path, O_RDONLY);
+	if (ei.dev_fd < 0) {
+		ret = -errno;
+		fprintf(stderr, "failed to open '%s': %s (%d)\n",
+			path, strerror(errno), errno);
+		return ret;
+	}
+
+	if (nr_threads == 0)
+		nr_threads = workq_nr_threads();
+
+	ei.bc = block_cache_open(path, ei.dev_fd, use_mmap);
+	if (!ei.bc) {
+		close(ei.dev_fd);
+		return -ENOMEM;
+	}
+
+	ret = extract(&ei, argv[optind], argv[optind + 2], nr_threads);
+
+	block_cache_destroy(ei.bc);
+	close(ei.dev_fd);
+	return ret;
+}
+
+static void __attribute__((constructor)) extract_ctor(void)
+{
+	cmd_register("extract",
+		     "[--mmap] [--offline-holes] [--threads nr] <ino|path> <device> <dest>",
+		     "copy files and their data out of an unmounted device",
+		     extract_cmd);
+}
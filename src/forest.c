@@ -0,0 +1,609 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "sparse.h"
+#include "util.h"
+#include "format.h"
+#include "key.h"
+#include "crc.h"
+#include "block.h"
+#include "btree.h"
+#include "forest.h"
+
+/*
+ * The forest is the set of trees that together contain the current fs
+ * items: the fs_root and the item trees of all the clients' log trees.
+ * Clients write items to their log trees which are later merged into
+ * the fs_root by the server.  Log tree items are always newer than the
+ * fs_root items, and the log item with the greatest vers is the most
+ * recent.  Deletion items hide older versions of their key.
+ *
+ * An iterator has a cursor in each tree that might contain items in
+ * its range.  The cursors are kept in a heap ordered by their current
+ * item so that the most recent version of the next key is always at
+ * the top.  Older versions of the key are skipped as the iterator
+ * advances.  Only the path of blocks to each cursor's leaf is held so
+ * iterators can stream through any number of items.
+ *
+ * Each log tree has a bloom filter of the lock ranges that its items
+ * are in.  Log trees whose bloom filters don't have any of the lock
+ * ranges that intersect the iterator's range can't have items in the
+ * range and aren't searched.
+ */
+
+/* ranges that cover more lock ranges than this always search log trees */
+#define FOREST_BLOOM_MAX_LOCKS		64
+
+struct forest_log_tree {
+	struct scoutfs_btree_root item_root;
+	__le64 *bloom_bits;
+};
+
+struct forest {
+	struct block_cache *bc;
+	struct scoutfs_btree_root fs_root;
+	struct forest_log_tree *logs;
+	int nr_logs;
+};
+
+struct forest_cursor {
+	struct btree_cursor btc;
+	struct scoutfs_key key;
+	bool log_items;
+	u64 vers;
+	bool deletion;
+	void *val;
+	unsigned val_len;
+};
+
+struct forest_iter {
+	struct forest *fo;
+	struct scoutfs_key_be first_be;
+	struct scoutfs_key_be last_be;
+	struct forest_cursor *cursors;
+	struct forest_cursor **heap;
+	int nr_heap;
+	int nr_cursors;
+	bool advance;
+	u64 skipped;
+};
+
+static int read_bloom(struct forest *fo, struct forest_log_tree *lt,
+		      struct scoutfs_btree_ref *ref)
+{
+	struct scoutfs_bloom_block *bb;
+	struct block *bl;
+	u64 blkno = le64_to_cpu(ref->blkno);
+
+	/* without a bloom block the tree is always searched */
+	if (blkno == 0)
+		return 0;
+
+	bl = block_read(fo->bc, blkno);
+	if (!bl)
+		return -EIO;
+	bb = block_data(bl);
+
+	if (le32_to_cpu(bb->hdr.magic) == SCOUTFS_BLOCK_MAGIC_BLOOM &&
+	    le64_to_cpu(bb->hdr.blkno) == blkno) {
+		lt->bloom_bits = malloc(SCOUTFS_FOREST_BLOOM_BITS / 8);
+		if (lt->bloom_bits)
+			memcpy(lt->bloom_bits, bb->bits,
+			       SCOUTFS_FOREST_BLOOM_BITS / 8);
+	} else {
+		fprintf(stderr, "bloom blkno %llu has unexpected header, searching its log tree\n",
+			blkno);
+	}
+
+	block_put(fo->bc, bl);
+	return 0;
+}
+
+static int add_log_tree(void *key, unsigned key_len, void *val,
+			unsigned val_len, u64 blkno, void *arg)
+{
+	struct scoutfs_log_trees_val *ltv = val;
+	struct forest *fo = arg;
+	struct forest_log_tree *logs;
+	struct forest_log_tree *lt;
+
+	if (val_len != sizeof(struct scoutfs_log_trees_val)) {
+		fprintf(stderr, "logs_root blkno %llu: log trees item val_len %u != expected %zu\n",
+			blkno, val_len, sizeof(struct scoutfs_log_trees_val));
+		return -EIO;
+	}
+
+	if (ltv->item_root.height == 0)
+		return 0;
+
+	logs = realloc(fo->logs, (fo->nr_logs + 1) * sizeof(*logs));
+	if (!logs)
+		return -ENOMEM;
+	fo->logs = logs;
+
+	lt = &fo->logs[fo->nr_logs++];
+	lt->item_root = ltv->item_root;
+	lt->bloom_bits = NULL;
+
+	return read_bloom(fo, lt, &ltv->bloom_ref);
+}
+
+/*
+ * Find the roots of all the trees in the forest described by the super
+ * block and read the log trees' bloom filters.
+ */
+int forest_open(struct block_cache *bc, struct scoutfs_super_block *super,
+		struct forest **fo_ret)
+{
+	struct forest *fo;
+	int ret;
+
+	fo = calloc(1, sizeof(*fo));
+	if (!fo)
+		return -ENOMEM;
+
+	fo->bc = bc;
+	fo->fs_root = super->fs_root;
+
+	ret = btree_walk(bc, &super->logs_root, NULL, 0, NULL, 0,
+			 add_log_tree, fo);
+	if (ret < 0) {
+		forest_close(fo);
+		fo = NULL;
+	}
+
+	*fo_ret = fo;
+	return ret;
+}
+
+void forest_close(struct forest *fo)
+{
+	int i;
+
+	if (fo) {
+		for (i = 0; i < fo->nr_logs; i++)
+			free(fo->logs[i].bloom_bits);
+		free(fo->logs);
+		free(fo);
+	}
+}
+
+/*
+ * Set the start key of the lock that covers the key, returning false
+ * if the key's zone isn't recorded in bloom filters.  Locks cover the
+ * format's groups of inodes and of index seqs.
+ */
+static bool lock_start(struct scoutfs_key *start, struct scoutfs_key *key)
+{
+	memset(start, 0, sizeof(*start));
+	start->sk_zone = key->sk_zone;
+
+	switch (key->sk_zone) {
+	case SCOUTFS_FS_ZONE:
+		start->_sk_first = cpu_to_le64(le64_to_cpu(key->_sk_first) &
+				~(u64)SCOUTFS_LOCK_INODE_GROUP_MASK);
+		return true;
+	case SCOUTFS_INODE_INDEX_ZONE:
+		start->sk_type = key->sk_type;
+		start->skii_major = cpu_to_le64(le64_to_cpu(key->skii_major) &
+				~(u64)SCOUTFS_LOCK_SEQ_GROUP_MASK);
+		return true;
+	}
+
+	return false;
+}
+
+/* step to the start of the next lock, returning false if it wraps */
+static bool next_lock_start(struct scoutfs_key *start)
+{
+	u64 val;
+
+	if (start->sk_zone == SCOUTFS_FS_ZONE) {
+		val = le64_to_cpu(start->_sk_first) +
+		      SCOUTFS_LOCK_INODE_GROUP_MASK + 1;
+		start->_sk_first = cpu_to_le64(val);
+	} else {
+		val = le64_to_cpu(start->skii_major) +
+		      SCOUTFS_LOCK_SEQ_GROUP_MASK + 1;
+		start->skii_major = cpu_to_le64(val);
+	}
+
+	return val != 0;
+}
+
+/*
+ * The bloom bits are set by hashing the lock's start key.  The 64bit
+ * hash is split into a bit nr for each of the hash functions.
+ */
+static bool bloom_has_lock(__le64 *bits, struct scoutfs_key *start)
+{
+	u64 hash;
+	u32 nr;
+	int i;
+
+	hash = crc32c_64(~0, start, sizeof(*start));
+
+	for (i = 0; i < SCOUTFS_FOREST_BLOOM_NRS; i++) {
+		nr = (u32)hash % SCOUTFS_FOREST_BLOOM_BITS;
+		if (!(le64_to_cpu(bits[nr / 64]) & (1ULL << (nr % 64))))
+			return false;
+		hash >>= 64 / SCOUTFS_FOREST_BLOOM_NRS;
+	}
+
+	return true;
+}
+
+/*
+ * Return true if the log tree's bloom filter says that it might have
+ * items between first and last.  Ranges that cross zones or types, or
+ * cover too many locks to check, are assumed to have items.
+ */
+static bool bloom_may_contain(struct forest_log_tree *lt,
+			      struct scoutfs_key *first,
+			      struct scoutfs_key *last)
+{
+	struct scoutfs_key start;
+	struct scoutfs_key end;
+	int i;
+
+	if (!lt->bloom_bits || !lock_start(&start, first) ||
+	    !lock_start(&end, last) || start.sk_zone != end.sk_zone ||
+	    start.sk_type != end.sk_type)
+		return true;
+
+	for (i = 0; i < FOREST_BLOOM_MAX_LOCKS; i++) {
+		if (bloom_has_lock(lt->bloom_bits, &start))
+			return true;
+		if (scoutfs_key_compare(&start, &end) == 0 ||
+		    !next_lock_start(&start))
+			return false;
+	}
+
+	return true;
+}
+
+/* log items sort before fs_root items and greater vers sort first */
+static int cmp_cursors(struct forest_cursor *a, struct forest_cursor *b)
+{
+	return scoutfs_key_compare(&a->key, &b->key) ?:
+	       -scoutfs_cmp(a->log_items, b->log_items) ?:
+	       -scoutfs_cmp(a->vers, b->vers);
+}
+
+static void heap_down(struct forest_iter *it, int i)
+{
+	struct forest_cursor **heap = it->heap;
+	struct forest_cursor *tmp;
+	int child;
+
+	for (;;) {
+		child = (i * 2) + 1;
+		if (child >= it->nr_heap)
+			break;
+		if (child + 1 < it->nr_heap &&
+		    cmp_cursors(heap[child + 1], heap[child]) < 0)
+			child++;
+		if (cmp_cursors(heap[i], heap[child]) <= 0)
+			break;
+		tmp = heap[i];
+		heap[i] = heap[child];
+		heap[child] = tmp;
+		i = child;
+	}
+}
+
+/*
+ * Advance the cursor to its next item and set its sort fields,
+ * returning 0 when the cursor has no more items.
+ */
+static int cursor_next(struct forest_cursor *fc)
+{
+	struct scoutfs_log_item_value *liv;
+	unsigned key_len;
+	void *key;
+	int ret;
+
+	ret = btree_cursor_next(&fc->btc, &key, &key_len, &fc->val,
+				&fc->val_len);
+	if (ret <= 0)
+		return ret;
+
+	if (key_len != sizeof(struct scoutfs_key_be)) {
+		fprintf(stderr, "fs item key_len %u != expected %zu\n",
+			key_len, sizeof(struct scoutfs_key_be));
+		return -EIO;
+	}
+	scoutfs_key_from_be(&fc->key, key);
+
+	if (fc->log_items) {
+		liv = fc->val;
+		if (fc->val_len < sizeof(*liv)) {
+			fprintf(stderr, "log item "SK_FMT" val_len %u too small for log item header\n",
+				SK_ARG(&fc->key), fc->val_len);
+			return -EIO;
+		}
+		fc->vers = le64_to_cpu(liv->vers);
+		fc->deletion = !!(liv->flags & SCOUTFS_LOG_ITEM_FLAG_DELETION);
+		fc->val += sizeof(*liv);
+		fc->val_len -= sizeof(*liv);
+	}
+
+	return 1;
+}
+
+/* advance the cursor at the top of the heap and restore the heap */
+static int advance_top(struct forest_iter *it)
+{
+	struct forest_cursor *fc = it->heap[0];
+	int ret;
+
+	ret = cursor_next(fc);
+	if (ret < 0)
+		return ret;
+
+	if (ret == 0)
+		it->heap[0] = it->heap[--it->nr_heap];
+	if (it->nr_heap > 0)
+		heap_down(it, 0);
+	return 0;
+}
+
+void forest_iter_stop(struct forest_iter *it)
+{
+	int i;
+
+	if (it) {
+		for (i = 0; i < it->nr_cursors; i++)
+			btree_cursor_stop(&it->cursors[i].btc);
+		free(it->cursors);
+		free(it->heap);
+		free(it);
+	}
+}
+
+/*
+ * Start iterating over the current items from first to last,
+ * inclusive.
+ */
+int forest_iter_start(struct forest *fo, struct scoutfs_key *first,
+		      struct scoutfs_key *last, struct forest_iter **it_ret)
+{
+	struct scoutfs_btree_root *root;
+	struct forest_cursor *fc;
+	struct forest_iter *it;
+	int ret = 0;
+	int i;
+	int t;
+
+	it = calloc(1, sizeof(*it));
+	if (it) {
+		it->cursors = calloc(fo->nr_logs + 1, sizeof(it->cursors[0]));
+		it->heap = calloc(fo->nr_logs + 1, sizeof(it->heap[0]));
+	}
+	if (!it || !it->cursors || !it->heap) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	it->fo = fo;
+	scoutfs_key_to_be(&it->first_be, first);
+	scoutfs_key_to_be(&it->last_be, last);
+
+	/* tree 0 is the fs_root, the rest are log trees */
+	for (t = 0; t <= fo->nr_logs; t++) {
+		if (t > 0 && !bloom_may_contain(&fo->logs[t - 1], first,
+						last)) {
+			it->skipped++;
+			continue;
+		}
+
+		root = t == 0 ? &fo->fs_root : &fo->logs[t - 1].item_root;
+		fc = &it->cursors[it->nr_cursors++];
+		fc->log_items = t > 0;
+
+		ret = btree_cursor_start(&fc->btc, fo->bc, root,
+					 &it->first_be, sizeof(it->first_be),
+					 &it->last_be, sizeof(it->last_be)) ?:
+		      cursor_next(fc);
+		if (ret < 0)
+			goto out;
+		if (ret > 0)
+			it->heap[it->nr_heap++] = fc;
+	}
+
+	for (i = (it->nr_heap / 2) - 1; i >= 0; i--)
+		heap_down(it, i);
+	ret = 0;
+out:
+	if (ret < 0) {
+		forest_iter_stop(it);
+		it = NULL;
+	}
+	*it_ret = it;
+	return ret;
+}
+
+/*
+ * Return 1 and set the key and value of the next current item, or 0
+ * when there are no more items.  The item is only valid until the next
+ * call.
+ */
+int forest_iter_next(struct forest_iter *it, struct scoutfs_key **key,
+		     void **val, unsigned *val_len)
+{
+	struct forest_cursor *top;
+	struct scoutfs_key prev;
+	int ret;
+
+	while (it->nr_heap > 0) {
+		top = it->heap[0];
+
+		/* skip past all the versions of the previous key */
+		if (it->advance) {
+			prev = top->key;
+			do {
+				ret = advance_top(it);
+				if (ret < 0)
+					return ret;
+			} while (it->nr_heap > 0 &&
+				 scoutfs_key_compare(&it->heap[0]->key,
+						     &prev) == 0);
+			it->advance = false;
+			continue;
+		}
+
+		it->advance = true;
+		if (top->deletion)
+			continue;
+
+		*key = &top->key;
+		*val = top->val;
+		*val_len = top->val_len;
+		return 1;
+	}
+
+	return 0;
+}
+
+/* the number of log trees that bloom filters let the iterator skip */
+u64 forest_iter_skipped(struct forest_iter *it)
+{
+	return it->skipped;
+}
+
+/*
+ * Call the function for the most recent version of each item from
+ * first to last, inclusive, that isn't deleted.
+ */
+int forest_walk(struct forest *fo, struct scoutfs_key *first,
+		struct scoutfs_key *last, forest_item_func func, void *arg)
+{
+	struct forest_iter *it;
+	struct scoutfs_key *key;
+	unsigned val_len;
+	void *val;
+	int ret;
+
+	ret = forest_iter_start(fo, first, last, &it);
+	while (ret == 0 &&
+	       (ret = forest_iter_next(it, &key, &val, &val_len)) > 0)
+		ret = func(key, val, val_len, arg);
+
+	forest_iter_stop(it);
+	return ret;
+}
+
+struct split_args {
+	struct scoutfs_key *keys;
+	int nr;
+	int alloced;
+};
+
+static int add_split_key(void *key, unsigned key_len, void *val,
+			 unsigned val_len, u64 blkno, void *arg)
+{
+	struct split_args *args = arg;
+	struct scoutfs_key *keys;
+
+	if (key_len != sizeof(struct scoutfs_key_be))
+		return 0;
+
+	if (args->nr == args->alloced) {
+		args->alloced = max(args->alloced * 2, 64);
+		keys = realloc(args->keys, args->alloced * sizeof(*keys));
+		if (!keys)
+			return -ENOMEM;
+		args->keys = keys;
+	}
+
+	scoutfs_key_from_be(&args->keys[args->nr++], key);
+	return 0;
+}
+
+/*
+ * Split the range from first to last into at least nr pieces that can
+ * be walked independently, using the fs_root parent keys as boundaries.
+ * The returned keys are the last key of each piece but the final piece
+ * which ends at last.  The caller frees the keys.  Small trees may not
+ * have enough parents and return fewer keys.
+ */
+int forest_split(struct forest *fo, struct scoutfs_key *first,
+		 struct scoutfs_key *last, int nr,
+		 struct scoutfs_key **keys_ret, int *nr_keys_ret)
+{
+	struct split_args args = { NULL, };
+	struct scoutfs_key_be first_be;
+	struct scoutfs_key_be last_be;
+	int ret;
+
+	scoutfs_key_to_be(&first_be, first);
+	scoutfs_key_to_be(&last_be, last);
+
+	ret = btree_split(fo->bc, &fo->fs_root, &first_be, sizeof(first_be),
+			  &last_be, sizeof(last_be), nr, add_split_key, &args);
+	if (ret < 0) {
+		free(args.keys);
+		args.keys = NULL;
+		args.nr = 0;
+	}
+
+	*keys_ret = args.keys;
+	*nr_keys_ret = args.nr;
+	return ret;
+}
+
+/*
+ * Split the fs zone into at least nr ranges of whole inodes, if the
+ * fs_root has enough parents.  Ranges end before the inode of each
+ * split key so all of an inode's items are in one range.  The last
+ * inode of each range is returned in order, the first range starts at
+ * inode 0 and the final range ends at U64_MAX.  The caller frees the
+ * array.
+ */
+int forest_split_inodes(struct forest *fo, int nr, u64 **last_inos_ret,
+			int *nr_ranges_ret)
+{
+	struct scoutfs_key *keys = NULL;
+	struct scoutfs_key first;
+	struct scoutfs_key last;
+	u64 *last_inos = NULL;
+	int nr_ranges = 0;
+	int nr_keys = 0;
+	u64 ino;
+	int ret;
+	int i;
+
+	scoutfs_key_set_zeros(&first);
+	first.sk_zone = SCOUTFS_FS_ZONE;
+	scoutfs_key_set_ones(&last);
+	last.sk_zone = SCOUTFS_FS_ZONE;
+
+	ret = forest_split(fo, &first, &last, nr, &keys, &nr_keys);
+	if (ret < 0)
+		goto out;
+
+	last_inos = malloc((nr_keys + 1) * sizeof(last_inos[0]));
+	if (!last_inos) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	/* keys in the same inode as the previous range don't split */
+	ino = 0;
+	for (i = 0; i < nr_keys; i++) {
+		if (le64_to_cpu(keys[i]._sk_first) <= ino)
+			continue;
+		last_inos[nr_ranges++] = le64_to_cpu(keys[i]._sk_first) - 1;
+		ino = le64_to_cpu(keys[i]._sk_first);
+	}
+	last_inos[nr_ranges++] = U64_MAX;
+	ret = 0;
+out:
+	free(keys);
+	*last_inos_ret = last_inos;
+	*nr_ranges_ret = nr_ranges;
+	return ret;
+}
@@ -0,0 +1,33 @@
+#ifndef _FOREST_H_
+#define _FOREST_H_
+
+struct block_cache;
+struct forest;
+struct forest_iter;
+
+/*
+ * Called for each current item in key order.  The value doesn't
+ * include the log item header.  Returning non-zero stops the walk and
+ * is returned to the caller.
+ */
+typedef int (*forest_item_func)(struct scoutfs_key *key, void *val,
+				unsigned val_len, void *arg);
+
+int forest_open(struct block_cache *bc, struct scoutfs_super_block *super,
+		struct forest **fo_ret);
+void forest_close(struct forest *fo);
+int forest_iter_start(struct forest *fo, struct scoutfs_key *first,
+		      struct scoutfs_key *last, struct forest_iter **it_ret);
+int forest_iter_next(struct forest_iter *it, struct scoutfs_key **key,
+		     void **val, unsigned *val_len);
+u64 forest_iter_skipped(struct forest_iter *it);
+void forest_iter_stop(struct forest_iter *it);
+int forest_walk(struct forest *fo, struct scoutfs_key *first,
+		struct scoutfs_key *last, forest_item_func func, void *arg);
+int forest_split(struct forest *fo, struct scoutfs_key *first,
+		 struct scoutfs_key *last, int nr,
+		 struct scoutfs_key **keys_ret, int *nr_keys_ret);
+int forest_split_inodes(struct forest *fo, int nr, u64 **last_inos_ret,
+			int *nr_ranges_ret);
+
+#endif
@@ -0,0 +1,497 @@
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <getopt.h>
+#include <stdbool.h>
+
+#include "sparse.h"
+#include "util.h"
+#include "format.h"
+#include "cmd.h"
+#include "parse.h"
+#include "key.h"
+#include "block.h"
+#include "forest.h"
+#include "workq.h"
+#include "pex.h"
+
+/*
+ * fragmentation reports on the physical layout of file data.  Every
+ * inode's packed extents are decoded and each file's mapped extents
+ * are joined where they're logically and physically contiguous.  A
+ * discontiguity is an extent that doesn't start at the block after the
+ * end of the file's previous mapped extent, which is a seek when the
+ * file is read sequentially.  Discontiguities are also averaged over
+ * the number of SCOUTFS_PACKEXT_BLOCKS regions that have mapped blocks.
+ *
+ * The fs zone is split into pieces of whole inodes that are walked by a
+ * pool of threads.  Files are summarized as their items stream by and
+ * each piece only keeps the top files and a histogram of extent
+ * lengths, which are combined once all the pieces are walked.
+ */
+
+/* the walk is split into about this many pieces per thread */
+#define FRAG_PIECES_PER_THREAD 4
+#define FRAG_DEFAULT_TOP 20
+#define FRAG_HIST_BUCKETS 64
+
+struct frag_file {
+	u64 ino;
+	u64 blocks;
+	u64 extents;
+	u64 regions;
+	u64 discontig;
+};
+
+struct frag_hist {
+	u64 extents[FRAG_HIST_BUCKETS];
+	u64 blocks[FRAG_HIST_BUCKETS];
+};
+
+struct frag_piece {
+	struct work work;
+	struct forest *fo;
+	u64 first_ino;
+	u64 last_ino;
+	int nr_top;
+
+	/* min heap of the most discontiguous files */
+	struct frag_file *top;
+	int top_nr;
+
+	struct frag_hist hist;
+	u64 files;
+	u64 fragmented;
+	int err;
+
+	/* the file whose items are being decoded */
+	struct frag_file file;
+	struct pex_decoder dec;
+	u64 iend;
+	u64 bend;
+	u64 ext_len;
+	u64 region;
+};
+
+/* returns true if a is less fragmented than b */
+static bool frag_less(struct frag_file *a, struct frag_file *b)
+{
+	return a->discontig != b->discontig ? a->discontig < b->discontig :
+	       a->extents != b->extents ? a->extents < b->extents :
+	       a->ino > b->ino;
+}
+
+static void top_sift_down(struct frag_file *top, int nr, int i)
+{
+	struct frag_file tmp;
+	int least;
+	int c;
+
+	for (;;) {
+		least = i;
+		c = (i * 2) + 1;
+		if (c < nr && frag_less(&top[c], &top[least]))
+			least = c;
+		if (c + 1 < nr && frag_less(&top[c + 1], &top[least]))
+			least = c + 1;
+		if (least == i)
+			break;
+
+		tmp = top[i];
+		top[i] = top[least];
+		top[least] = tmp;
+		i = least;
+	}
+}
+
+static void top_sift_up(struct frag_file *top, int i)
+{
+	struct frag_file tmp;
+	int p;
+
+	while (i > 0) {
+		p = (i - 1) / 2;
+		if (!frag_less(&top[i], &top[p]))
+			break;
+
+		tmp = top[i];
+		top[i] = top[p];
+		top[p] = tmp;
+		i = p;
+	}
+}
+
+static void add_top(struct frag_file *top, int *top_nr, int nr_top,
+		    struct frag_file *ff)
+{
+	if (*top_nr < nr_top) {
+		top[*top_nr] = *ff;
+		top_sift_up(top, (*top_nr)++);
+	} else if (nr_top > 0 && frag_less(&top[0], ff)) {
+		top[0] = *ff;
+		top_sift_down(top, *top_nr, 0);
+	}
+}
+
+static void add_hist(struct frag_hist *hist, u64 len)
+{
+	int b = flsll(len) - 1;
+
+	hist->extents[b]++;
+	hist->blocks[b] += len;
+}
+
+static void finish_file(struct frag_piece *fp)
+{
+	struct frag_file *ff = &fp->file;
+
+	if (ff->extents) {
+		add_hist(&fp->hist, fp->ext_len);
+		add_top(fp->top, &fp->top_nr, fp->nr_top, ff);
+		fp->files++;
+		if (ff->discontig)
+			fp->fragmented++;
+	}
+
+	memset(ff, 0, sizeof(*ff));
+}
+
+/* only mapped extents are considered, holes and offline are skipped */
+static void add_extent(struct frag_piece *fp, struct pex_extent *ext)
+{
+	struct frag_file *ff = &fp->file;
+	u64 region;
+
+	if (ext->blkno == 0 || ext->count == 0)
+		return;
+
+	if (ff->extents == 0 || ext->iblock != fp->iend ||
+	    ext->blkno != fp->bend) {
+		if (ff->extents) {
+			add_hist(&fp->hist, fp->ext_len);
+			if (ext->blkno != fp->bend)
+				ff->discontig++;
+		}
+		ff->extents++;
+		fp->ext_len = 0;
+	}
+
+	region = ext->iblock >> SCOUTFS_PACKEXT_BASE_SHIFT;
+	if (ff->blocks == 0 || region != fp->region) {
+		ff->regions++;
+		fp->region = region;
+	}
+
+	fp->ext_len += ext->count;
+	ff->blocks += ext->count;
+	fp->iend = ext->iblock + ext->count;
+	fp->bend = ext->blkno + ext->count;
+}
+
+static int add_item(struct frag_piece *fp, struct scoutfs_key *key,
+		    void *val, unsigned val_len)
+{
+	struct pex_extent ext;
+	int ret;
+
+	if (key->sk_type != SCOUTFS_PACKED_EXTENT_TYPE)
+		return 0;
+
+	if (le64_to_cpu(key->skpe_ino) != fp->file.ino) {
+		finish_file(fp);
+		fp->file.ino = le64_to_cpu(key->skpe_ino);
+	}
+
+	ret = pex_decode_key(&fp->dec, key, val, val_len);
+	if (ret < 0) {
+		fprintf(stderr, "packed extent item "SK_FMT" doesn't follow previous part\n",
+			SK_ARG(key));
+		return ret;
+	}
+
+	while ((ret = pex_decode_next(&fp->dec, &ext)) > 0)
+		add_extent(fp, &ext);
+	if (ret < 0) {
+		fprintf(stderr, "packed extent item "SK_FMT" is malformed at off %u\n",
+			SK_ARG(key), fp->dec.off);
+		return ret;
+	}
+
+	return 0;
+}
+
+static void frag_worker(struct work *work)
+{
+	struct frag_piece *fp = container_of(work, struct frag_piece, work);
+	struct forest_iter *it = NULL;
+	struct scoutfs_key first;
+	struct scoutfs_key last;
+	struct scoutfs_key *key;
+	unsigned val_len;
+	void *val;
+	int ret;
+
+	scoutfs_key_set_zeros(&first);
+	first.sk_zone = SCOUTFS_FS_ZONE;
+	first._sk_first = cpu_to_le64(fp->first_ino);
+	scoutfs_key_set_ones(&last);
+	last.sk_zone = SCOUTFS_FS_ZONE;
+	last._sk_first = cpu_to_le64(fp->last_ino);
+
+	fp->top = calloc(fp->nr_top, sizeof(fp->top[0]));
+	if (!fp->top) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	ret = forest_iter_start(fp->fo, &first, &last, &it);
+	if (ret < 0)
+		goto out;
+
+	while ((ret = forest_iter_next(it, &key, &val, &val_len)) > 0) {
+		ret = add_item(fp, key, val, val_len);
+		if (ret < 0)
+			break;
+	}
+
+	if (ret == 0)
+		finish_file(fp);
+out:
+	forest_iter_stop(it);
+	fp->err = ret;
+}
+
+static void print_report(struct frag_piece *pieces, int nr_pieces,
+			 int nr_top)
+{
+	struct frag_hist hist = {{0,}};
+	struct frag_file *top;
+	struct frag_file *ff;
+	struct frag_file tmp;
+	u64 fragmented = 0;
+	u64 extents = 0;
+	u64 blocks = 0;
+	u64 files = 0;
+	int top_nr = 0;
+	int i;
+	int j;
+
+	/* only the pieces' arrays are needed if we can't allocate */
+	top = calloc(nr_top, sizeof(top[0]));
+
+	for (i = 0; i < nr_pieces; i++) {
+		for (j = 0; j < FRAG_HIST_BUCKETS; j++) {
+			hist.extents[j] += pieces[i].hist.extents[j];
+			hist.blocks[j] += pieces[i].hist.blocks[j];
+		}
+		files += pieces[i].files;
+		fragmented += pieces[i].fragmented;
+
+		for (j = 0; top && j < pieces[i].top_nr; j++)
+			add_top(top, &top_nr, nr_top, &pieces[i].top[j]);
+	}
+
+	for (j = 0; j < FRAG_HIST_BUCKETS; j++) {
+		extents += hist.extents[j];
+		blocks += hist.blocks[j];
+	}
+
+	/* pop the heap from least to most fragmented into the tail */
+	for (i = top_nr - 1; i > 0; i--) {
+		tmp = top[0];
+		top[0] = top[i];
+		top[i] = tmp;
+		top_sift_down(top, i, 0);
+	}
+
+	printf("top %d files by discontiguities:\n", top_nr);
+	printf("  %20s %12s %10s %10s %8s %10s %10s\n",
+	       "ino", "blocks", "extents", "mean_len", "regions",
+	       "discontig", "per_region");
+	for (i = 0; i < top_nr; i++) {
+		ff = &top[i];
+		printf("  %20llu %12llu %10llu %10.1f %8llu %10llu %10.2f\n",
+		       ff->ino, ff->blocks, ff->extents,
+		       (double)ff->blocks / ff->extents, ff->regions,
+		       ff->discontig, (double)ff->discontig / ff->regions);
+	}
+
+	printf("\nextent lengths:\n");
+	printf("  %-27s %10s %12s %8s\n", "length", "extents", "blocks",
+	       "blocks");
+	for (i = 0; i < FRAG_HIST_BUCKETS; i++) {
+		if (hist.extents[i] == 0)
+			continue;
+
+		printf("  %12llu - %-12llu %10llu %12llu %7.2f%%\n",
+		       1ULL << i, (2ULL << i) - 1, hist.extents[i],
+		       hist.blocks[i],
+		       (double)hist.blocks[i] * 100.0 / blocks);
+	}
+
+	printf("\n%llu files with %llu blocks in %llu extents, mean extent %.1f blocks, %llu files with discontiguities\n",
+	       files, blocks, extents,
+	       extents ? (double)blocks / extents : 0.0, fragmented);
+
+	free(top);
+}
+
+static int frag_report(struct block_cache *bc, int nr_threads, int nr_top)
+{
+	struct frag_piece *pieces = NULL;
+	struct scoutfs_super_block *super;
+	struct forest *fo = NULL;
+	struct workq *wq = NULL;
+	u64 *last_inos = NULL;
+	struct block *bl;
+	int nr_pieces = 0;
+	int ret;
+	int i;
+
+	bl = block_read(bc, SCOUTFS_SUPER_BLKNO);
+	if (!bl)
+		return -EIO;
+	super = block_data(bl);
+
+	if (le32_to_cpu(super->hdr.magic) != SCOUTFS_BLOCK_MAGIC_SUPER) {
+		fprintf(stderr, "super block magic %08x != expected %08x\n",
+			le32_to_cpu(super->hdr.magic),
+			SCOUTFS_BLOCK_MAGIC_SUPER);
+		ret = -EIO;
+		goto out;
+	}
+
+	wq = workq_create(nr_threads);
+	if (!wq) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	ret = forest_open(bc, super, &fo) ?:
+	      forest_split_inodes(fo, nr_threads * FRAG_PIECES_PER_THREAD,
+				  &last_inos, &nr_pieces);
+	if (ret < 0)
+		goto out;
+
+	pieces = calloc(nr_pieces, sizeof(*pieces));
+	if (!pieces) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	for (i = 0; i < nr_pieces; i++) {
+		work_init(&pieces[i].work, frag_worker);
+		pieces[i].fo = fo;
+		pieces[i].first_ino = i ? last_inos[i - 1] + 1 : 0;
+		pieces[i].last_ino = last_inos[i];
+		pieces[i].nr_top = nr_top;
+		workq_queue(wq, &pieces[i].work);
+	}
+	workq_wait(wq);
+
+	for (i = 0; i < nr_pieces; i++) {
+		ret = pieces[i].err;
+		if (ret < 0)
+			goto out;
+	}
+
+	print_report(pieces, nr_pieces, nr_top);
+	ret = 0;
+out:
+	if (pieces) {
+		for (i = 0; i < nr_pieces; i++)
+			free(pieces[i].top);
+		free(pieces);
+	}
+	free(last_inos);
+	forest_close(fo);
+	workq_destroy(wq);
+	block_put(bc, bl);
+	return ret;
+}
+
+static struct option long_ops[] = {
+	{ "mmap", 0, NULL, 'm' },
+	{ "threads", 1, NULL, 't' },
+	{ "top", 1, NULL, 'n' },
+	{ NULL, 0, NULL, 0}
+};
+
+static int fragmentation_cmd(int argc, char **argv)
+{
+	struct block_cache *bc;
+	bool use_mmap = false;
+	int nr_top = FRAG_DEFAULT_TOP;
+	int nr_threads = 0;
+	char *path;
+	char *end;
+	int ret;
+	int fd;
+	int c;
+
+	while ((c = getopt_long(argc, argv, "mn:t:", long_ops, NULL)) != -1) {
+		switch (c) {
+		case 'm':
+			use_mmap = true;
+			break;
+		case 'n':
+			nr_top = strtol(optarg, &end, 0);
+			if (*end != '\0' || nr_top < 0) {
+				fprintf(stderr, "invalid number of top files '%s'\n",
+					optarg);
+				return -EINVAL;
+			}
+			break;
+		case 't':
+			ret = parse_threads(optarg, &nr_threads);
+			if (ret)
+				return ret;
+			break;
+		case '?':
+		default:
+			return -EINVAL;
+		}
+	}
+
+	if (optind != argc - 1) {
+		printf("scoutfs fragmentation: a single path argument is required\n");
+		return -EINVAL;
+	}
+	path = argv[optind];
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		ret = -errno;
+		fprintf(stderr, "failed to open '%s': %s (%d)\n",
+			path, strerror(errno), errno);
+		return ret;
+	}
+
+	if (nr_threads == 0)
+		nr_threads = workq_nr_threads();
+
+	bc = block_cache_open(path, fd, use_mmap);
+	if (!bc) {
+		close(fd);
+		return -ENOMEM;
+	}
+
+	ret = frag_report(bc, nr_threads, nr_top);
+
+	block_cache_destroy(bc);
+	close(fd);
+	return ret;
+}
+
+static void __attribute__((constructor)) fragmentation_ctor(void)
+{
+	cmd_register("fragmentation",
+		     "[--mmap] [--threads nr] [--top nr] <device>",
+		     "report the files whose data extents are most fragmented",
+		     fragmentation_cmd);
+}
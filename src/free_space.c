@@ -0,0 +1,354 @@
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <getopt.h>
+#include <stdbool.h>
+
+#include "sparse.h"
+#include "util.h"
+#include "format.h"
+#include "cmd.h"
+#include "radix.h"
+#include "block.h"
+#include "btree.h"
+
+/*
+ * free-space describes the free extents in the radix allocators.  Set
+ * bits in the leaf bitmaps are free blocks and runs of set bits are
+ * free extents.  Allocating large streaming writes depends on finding
+ * long runs, and particularly on finding entirely free large regions
+ * of SCOUTFS_RADIX_LG_BITS which are tracked by the lg_total counts.
+ *
+ * Each radix is walked in bit order so that runs can continue across
+ * leaf blocks and through full refs that don't have blocks.  Leaves are
+ * scanned a large region at a time.  Regions that are entirely set or
+ * clear are found by counting their bits and extend or end the current
+ * run without looking at their bits.  Runs in partially free regions
+ * are found a word at a time by counting trailing zeros.
+ */
+
+#define FREE_HIST_BUCKETS 64
+
+/* extents are bucketed by the power of two of their length */
+struct free_hist {
+	u64 extents[FREE_HIST_BUCKETS];
+	u64 blocks[FREE_HIST_BUCKETS];
+	u64 free;
+};
+
+struct free_root {
+	struct free_hist *hist;
+	u64 run;
+	u64 free;
+	u64 extents;
+	u64 largest;
+	u64 lg_full;
+	u64 lg_partial;
+};
+
+struct free_space_info {
+	struct block_cache *bc;
+	struct free_hist meta;
+	struct free_hist data;
+};
+
+static void end_run(struct free_root *fr)
+{
+	int b;
+
+	if (fr->run == 0)
+		return;
+
+	b = flsll(fr->run) - 1;
+	fr->hist->extents[b]++;
+	fr->hist->blocks[b] += fr->run;
+	fr->extents++;
+	fr->largest = max(fr->largest, fr->run);
+	fr->run = 0;
+}
+
+/* runs continue from the low bit of each little endian word */
+static void scan_word(struct free_root *fr, u64 w)
+{
+	unsigned int bit = 0;
+	unsigned int nr;
+	u64 rem;
+
+	if (w == U64_MAX) {
+		fr->run += 64;
+		return;
+	}
+
+	while (bit < 64) {
+		rem = w >> bit;
+		if (rem & 1) {
+			/* high bits shifted in are clear so ~rem is non-zero */
+			nr = __builtin_ctzll(~rem);
+			fr->run += nr;
+			bit += nr;
+		} else {
+			end_run(fr);
+			if (rem == 0)
+				break;
+			bit += __builtin_ctzll(rem);
+		}
+	}
+}
+
+static void scan_leaf(struct free_root *fr, struct scoutfs_radix_block *rdx)
+{
+	u64 words = SCOUTFS_RADIX_LG_BITS / 64;
+	u64 set;
+	u64 i;
+	u64 r;
+
+	for (r = 0; r < SCOUTFS_RADIX_BITS / SCOUTFS_RADIX_LG_BITS; r++) {
+		set = radix_leaf_region_set(rdx, r);
+		fr->free += set;
+
+		if (set == SCOUTFS_RADIX_LG_BITS) {
+			fr->run += SCOUTFS_RADIX_LG_BITS;
+			fr->lg_full++;
+		} else if (set == 0) {
+			end_run(fr);
+		} else {
+			fr->lg_partial++;
+			for (i = 0; i < words; i++)
+				scan_word(fr, le64_to_cpu(
+						rdx->bits[(r * words) + i]));
+		}
+	}
+}
+
+static int walk_radix_ref(struct free_space_info *fsi, struct free_root *fr,
+			  struct scoutfs_radix_ref *ref, int level)
+{
+	struct scoutfs_radix_block *rdx;
+	struct block *bl;
+	u64 blkno;
+	u64 full;
+	int ret;
+	int i;
+
+	blkno = le64_to_cpu(ref->blkno);
+	if (blkno == 0) {
+		end_run(fr);
+		return 0;
+	}
+
+	if (blkno == U64_MAX) {
+		full = radix_full_subtree_total(level);
+		fr->run += full;
+		fr->free += full;
+		fr->lg_full += full / SCOUTFS_RADIX_LG_BITS;
+		return 0;
+	}
+
+	bl = block_read(fsi->bc, blkno);
+	if (!bl)
+		return -EIO;
+	rdx = block_data(bl);
+
+	if (le32_to_cpu(rdx->hdr.magic) != SCOUTFS_BLOCK_MAGIC_RADIX ||
+	    le64_to_cpu(rdx->hdr.blkno) != blkno) {
+		fprintf(stderr, "radix blkno %llu: magic %08x blkno %llu aren't a radix block\n",
+			blkno, le32_to_cpu(rdx->hdr.magic),
+			le64_to_cpu(rdx->hdr.blkno));
+		ret = -EIO;
+		goto out;
+	}
+
+	if (level == 0) {
+		scan_leaf(fr, rdx);
+		ret = 0;
+		goto out;
+	}
+
+	for (i = 0; i < SCOUTFS_RADIX_REFS; i++) {
+		blkno = le64_to_cpu(rdx->refs[i].blkno);
+		if (blkno != 0 && blkno != U64_MAX)
+			block_readahead(fsi->bc, blkno);
+	}
+
+	ret = 0;
+	for (i = 0; i < SCOUTFS_RADIX_REFS && ret == 0; i++)
+		ret = walk_radix_ref(fsi, fr, &rdx->refs[i], level - 1);
+out:
+	block_put(fsi->bc, bl);
+	return ret;
+}
+
+static int print_root(struct free_space_info *fsi, char *prefix, char *name,
+		      struct scoutfs_radix_root *root, bool meta)
+{
+	struct free_root fr = {
+		.hist = meta ? &fsi->meta : &fsi->data,
+	};
+	int ret;
+
+	if (root->height > 0) {
+		ret = walk_radix_ref(fsi, &fr, &root->ref, root->height - 1);
+		if (ret < 0)
+			return ret;
+		end_run(&fr);
+	}
+
+	fr.hist->free += fr.free;
+
+	printf("%-21s %-12s %12llu %10llu %12llu %8llu %10llu %7.2f%%\n",
+	       prefix, name, fr.free, fr.extents, fr.largest, fr.lg_full,
+	       fr.lg_partial, fr.free ? (double)fr.lg_full *
+		SCOUTFS_RADIX_LG_BITS * 100.0 / fr.free : 0.0);
+
+	return 0;
+}
+
+static int print_log_trees_roots(void *key, unsigned key_len, void *val,
+				 unsigned val_len, u64 blkno, void *arg)
+{
+	struct scoutfs_log_trees_key *ltk = key;
+	struct scoutfs_log_trees_val *ltv = val;
+	struct free_space_info *fsi = arg;
+	char prefix[32];
+
+	if (key_len != sizeof(*ltk) || val_len != sizeof(*ltv)) {
+		fprintf(stderr, "logs_root blkno %llu: item key_len %u val_len %u aren't log trees\n",
+			blkno, key_len, val_len);
+		return -EIO;
+	}
+
+	snprintf(prefix, sizeof(prefix), "%016llx.%llu",
+		 be64_to_cpu(ltk->rid), be64_to_cpu(ltk->nr));
+
+	return print_root(fsi, prefix, "meta_avail", &ltv->meta_avail, true) ?:
+	       print_root(fsi, prefix, "meta_freed", &ltv->meta_freed, true) ?:
+	       print_root(fsi, prefix, "data_avail", &ltv->data_avail, false) ?:
+	       print_root(fsi, prefix, "data_freed", &ltv->data_freed, false);
+}
+
+static void print_hist(char *which, struct free_hist *hist)
+{
+	int i;
+
+	printf("\n%s free extents:\n", which);
+	printf("  %-27s %10s %12s %8s\n", "length", "extents", "blocks",
+	       "free");
+
+	for (i = 0; i < FREE_HIST_BUCKETS; i++) {
+		if (hist->extents[i] == 0)
+			continue;
+
+		printf("  %12llu - %-12llu %10llu %12llu %7.2f%%\n",
+		       1ULL << i, (2ULL << i) - 1, hist->extents[i],
+		       hist->blocks[i],
+		       (double)hist->blocks[i] * 100.0 / hist->free);
+	}
+}
+
+static int free_space_report(struct free_space_info *fsi)
+{
+	struct scoutfs_super_block *super;
+	struct block *bl;
+	int ret;
+
+	bl = block_read(fsi->bc, SCOUTFS_SUPER_BLKNO);
+	if (!bl)
+		return -EIO;
+	super = block_data(bl);
+
+	if (le32_to_cpu(super->hdr.magic) != SCOUTFS_BLOCK_MAGIC_SUPER) {
+		fprintf(stderr, "super block magic %08x != expected %08x\n",
+			le32_to_cpu(super->hdr.magic),
+			SCOUTFS_BLOCK_MAGIC_SUPER);
+		ret = -EIO;
+		goto out;
+	}
+
+	printf("large regions are %u blocks\n", SCOUTFS_RADIX_LG_BITS);
+	printf("%-21s %-12s %12s %10s %12s %8s %10s %8s\n",
+	       "owner", "radix", "free", "extents", "largest", "lg_free",
+	       "lg_partial", "in_lg");
+
+	ret = print_root(fsi, "core", "meta_avail",
+			 &super->core_meta_avail, true) ?:
+	      print_root(fsi, "core", "meta_freed",
+			 &super->core_meta_freed, true) ?:
+	      print_root(fsi, "core", "data_avail",
+			 &super->core_data_avail, false) ?:
+	      print_root(fsi, "core", "data_freed",
+			 &super->core_data_freed, false) ?:
+	      btree_walk(fsi->bc, &super->logs_root, NULL, 0, NULL, 0,
+			 print_log_trees_roots, fsi);
+	if (ret < 0)
+		goto out;
+
+	print_hist("meta", &fsi->meta);
+	print_hist("data", &fsi->data);
+out:
+	block_put(fsi->bc, bl);
+	return ret;
+}
+
+static struct option long_ops[] = {
+	{ "mmap", 0, NULL, 'm' },
+	{ NULL, 0, NULL, 0}
+};
+
+static int free_space_cmd(int argc, char **argv)
+{
+	struct free_space_info fsi = {NULL,};
+	bool use_mmap = false;
+	char *path;
+	int ret;
+	int fd;
+	int c;
+
+	while ((c = getopt_long(argc, argv, "m", long_ops, NULL)) != -1) {
+		switch (c) {
+		case 'm':
+			use_mmap = true;
+			break;
+		case '?':
+		default:
+			return -EINVAL;
+		}
+	}
+
+	if (optind != argc - 1) {
+		printf("scoutfs free-space: a single path argument is required\n");
+		return -EINVAL;
+	}
+	path = argv[optind];
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		ret = -errno;
+		fprintf(stderr, "failed to open '%s': %s (%d)\n",
+			path, strerror(errno), errno);
+		return ret;
+	}
+
+	fsi.bc = block_cache_open(path, fd, use_mmap);
+	if (!fsi.bc) {
+		close(fd);
+		return -ENOMEM;
+	}
+
+	ret = free_space_report(&fsi);
+
+	block_cache_destroy(fsi.bc);
+	close(fd);
+	return ret;
+}
+
+static void __attribute__((constructor)) free_space_ctor(void)
+{
+	cmd_register("free-space", "[--mmap] <device>",
+		     "report the lengths of free extents in the radix allocators",
+		     free_space_cmd);
+}
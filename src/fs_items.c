@@ -0,0 +1,168 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+
+#include "sparse.h"
+#include "util.h"
+#include "format.h"
+#include "key.h"
+#include "forest.h"
+#include "fs_items.h"
+
+/*
+ * Offline commands that copy files out of a volume read the current
+ * versions of inode, symlink, and readdir items through a forest.
+ */
+
+struct copy_val_args {
+	void *buf;
+	unsigned size;
+	unsigned len;
+};
+
+struct readdir_args {
+	struct fs_dent *dents;
+	u64 nr;
+	u64 alloced;
+};
+
+void fs_init_key(struct scoutfs_key *key, u64 ino, u8 type)
+{
+	scoutfs_key_set_zeros(key);
+	key->sk_zone = SCOUTFS_FS_ZONE;
+	key->_sk_first = cpu_to_le64(ino);
+	key->sk_type = type;
+}
+
+/* appends the values of items to the buffer while they fit */
+static int copy_val(struct scoutfs_key *key, void *val, unsigned val_len,
+		    void *arg)
+{
+	struct copy_val_args *cva = arg;
+
+	if (cva->len + val_len <= cva->size)
+		memcpy(cva->buf + cva->len, val, val_len);
+	cva->len += val_len;
+	return 0;
+}
+
+/* returns -ENOENT if the inode doesn't exist */
+int fs_lookup_inode(struct forest *fo, u64 ino, struct scoutfs_inode *inode)
+{
+	struct copy_val_args cva = {
+		.buf = inode,
+		.size = sizeof(*inode),
+	};
+	struct scoutfs_key key;
+	int ret;
+
+	fs_init_key(&key, ino, SCOUTFS_INODE_TYPE);
+
+	ret = forest_walk(fo, &key, &key, copy_val, &cva);
+	if (ret == 0 && cva.len == 0) {
+		fprintf(stderr, "inode %llu not found\n", ino);
+		ret = -ENOENT;
+	} else if (ret == 0 && cva.len != sizeof(*inode)) {
+		fprintf(stderr, "inode %llu item has an invalid value\n", ino);
+		ret = -EIO;
+	}
+
+	return ret;
+}
+
+/*
+ * Read a symlink's target into a buffer of SCOUTFS_SYMLINK_MAX_SIZE + 1
+ * bytes and terminate it.
+ */
+int fs_read_symlink(struct forest *fo, u64 ino, struct scoutfs_inode *inode,
+		    char *target)
+{
+	struct copy_val_args cva = {
+		.buf = target,
+		.size = SCOUTFS_SYMLINK_MAX_SIZE + 1,
+	};
+	struct scoutfs_key first;
+	struct scoutfs_key last;
+	u64 size = le64_to_cpu(inode->size);
+	int ret;
+
+	fs_init_key(&first, ino, SCOUTFS_SYMLINK_TYPE);
+	last = first;
+	last.sks_nr = cpu_to_le64(U64_MAX);
+
+	ret = forest_walk(fo, &first, &last, copy_val, &cva);
+	if (ret == 0 && (size > SCOUTFS_SYMLINK_MAX_SIZE || cva.len < size ||
+			 cva.len > cva.size))
+		ret = -EIO;
+	if (ret < 0) {
+		fprintf(stderr, "symlink ino %llu items don't contain its %llu byte target\n",
+			ino, size);
+		return ret;
+	}
+
+	target[size] = '\0';
+	return 0;
+}
+
+static int add_dent(struct scoutfs_key *key, void *val, unsigned val_len,
+		    void *arg)
+{
+	struct scoutfs_dirent *dent = val;
+	struct readdir_args *ra = arg;
+	struct fs_dent *de;
+	unsigned name_len;
+
+	if (val_len <= sizeof(*dent) ||
+	    val_len - sizeof(*dent) > SCOUTFS_NAME_LEN) {
+		fprintf(stderr, "readdir item "SK_FMT" has invalid val_len %u\n",
+			SK_ARG(key), val_len);
+		return -EIO;
+	}
+	name_len = val_len - sizeof(*dent);
+
+	if (ra->nr == ra->alloced) {
+		ra->alloced = max(ra->alloced * 2, 64ULL);
+		de = realloc(ra->dents, ra->alloced * sizeof(ra->dents[0]));
+		if (!de)
+			return -ENOMEM;
+		ra->dents = de;
+	}
+
+	de = &ra->dents[ra->nr++];
+	de->ino = le64_to_cpu(dent->ino);
+	de->type = dent->type;
+	memcpy(de->name, dent->name, name_len);
+	de->name[name_len] = '\0';
+	return 0;
+}
+
+/*
+ * Return a directory's entries in readdir order.  The names are
+ * terminated but haven't been checked.  The caller frees the entries.
+ */
+int fs_readdir(struct forest *fo, u64 ino, struct fs_dent **dents_ret,
+	       u64 *nr_ret)
+{
+	struct readdir_args ra = {NULL,};
+	struct scoutfs_key first;
+	struct scoutfs_key last;
+	int ret;
+
+	fs_init_key(&first, ino, SCOUTFS_READDIR_TYPE);
+	last = first;
+	last.skd_major = cpu_to_le64(U64_MAX);
+	last._sk_third = cpu_to_le64(U64_MAX);
+	last._sk_fourth = U8_MAX;
+
+	ret = forest_walk(fo, &first, &last, add_dent, &ra);
+	if (ret < 0) {
+		free(ra.dents);
+		ra.dents = NULL;
+		ra.nr = 0;
+	}
+
+	*dents_ret = ra.dents;
+	*nr_ret = ra.nr;
+	return ret;
+}
@@ -0,0 +1,20 @@
+#ifndef _FS_ITEMS_H_
+#define _FS_ITEMS_H_
+
+struct forest;
+
+/* a directory entry read from a readdir item */
+struct fs_dent {
+	u64 ino;
+	u8 type;
+	char name[SCOUTFS_NAME_LEN + 1];
+};
+
+void fs_init_key(struct scoutfs_key *key, u64 ino, u8 type);
+int fs_lookup_inode(struct forest *fo, u64 ino, struct scoutfs_inode *inode);
+int fs_read_symlink(struct forest *fo, u64 ino, struct scoutfs_inode *inode,
+		    char *target);
+int fs_readdir(struct forest *fo, u64 ino, struct fs_dent **dents_ret,
+	       u64 *nr_ret);
+
+#endif
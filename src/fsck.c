@@ -0,0 +1,1387 @@
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <stdarg.h>
+#include <getopt.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "sparse.h"
+#include "util.h"
+#include "format.h"
+#include "bitops.h"
+#include "cmd.h"
+#include "parse.h"
+#include "crc.h"
+#include "key.h"
+#include "radix.h"
+#include "block.h"
+#include "workq.h"
+#include "list.h"
+#include "popcount.h"
+#include "pex.h"
+
+/*
+ * fsck performs a read-only check of all the metadata structures that
+ * are reachable from the super block of an unmounted volume.
+ *
+ * Every referenced block has its header verified against the ref that
+ * pointed to it.  Btree blocks have their item layout, levels, and key
+ * ordering checked against the keys in their parents.  Radix blocks
+ * have their totals and first hints recalculated from their refs or
+ * bitmaps.  Every referenced metadata block and every data block mapped
+ * by extent items is checked to make sure that it isn't also marked
+ * free in any of the radix allocator trees.
+ *
+ * The radix allocators can be checked on their own, skipping all the
+ * item btrees other than the logs_root that references the clients'
+ * allocators.  The leaf bitmaps of large data devices are most of the
+ * metadata and are checked at close to the rate they can be read.
+ *
+ * The walk is split up into work that is executed by a pool of
+ * threads.  The top levels of each tree fan out into work for each of
+ * their subtrees which are then walked depth-first so memory use is
+ * bounded by the number of queued subtrees rather than the size of the
+ * volume.
+ *
+ * Problems are printed as they're found and the command returns an
+ * error if any were found.
+ */
+
+/* the top levels of trees that queue work for each of their children */
+#define FSCK_FANOUT_LEVELS 2
+
+struct fsck_info;
+struct fsck_tree;
+
+/*
+ * Extent items can be split into multiple parts in a region and each
+ * part's blknos are encoded relative to the end of the previous part.
+ * Each walk remembers where the previous extent item left off.
+ */
+struct pex_state {
+	struct scoutfs_key next_key;
+	struct pex_decoder dec;
+	bool valid;
+};
+
+typedef void (*fsck_item_func)(struct fsck_info *fi, struct fsck_tree *tree,
+			       u64 blkno, void *key, unsigned key_len,
+			       void *val, unsigned val_len,
+			       struct pex_state *pex);
+
+struct fsck_tree {
+	struct list_head head;
+	char name[64];
+	struct scoutfs_btree_root root;
+	fsck_item_func item_func;
+	unsigned key_len;
+	unsigned val_len;
+	bool log_items;
+};
+
+struct fsck_info {
+	struct block_cache *bc;
+	struct workq *wq;
+	struct scoutfs_super_block super;
+
+	/* all the radix trees whose set bits are free blocks */
+	struct scoutfs_radix_root *meta_free;
+	struct scoutfs_radix_root *data_free;
+	int nr_meta_free;
+	int nr_data_free;
+
+	/* only check the allocators and the logs_root that has some */
+	bool radix_only;
+
+	pthread_mutex_t mutex;
+	struct list_head trees;
+	u64 blocks;
+	u64 items;
+	u64 problems;
+};
+
+struct btree_work {
+	struct work work;
+	struct fsck_info *fi;
+	struct fsck_tree *tree;
+	struct scoutfs_btree_ref ref;
+	u8 level;
+	int fanout;
+	unsigned lo_len;
+	unsigned hi_len;
+	u8 lo[SCOUTFS_BTREE_MAX_KEY_LEN];
+	u8 hi[SCOUTFS_BTREE_MAX_KEY_LEN];
+	struct pex_state pex;
+};
+
+struct radix_work {
+	struct work work;
+	struct fsck_info *fi;
+	char *name;
+	struct scoutfs_radix_ref ref;
+	int level;
+	u64 first_bit;
+	bool meta;
+	int fanout;
+};
+
+static void problem(struct fsck_info *fi, char *fmt, ...)
+{
+	va_list args;
+
+	pthread_mutex_lock(&fi->mutex);
+	fi->problems++;
+	va_start(args, fmt);
+	vprintf(fmt, args);
+	va_end(args);
+	pthread_mutex_unlock(&fi->mutex);
+}
+
+static void count_block(struct fsck_info *fi)
+{
+	__atomic_add_fetch(&fi->blocks, 1, __ATOMIC_RELAXED);
+}
+
+static void count_item(struct fsck_info *fi)
+{
+	__atomic_add_fetch(&fi->items, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Verify a block's header against the ref that was used to read it.
+ * Returns false if the block can't be trusted and its contents
+ * shouldn't be examined.
+ */
+static bool check_header(struct fsck_info *fi, char *name,
+			 struct scoutfs_block_header *hdr, u32 magic,
+			 u64 blkno, u64 seq)
+{
+	u32 crc = crc_block(hdr);
+	bool ok = true;
+
+	if (crc != le32_to_cpu(hdr->crc)) {
+		problem(fi, "%s blkno %llu: crc %08x != calculated %08x\n",
+			name, blkno, le32_to_cpu(hdr->crc), crc);
+		ok = false;
+	}
+
+	if (le32_to_cpu(hdr->magic) != magic) {
+		problem(fi, "%s blkno %llu: magic %08x != expected %08x\n",
+			name, blkno, le32_to_cpu(hdr->magic), magic);
+		ok = false;
+	}
+
+	if (hdr->fsid != fi->super.hdr.fsid)
+		problem(fi, "%s blkno %llu: fsid %llx != super fsid %llx\n",
+			name, blkno, le64_to_cpu(hdr->fsid),
+			le64_to_cpu(fi->super.hdr.fsid));
+
+	if (le64_to_cpu(hdr->blkno) != blkno)
+		problem(fi, "%s blkno %llu: header blkno %llu doesn't match ref\n",
+			name, blkno, le64_to_cpu(hdr->blkno));
+
+	if (le64_to_cpu(hdr->seq) != seq)
+		problem(fi, "%s blkno %llu: header seq %llu != ref seq %llu\n",
+			name, blkno, le64_to_cpu(hdr->seq), seq);
+
+	return ok;
+}
+
+/*
+ * Search for a set bit between first and last, inclusive, in a radix
+ * tree.  found is set to the first set bit or U64_MAX if none were
+ * set.  Subtrees referenced by empty and full refs aren't read.
+ */
+static int radix_find_set(struct block_cache *bc,
+			  struct scoutfs_radix_root *root,
+			  u64 first, u64 last, u64 *found)
+{
+	struct scoutfs_radix_block *rdx;
+	struct scoutfs_radix_ref ref;
+	int inds[U8_MAX];
+	struct block *bl;
+	u64 capacity;
+	u64 blkno;
+	u64 bit;
+	u64 end;
+	int level;
+
+	*found = U64_MAX;
+
+	if (root->height == 0)
+		return 0;
+
+	capacity = radix_full_subtree_total(root->height - 1);
+	last = min(last, capacity - 1);
+
+	bit = first;
+	while (bit <= last) {
+		radix_calc_level_inds(inds, root->height, bit);
+		ref = root->ref;
+
+		for (level = root->height - 1; ; level--) {
+			blkno = le64_to_cpu(ref.blkno);
+
+			if (blkno == 0) {
+				end = radix_full_subtree_total(level);
+				bit = round_down(bit, end) + end;
+				break;
+			}
+
+			if (blkno == U64_MAX) {
+				*found = bit;
+				return 0;
+			}
+
+			bl = block_read(bc, blkno);
+			if (!bl)
+				return -EIO;
+			rdx = block_data(bl);
+
+			if (level == 0) {
+				end = min(last, radix_calc_leaf_bit(bit) +
+						SCOUTFS_RADIX_BITS - 1);
+				for (; bit <= end; bit++) {
+					if (test_bit_le(bit % SCOUTFS_RADIX_BITS,
+							rdx->bits)) {
+						*found = bit;
+						block_put(bc, bl);
+						return 0;
+					}
+				}
+				block_put(bc, bl);
+				break;
+			}
+
+			ref = rdx->refs[inds[level]];
+			block_put(bc, bl);
+		}
+	}
+
+	return 0;
+}
+
+static int find_free(struct fsck_info *fi, bool meta, u64 first, u64 last,
+		     u64 *found)
+{
+	struct scoutfs_radix_root *roots;
+	int nr;
+	int ret;
+	int i;
+
+	roots = meta ? fi->meta_free : fi->data_free;
+	nr = meta ? fi->nr_meta_free : fi->nr_data_free;
+
+	for (i = 0; i < nr; i++) {
+		ret = radix_find_set(fi->bc, &roots[i], first, last, found);
+		if (ret < 0 || *found != U64_MAX)
+			return ret;
+	}
+
+	return 0;
+}
+
+/*
+ * Metadata blocks must be in the dynamically allocated region of the
+ * metadata device and can't be free in any allocator.
+ */
+static bool check_meta_blkno(struct fsck_info *fi, char *name, u64 blkno)
+{
+	struct scoutfs_super_block *super = &fi->super;
+	u64 found;
+	int ret;
+
+	if (blkno < le64_to_cpu(super->first_meta_blkno) ||
+	    blkno > le64_to_cpu(super->last_meta_blkno)) {
+		problem(fi, "%s blkno %llu: outside of meta blknos %llu - %llu\n",
+			name, blkno, le64_to_cpu(super->first_meta_blkno),
+			le64_to_cpu(super->last_meta_blkno));
+		return false;
+	}
+
+	ret = find_free(fi, true, blkno, blkno, &found);
+	if (ret == 0 && found != U64_MAX)
+		problem(fi, "%s blkno %llu: referenced block is marked free\n",
+			name, blkno);
+
+	return true;
+}
+
+static void check_data_extent(struct fsck_info *fi, char *name,
+			      struct scoutfs_key *key, u64 blkno, u64 count)
+{
+	struct scoutfs_super_block *super = &fi->super;
+	u64 found;
+	int ret;
+
+	if (blkno < le64_to_cpu(super->first_data_blkno) ||
+	    blkno + count - 1 > le64_to_cpu(super->last_data_blkno)) {
+		problem(fi, "%s item "SK_FMT": extent blkno %llu count %llu outside of data blknos %llu - %llu\n",
+			name, SK_ARG(key), blkno, count,
+			le64_to_cpu(super->first_data_blkno),
+			le64_to_cpu(super->last_data_blkno));
+		return;
+	}
+
+	ret = find_free(fi, false, blkno, blkno + count - 1, &found);
+	if (ret == 0 && found != U64_MAX)
+		problem(fi, "%s item "SK_FMT": extent blkno %llu count %llu has free blkno %llu\n",
+			name, SK_ARG(key), blkno, count, found);
+}
+
+/*
+ * Decode the packed extents in an item, continuing from the decoder's
+ * position.  Mapped data blocks are checked if name is set.  Returns
+ * -EIO if the item was malformed.
+ */
+static int decode_packed_extents(struct fsck_info *fi, char *name,
+				 struct scoutfs_key *key, void *val,
+				 unsigned val_len, struct pex_decoder *dec)
+{
+	struct pex_extent ext;
+	int ret;
+
+	pex_decode_item(dec, val, val_len);
+
+	while ((ret = pex_decode_next(dec, &ext)) > 0) {
+		if (name && ext.blkno && ext.count)
+			check_data_extent(fi, name, key, ext.blkno, ext.count);
+	}
+
+	if (ret < 0 && name)
+		problem(fi, "%s item "SK_FMT": packed extent at off %u is malformed\n",
+			name, SK_ARG(key), dec->off);
+
+	return ret;
+}
+
+/*
+ * Find a leaf item by descending from the root.  The caller is given
+ * a reference on the leaf block and pointers to the value in it.
+ * Blocks that are damaged just stop the search, they'll be reported
+ * by the walk.
+ */
+static int lookup_item(struct fsck_info *fi, struct scoutfs_btree_root *root,
+		       void *key, unsigned key_len, struct block **bl_ret,
+		       void **val, unsigned *val_len)
+{
+	struct scoutfs_btree_item *item;
+	struct scoutfs_btree_block *bt;
+	struct scoutfs_btree_ref ref;
+	struct block *bl;
+	unsigned nr;
+	unsigned off;
+	int cmp;
+	int i;
+
+	ref = root->ref;
+	if (root->height == 0 || ref.blkno == 0)
+		return -ENOENT;
+
+	for (;;) {
+		bl = block_read(fi->bc, le64_to_cpu(ref.blkno));
+		if (!bl)
+			return -EIO;
+		bt = block_data(bl);
+
+		nr = le32_to_cpu(bt->nr_items);
+		if (offsetof(struct scoutfs_btree_block, item_hdrs[nr]) >
+		    SCOUTFS_BLOCK_SIZE)
+			break;
+
+		cmp = 1;
+		for (i = 0; i < nr; i++) {
+			off = le32_to_cpu(bt->item_hdrs[i].off);
+			if (off + sizeof(*item) > SCOUTFS_BLOCK_SIZE)
+				break;
+			item = (void *)bt + off;
+			if (off + sizeof(*item) + le16_to_cpu(item->key_len) +
+			    le16_to_cpu(item->val_len) > SCOUTFS_BLOCK_SIZE)
+				break;
+
+			cmp = memcmp_lens(key, key_len, item + 1,
+					  le16_to_cpu(item->key_len));
+			if (cmp <= 0)
+				break;
+		}
+		if (i == nr || cmp > 0)
+			break;
+
+		if (bt->level == 0) {
+			if (cmp != 0)
+				break;
+			*bl_ret = bl;
+			*val = (void *)(item + 1) + le16_to_cpu(item->key_len);
+			*val_len = le16_to_cpu(item->val_len);
+			return 0;
+		}
+
+		if (le16_to_cpu(item->val_len) != sizeof(ref))
+			break;
+		memcpy(&ref, (void *)(item + 1) + le16_to_cpu(item->key_len),
+		       sizeof(ref));
+		block_put(fi->bc, bl);
+	}
+
+	block_put(fi->bc, bl);
+	return -ENOENT;
+}
+
+/*
+ * Position the decoder where the given part of a region's extents
+ * starts by decoding all the previous parts.  This is only needed when
+ * a walk starts in the middle of a region's parts.
+ */
+static int pex_part_decoder(struct fsck_info *fi, struct fsck_tree *tree,
+			    struct scoutfs_key *key, struct pex_decoder *dec)
+{
+	struct scoutfs_log_item_value *liv;
+	struct scoutfs_key_be kbe;
+	struct scoutfs_key pkey;
+	struct block *bl;
+	unsigned val_len;
+	void *val;
+	int ret;
+	int i;
+
+	pex_decode_start(dec, le64_to_cpu(key->skpe_base));
+	pkey = *key;
+
+	for (i = 0; i < key->skpe_part; i++) {
+		pkey.skpe_part = i;
+		scoutfs_key_to_be(&kbe, &pkey);
+
+		ret = lookup_item(fi, &tree->root, &kbe, sizeof(kbe), &bl,
+				  &val, &val_len);
+		if (ret < 0)
+			return ret;
+
+		if (tree->log_items) {
+			liv = val;
+			if (val_len < sizeof(*liv) ||
+			    (liv->flags & SCOUTFS_LOG_ITEM_FLAG_DELETION)) {
+				block_put(fi->bc, bl);
+				return -ENOENT;
+			}
+			val += sizeof(*liv);
+			val_len -= sizeof(*liv);
+		}
+
+		ret = decode_packed_extents(fi, NULL, &pkey, val, val_len,
+					    dec);
+		block_put(fi->bc, bl);
+		if (ret < 0)
+			return ret;
+	}
+
+	return 0;
+}
+
+static void check_packed_extent(struct fsck_info *fi, struct fsck_tree *tree,
+				struct scoutfs_key *key, void *val,
+				unsigned val_len, struct pex_state *pex)
+{
+	struct pex_decoder dec;
+
+	if (key->skpe_part == 0) {
+		pex_decode_start(&dec, le64_to_cpu(key->skpe_base));
+	} else if (pex->valid &&
+		   scoutfs_key_compare(key, &pex->next_key) == 0) {
+		dec = pex->dec;
+	} else if (pex_part_decoder(fi, tree, key, &dec) < 0) {
+		problem(fi, "%s item "SK_FMT": couldn't find previous packed extent parts\n",
+			tree->name, SK_ARG(key));
+		pex->valid = false;
+		return;
+	}
+
+	if (decode_packed_extents(fi, tree->name, key, val, val_len,
+				  &dec) < 0) {
+		pex->valid = false;
+		return;
+	}
+
+	pex->next_key = *key;
+	scoutfs_key_inc(&pex->next_key);
+	pex->dec = dec;
+	pex->valid = true;
+}
+
+static void check_fs_item(struct fsck_info *fi, struct fsck_tree *tree,
+			  u64 blkno, void *key, unsigned key_len,
+			  void *val, unsigned val_len, struct pex_state *pex)
+{
+	struct scoutfs_log_item_value *liv;
+	struct scoutfs_key item_key;
+
+	scoutfs_key_from_be(&item_key, key);
+
+	if (tree->log_items) {
+		liv = val;
+		if (val_len < sizeof(*liv)) {
+			problem(fi, "%s blkno %llu: item "SK_FMT" val_len %u too small for log item header\n",
+				tree->name, blkno, SK_ARG(&item_key), val_len);
+			return;
+		}
+		if (liv->flags & SCOUTFS_LOG_ITEM_FLAG_DELETION)
+			return;
+		val += sizeof(*liv);
+		val_len -= sizeof(*liv);
+	}
+
+	if (val_len > SCOUTFS_MAX_VAL_SIZE)
+		problem(fi, "%s blkno %llu: item "SK_FMT" val_len %u larger than max %u\n",
+			tree->name, blkno, SK_ARG(&item_key), val_len,
+			SCOUTFS_MAX_VAL_SIZE);
+
+	if (item_key.sk_zone == SCOUTFS_FS_ZONE &&
+	    item_key.sk_type == SCOUTFS_PACKED_EXTENT_TYPE)
+		check_packed_extent(fi, tree, &item_key, val, val_len, pex);
+}
+
+static void queue_btree(struct fsck_info *fi, struct fsck_tree *tree);
+static void queue_radix(struct fsck_info *fi, char *name,
+			struct scoutfs_radix_root *root, bool meta);
+static void queue_bloom(struct fsck_info *fi, struct fsck_tree *tree,
+			struct scoutfs_btree_ref *ref);
+
+static struct fsck_tree *alloc_tree(struct fsck_info *fi,
+				    struct scoutfs_btree_root *root,
+				    fsck_item_func item_func,
+				    unsigned key_len, unsigned val_len,
+				    char *fmt, ...)
+{
+	struct fsck_tree *tree;
+	va_list args;
+
+	tree = calloc(1, sizeof(struct fsck_tree));
+	if (!tree) {
+		problem(fi, "failed to allocate tree: %s (%d)\n",
+			strerror(errno), errno);
+		return NULL;
+	}
+
+	va_start(args, fmt);
+	vsnprintf(tree->name, sizeof(tree->name), fmt, args);
+	va_end(args);
+
+	tree->root = *root;
+	tree->item_func = item_func;
+	tree->key_len = key_len;
+	tree->val_len = val_len;
+
+	pthread_mutex_lock(&fi->mutex);
+	list_add_tail(&tree->head, &fi->trees);
+	pthread_mutex_unlock(&fi->mutex);
+
+	return tree;
+}
+
+/*
+ * Each log trees item references its own item btree, bloom block, and
+ * radix allocators which are all queued to be checked.
+ */
+static void check_log_trees_item(struct fsck_info *fi, struct fsck_tree *tree,
+				 u64 blkno, void *key, unsigned key_len,
+				 void *val, unsigned val_len,
+				 struct pex_state *pex)
+{
+	struct scoutfs_log_trees_key *ltk = key;
+	struct scoutfs_log_trees_val *ltv = val;
+	struct fsck_tree *items;
+
+	items = alloc_tree(fi, &ltv->item_root, check_fs_item,
+			   sizeof(struct scoutfs_key_be), 0,
+			   "log tree rid %016llx nr %llu",
+			   be64_to_cpu(ltk->rid), be64_to_cpu(ltk->nr));
+	if (!items)
+		return;
+	items->log_items = true;
+
+	if (!fi->radix_only) {
+		queue_btree(fi, items);
+		queue_bloom(fi, items, &ltv->bloom_ref);
+	}
+	queue_radix(fi, items->name, &ltv->meta_avail, true);
+	queue_radix(fi, items->name, &ltv->meta_freed, true);
+	queue_radix(fi, items->name, &ltv->data_avail, false);
+	queue_radix(fi, items->name, &ltv->data_freed, false);
+}
+
+static void readahead_btree_children(struct block_cache *bc,
+				     struct scoutfs_btree_block *bt,
+				     unsigned nr)
+{
+	struct scoutfs_btree_item *item;
+	struct scoutfs_btree_ref *ref;
+	int i;
+
+	for (i = 0; i < nr; i++) {
+		item = (void *)bt + le32_to_cpu(bt->item_hdrs[i].off);
+		ref = (void *)(item + 1) + le16_to_cpu(item->key_len);
+		if (ref->blkno)
+			block_readahead(bc, le64_to_cpu(ref->blkno));
+	}
+}
+
+static void btree_worker(struct work *work);
+
+/*
+ * Check a btree block and all the blocks beneath it.  All of its keys
+ * must be greater than lo and less than or equal to hi, which come from
+ * the keys of the items in the parent that surround the ref to the
+ * block.  Parents at the top of the tree queue work for their children
+ * while lower parents walk their children directly.
+ */
+static void check_btree_block(struct fsck_info *fi, struct fsck_tree *tree,
+			      struct scoutfs_btree_ref *ref, u8 level,
+			      int fanout, void *lo, unsigned lo_len,
+			      void *hi, unsigned hi_len, struct pex_state *pex)
+{
+	struct scoutfs_btree_item *item;
+	struct scoutfs_btree_block *bt;
+	struct scoutfs_btree_ref *child;
+	struct btree_work *bw;
+	struct block *bl;
+	unsigned free_end;
+	unsigned key_len;
+	unsigned val_len;
+	unsigned prev_len;
+	unsigned off;
+	unsigned nr;
+	void *prev;
+	u64 blkno;
+	void *key;
+	void *val;
+	int i;
+
+	blkno = le64_to_cpu(ref->blkno);
+	if (!check_meta_blkno(fi, tree->name, blkno))
+		return;
+
+	bl = block_read(fi->bc, blkno);
+	if (!bl) {
+		problem(fi, "%s blkno %llu: read failed\n", tree->name, blkno);
+		return;
+	}
+	bt = block_data(bl);
+	count_block(fi);
+
+	if (!check_header(fi, tree->name, &bt->hdr, SCOUTFS_BLOCK_MAGIC_BTREE,
+			  blkno, le64_to_cpu(ref->seq)))
+		goto out;
+
+	if (bt->level != level) {
+		problem(fi, "%s blkno %llu: level %u != expected level %u\n",
+			tree->name, blkno, bt->level, level);
+		goto out;
+	}
+
+	nr = le32_to_cpu(bt->nr_items);
+	free_end = le32_to_cpu(bt->free_end);
+	if (nr == 0 ||
+	    offsetof(struct scoutfs_btree_block, item_hdrs[nr]) > free_end ||
+	    free_end > SCOUTFS_BLOCK_SIZE) {
+		problem(fi, "%s blkno %llu: nr_items %u and free_end %u are inconsistent\n",
+			tree->name, blkno, nr, free_end);
+		goto out;
+	}
+
+	/* make sure all the items are in the block before following refs */
+	for (i = 0; i < nr; i++) {
+		off = le32_to_cpu(bt->item_hdrs[i].off);
+		item = (void *)bt + off;
+		if (off < free_end || off + sizeof(*item) > SCOUTFS_BLOCK_SIZE ||
+		    off + sizeof(*item) + le16_to_cpu(item->key_len) +
+		    le16_to_cpu(item->val_len) > SCOUTFS_BLOCK_SIZE) {
+			problem(fi, "%s blkno %llu: item [%u] off %u outside of item space\n",
+				tree->name, blkno, i, off);
+			goto out;
+		}
+	}
+
+	if (level > 0)
+		readahead_btree_children(fi->bc, bt, nr);
+
+	prev = lo;
+	prev_len = lo_len;
+
+	for (i = 0; i < nr; i++) {
+		item = (void *)bt + le32_to_cpu(bt->item_hdrs[i].off);
+		key_len = le16_to_cpu(item->key_len);
+		val_len = le16_to_cpu(item->val_len);
+		key = (void *)(item + 1);
+		val = (void *)key + key_len;
+
+		if (key_len == 0 || key_len > SCOUTFS_BTREE_MAX_KEY_LEN ||
+		    (tree->key_len && key_len != tree->key_len)) {
+			problem(fi, "%s blkno %llu: item [%u] has invalid key_len %u\n",
+				tree->name, blkno, i, key_len);
+			continue;
+		}
+
+		if (prev && memcmp_lens(prev, prev_len, key, key_len) >= 0) {
+			problem(fi, "%s blkno %llu: item [%u] key isn't greater than %s\n",
+				tree->name, blkno, i,
+				i == 0 ? "parent's previous key" :
+					 "previous key");
+		}
+
+		if (hi && memcmp_lens(key, key_len, hi, hi_len) > 0) {
+			problem(fi, "%s blkno %llu: item [%u] key is greater than parent key\n",
+				tree->name, blkno, i);
+		}
+
+		if (level > 0) {
+			if (val_len != sizeof(struct scoutfs_btree_ref)) {
+				problem(fi, "%s blkno %llu: parent item [%u] val_len %u isn't a ref\n",
+					tree->name, blkno, i, val_len);
+				goto next;
+			}
+			child = val;
+
+			if (fanout > 0 && (bw = calloc(1, sizeof(*bw)))) {
+				work_init(&bw->work, btree_worker);
+				bw->fi = fi;
+				bw->tree = tree;
+				bw->ref = *child;
+				bw->level = level - 1;
+				bw->fanout = fanout - 1;
+				if (prev) {
+					bw->lo_len = prev_len;
+					memcpy(bw->lo, prev, prev_len);
+				}
+				bw->hi_len = key_len;
+				memcpy(bw->hi, key, key_len);
+				workq_queue(fi->wq, &bw->work);
+			} else {
+				check_btree_block(fi, tree, child, level - 1,
+						  0, prev, prev_len, key,
+						  key_len, pex);
+			}
+		} else {
+			if (tree->val_len && val_len != tree->val_len) {
+				problem(fi, "%s blkno %llu: item [%u] val_len %u != expected %u\n",
+					tree->name, blkno, i, val_len,
+					tree->val_len);
+				goto next;
+			}
+			count_item(fi);
+			if (tree->item_func)
+				tree->item_func(fi, tree, blkno, key, key_len,
+						val, val_len, pex);
+		}
+next:
+		prev = key;
+		prev_len = key_len;
+	}
+
+out:
+	block_put(fi->bc, bl);
+}
+
+static void btree_worker(struct work *work)
+{
+	struct btree_work *bw = container_of(work, struct btree_work, work);
+
+	check_btree_block(bw->fi, bw->tree, &bw->ref, bw->level, bw->fanout,
+			  bw->lo_len ? bw->lo : NULL, bw->lo_len,
+			  bw->hi_len ? bw->hi : NULL, bw->hi_len, &bw->pex);
+	free(bw);
+}
+
+static void queue_btree(struct fsck_info *fi, struct fsck_tree *tree)
+{
+	struct btree_work *bw;
+
+	if (tree->root.height == 0 && tree->root.ref.blkno == 0)
+		return;
+
+	if (tree->root.height == 0 || tree->root.height > SCOUTFS_BTREE_MAX_HEIGHT) {
+		problem(fi, "%s: invalid root height %u\n", tree->name,
+			tree->root.height);
+		return;
+	}
+
+	bw = calloc(1, sizeof(*bw));
+	if (!bw) {
+		problem(fi, "%s: failed to allocate work\n", tree->name);
+		return;
+	}
+
+	work_init(&bw->work, btree_worker);
+	bw->fi = fi;
+	bw->tree = tree;
+	bw->ref = tree->root.ref;
+	bw->level = tree->root.height - 1;
+	bw->fanout = FSCK_FANOUT_LEVELS;
+	workq_queue(fi->wq, &bw->work);
+}
+
+/*
+ * Free bits can only describe blocks in the device region that the
+ * allocator is managing.
+ */
+static void check_free_bits(struct fsck_info *fi, char *name, u64 blkno,
+			    bool meta, u64 first, u64 last, void *bits)
+{
+	struct scoutfs_super_block *super = &fi->super;
+	u64 lo;
+	u64 hi;
+	u64 bit;
+
+	lo = le64_to_cpu(meta ? super->first_meta_blkno :
+				super->first_data_blkno);
+	hi = le64_to_cpu(meta ? super->last_meta_blkno :
+				super->last_data_blkno);
+
+	if (first >= lo && last <= hi)
+		return;
+
+	/* full refs have all their bits set */
+	if (!bits) {
+		problem(fi, "%s radix full ref: free bits %llu - %llu outside of %s blknos %llu - %llu\n",
+			name, first, last, meta ? "meta" : "data", lo, hi);
+		return;
+	}
+
+	for (bit = first; bit <= last; bit++) {
+		if ((bit < lo || bit > hi) && test_bit_le(bit - first, bits)) {
+			problem(fi, "%s radix blkno %llu: free bit %llu outside of %s blknos %llu - %llu\n",
+				name, blkno, bit, meta ? "meta" : "data",
+				lo, hi);
+			break;
+		}
+	}
+}
+
+static void radix_worker(struct work *work);
+
+/*
+ * Check a ref to a radix block at the given level whose first bit is
+ * first_bit.  Empty and full refs describe whole subtrees without
+ * blocks.  Referenced blocks have their totals calculated from their
+ * contents and compared to the totals in the ref.  The first hints in
+ * blocks can be before the first set bits or refs but searches would
+ * miss free space if they were after them.
+ */
+static void check_radix_ref(struct fsck_info *fi, char *name,
+			    struct scoutfs_radix_ref *ref, int level,
+			    u64 first_bit, bool meta, int fanout)
+{
+	u64 full = radix_full_subtree_total(level);
+	struct scoutfs_radix_block *rdx;
+	struct radix_totals tot;
+	struct radix_work *rw;
+	struct block *bl;
+	u64 blkno;
+	u64 sm;
+	int i;
+
+	blkno = le64_to_cpu(ref->blkno);
+
+	if (blkno == 0 || blkno == U64_MAX) {
+		sm = blkno ? full : 0;
+		if (le64_to_cpu(ref->sm_total) != sm ||
+		    le64_to_cpu(ref->lg_total) != sm)
+			problem(fi, "%s radix %s ref at bit %llu level %u: sm_total %llu lg_total %llu != %llu\n",
+				name, blkno ? "full" : "empty", first_bit,
+				level, le64_to_cpu(ref->sm_total),
+				le64_to_cpu(ref->lg_total), sm);
+		if (blkno)
+			check_free_bits(fi, name, blkno, meta, first_bit,
+					first_bit + full - 1, NULL);
+		return;
+	}
+
+	if (!check_meta_blkno(fi, name, blkno))
+		return;
+
+	bl = block_read(fi->bc, blkno);
+	if (!bl) {
+		problem(fi, "%s radix blkno %llu: read failed\n", name, blkno);
+		return;
+	}
+	rdx = block_data(bl);
+	count_block(fi);
+
+	if (!check_header(fi, name, &rdx->hdr, SCOUTFS_BLOCK_MAGIC_RADIX,
+			  blkno, le64_to_cpu(ref->seq)))
+		goto out;
+
+	if (level == 0) {
+		radix_leaf_totals(rdx, &tot);
+		check_free_bits(fi, name, blkno, meta, first_bit,
+				first_bit + SCOUTFS_RADIX_BITS - 1, rdx->bits);
+	} else {
+		radix_parent_totals(rdx, &tot);
+	}
+
+	if (le64_to_cpu(ref->sm_total) != tot.sm_total ||
+	    le64_to_cpu(ref->lg_total) != tot.lg_total)
+		problem(fi, "%s radix blkno %llu: ref sm_total %llu lg_total %llu != calculated %llu %llu\n",
+			name, blkno, le64_to_cpu(ref->sm_total),
+			le64_to_cpu(ref->lg_total), tot.sm_total,
+			tot.lg_total);
+
+	if (le32_to_cpu(rdx->sm_first) > tot.sm_first ||
+	    le32_to_cpu(rdx->lg_first) > tot.lg_first)
+		problem(fi, "%s radix blkno %llu: sm_first %u lg_first %u after first set %s %u %u\n",
+			name, blkno, le32_to_cpu(rdx->sm_first),
+			le32_to_cpu(rdx->lg_first),
+			level == 0 ? "bits" : "refs", tot.sm_first,
+			tot.lg_first);
+
+	if (level == 0)
+		goto out;
+
+	if (level > 1) {
+		for (i = 0; i < SCOUTFS_RADIX_REFS; i++) {
+			blkno = le64_to_cpu(rdx->refs[i].blkno);
+			if (blkno != 0 && blkno != U64_MAX)
+				block_readahead(fi->bc, blkno);
+		}
+	}
+
+	full = radix_full_subtree_total(level - 1);
+	for (i = 0; i < SCOUTFS_RADIX_REFS; i++) {
+		if (fanout > 0 && (blkno = le64_to_cpu(rdx->refs[i].blkno)) &&
+		    blkno != U64_MAX && (rw = calloc(1, sizeof(*rw)))) {
+			work_init(&rw->work, radix_worker);
+			rw->fi = fi;
+			rw->name = name;
+			rw->ref = rdx->refs[i];
+			rw->level = level - 1;
+			rw->first_bit = first_bit + (i * full);
+			rw->meta = meta;
+			rw->fanout = fanout - 1;
+			workq_queue(fi->wq, &rw->work);
+		} else {
+			check_radix_ref(fi, name, &rdx->refs[i], level - 1,
+					first_bit + (i * full), meta, 0);
+		}
+	}
+
+out:
+	block_put(fi->bc, bl);
+}
+
+static void radix_worker(struct work *work)
+{
+	struct radix_work *rw = container_of(work, struct radix_work, work);
+
+	check_radix_ref(rw->fi, rw->name, &rw->ref, rw->level, rw->first_bit,
+			rw->meta, rw->fanout);
+	free(rw);
+}
+
+static void queue_radix(struct fsck_info *fi, char *name,
+			struct scoutfs_radix_root *root, bool meta)
+{
+	struct radix_work *rw;
+
+	if (root->height == 0) {
+		if (root->ref.blkno)
+			problem(fi, "%s: radix root with height 0 has blkno %llu\n",
+				name, le64_to_cpu(root->ref.blkno));
+		return;
+	}
+
+	rw = calloc(1, sizeof(*rw));
+	if (!rw) {
+		problem(fi, "%s: failed to allocate work\n", name);
+		return;
+	}
+
+	work_init(&rw->work, radix_worker);
+	rw->fi = fi;
+	rw->name = name;
+	rw->ref = root->ref;
+	rw->level = root->height - 1;
+	rw->first_bit = 0;
+	rw->meta = meta;
+	rw->fanout = FSCK_FANOUT_LEVELS;
+	workq_queue(fi->wq, &rw->work);
+}
+
+/* bloom blocks are small enough that they're checked inline */
+static void queue_bloom(struct fsck_info *fi, struct fsck_tree *tree,
+			struct scoutfs_btree_ref *ref)
+{
+	struct scoutfs_bloom_block *bb;
+	struct block *bl;
+	u64 blkno;
+	u64 total;
+
+	blkno = le64_to_cpu(ref->blkno);
+	if (blkno == 0 || !check_meta_blkno(fi, tree->name, blkno))
+		return;
+
+	bl = block_read(fi->bc, blkno);
+	if (!bl) {
+		problem(fi, "%s bloom blkno %llu: read failed\n",
+			tree->name, blkno);
+		return;
+	}
+	bb = block_data(bl);
+	count_block(fi);
+
+	if (check_header(fi, tree->name, &bb->hdr, SCOUTFS_BLOCK_MAGIC_BLOOM,
+			 blkno, le64_to_cpu(ref->seq))) {
+		total = popcount_words(bb->bits,
+				       SCOUTFS_FOREST_BLOOM_BITS / 64);
+		if (le64_to_cpu(bb->total_set) != total)
+			problem(fi, "%s bloom blkno %llu: total_set %llu != %llu set bits\n",
+				tree->name, blkno,
+				le64_to_cpu(bb->total_set), total);
+	}
+
+	block_put(fi->bc, bl);
+}
+
+/*
+ * Gather the radix roots in the log trees items so that referenced
+ * blocks can be checked against all the free bits.  The logs_root
+ * btree is walked without checking, damage will be reported when it's
+ * checked.
+ */
+static int gather_free_roots(struct fsck_info *fi,
+			     struct scoutfs_btree_ref *ref, int depth)
+{
+	struct scoutfs_log_trees_val *ltv;
+	struct scoutfs_radix_root *roots;
+	struct scoutfs_btree_item *item;
+	struct scoutfs_btree_block *bt;
+	struct block *bl;
+	unsigned off;
+	unsigned nr;
+	void *val;
+	int ret = 0;
+	int i;
+
+	if (ref->blkno == 0 || depth > SCOUTFS_BTREE_MAX_HEIGHT)
+		return 0;
+
+	bl = block_read(fi->bc, le64_to_cpu(ref->blkno));
+	if (!bl)
+		return -EIO;
+	bt = block_data(bl);
+
+	if (le32_to_cpu(bt->hdr.magic) != SCOUTFS_BLOCK_MAGIC_BTREE)
+		goto out;
+
+	nr = le32_to_cpu(bt->nr_items);
+	if (offsetof(struct scoutfs_btree_block, item_hdrs[nr]) >
+	    SCOUTFS_BLOCK_SIZE)
+		goto out;
+
+	for (i = 0; i < nr; i++) {
+		off = le32_to_cpu(bt->item_hdrs[i].off);
+		item = (void *)bt + off;
+		if (off + sizeof(*item) > SCOUTFS_BLOCK_SIZE ||
+		    off + sizeof(*item) + le16_to_cpu(item->key_len) +
+		    le16_to_cpu(item->val_len) > SCOUTFS_BLOCK_SIZE)
+			break;
+		val = (void *)(item + 1) + le16_to_cpu(item->key_len);
+
+		if (bt->level > 0) {
+			if (le16_to_cpu(item->val_len) !=
+			    sizeof(struct scoutfs_btree_ref))
+				continue;
+			ret = gather_free_roots(fi, val, depth + 1);
+			if (ret < 0)
+				break;
+			continue;
+		}
+
+		if (le16_to_cpu(item->val_len) != sizeof(*ltv))
+			continue;
+		ltv = val;
+
+		roots = realloc(fi->meta_free, (fi->nr_meta_free + 2) *
+					       sizeof(roots[0]));
+		if (!roots) {
+			ret = -ENOMEM;
+			break;
+		}
+		fi->meta_free = roots;
+		roots[fi->nr_meta_free++] = ltv->meta_avail;
+		roots[fi->nr_meta_free++] = ltv->meta_freed;
+
+		roots = realloc(fi->data_free, (fi->nr_data_free + 2) *
+					       sizeof(roots[0]));
+		if (!roots) {
+			ret = -ENOMEM;
+			break;
+		}
+		fi->data_free = roots;
+		roots[fi->nr_data_free++] = ltv->data_avail;
+		roots[fi->nr_data_free++] = ltv->data_freed;
+	}
+
+out:
+	block_put(fi->bc, bl);
+	return ret;
+}
+
+/*
+ * The super block is the root of everything so we stop if it doesn't
+ * look like a super block that we understand.
+ */
+static int check_super(struct fsck_info *fi)
+{
+	struct scoutfs_super_block *super = &fi->super;
+	struct block *bl;
+	u32 crc;
+
+	bl = block_read(fi->bc, SCOUTFS_SUPER_BLKNO);
+	if (!bl)
+		return -EIO;
+	memcpy(super, block_data(bl), sizeof(*super));
+	crc = crc_block(block_data(bl));
+	block_put(fi->bc, bl);
+	count_block(fi);
+
+	if (le32_to_cpu(super->hdr.magic) != SCOUTFS_BLOCK_MAGIC_SUPER) {
+		fprintf(stderr, "super block magic %08x != expected %08x\n",
+			le32_to_cpu(super->hdr.magic),
+			SCOUTFS_BLOCK_MAGIC_SUPER);
+		return -EIO;
+	}
+
+	if (le64_to_cpu(super->format_hash) != SCOUTFS_FORMAT_HASH) {
+		fprintf(stderr, "super block format_hash %llx != expected %llx\n",
+			le64_to_cpu(super->format_hash),
+			SCOUTFS_FORMAT_HASH);
+		return -EIO;
+	}
+
+	if (crc != le32_to_cpu(super->hdr.crc))
+		problem(fi, "super blkno %llu: crc %08x != calculated %08x\n",
+			SCOUTFS_SUPER_BLKNO, le32_to_cpu(super->hdr.crc), crc);
+
+	if (le64_to_cpu(super->hdr.blkno) != SCOUTFS_SUPER_BLKNO)
+		problem(fi, "super blkno %llu: header blkno %llu doesn't match\n",
+			SCOUTFS_SUPER_BLKNO, le64_to_cpu(super->hdr.blkno));
+
+	if (le64_to_cpu(super->first_meta_blkno) >
+	    le64_to_cpu(super->last_meta_blkno) ||
+	    le64_to_cpu(super->last_meta_blkno) >=
+	    le64_to_cpu(super->first_data_blkno) ||
+	    le64_to_cpu(super->first_data_blkno) >
+	    le64_to_cpu(super->last_data_blkno))
+		problem(fi, "super: meta blknos %llu - %llu and data blknos %llu - %llu are inconsistent\n",
+			le64_to_cpu(super->first_meta_blkno),
+			le64_to_cpu(super->last_meta_blkno),
+			le64_to_cpu(super->first_data_blkno),
+			le64_to_cpu(super->last_data_blkno));
+
+	return 0;
+}
+
+/* quorum blocks are only written once a mount has voted */
+static void check_quorum_blocks(struct fsck_info *fi)
+{
+	struct scoutfs_quorum_block *blk;
+	struct block *bl;
+	u64 blkno;
+	int i;
+
+	for (i = 0; i < SCOUTFS_QUORUM_BLOCKS; i++) {
+		blkno = SCOUTFS_QUORUM_BLKNO + i;
+		bl = block_read(fi->bc, blkno);
+		if (!bl) {
+			problem(fi, "quorum blkno %llu: read failed\n", blkno);
+			continue;
+		}
+		blk = block_data(bl);
+		count_block(fi);
+
+		if (blk->voter_rid != 0) {
+			if (blk->fsid != fi->super.hdr.fsid)
+				problem(fi, "quorum blkno %llu: fsid %llx != super fsid %llx\n",
+					blkno, le64_to_cpu(blk->fsid),
+					le64_to_cpu(fi->super.hdr.fsid));
+			if (le64_to_cpu(blk->blkno) != blkno)
+				problem(fi, "quorum blkno %llu: header blkno %llu doesn't match\n",
+					blkno, le64_to_cpu(blk->blkno));
+			if (blk->log_nr > SCOUTFS_QUORUM_LOG_MAX)
+				problem(fi, "quorum blkno %llu: log_nr %u greater than max %u\n",
+					blkno, blk->log_nr,
+					SCOUTFS_QUORUM_LOG_MAX);
+		}
+
+		block_put(fi->bc, bl);
+	}
+}
+
+static int fsck_volume(struct fsck_info *fi)
+{
+	struct scoutfs_super_block *super = &fi->super;
+	struct {
+		char *name;
+		struct scoutfs_btree_root *root;
+		fsck_item_func item_func;
+		unsigned key_len;
+		unsigned val_len;
+	} *bt, btrees[] = {
+		{ "fs_root", &super->fs_root, check_fs_item,
+		  sizeof(struct scoutfs_key_be), 0 },
+		{ "logs_root", &super->logs_root, check_log_trees_item,
+		  sizeof(struct scoutfs_log_trees_key),
+		  sizeof(struct scoutfs_log_trees_val) },
+		{ "lock_clients", &super->lock_clients, NULL,
+		  sizeof(struct scoutfs_lock_client_btree_key), 0 },
+		{ "trans_seqs", &super->trans_seqs, NULL,
+		  sizeof(struct scoutfs_trans_seq_btree_key), 0 },
+		{ "mounted_clients", &super->mounted_clients, NULL,
+		  sizeof(struct scoutfs_mounted_client_btree_key),
+		  sizeof(struct scoutfs_mounted_client_btree_val) },
+	};
+	struct fsck_tree *tree;
+	struct scoutfs_radix_root *roots;
+	int ret;
+
+	ret = check_super(fi);
+	if (ret)
+		return ret;
+
+	check_quorum_blocks(fi);
+
+	/* the core allocators are free space along with all the logs' */
+	fi->meta_free = malloc(2 * sizeof(roots[0]));
+	fi->data_free = malloc(2 * sizeof(roots[0]));
+	if (!fi->meta_free || !fi->data_free)
+		return -ENOMEM;
+	fi->meta_free[0] = super->core_meta_avail;
+	fi->meta_free[1] = super->core_meta_freed;
+	fi->data_free[0] = super->core_data_avail;
+	fi->data_free[1] = super->core_data_freed;
+	fi->nr_meta_free = 2;
+	fi->nr_data_free = 2;
+
+	ret = gather_free_roots(fi, &super->logs_root.ref, 0);
+	if (ret < 0) {
+		fprintf(stderr, "error gathering log trees allocators: %s (%d)\n",
+			strerror(-ret), -ret);
+		return ret;
+	}
+
+	queue_radix(fi, "core_meta_avail", &super->core_meta_avail, true);
+	queue_radix(fi, "core_meta_freed", &super->core_meta_freed, true);
+	queue_radix(fi, "core_data_avail", &super->core_data_avail, false);
+	queue_radix(fi, "core_data_freed", &super->core_data_freed, false);
+
+	for (bt = btrees; bt < btrees + array_size(btrees); bt++) {
+		if (fi->radix_only && bt->root != &super->logs_root)
+			continue;
+		tree = alloc_tree(fi, bt->root, bt->item_func, bt->key_len,
+				  bt->val_len, "%s", bt->name);
+		if (tree)
+			queue_btree(fi, tree);
+	}
+
+	workq_wait(fi->wq);
+
+	return 0;
+}
+
+static struct option long_ops[] = {
+	{ "mmap", 0, NULL, 'm' },
+	{ "radix", 0, NULL, 'r' },
+	{ "threads", 1, NULL, 't' },
+	{ NULL, 0, NULL, 0}
+};
+
+static int fsck_cmd(int argc, char **argv)
+{
+	struct fsck_info fi = {
+		.trees = LIST_HEAD_INIT(fi.trees),
+	};
+	struct fsck_tree *tree;
+	struct fsck_tree *tmp;
+	bool use_mmap = false;
+	int nr_threads = 0;
+	char *path;
+	int ret;
+	int fd;
+	int c;
+
+	while ((c = getopt_long(argc, argv, "mrt:", long_ops, NULL)) != -1) {
+		switch (c) {
+		case 'm':
+			use_mmap = true;
+			break;
+		case 'r':
+			fi.radix_only = true;
+			break;
+		case 't':
+			ret = parse_threads(optarg, &nr_threads);
+			if (ret)
+				return ret;
+			break;
+		case '?':
+		default:
+			return -EINVAL;
+		}
+	}
+
+	if (optind != argc - 1) {
+		printf("scoutfs fsck: a single path argument is required\n");
+		return -EINVAL;
+	}
+	path = argv[optind];
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		ret = -errno;
+		fprintf(stderr, "failed to open '%s': %s (%d)\n",
+			path, strerror(errno), errno);
+		return ret;
+	}
+
+	if (nr_threads == 0)
+		nr_threads = workq_nr_threads();
+
+	pthread_mutex_init(&fi.mutex, NULL);
+	fi.bc = block_cache_open(path, fd, use_mmap);
+	fi.wq = workq_create(nr_threads);
+	if (!fi.bc || !fi.wq) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	ret = fsck_volume(&fi);
+	if (ret == 0) {
+		printf("checked %llu blocks and %llu items, found %llu problems\n",
+		       fi.blocks, fi.items, fi.problems);
+		if (fi.problems)
+			ret = -EIO;
+	}
+
+out:
+	workq_destroy(fi.wq);
+	list_for_each_entry_safe(tree, tmp, &fi.trees, head) {
+		list_del(&tree->head);
+		free(tree);
+	}
+	free(fi.meta_free);
+	free(fi.data_free);
+	if (fi.bc)
+		block_cache_destroy(fi.bc);
+	pthread_mutex_destroy(&fi.mutex);
+	close(fd);
+	return ret;
+}
+
+static void __attribute__((constructor)) fsck_ctor(void)
+{
+	cmd_register("fsck", "[--mmap] [--radix] [--threads nr] <device>",
+		     "check metadata structures for consistency", fsck_cmd);
+}
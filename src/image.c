@@ -0,0 +1,1277 @@
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <stdarg.h>
+#include <getopt.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <zlib.h>
+
+#include "sparse.h"
+#include "util.h"
+#include "format.h"
+#include "cmd.h"
+#include "parse.h"
+#include "crc.h"
+#include "bitmap.h"
+#include "block.h"
+#include "workq.h"
+#include "dev.h"
+#include "list.h"
+
+/*
+ * image copies all the metadata blocks that are referenced by the super
+ * block of an unmounted volume into a sparse file at their original
+ * offsets.  The resulting file is the size of the device and can be
+ * read by print and fsck, or shipped somewhere to be analyzed, without
+ * having to copy the device's unreferenced or data blocks.
+ *
+ * The copy is done in two passes.  First the trees are walked by a
+ * pool of threads to mark all the referenced blocks in a bitmap.  Only
+ * parent blocks and log trees leaves are read, the leaves of all the
+ * other trees are marked from their parent refs.  Then regions of the
+ * bitmap are copied by the threads with large reads and writes of each
+ * contiguous run of marked blocks.
+ *
+ * Blocks are never overwritten and a ref's seq is the transaction seq
+ * that wrote the block it references.  A block can only be written
+ * after its children so an incremental image of the blocks written
+ * after a given seq can prune the walk at every ref with an older seq.
+ * Written over a full image of the volume taken at that seq, it
+ * results in an image of the current volume.
+ *
+ * The walk doesn't verify the metadata, that's fsck's job.  Blocks
+ * that don't look like what their refs expect are warned about and not
+ * followed but the rest of the image is still written.
+ */
+
+/* the top levels of trees that queue work for each of their children */
+#define IMAGE_FANOUT_LEVELS 2
+
+/* each copy work copies marked blocks in a 64MB region of the device */
+#define IMAGE_REGION_BLOCKS (16 * 1024)
+
+/* and reads and writes contiguous runs of up to 1MB */
+#define IMAGE_RUN_BLOCKS 256
+
+struct image_info {
+	struct block_cache *bc;
+	struct workq *wq;
+	int nr_threads;
+	int dev_fd;
+	int img_fd;
+	struct scoutfs_super_block super;
+	u64 since_seq;
+
+	/* a bit for every metadata blkno that's referenced */
+	unsigned long *bits;
+	u64 nr_bits;
+
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	int in_flight;
+	u64 blocks;
+	u64 warnings;
+	int err;
+};
+
+struct btree_work {
+	struct work work;
+	struct image_info *ii;
+	struct scoutfs_btree_ref ref;
+	u8 level;
+	bool log_trees;
+	int fanout;
+};
+
+struct radix_work {
+	struct work work;
+	struct image_info *ii;
+	struct scoutfs_radix_ref ref;
+	int level;
+	int fanout;
+};
+
+struct copy_work {
+	struct work work;
+	struct image_info *ii;
+	u64 start;
+	u64 end;
+};
+
+static void warn(struct image_info *ii, char *fmt, ...)
+{
+	va_list args;
+
+	pthread_mutex_lock(&ii->mutex);
+	ii->warnings++;
+	va_start(args, fmt);
+	vfprintf(stderr, fmt, args);
+	va_end(args);
+	pthread_mutex_unlock(&ii->mutex);
+}
+
+/* the first error stops copying and is returned by the command */
+static void set_error(struct image_info *ii, int err)
+{
+	pthread_mutex_lock(&ii->mutex);
+	if (!ii->err)
+		ii->err = err;
+	pthread_mutex_unlock(&ii->mutex);
+}
+
+static int get_error(struct image_info *ii)
+{
+	return __atomic_load_n(&ii->err, __ATOMIC_RELAXED);
+}
+
+/*
+ * Mark a block as referenced, returning true if it wasn't already
+ * marked so that callers only walk each block once.
+ */
+static bool mark_block(struct image_info *ii, char *what, u64 blkno)
+{
+	unsigned long mask = 1UL << (blkno & (BITS_PER_LONG - 1));
+	unsigned long *word;
+
+	if (blkno >= ii->nr_bits) {
+		warn(ii, "%s blkno %llu is outside of the metadata device\n",
+		     what, blkno);
+		return false;
+	}
+
+	word = &ii->bits[blkno / BITS_PER_LONG];
+	return !(__atomic_fetch_or(word, mask, __ATOMIC_RELAXED) & mask);
+}
+
+static bool marked(struct image_info *ii, u64 blkno)
+{
+	return !!(ii->bits[blkno / BITS_PER_LONG] &
+		  (1UL << (blkno & (BITS_PER_LONG - 1))));
+}
+
+/* refs to blocks written before an incremental image's seq are skipped */
+static bool older(struct image_info *ii, __le64 seq)
+{
+	return le64_to_cpu(seq) <= ii->since_seq;
+}
+
+static void queue_btree(struct image_info *ii, struct scoutfs_btree_root *root,
+			bool log_trees);
+static void queue_radix(struct image_info *ii,
+			struct scoutfs_radix_root *root);
+static void btree_worker(struct work *work);
+
+/* each log trees item references its trees, bloom, and allocators */
+static void mark_log_trees(struct image_info *ii,
+			   struct scoutfs_log_trees_val *ltv)
+{
+	u64 blkno;
+
+	queue_btree(ii, &ltv->item_root, false);
+
+	blkno = le64_to_cpu(ltv->bloom_ref.blkno);
+	if (blkno && !older(ii, ltv->bloom_ref.seq))
+		mark_block(ii, "bloom", blkno);
+
+	queue_radix(ii, &ltv->meta_avail);
+	queue_radix(ii, &ltv->meta_freed);
+	queue_radix(ii, &ltv->data_avail);
+	queue_radix(ii, &ltv->data_freed);
+}
+
+/*
+ * Mark a btree block and everything beneath it.  Leaf blocks are only
+ * read in the logs_root tree to find the log trees that they reference.
+ */
+static void walk_btree(struct image_info *ii, struct scoutfs_btree_ref *ref,
+		       u8 level, bool log_trees, int fanout)
+{
+	struct scoutfs_btree_item *item;
+	struct scoutfs_btree_block *bt;
+	struct scoutfs_btree_ref *child;
+	struct btree_work *bw;
+	struct block *bl;
+	unsigned off;
+	unsigned nr;
+	u64 blkno;
+	void *val;
+	int i;
+
+	blkno = le64_to_cpu(ref->blkno);
+	if (older(ii, ref->seq) || !mark_block(ii, "btree", blkno) ||
+	    (level == 0 && !log_trees))
+		return;
+
+	bl = block_read(ii->bc, blkno);
+	if (!bl) {
+		set_error(ii, -EIO);
+		return;
+	}
+	bt = block_data(bl);
+
+	nr = le32_to_cpu(bt->nr_items);
+	if (le32_to_cpu(bt->hdr.magic) != SCOUTFS_BLOCK_MAGIC_BTREE ||
+	    le64_to_cpu(bt->hdr.blkno) != blkno || bt->level != level ||
+	    offsetof(struct scoutfs_btree_block, item_hdrs[nr]) >
+	    SCOUTFS_BLOCK_SIZE) {
+		warn(ii, "btree blkno %llu: unexpected header, not following its refs\n",
+		     blkno);
+		goto out;
+	}
+
+	/* only use the items before the first that isn't in the block */
+	for (i = 0; i < nr; i++) {
+		off = le32_to_cpu(bt->item_hdrs[i].off);
+		item = (void *)bt + off;
+		if (off + sizeof(*item) > SCOUTFS_BLOCK_SIZE ||
+		    off + sizeof(*item) + le16_to_cpu(item->key_len) +
+		    le16_to_cpu(item->val_len) > SCOUTFS_BLOCK_SIZE) {
+			warn(ii, "btree blkno %llu: item [%u] outside of block\n",
+			     blkno, i);
+			nr = i;
+			break;
+		}
+	}
+
+	/* leaves beneath level 1 are marked without being read */
+	for (i = 0; i < nr && (level > 1 || (level == 1 && log_trees)); i++) {
+		item = (void *)bt + le32_to_cpu(bt->item_hdrs[i].off);
+		if (le16_to_cpu(item->val_len) != sizeof(*child))
+			continue;
+		child = (void *)(item + 1) + le16_to_cpu(item->key_len);
+		if (!older(ii, child->seq))
+			block_readahead(ii->bc, le64_to_cpu(child->blkno));
+	}
+
+	for (i = 0; i < nr; i++) {
+		item = (void *)bt + le32_to_cpu(bt->item_hdrs[i].off);
+		val = (void *)(item + 1) + le16_to_cpu(item->key_len);
+
+		if (level == 0) {
+			if (le16_to_cpu(item->val_len) ==
+			    sizeof(struct scoutfs_log_trees_val))
+				mark_log_trees(ii, val);
+			continue;
+		}
+
+		if (le16_to_cpu(item->val_len) != sizeof(*child))
+			continue;
+		child = val;
+
+		if (fanout > 0 && (bw = calloc(1, sizeof(*bw)))) {
+			work_init(&bw->work, btree_worker);
+			bw->ii = ii;
+			bw->ref = *child;
+			bw->level = level - 1;
+			bw->log_trees = log_trees;
+			bw->fanout = fanout - 1;
+			workq_queue(ii->wq, &bw->work);
+		} else {
+			walk_btree(ii, child, level - 1, log_trees, 0);
+		}
+	}
+
+out:
+	block_put(ii->bc, bl);
+}
+
+static void btree_worker(struct work *work)
+{
+	struct btree_work *bw = container_of(work, struct btree_work, work);
+
+	walk_btree(bw->ii, &bw->ref, bw->level, bw->log_trees, bw->fanout);
+	free(bw);
+}
+
+static void queue_btree(struct image_info *ii, struct scoutfs_btree_root *root,
+			bool log_trees)
+{
+	struct btree_work *bw;
+
+	if (root->height == 0 || root->ref.blkno == 0)
+		return;
+
+	bw = calloc(1, sizeof(*bw));
+	if (!bw) {
+		set_error(ii, -ENOMEM);
+		return;
+	}
+
+	work_init(&bw->work, btree_worker);
+	bw->ii = ii;
+	bw->ref = root->ref;
+	bw->level = root->height - 1;
+	bw->log_trees = log_trees;
+	bw->fanout = IMAGE_FANOUT_LEVELS;
+	workq_queue(ii->wq, &bw->work);
+}
+
+static void radix_worker(struct work *work);
+
+/*
+ * Mark a radix block and all the blocks beneath it.  Empty and full
+ * refs don't have blocks and leaves are marked without being read.
+ */
+static void walk_radix(struct image_info *ii, struct scoutfs_radix_ref *ref,
+		       int level, int fanout)
+{
+	struct scoutfs_radix_block *rdx;
+	struct radix_work *rw;
+	struct block *bl;
+	u64 blkno;
+	int i;
+
+	blkno = le64_to_cpu(ref->blkno);
+	if (blkno == 0 || blkno == U64_MAX || older(ii, ref->seq) ||
+	    !mark_block(ii, "radix", blkno) || level == 0)
+		return;
+
+	bl = block_read(ii->bc, blkno);
+	if (!bl) {
+		set_error(ii, -EIO);
+		return;
+	}
+	rdx = block_data(bl);
+
+	if (le32_to_cpu(rdx->hdr.magic) != SCOUTFS_BLOCK_MAGIC_RADIX ||
+	    le64_to_cpu(rdx->hdr.blkno) != blkno) {
+		warn(ii, "radix blkno %llu: unexpected header, not following its refs\n",
+		     blkno);
+		goto out;
+	}
+
+	for (i = 0; i < SCOUTFS_RADIX_REFS && level > 1; i++) {
+		blkno = le64_to_cpu(rdx->refs[i].blkno);
+		if (blkno != 0 && blkno != U64_MAX &&
+		    !older(ii, rdx->refs[i].seq))
+			block_readahead(ii->bc, blkno);
+	}
+
+	for (i = 0; i < SCOUTFS_RADIX_REFS; i++) {
+		blkno = le64_to_cpu(rdx->refs[i].blkno);
+		if (blkno == 0 || blkno == U64_MAX)
+			continue;
+
+		if (level > 1 && fanout > 0 && (rw = calloc(1, sizeof(*rw)))) {
+			work_init(&rw->work, radix_worker);
+			rw->ii = ii;
+			rw->ref = rdx->refs[i];
+			rw->level = level - 1;
+			rw->fanout = fanout - 1;
+			workq_queue(ii->wq, &rw->work);
+		} else {
+			walk_radix(ii, &rdx->refs[i], level - 1, 0);
+		}
+	}
+
+out:
+	block_put(ii->bc, bl);
+}
+
+static void radix_worker(struct work *work)
+{
+	struct radix_work *rw = container_of(work, struct radix_work, work);
+
+	walk_radix(rw->ii, &rw->ref, rw->level, rw->fanout);
+	free(rw);
+}
+
+static void queue_radix(struct image_info *ii, struct scoutfs_radix_root *root)
+{
+	struct radix_work *rw;
+
+	if (root->height == 0)
+		return;
+
+	rw = calloc(1, sizeof(*rw));
+	if (!rw) {
+		set_error(ii, -ENOMEM);
+		return;
+	}
+
+	work_init(&rw->work, radix_worker);
+	rw->ii = ii;
+	rw->ref = root->ref;
+	rw->level = root->height - 1;
+	rw->fanout = IMAGE_FANOUT_LEVELS;
+	workq_queue(ii->wq, &rw->work);
+}
+
+static int read_blocks(int fd, void *buf, u64 blkno, u64 nr)
+{
+	int ret;
+
+	ret = rw_full(fd, buf, nr << SCOUTFS_BLOCK_SHIFT,
+		      blkno << SCOUTFS_BLOCK_SHIFT, false);
+	if (ret < 0)
+		fprintf(stderr, "read blkno %llu failed: %s (%d)\n",
+			blkno, strerror(-ret), -ret);
+	return ret;
+}
+
+static int write_blocks(int fd, void *buf, u64 blkno, u64 nr)
+{
+	int ret;
+
+	ret = rw_full(fd, buf, nr << SCOUTFS_BLOCK_SHIFT,
+		      blkno << SCOUTFS_BLOCK_SHIFT, true);
+	if (ret < 0)
+		fprintf(stderr, "write blkno %llu failed: %s (%d)\n",
+			blkno, strerror(-ret), -ret);
+	return ret;
+}
+
+/* copy each contiguous run of marked blocks in a region */
+static void copy_worker(struct work *work)
+{
+	struct copy_work *cw = container_of(work, struct copy_work, work);
+	struct image_info *ii = cw->ii;
+	void *buf;
+	u64 blkno;
+	u64 nr;
+	int ret;
+
+	buf = malloc(IMAGE_RUN_BLOCKS << SCOUTFS_BLOCK_SHIFT);
+	if (!buf) {
+		set_error(ii, -ENOMEM);
+		goto out;
+	}
+
+	blkno = cw->start;
+	while (!get_error(ii) &&
+	       (blkno = find_next_set_bit(ii->bits, blkno, cw->end)) < cw->end) {
+		for (nr = 1; nr < IMAGE_RUN_BLOCKS && blkno + nr < cw->end &&
+			     marked(ii, blkno + nr); nr++)
+			;
+
+		ret = read_blocks(ii->dev_fd, buf, blkno, nr) ?:
+		      write_blocks(ii->img_fd, buf, blkno, nr);
+		if (ret < 0)
+			set_error(ii, ret);
+		else
+			__atomic_add_fetch(&ii->blocks, nr, __ATOMIC_RELAXED);
+		blkno += nr;
+	}
+
+out:
+	free(buf);
+	free(cw);
+}
+
+static int copy_marked(struct image_info *ii, u64 size)
+{
+	struct copy_work *cw;
+	u64 start;
+	int ret;
+
+	/* the image is the size of the device, unwritten blocks are holes */
+	if (ftruncate(ii->img_fd, size)) {
+		ret = -errno;
+		fprintf(stderr, "failed to set image size to %llu: %s (%d)\n",
+			size, strerror(errno), errno);
+		return ret;
+	}
+
+	for (start = 0; start < ii->nr_bits; start += IMAGE_REGION_BLOCKS) {
+		cw = calloc(1, sizeof(*cw));
+		if (!cw)
+			return -ENOMEM;
+
+		work_init(&cw->work, copy_worker);
+		cw->ii = ii;
+		cw->start = start;
+		cw->end = min(start + IMAGE_REGION_BLOCKS, ii->nr_bits);
+		workq_queue(ii->wq, &cw->work);
+	}
+
+	workq_wait(ii->wq);
+	return get_error(ii);
+}
+
+/*
+ * The compressed stream starts with a header that describes the
+ * volume.  It's followed by chunks that each contain the blknos and
+ * then the contents of up to IMAGE_CHUNK_BLOCKS blocks, compressed with
+ * zlib.  Chunks are compressed independently so they can be compressed
+ * and restored in parallel.  Blocks are in blkno order and a chunk with
+ * no blocks ends the stream so that truncated streams are noticed.
+ */
+#define IMAGE_STREAM_MAGIC	0x4d49534654554f53ULL	/* "SOUTFSIM" */
+#define IMAGE_STREAM_VERSION	1
+#define IMAGE_CHUNK_MAGIC	0x4b4e4843		/* "CHNK" */
+#define IMAGE_CHUNK_BLOCKS	256
+
+struct image_stream_header {
+	__le64 magic;
+	__le32 version;
+	__le32 block_size;
+	__le64 fsid;
+	__le64 device_size;
+	__le64 last_meta_blkno;
+	__le64 nr_blocks;
+	__le64 since_seq;
+} __packed;
+
+struct image_chunk_header {
+	__le32 magic;
+	__le32 nr_blocks;
+	__le32 comp_len;
+	__le32 comp_crc;
+} __packed;
+
+static size_t chunk_raw_len(u64 nr)
+{
+	return nr * (sizeof(__le64) + SCOUTFS_BLOCK_SIZE);
+}
+
+/*
+ * Each chunk is read and compressed by a worker.  The chunks are
+ * written to the stream in order as the oldest chunk finishes.
+ */
+struct chunk_work {
+	struct work work;
+	struct list_head head;
+	struct image_info *ii;
+	u64 start;
+	u64 nr;
+	void *comp;
+	uLongf comp_len;
+	bool done;
+};
+
+static void compress_worker(struct work *work)
+{
+	struct chunk_work *cw = container_of(work, struct chunk_work, work);
+	struct image_info *ii = cw->ii;
+	__le64 *blknos;
+	void *blocks;
+	void *raw;
+	u64 blkno;
+	u64 done;
+	u64 nr;
+	int ret;
+
+	raw = malloc(chunk_raw_len(cw->nr));
+	cw->comp_len = compressBound(chunk_raw_len(cw->nr));
+	cw->comp = malloc(cw->comp_len);
+	if (!raw || !cw->comp) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	blknos = raw;
+	blocks = raw + (cw->nr * sizeof(__le64));
+
+	/* read each run of blocks straight into its place in the chunk */
+	blkno = cw->start;
+	for (done = 0; done < cw->nr; done += nr) {
+		blkno = find_next_set_bit(ii->bits, blkno, ii->nr_bits);
+		for (nr = 1; done + nr < cw->nr && marked(ii, blkno + nr); nr++)
+			;
+
+		ret = read_blocks(ii->dev_fd, blocks +
+				  (done << SCOUTFS_BLOCK_SHIFT), blkno, nr);
+		if (ret < 0)
+			goto out;
+
+		for (; nr > 0; blkno++, done++, nr--)
+			blknos[done] = cpu_to_le64(blkno);
+	}
+
+	/* favour speed, metadata compresses well at the fastest level */
+	ret = compress2(cw->comp, &cw->comp_len, raw, chunk_raw_len(cw->nr),
+			Z_BEST_SPEED);
+	if (ret != Z_OK) {
+		fprintf(stderr, "compressing chunk failed: zlib error %d\n",
+			ret);
+		ret = -EIO;
+		goto out;
+	}
+	ret = 0;
+
+out:
+	free(raw);
+	if (ret < 0)
+		set_error(ii, ret);
+
+	pthread_mutex_lock(&ii->mutex);
+	cw->done = true;
+	pthread_cond_broadcast(&ii->cond);
+	pthread_mutex_unlock(&ii->mutex);
+}
+
+static int write_chunk(struct image_info *ii, u64 nr, void *comp,
+		       u32 comp_len)
+{
+	struct image_chunk_header hdr = {
+		.magic = cpu_to_le32(IMAGE_CHUNK_MAGIC),
+		.nr_blocks = cpu_to_le32(nr),
+		.comp_len = cpu_to_le32(comp_len),
+		.comp_crc = cpu_to_le32(crc32c(~0, comp, comp_len)),
+	};
+	int ret;
+
+	ret = rw_full(ii->img_fd, &hdr, sizeof(hdr), -1, true) ?:
+	      rw_full(ii->img_fd, comp, comp_len, -1, true);
+	if (ret < 0)
+		fprintf(stderr, "writing image stream failed: %s (%d)\n",
+			strerror(-ret), -ret);
+	return ret;
+}
+
+/* write the oldest chunk once it's been compressed */
+static int write_oldest_chunk(struct image_info *ii, struct list_head *chunks)
+{
+	struct chunk_work *cw;
+	int ret;
+
+	cw = list_first_entry(chunks, struct chunk_work, head);
+
+	pthread_mutex_lock(&ii->mutex);
+	while (!cw->done)
+		pthread_cond_wait(&ii->cond, &ii->mutex);
+	pthread_mutex_unlock(&ii->mutex);
+
+	ret = get_error(ii);
+	if (ret == 0) {
+		ret = write_chunk(ii, cw->nr, cw->comp, cw->comp_len);
+		if (ret == 0)
+			ii->blocks += cw->nr;
+	}
+
+	list_del(&cw->head);
+	free(cw->comp);
+	free(cw);
+	return ret;
+}
+
+static int stream_marked(struct image_info *ii, u64 size)
+{
+	struct scoutfs_super_block *super = &ii->super;
+	struct image_stream_header hdr = {
+		.magic = cpu_to_le64(IMAGE_STREAM_MAGIC),
+		.version = cpu_to_le32(IMAGE_STREAM_VERSION),
+		.block_size = cpu_to_le32(SCOUTFS_BLOCK_SIZE),
+		.fsid = super->hdr.fsid,
+		.device_size = cpu_to_le64(size),
+		.last_meta_blkno = super->last_meta_blkno,
+		.since_seq = cpu_to_le64(ii->since_seq),
+	};
+	LIST_HEAD(chunks);
+	struct chunk_work *cw;
+	int max_chunks = ii->nr_threads * 2;
+	int nr_chunks = 0;
+	u64 total = 0;
+	u64 blkno;
+	u64 nr;
+	int ret;
+	int err;
+
+	blkno = 0;
+	while ((blkno = find_next_set_bit(ii->bits, blkno, ii->nr_bits)) <
+	       ii->nr_bits) {
+		total++;
+		blkno++;
+	}
+	hdr.nr_blocks = cpu_to_le64(total);
+
+	ret = rw_full(ii->img_fd, &hdr, sizeof(hdr), -1, true);
+	if (ret < 0) {
+		fprintf(stderr, "writing image stream failed: %s (%d)\n",
+			strerror(-ret), -ret);
+		return ret;
+	}
+
+	blkno = 0;
+	while (ret == 0) {
+		if (nr_chunks == max_chunks || (blkno >= ii->nr_bits &&
+						nr_chunks > 0)) {
+			ret = write_oldest_chunk(ii, &chunks);
+			nr_chunks--;
+			continue;
+		}
+
+		blkno = find_next_set_bit(ii->bits, blkno, ii->nr_bits);
+		if (blkno >= ii->nr_bits)
+			break;
+
+		cw = calloc(1, sizeof(*cw));
+		if (!cw) {
+			ret = -ENOMEM;
+			break;
+		}
+
+		work_init(&cw->work, compress_worker);
+		cw->ii = ii;
+		cw->start = blkno;
+		for (nr = 0; nr < IMAGE_CHUNK_BLOCKS && blkno < ii->nr_bits;
+		     nr++) {
+			blkno = find_next_set_bit(ii->bits, blkno, ii->nr_bits);
+			if (blkno < ii->nr_bits)
+				blkno++;
+			else
+				break;
+		}
+		cw->nr = nr;
+
+		list_add_tail(&cw->head, &chunks);
+		nr_chunks++;
+		workq_queue(ii->wq, &cw->work);
+	}
+
+	/* drain the remaining chunks after errors */
+	while (nr_chunks-- > 0) {
+		err = write_oldest_chunk(ii, &chunks);
+		if (err && !ret)
+			ret = err;
+	}
+
+	if (ret == 0)
+		ret = write_chunk(ii, 0, NULL, 0);
+
+	return ret;
+}
+
+static int read_super(struct image_info *ii)
+{
+	struct scoutfs_super_block *super = &ii->super;
+	struct block *bl;
+
+	bl = block_read(ii->bc, SCOUTFS_SUPER_BLKNO);
+	if (!bl)
+		return -EIO;
+	memcpy(super, block_data(bl), sizeof(*super));
+	block_put(ii->bc, bl);
+
+	if (le32_to_cpu(super->hdr.magic) != SCOUTFS_BLOCK_MAGIC_SUPER) {
+		fprintf(stderr, "super block magic %08x != expected %08x\n",
+			le32_to_cpu(super->hdr.magic),
+			SCOUTFS_BLOCK_MAGIC_SUPER);
+		return -EIO;
+	}
+
+	if (le64_to_cpu(super->format_hash) != SCOUTFS_FORMAT_HASH) {
+		fprintf(stderr, "super block format_hash %llx != expected %llx\n",
+			le64_to_cpu(super->format_hash),
+			SCOUTFS_FORMAT_HASH);
+		return -EIO;
+	}
+
+	return 0;
+}
+
+static int image_volume(struct image_info *ii, u64 size, bool compress)
+{
+	struct scoutfs_super_block *super = &ii->super;
+	u64 blkno;
+	int ret;
+
+	ret = read_super(ii);
+	if (ret)
+		return ret;
+
+	ii->nr_bits = le64_to_cpu(super->last_meta_blkno) + 1;
+	if ((ii->nr_bits << SCOUTFS_BLOCK_SHIFT) > size) {
+		fprintf(stderr, "super last_meta_blkno %llu is past the end of the %llu byte device\n",
+			le64_to_cpu(super->last_meta_blkno), size);
+		return -EIO;
+	}
+
+	if (ii->since_seq >= le64_to_cpu(super->hdr.seq)) {
+		fprintf(stderr, "since seq %llu isn't older than the super block seq %llu\n",
+			ii->since_seq, le64_to_cpu(super->hdr.seq));
+		return -EINVAL;
+	}
+
+	ii->bits = alloc_bits(ii->nr_bits);
+	if (!ii->bits)
+		return -ENOMEM;
+
+	/* the super and quorum blocks aren't referenced by seq */
+	mark_block(ii, "super", SCOUTFS_SUPER_BLKNO);
+	for (blkno = SCOUTFS_QUORUM_BLKNO;
+	     blkno < SCOUTFS_QUORUM_BLKNO + SCOUTFS_QUORUM_BLOCKS; blkno++)
+		mark_block(ii, "quorum", blkno);
+
+	queue_radix(ii, &super->core_meta_avail);
+	queue_radix(ii, &super->core_meta_freed);
+	queue_radix(ii, &super->core_data_avail);
+	queue_radix(ii, &super->core_data_freed);
+	queue_btree(ii, &super->fs_root, false);
+	queue_btree(ii, &super->logs_root, true);
+	queue_btree(ii, &super->lock_clients, false);
+	queue_btree(ii, &super->trans_seqs, false);
+	queue_btree(ii, &super->mounted_clients, false);
+
+	workq_wait(ii->wq);
+	ret = get_error(ii);
+	if (ret)
+		return ret;
+
+	if (compress)
+		return stream_marked(ii, size);
+
+	return copy_marked(ii, size);
+}
+
+static struct option long_ops[] = {
+	{ "compress", 0, NULL, 'c' },
+	{ "since-seq", 1, NULL, 's' },
+	{ "threads", 1, NULL, 't' },
+	{ NULL, 0, NULL, 0}
+};
+
+static int image_cmd(int argc, char **argv)
+{
+	struct image_info ii = {
+		.dev_fd = -1,
+		.img_fd = -1,
+		.mutex = PTHREAD_MUTEX_INITIALIZER,
+		.cond = PTHREAD_COND_INITIALIZER,
+	};
+	bool compress = false;
+	bool to_stdout;
+	char *end;
+	int nr_threads = 0;
+	char *dev_path;
+	char *img_path;
+	u64 size;
+	int ret;
+	int c;
+
+	while ((c = getopt_long(argc, argv, "cs:t:", long_ops, NULL)) != -1) {
+		switch (c) {
+		case 'c':
+			compress = true;
+			break;
+		case 's':
+			ii.since_seq = strtoull(optarg, &end, 0);
+			if (*end != '\0') {
+				fprintf(stderr, "invalid since seq '%s'\n",
+					optarg);
+				return -EINVAL;
+			}
+			break;
+		case 't':
+			ret = parse_threads(optarg, &nr_threads);
+			if (ret)
+				return ret;
+			break;
+		case '?':
+		default:
+			return -EINVAL;
+		}
+	}
+
+	if (optind != argc - 2) {
+		printf("scoutfs image: device and image file arguments are required\n");
+		return -EINVAL;
+	}
+	dev_path = argv[optind];
+	img_path = argv[optind + 1];
+	to_stdout = strcmp(img_path, "-") == 0;
+
+	if (to_stdout && !compress) {
+		fprintf(stderr, "only compressed images can be written to stdout\n");
+		return -EINVAL;
+	}
+
+	ii.dev_fd = open(dev_path, O_RDONLY);
+	if (ii.dev_fd < 0) {
+		ret = -errno;
+		fprintf(stderr, "failed to open '%s': %s (%d)\n",
+			dev_path, strerror(errno), errno);
+		return ret;
+	}
+
+	ret = device_size(dev_path, ii.dev_fd, &size);
+	if (ret)
+		goto out;
+
+	/* incremental images are written over an existing full image */
+	if (to_stdout)
+		ii.img_fd = dup(STDOUT_FILENO);
+	else
+		ii.img_fd = open(img_path, O_WRONLY | O_CREAT |
+				 (ii.since_seq && !compress ? 0 : O_TRUNC),
+				 0644);
+	if (ii.img_fd < 0) {
+		ret = -errno;
+		fprintf(stderr, "failed to create '%s': %s (%d)\n",
+			img_path, strerror(errno), errno);
+		goto out;
+	}
+
+	if (nr_threads == 0)
+		nr_threads = workq_nr_threads();
+	ii.nr_threads = nr_threads;
+
+	ii.bc = block_cache_open(dev_path, ii.dev_fd, false);
+	ii.wq = workq_create(nr_threads);
+	if (!ii.bc || !ii.wq) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	ret = image_volume(&ii, size, compress);
+	if (ret == 0 && !to_stdout && fsync(ii.img_fd)) {
+		ret = -errno;
+		fprintf(stderr, "failed to sync '%s': %s (%d)\n",
+			img_path, strerror(errno), errno);
+	}
+	if (ret == 0 && ii.since_seq)
+		fprintf(to_stdout ? stderr : stdout,
+			"copied %llu metadata blocks written after seq %llu to '%s' with %llu warnings\n",
+			ii.blocks, ii.since_seq, img_path, ii.warnings);
+	else if (ret == 0)
+		fprintf(to_stdout ? stderr : stdout,
+			"copied %llu metadata blocks to '%s' with %llu warnings\n",
+			ii.blocks, img_path, ii.warnings);
+
+out:
+	workq_destroy(ii.wq);
+	if (ii.bc)
+		block_cache_destroy(ii.bc);
+	free(ii.bits);
+	if (ii.img_fd >= 0)
+		close(ii.img_fd);
+	close(ii.dev_fd);
+	return ret;
+}
+
+/*
+ * Each chunk read from the stream is decompressed by a worker which
+ * writes each run of contiguous blocks in the chunk to the device.
+ * Writes can complete in any order.
+ */
+struct restore_work {
+	struct work work;
+	struct image_info *ii;
+	u64 nr;
+	void *comp;
+	u32 comp_len;
+};
+
+static void restore_worker(struct work *work)
+{
+	struct restore_work *rw = container_of(work, struct restore_work, work);
+	struct image_info *ii = rw->ii;
+	uLongf raw_len = chunk_raw_len(rw->nr);
+	__le64 *blknos;
+	void *blocks;
+	void *raw;
+	u64 blkno;
+	u64 done;
+	u64 nr;
+	int ret;
+
+	raw = malloc(raw_len);
+	if (!raw) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	ret = uncompress(raw, &raw_len, rw->comp, rw->comp_len);
+	if (ret != Z_OK || raw_len != chunk_raw_len(rw->nr)) {
+		fprintf(stderr, "decompressing chunk failed: zlib error %d, %lu of %zu bytes\n",
+			ret, raw_len, chunk_raw_len(rw->nr));
+		ret = -EIO;
+		goto out;
+	}
+
+	blknos = raw;
+	blocks = raw + (rw->nr * sizeof(__le64));
+
+	for (done = 0; done < rw->nr; done += nr) {
+		blkno = le64_to_cpu(blknos[done]);
+		if (blkno >= ii->nr_bits) {
+			fprintf(stderr, "chunk blkno %llu is past last_meta_blkno %llu\n",
+				blkno, ii->nr_bits - 1);
+			ret = -EIO;
+			goto out;
+		}
+
+		for (nr = 1; done + nr < rw->nr &&
+			     le64_to_cpu(blknos[done + nr]) == blkno + nr; nr++)
+			;
+
+		ret = write_blocks(ii->dev_fd, blocks +
+				   (done << SCOUTFS_BLOCK_SHIFT), blkno, nr);
+		if (ret < 0)
+			goto out;
+	}
+
+	__atomic_add_fetch(&ii->blocks, rw->nr, __ATOMIC_RELAXED);
+	ret = 0;
+out:
+	free(raw);
+	free(rw->comp);
+	free(rw);
+	if (ret < 0)
+		set_error(ii, ret);
+
+	pthread_mutex_lock(&ii->mutex);
+	ii->in_flight--;
+	pthread_cond_broadcast(&ii->cond);
+	pthread_mutex_unlock(&ii->mutex);
+}
+
+static int read_stream(struct image_info *ii, void *buf, size_t size)
+{
+	int ret;
+
+	ret = rw_full(ii->img_fd, buf, size, -1, false);
+	if (ret == -ENODATA)
+		fprintf(stderr, "image stream ended unexpectedly\n");
+	else if (ret < 0)
+		fprintf(stderr, "reading image stream failed: %s (%d)\n",
+			strerror(-ret), -ret);
+	return ret;
+}
+
+/*
+ * An incremental image only contains the blocks written after its
+ * seq.  It can only be restored over the same volume whose super block
+ * shows that it has all the blocks written up to that seq.
+ */
+static int check_incremental_base(struct image_info *ii,
+				  struct image_stream_header *hdr)
+{
+	struct scoutfs_super_block *super;
+	u64 since_seq = le64_to_cpu(hdr->since_seq);
+	int ret;
+
+	super = malloc(SCOUTFS_BLOCK_SIZE);
+	if (!super)
+		return -ENOMEM;
+
+	ret = read_blocks(ii->dev_fd, super, SCOUTFS_SUPER_BLKNO, 1);
+	if (ret < 0)
+		goto out;
+
+	if (le32_to_cpu(super->hdr.magic) != SCOUTFS_BLOCK_MAGIC_SUPER ||
+	    super->hdr.fsid != hdr->fsid ||
+	    le64_to_cpu(super->hdr.seq) < since_seq) {
+		fprintf(stderr, "incremental image of blocks written after seq %llu can't be restored over super block magic %08x fsid %llx seq %llu\n",
+			since_seq, le32_to_cpu(super->hdr.magic),
+			le64_to_cpu(super->hdr.fsid),
+			le64_to_cpu(super->hdr.seq));
+		ret = -EINVAL;
+	}
+out:
+	free(super);
+	return ret;
+}
+
+static int restore_stream(struct image_info *ii, u64 size)
+{
+	struct image_stream_header hdr;
+	struct image_chunk_header chdr;
+	struct restore_work *rw;
+	int max_in_flight = ii->nr_threads * 2;
+	u32 comp_len;
+	u64 nr;
+	int ret;
+
+	ret = read_stream(ii, &hdr, sizeof(hdr));
+	if (ret < 0)
+		return ret;
+
+	if (le64_to_cpu(hdr.magic) != IMAGE_STREAM_MAGIC ||
+	    le32_to_cpu(hdr.version) != IMAGE_STREAM_VERSION ||
+	    le32_to_cpu(hdr.block_size) != SCOUTFS_BLOCK_SIZE) {
+		fprintf(stderr, "image stream header magic %llx version %u block size %u isn't supported\n",
+			le64_to_cpu(hdr.magic), le32_to_cpu(hdr.version),
+			le32_to_cpu(hdr.block_size));
+		return -EINVAL;
+	}
+
+	ii->nr_bits = le64_to_cpu(hdr.last_meta_blkno) + 1;
+	if ((ii->nr_bits << SCOUTFS_BLOCK_SHIFT) > size) {
+		fprintf(stderr, "image last_meta_blkno %llu is past the end of the %llu byte device\n",
+			ii->nr_bits - 1, size);
+		return -EINVAL;
+	}
+
+	if (hdr.since_seq) {
+		ret = check_incremental_base(ii, &hdr);
+		if (ret < 0)
+			return ret;
+	}
+
+	for (;;) {
+		ret = read_stream(ii, &chdr, sizeof(chdr));
+		if (ret < 0)
+			break;
+
+		nr = le32_to_cpu(chdr.nr_blocks);
+		comp_len = le32_to_cpu(chdr.comp_len);
+		if (le32_to_cpu(chdr.magic) != IMAGE_CHUNK_MAGIC ||
+		    nr > IMAGE_CHUNK_BLOCKS ||
+		    comp_len > compressBound(chunk_raw_len(nr))) {
+			fprintf(stderr, "image stream chunk header is corrupt\n");
+			ret = -EIO;
+			break;
+		}
+		if (nr == 0)
+			break;
+
+		rw = calloc(1, sizeof(*rw));
+		if (rw)
+			rw->comp = malloc(comp_len);
+		if (!rw || !rw->comp) {
+			if (rw)
+				free(rw);
+			ret = -ENOMEM;
+			break;
+		}
+
+		ret = read_stream(ii, rw->comp, comp_len);
+		if (ret == 0 && crc32c(~0, rw->comp, comp_len) !=
+				le32_to_cpu(chdr.comp_crc)) {
+			fprintf(stderr, "image stream chunk crc doesn't match\n");
+			ret = -EIO;
+		}
+		if (ret < 0) {
+			free(rw->comp);
+			free(rw);
+			break;
+		}
+
+		pthread_mutex_lock(&ii->mutex);
+		while (ii->in_flight == max_in_flight)
+			pthread_cond_wait(&ii->cond, &ii->mutex);
+		ii->in_flight++;
+		pthread_mutex_unlock(&ii->mutex);
+
+		work_init(&rw->work, restore_worker);
+		rw->ii = ii;
+		rw->nr = nr;
+		rw->comp_len = comp_len;
+		workq_queue(ii->wq, &rw->work);
+
+		ret = get_error(ii);
+		if (ret < 0)
+			break;
+	}
+
+	workq_wait(ii->wq);
+	if (ret == 0)
+		ret = get_error(ii);
+
+	if (ret == 0 && ii->blocks != le64_to_cpu(hdr.nr_blocks)) {
+		fprintf(stderr, "restored %llu blocks but the image header has %llu\n",
+			ii->blocks, le64_to_cpu(hdr.nr_blocks));
+		ret = -EIO;
+	}
+
+	return ret;
+}
+
+static struct option restore_ops[] = {
+	{ "threads", 1, NULL, 't' },
+	{ NULL, 0, NULL, 0}
+};
+
+static int image_restore_cmd(int argc, char **argv)
+{
+	struct image_info ii = {
+		.dev_fd = -1,
+		.img_fd = -1,
+		.mutex = PTHREAD_MUTEX_INITIALIZER,
+		.cond = PTHREAD_COND_INITIALIZER,
+	};
+	int nr_threads = 0;
+	char *dev_path;
+	char *img_path;
+	u64 size;
+	int ret;
+	int c;
+
+	while ((c = getopt_long(argc, argv, "t:", restore_ops, NULL)) != -1) {
+		switch (c) {
+		case 't':
+			ret = parse_threads(optarg, &nr_threads);
+			if (ret)
+				return ret;
+			break;
+		case '?':
+		default:
+			return -EINVAL;
+		}
+	}
+
+	if (optind != argc - 2) {
+		printf("scoutfs image-restore: image file and device arguments are required\n");
+		return -EINVAL;
+	}
+	img_path = argv[optind];
+	dev_path = argv[optind + 1];
+
+	if (strcmp(img_path, "-") == 0)
+		ii.img_fd = dup(STDIN_FILENO);
+	else
+		ii.img_fd = open(img_path, O_RDONLY);
+	if (ii.img_fd < 0) {
+		ret = -errno;
+		fprintf(stderr, "failed to open '%s': %s (%d)\n",
+			img_path, strerror(errno), errno);
+		return ret;
+	}
+
+	ii.dev_fd = open(dev_path, O_RDWR);
+	if (ii.dev_fd < 0) {
+		ret = -errno;
+		fprintf(stderr, "failed to open '%s': %s (%d)\n",
+			dev_path, strerror(errno), errno);
+		goto out;
+	}
+
+	ret = device_size(dev_path, ii.dev_fd, &size);
+	if (ret)
+		goto out;
+
+	if (nr_threads == 0)
+		nr_threads = workq_nr_threads();
+	ii.nr_threads = nr_threads;
+
+	ii.wq = workq_create(nr_threads);
+	if (!ii.wq) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	ret = restore_stream(&ii, size);
+	if (ret == 0 && fsync(ii.dev_fd)) {
+		ret = -errno;
+		fprintf(stderr, "failed to sync '%s': %s (%d)\n",
+			dev_path, strerror(errno), errno);
+	}
+	if (ret == 0)
+		printf("restored %llu metadata blocks to '%s'\n",
+		       ii.blocks, dev_path);
+
+out:
+	workq_destroy(ii.wq);
+	if (ii.dev_fd >= 0)
+		close(ii.dev_fd);
+	close(ii.img_fd);
+	return ret;
+}
+
+static void __attribute__((constructor)) image_ctor(void)
+{
+	cmd_register("image", "[--compress] [--since-seq seq] [--threads nr] "
+		     "<device> <file>",
+		     "copy referenced metadata blocks to a sparse or compressed image file",
+		     image_cmd);
+	cmd_register("image-restore", "[--threads nr] <file> <device>",
+		     "write the metadata blocks in a compressed image to a device",
+		     image_restore_cmd);
+}
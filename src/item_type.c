@@ -0,0 +1,39 @@
+#include <stdio.h>
+
+#include "sparse.h"
+#include "util.h"
+#include "format.h"
+#include "item_type.h"
+
+#define ITEM_TYPE(zone, type, name)			\
+	[zone][type] = {				\
+		.print = print_##name,			\
+		.json = json_##name,			\
+	}
+
+/*
+ * Item types are found by indexing the key's zone and type.  Zones and
+ * types that the tools don't understand have empty descriptors.
+ */
+static const struct item_type item_types[SCOUTFS_MAX_ZONE][SCOUTFS_MAX_TYPE] = {
+	ITEM_TYPE(SCOUTFS_INODE_INDEX_ZONE, SCOUTFS_INODE_INDEX_META_SEQ_TYPE, inode_index),
+	ITEM_TYPE(SCOUTFS_INODE_INDEX_ZONE, SCOUTFS_INODE_INDEX_DATA_SEQ_TYPE, inode_index),
+	ITEM_TYPE(SCOUTFS_XATTR_INDEX_ZONE, SCOUTFS_XATTR_INDEX_NAME_TYPE, xattr_index),
+	ITEM_TYPE(SCOUTFS_RID_ZONE, SCOUTFS_ORPHAN_TYPE, orphan),
+	ITEM_TYPE(SCOUTFS_FS_ZONE, SCOUTFS_INODE_TYPE, inode),
+	ITEM_TYPE(SCOUTFS_FS_ZONE, SCOUTFS_XATTR_TYPE, xattr),
+	ITEM_TYPE(SCOUTFS_FS_ZONE, SCOUTFS_DIRENT_TYPE, dirent),
+	ITEM_TYPE(SCOUTFS_FS_ZONE, SCOUTFS_READDIR_TYPE, dirent),
+	ITEM_TYPE(SCOUTFS_FS_ZONE, SCOUTFS_LINK_BACKREF_TYPE, dirent),
+	ITEM_TYPE(SCOUTFS_FS_ZONE, SCOUTFS_SYMLINK_TYPE, symlink),
+	ITEM_TYPE(SCOUTFS_FS_ZONE, SCOUTFS_PACKED_EXTENT_TYPE, packed_extent),
+};
+
+/* returns null for zones and types outside the table */
+const struct item_type *item_type_find(u8 zone, u8 type)
+{
+	if (zone >= SCOUTFS_MAX_ZONE || type >= SCOUTFS_MAX_TYPE)
+		return NULL;
+
+	return &item_types[zone][type];
+}
@@ -0,0 +1,52 @@
+#ifndef _ITEM_TYPE_H_
+#define _ITEM_TYPE_H_
+
+struct rec_info;
+
+/*
+ * Each zone and type of item that the tools understand has a single
+ * descriptor with the functions that output it.  Tools that add a new
+ * output format add a function to the descriptor instead of building
+ * their own zone and type table.
+ */
+struct item_type {
+	void (*print)(struct scoutfs_key *key, void *val, int val_len,
+		      void *arg);
+	void (*json)(struct rec_info *ri, struct scoutfs_key *key, void *val,
+		     int val_len);
+};
+
+const struct item_type *item_type_find(u8 zone, u8 type);
+
+/* print.c */
+void print_inode(struct scoutfs_key *key, void *val, int val_len, void *arg);
+void print_orphan(struct scoutfs_key *key, void *val, int val_len, void *arg);
+void print_xattr(struct scoutfs_key *key, void *val, int val_len, void *arg);
+void print_dirent(struct scoutfs_key *key, void *val, int val_len, void *arg);
+void print_symlink(struct scoutfs_key *key, void *val, int val_len, void *arg);
+void print_packed_extent(struct scoutfs_key *key, void *val, int val_len,
+			 void *arg);
+void print_inode_index(struct scoutfs_key *key, void *val, int val_len,
+		       void *arg);
+void print_xattr_index(struct scoutfs_key *key, void *val, int val_len,
+		       void *arg);
+
+/* records.c */
+void json_inode(struct rec_info *ri, struct scoutfs_key *key, void *val,
+		int val_len);
+void json_orphan(struct rec_info *ri, struct scoutfs_key *key, void *val,
+		 int val_len);
+void json_xattr(struct rec_info *ri, struct scoutfs_key *key, void *val,
+		int val_len);
+void json_dirent(struct rec_info *ri, struct scoutfs_key *key, void *val,
+		 int val_len);
+void json_symlink(struct rec_info *ri, struct scoutfs_key *key, void *val,
+		  int val_len);
+void json_packed_extent(struct rec_info *ri, struct scoutfs_key *key,
+			void *val, int val_len);
+void json_inode_index(struct rec_info *ri, struct scoutfs_key *key, void *val,
+		      int val_len);
+void json_xattr_index(struct rec_info *ri, struct scoutfs_key *key, void *val,
+		      int val_len);
+
+#endif
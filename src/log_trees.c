@@ -0,0 +1,447 @@
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <getopt.h>
+#include <stdbool.h>
+
+#include "sparse.h"
+#include "util.h"
+#include "format.h"
+#include "cmd.h"
+#include "parse.h"
+#include "key.h"
+#include "block.h"
+#include "btree.h"
+#include "workq.h"
+
+/*
+ * log-trees reports on the items that clients have written to their
+ * log trees that haven't yet been merged into the fs_root.  Until
+ * they're merged, reads of keys in the log trees' lock ranges have to
+ * search each log tree as well as the fs_root.  Growing log trees are a
+ * sign that merging isn't keeping up with clients.
+ *
+ * Each log tree is walked by a thread which counts its items,
+ * deletions, and their bytes, and looks up each key in the fs_root to
+ * find the items that replace existing items.  Then the keys from all
+ * the trees are sorted together to find the keys that are in more than
+ * one log tree.
+ *
+ * The stats are summarized per key zone and per client rid.  The
+ * number of trees that a read in a zone searches is the fs_root and
+ * every log tree that has items in the zone.  The read amplification is
+ * the average number of trees, including the fs_root, that have a
+ * version of each logged item's key.  It's the number of items that
+ * reads of the logged keys find and that merging will have to resolve.
+ */
+
+struct lt_stats {
+	u64 trees;
+	u64 items;
+	u64 deletions;
+	u64 bytes;
+	u64 fs_overlap;
+	u64 tree_overlap;
+	u64 versions;
+};
+
+struct lt_key {
+	struct scoutfs_key key;
+	u32 tree;
+	bool in_fs;
+};
+
+struct log_tree {
+	struct work work;
+	struct block_cache *bc;
+	struct scoutfs_btree_root *fs_root;
+	u64 rid;
+	u64 nr;
+	struct scoutfs_btree_root item_root;
+	struct lt_stats zones[U8_MAX + 1];
+	struct lt_key *keys;
+	u64 nr_keys;
+	u64 alloced;
+	int err;
+};
+
+struct lt_info {
+	struct block_cache *bc;
+	struct workq *wq;
+	struct scoutfs_super_block super;
+	struct log_tree **trees;
+	int nr_trees;
+};
+
+static void add_stats(struct lt_stats *dst, struct lt_stats *src)
+{
+	dst->trees += src->trees;
+	dst->items += src->items;
+	dst->deletions += src->deletions;
+	dst->bytes += src->bytes;
+	dst->fs_overlap += src->fs_overlap;
+	dst->tree_overlap += src->tree_overlap;
+	dst->versions += src->versions;
+}
+
+static int found_item(void *key, unsigned key_len, void *val,
+		      unsigned val_len, u64 blkno, void *arg)
+{
+	bool *found = arg;
+
+	*found = true;
+	return 0;
+}
+
+static int count_item(void *key, unsigned key_len, void *val,
+		      unsigned val_len, u64 blkno, void *arg)
+{
+	struct log_tree *lt = arg;
+	struct scoutfs_log_item_value *liv = val;
+	struct lt_stats *st;
+	struct lt_key *keys;
+	struct lt_key *lk;
+	bool found = false;
+	int ret;
+
+	if (key_len != sizeof(struct scoutfs_key_be) ||
+	    val_len < sizeof(*liv)) {
+		fprintf(stderr, "log tree rid %016llx nr %llu blkno %llu: item key_len %u val_len %u aren't a log item\n",
+			lt->rid, lt->nr, blkno, key_len, val_len);
+		return -EIO;
+	}
+
+	if (lt->nr_keys == lt->alloced) {
+		lt->alloced = max(lt->alloced * 2, 1024ULL);
+		keys = realloc(lt->keys, lt->alloced * sizeof(*keys));
+		if (!keys)
+			return -ENOMEM;
+		lt->keys = keys;
+	}
+
+	/* the fs_root path to the key is usually cached */
+	ret = btree_walk(lt->bc, lt->fs_root, key, key_len, key, key_len,
+			 found_item, &found);
+	if (ret < 0)
+		return ret;
+
+	lk = &lt->keys[lt->nr_keys++];
+	scoutfs_key_from_be(&lk->key, key);
+	lk->in_fs = found;
+
+	st = &lt->zones[lk->key.sk_zone];
+	st->trees = 1;
+	st->items++;
+	if (liv->flags & SCOUTFS_LOG_ITEM_FLAG_DELETION)
+		st->deletions++;
+	st->bytes += sizeof(struct scoutfs_btree_item_header) +
+		     sizeof(struct scoutfs_btree_item) + key_len + val_len;
+	if (found)
+		st->fs_overlap++;
+
+	return 0;
+}
+
+static void log_tree_worker(struct work *work)
+{
+	struct log_tree *lt = container_of(work, struct log_tree, work);
+
+	lt->err = btree_walk(lt->bc, &lt->item_root, NULL, 0, NULL, 0,
+			     count_item, lt);
+}
+
+static int add_log_tree(void *key, unsigned key_len, void *val,
+			unsigned val_len, u64 blkno, void *arg)
+{
+	struct scoutfs_log_trees_key *ltk = key;
+	struct scoutfs_log_trees_val *ltv = val;
+	struct lt_info *li = arg;
+	struct log_tree **trees;
+	struct log_tree *lt;
+
+	if (key_len != sizeof(*ltk) || val_len != sizeof(*ltv)) {
+		fprintf(stderr, "logs_root blkno %llu: item key_len %u val_len %u aren't log trees\n",
+			blkno, key_len, val_len);
+		return -EIO;
+	}
+
+	trees = realloc(li->trees, (li->nr_trees + 1) * sizeof(*trees));
+	if (!trees)
+		return -ENOMEM;
+	li->trees = trees;
+
+	lt = calloc(1, sizeof(*lt));
+	if (!lt)
+		return -ENOMEM;
+	li->trees[li->nr_trees++] = lt;
+
+	work_init(&lt->work, log_tree_worker);
+	lt->bc = li->bc;
+	lt->fs_root = &li->super.fs_root;
+	lt->rid = be64_to_cpu(ltk->rid);
+	lt->nr = be64_to_cpu(ltk->nr);
+	lt->item_root = ltv->item_root;
+	return 0;
+}
+
+static int cmp_lt_keys(const void *A, const void *B)
+{
+	const struct lt_key *a = A;
+	const struct lt_key *b = B;
+
+	return scoutfs_key_compare((struct scoutfs_key *)&a->key,
+				   (struct scoutfs_key *)&b->key);
+}
+
+/*
+ * Sort the keys from all the trees together and add the number of
+ * versions of each key to the stats of each tree that logged it.
+ */
+static int count_overlap(struct lt_info *li)
+{
+	struct lt_key *keys;
+	struct lt_stats *st;
+	u64 total = 0;
+	u64 nr = 0;
+	u64 versions;
+	u64 i;
+	u64 j;
+	int t;
+
+	for (t = 0; t < li->nr_trees; t++)
+		total += li->trees[t]->nr_keys;
+
+	keys = malloc(max(total, 1ULL) * sizeof(*keys));
+	if (!keys)
+		return -ENOMEM;
+
+	for (t = 0; t < li->nr_trees; t++) {
+		for (i = 0; i < li->trees[t]->nr_keys; i++) {
+			keys[nr] = li->trees[t]->keys[i];
+			keys[nr++].tree = t;
+		}
+	}
+
+	qsort(keys, nr, sizeof(keys[0]), cmp_lt_keys);
+
+	for (i = 0; i < nr; i = j) {
+		for (j = i + 1; j < nr && cmp_lt_keys(&keys[i], &keys[j]) == 0;
+		     j++)
+			;
+		versions = (j - i) + (keys[i].in_fs ? 1 : 0);
+
+		for (; i < j; i++) {
+			st = &li->trees[keys[i].tree]->zones[keys[i].key.sk_zone];
+			st->versions += versions;
+			if (versions - (keys[i].in_fs ? 1 : 0) > 1)
+				st->tree_overlap++;
+		}
+	}
+
+	free(keys);
+	return 0;
+}
+
+static void print_header(char *what)
+{
+	printf("%-22s %6s %10s %10s %12s %10s %10s %8s %8s\n",
+	       what, "trees", "items", "deletions", "bytes", "fs_overlap",
+	       "tree_ovlp", "searched", "read_amp");
+}
+
+/* searched is only meaningful for zones and is printed as - when 0 */
+static void print_stats(char *name, struct lt_stats *st, u64 searched)
+{
+	char str[32];
+
+	if (searched)
+		snprintf(str, sizeof(str), "%llu", searched);
+	else
+		strcpy(str, "-");
+
+	printf("%-22s %6llu %10llu %10llu %12llu %10llu %10llu %8s %8.2f\n",
+	       name, st->trees, st->items, st->deletions, st->bytes,
+	       st->fs_overlap, st->tree_overlap, str,
+	       st->items ? (double)st->versions / st->items : 0.0);
+}
+
+static void print_report(struct lt_info *li)
+{
+	struct lt_stats zones[U8_MAX + 1];
+	struct lt_stats total = { 0, };
+	struct lt_stats st;
+	struct log_tree *lt;
+	char name[64];
+	u64 rid;
+	int z;
+	int t;
+	int r;
+
+	memset(zones, 0, sizeof(zones));
+
+	print_header("log tree");
+	for (t = 0; t < li->nr_trees; t++) {
+		lt = li->trees[t];
+		memset(&st, 0, sizeof(st));
+		for (z = 0; z <= U8_MAX; z++) {
+			add_stats(&st, &lt->zones[z]);
+			add_stats(&zones[z], &lt->zones[z]);
+		}
+		st.trees = 1;
+		add_stats(&total, &st);
+
+		snprintf(name, sizeof(name), "%016llx.%llu", lt->rid, lt->nr);
+		print_stats(name, &st, 0);
+	}
+
+	printf("\n");
+	print_header("zone");
+	for (z = 0; z <= U8_MAX; z++) {
+		if (zones[z].items)
+			print_stats(sk_zone_str(z), &zones[z],
+				    zones[z].trees + 1);
+	}
+
+	/* trees are sorted by rid so each rid's trees are together */
+	printf("\n");
+	print_header("rid");
+	for (t = 0; t < li->nr_trees; t = r) {
+		rid = li->trees[t]->rid;
+		memset(&st, 0, sizeof(st));
+		for (r = t; r < li->nr_trees && li->trees[r]->rid == rid; r++) {
+			for (z = 0; z <= U8_MAX; z++)
+				add_stats(&st, &li->trees[r]->zones[z]);
+		}
+		st.trees = r - t;
+
+		snprintf(name, sizeof(name), "%016llx", rid);
+		print_stats(name, &st, 0);
+	}
+
+	printf("\n");
+	print_stats("total", &total, total.trees + 1);
+}
+
+static int log_trees_report(struct lt_info *li)
+{
+	struct scoutfs_super_block *super = &li->super;
+	struct block *bl;
+	int ret;
+	int t;
+
+	bl = block_read(li->bc, SCOUTFS_SUPER_BLKNO);
+	if (!bl)
+		return -EIO;
+	memcpy(super, block_data(bl), sizeof(*super));
+	block_put(li->bc, bl);
+
+	if (le32_to_cpu(super->hdr.magic) != SCOUTFS_BLOCK_MAGIC_SUPER) {
+		fprintf(stderr, "super block magic %08x != expected %08x\n",
+			le32_to_cpu(super->hdr.magic),
+			SCOUTFS_BLOCK_MAGIC_SUPER);
+		return -EIO;
+	}
+
+	ret = btree_walk(li->bc, &super->logs_root, NULL, 0, NULL, 0,
+			 add_log_tree, li);
+	if (ret < 0)
+		return ret;
+
+	for (t = 0; t < li->nr_trees; t++)
+		workq_queue(li->wq, &li->trees[t]->work);
+	workq_wait(li->wq);
+
+	for (t = 0; t < li->nr_trees; t++) {
+		ret = li->trees[t]->err;
+		if (ret < 0)
+			return ret;
+	}
+
+	ret = count_overlap(li);
+	if (ret == 0)
+		print_report(li);
+	return ret;
+}
+
+static struct option long_ops[] = {
+	{ "mmap", 0, NULL, 'm' },
+	{ "threads", 1, NULL, 't' },
+	{ NULL, 0, NULL, 0}
+};
+
+static int log_trees_cmd(int argc, char **argv)
+{
+	struct lt_info li = { NULL, };
+	bool use_mmap = false;
+	int nr_threads = 0;
+	char *path;
+	int ret;
+	int fd;
+	int c;
+	int t;
+
+	while ((c = getopt_long(argc, argv, "mt:", long_ops, NULL)) != -1) {
+		switch (c) {
+		case 'm':
+			use_mmap = true;
+			break;
+		case 't':
+			ret = parse_threads(optarg, &nr_threads);
+			if (ret)
+				return ret;
+			break;
+		case '?':
+		default:
+			return -EINVAL;
+		}
+	}
+
+	if (optind != argc - 1) {
+		printf("scoutfs log-trees: a single path argument is required\n");
+		return -EINVAL;
+	}
+	path = argv[optind];
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		ret = -errno;
+		fprintf(stderr, "failed to open '%s': %s (%d)\n",
+			path, strerror(errno), errno);
+		return ret;
+	}
+
+	if (nr_threads == 0)
+		nr_threads = workq_nr_threads();
+
+	li.bc = block_cache_open(path, fd, use_mmap);
+	li.wq = workq_create(nr_threads);
+	if (!li.bc || !li.wq) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	ret = log_trees_report(&li);
+out:
+	workq_destroy(li.wq);
+	for (t = 0; t < li.nr_trees; t++) {
+		free(li.trees[t]->keys);
+		free(li.trees[t]);
+	}
+	free(li.trees);
+	if (li.bc)
+		block_cache_destroy(li.bc);
+	close(fd);
+	return ret;
+}
+
+static void __attribute__((constructor)) log_trees_ctor(void)
+{
+	cmd_register("log-trees", "[--mmap] [--threads nr] <device>",
+		     "report on the items waiting to be merged in log trees",
+		     log_trees_cmd);
+}
@@ -28,6 +28,9 @@
 #include "bitops.h"
 #include "radix.h"
 
+/* all of mkfs's batches of blocks can be in flight at once */
+#define MKFS_IO_DEPTH SCOUTFS_QUORUM_BLOCKS
+
 static int write_raw_block(int fd, u64 blkno, void *blk)
 {
 	ssize_t ret;
@@ -42,6 +45,30 @@ static int write_raw_block(int fd, u64 blkno, void *blk)
 	return 0;
 }
 
+/*
+ * Write a batch of blocks, all in flight at once.
+ */
+static int write_raw_blocks(struct dev_ioq *ioq, struct dev_io *ios, int nr)
+{
+	int ret;
+	int i;
+
+	ret = dev_ioq_rw(ioq, ios, nr, true);
+	if (ret < 0)
+		return ret;
+
+	for (i = 0; i < nr; i++) {
+		if (ios[i].ret < 0) {
+			fprintf(stderr, "write to blkno %llu failed: %s (%d)\n",
+				ios[i].blkno, strerror(-ios[i].ret),
+				-ios[i].ret);
+			return ios[i].ret;
+		}
+	}
+
+	return 0;
+}
+
 /*
  * Update the block's header and write it out.
  */
@@ -204,11 +231,13 @@ static void set_radix_path(struct scoutfs_super_block *super, int *inds,
  * initialize and write populated blocks down the paths to the two ends
  * of the interval and write full refs in between.
  */
-static int write_radix_blocks(struct scoutfs_super_block *super, int fd,
+static int write_radix_blocks(struct scoutfs_super_block *super,
+			      struct dev_ioq *ioq,
 			      struct scoutfs_radix_root *root,
 			      u64 blkno, u64 first, u64 last)
 {
 	struct scoutfs_radix_block *rdx;
+	struct dev_io *ios;
 	void **blocks;
 	u64 next_blkno;
 	u64 edge;
@@ -226,8 +255,11 @@ static int write_radix_blocks(struct scoutfs_super_block *super, int fd,
 
 	/* allocate all the blocks we might need */
 	blocks = calloc(alloced, sizeof(*blocks));
-	if (!blocks)
-		return -ENOMEM;
+	ios = calloc(alloced, sizeof(*ios));
+	if (!blocks || !ios) {
+		ret = -ENOMEM;
+		goto out;
+	}
 
 	for (i = 0; i < alloced; i++) {
 		blocks[i] = calloc(1, SCOUTFS_BLOCK_SIZE);
@@ -262,13 +294,17 @@ static int write_radix_blocks(struct scoutfs_super_block *super, int fd,
 		rdx->hdr.seq = cpu_to_le64(1);
 		rdx->hdr.blkno = cpu_to_le64(blkno + i);
 		rdx->hdr.crc = cpu_to_le32(crc_block(&rdx->hdr));
-		ret = write_raw_block(fd, blkno + i, rdx);
-		if (ret < 0)
-			goto out;
+		ios[i].blkno = blkno + i;
+		ios[i].buf = rdx;
 	}
 
+	ret = write_raw_blocks(ioq, ios, used);
+	if (ret < 0)
+		goto out;
+
 	ret = used;
 out:
+	free(ios);
 	if (blocks) {
 		for (i = 0; i < alloced && blocks[i]; i++)
 			free(blocks[i]);
@@ -291,6 +327,8 @@ static int write_new_fs(char *path, int fd, u8 quorum_count)
 	struct scoutfs_inode *inode;
 	struct scoutfs_btree_block *bt;
 	struct scoutfs_btree_item *btitem;
+	struct dev_io quorum_ios[SCOUTFS_QUORUM_BLOCKS];
+	struct dev_ioq *ioq = NULL;
 	struct scoutfs_key key;
 	struct timeval tv;
 	char uuid_str[37];
@@ -312,7 +350,8 @@ static int write_new_fs(char *path, int fd, u8 quorum_count)
 	super = calloc(1, SCOUTFS_BLOCK_SIZE);
 	bt = calloc(1, SCOUTFS_BLOCK_SIZE);
 	zeros = calloc(1, SCOUTFS_BLOCK_SIZE);
-	if (!super || !bt || !zeros) {
+	ioq = dev_ioq_create(fd, MKFS_IO_DEPTH);
+	if (!super || !bt || !zeros || !ioq) {
 		ret = -errno;
 		fprintf(stderr, "failed to allocate block mem: %s (%d)\n",
 			strerror(errno), errno);
@@ -421,7 +460,7 @@ static int write_new_fs(char *path, int fd, u8 quorum_count)
 		goto out;
 
 	/* write out radix allocator blocks for data */
-	ret = write_radix_blocks(super, fd, &super->core_data_avail, next_meta,
+	ret = write_radix_blocks(super, ioq, &super->core_data_avail, next_meta,
 				 next_data, last_data);
 	if (ret < 0)
 		goto out;
@@ -436,7 +475,7 @@ static int write_new_fs(char *path, int fd, u8 quorum_count)
 	 * Write out radix alloc blocks, knowing that the region we mark
 	 * has to start after the blocks we store the allocator itself in.
 	 */
-	ret = write_radix_blocks(super, fd, &super->core_meta_avail,
+	ret = write_radix_blocks(super, ioq, &super->core_meta_avail,
 				 next_meta, next_meta + meta_alloc_blocks,
 				 last_meta);
 	if (ret < 0)
@@ -448,12 +487,14 @@ static int write_new_fs(char *path, int fd, u8 quorum_count)
 
 	/* zero out quorum blocks */
 	for (i = 0; i < SCOUTFS_QUORUM_BLOCKS; i++) {
-		ret = write_raw_block(fd, SCOUTFS_QUORUM_BLKNO + i, zeros);
-		if (ret < 0) {
-			fprintf(stderr, "error zeroing quorum block: %s (%d)\n",
-				strerror(-errno), -errno);
-			goto out;
-		}
+		quorum_ios[i].blkno = SCOUTFS_QUORUM_BLKNO + i;
+		quorum_ios[i].buf = zeros;
+	}
+	ret = write_raw_blocks(ioq, quorum_ios, SCOUTFS_QUORUM_BLOCKS);
+	if (ret < 0) {
+		fprintf(stderr, "error zeroing quorum blocks: %s (%d)\n",
+			strerror(-ret), -ret);
+		goto out;
 	}
 
 	/* fill out allocator fields now that we've written our blocks */
@@ -503,6 +544,7 @@ out:
 		free(bt);
 	if (zeros)
 		free(zeros);
+	dev_ioq_destroy(ioq);
 	return ret;
 }
 
@@ -3,10 +3,12 @@
 #include <stdlib.h>
 #include <limits.h>
 #include <stdio.h>
+#include <stdbool.h>
 
 #include "sparse.h"
 #include "util.h"
 #include "format.h"
+#include "key.h"
 
 #include "parse.h"
 
@@ -45,6 +47,22 @@ int parse_u32(char *str, u32 *val_ret)
 	return 0;
 }
 
+/*
+ * Parse the number of threads given to a command's --threads option.
+ */
+int parse_threads(char *str, int *nr_threads)
+{
+	char *end;
+
+	*nr_threads = strtol(str, &end, 0);
+	if (*end != '\0' || *nr_threads <= 0) {
+		fprintf(stderr, "invalid number of threads '%s'\n", str);
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
 int parse_timespec(char *str, struct timespec *ts)
 {
 	unsigned long long sec;
@@ -69,3 +87,96 @@ int parse_timespec(char *str, struct timespec *ts)
 
 	return 0;
 }
+
+static int parse_key_name(char *str, char **strings, int nr, u64 max,
+			  u64 *val)
+{
+	char *end;
+	int i;
+
+	for (i = 0; strings && i < nr; i++) {
+		if (strings[i] && !strcmp(str, strings[i])) {
+			*val = i;
+			return 0;
+		}
+	}
+
+	*val = strtoull(str, &end, 0);
+	if (*str == '\0' || *end != '\0' || *val > max)
+		return -EINVAL;
+
+	return 0;
+}
+
+/*
+ * Parse a key in the zone.first.type.second.third.fourth form that
+ * keys are printed in.  Zones and types can be given by their printed
+ * names or by number.  Trailing fields can be omitted.  They're set to
+ * zero or, if last is set, to their max values so that a partial key
+ * can describe either end of a range.
+ */
+int parse_key(char *str, struct scoutfs_key *key, bool last)
+{
+	static const u64 maxes[] = {
+		U8_MAX, U64_MAX, U8_MAX, U64_MAX, U64_MAX, U8_MAX,
+	};
+	char *fields[array_size(maxes)];
+	u64 vals[array_size(maxes)];
+	char *buf;
+	char *s;
+	int nr = 0;
+	int ret;
+	int i;
+
+	buf = strdup(str);
+	if (!buf)
+		return -ENOMEM;
+
+	for (s = buf; nr < array_size(fields); nr++) {
+		fields[nr] = strsep(&s, ".");
+		if (!s) {
+			nr++;
+			break;
+		}
+	}
+
+	if (s || (nr == 1 && fields[0][0] == '\0')) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	for (i = 0; i < array_size(vals); i++) {
+		if (i >= nr) {
+			vals[i] = last ? maxes[i] : 0;
+			continue;
+		}
+
+		if (i == 0)
+			ret = parse_key_name(fields[i], scoutfs_zone_strings,
+					     SCOUTFS_MAX_ZONE, maxes[i],
+					     &vals[i]);
+		else if (i == 2 && vals[0] < SCOUTFS_MAX_ZONE)
+			ret = parse_key_name(fields[i],
+					     scoutfs_type_strings[vals[0]],
+					     SCOUTFS_MAX_TYPE, maxes[i],
+					     &vals[i]);
+		else
+			ret = parse_key_name(fields[i], NULL, 0, maxes[i],
+					     &vals[i]);
+		if (ret)
+			goto out;
+	}
+
+	key->sk_zone = vals[0];
+	key->_sk_first = cpu_to_le64(vals[1]);
+	key->sk_type = vals[2];
+	key->_sk_second = cpu_to_le64(vals[3]);
+	key->_sk_third = cpu_to_le64(vals[4]);
+	key->_sk_fourth = vals[5];
+	ret = 0;
+out:
+	if (ret == -EINVAL)
+		fprintf(stderr, "invalid key: '%s'\n", str);
+	free(buf);
+	return ret;
+}
@@ -2,9 +2,12 @@
 #define _PARSE_H_
 
 #include <sys/time.h>
+#include <stdbool.h>
 
 int parse_u64(char *str, u64 *val_ret);
 int parse_u32(char *str, u32 *val_ret);
+int parse_threads(char *str, int *nr_threads);
 int parse_timespec(char *str, struct timespec *ts);
+int parse_key(char *str, struct scoutfs_key *key, bool last);
 
 #endif
@@ -0,0 +1,135 @@
+#include <string.h>
+#include <errno.h>
+
+#include "sparse.h"
+#include "util.h"
+#include "format.h"
+#include "key.h"
+#include "pex.h"
+
+/*
+ * Packed extents start with a fixed header and are followed by the low
+ * bytes of the zigzag encoded difference between their first blkno and
+ * the last blkno of the previous mapped extent.  Extents without blocks
+ * don't store a difference and don't change the previous blkno.
+ */
+
+const u64 pex_diff_masks[9] = {
+	0x0000000000000000ULL, 0x00000000000000ffULL, 0x000000000000ffffULL,
+	0x0000000000ffffffULL, 0x00000000ffffffffULL, 0x000000ffffffffffULL,
+	0x0000ffffffffffffULL, 0x00ffffffffffffffULL, 0xffffffffffffffffULL,
+};
+
+void pex_decode_start(struct pex_decoder *dec, u64 base)
+{
+	dec->iblock = base << SCOUTFS_PACKEXT_BASE_SHIFT;
+	dec->blkno = 0;
+	dec->val = NULL;
+	dec->val_len = 0;
+	dec->off = 0;
+}
+
+/*
+ * Decode the extents in the value of the next part.  The logical and
+ * physical positions continue from the previous part.
+ */
+void pex_decode_item(struct pex_decoder *dec, void *val, unsigned val_len)
+{
+	dec->val = val;
+	dec->val_len = val_len;
+	dec->off = 0;
+}
+
+/*
+ * Decode the value of a packed extent item that's found while iterating
+ * over items in key order.  The first part starts a region and the
+ * following parts continue from the part before them.  Returns -EIO if
+ * a later part doesn't follow the previously decoded part, in which
+ * case its extents are decoded from the start of its region so callers
+ * that only print items can still show them.
+ */
+int pex_decode_key(struct pex_decoder *dec, struct scoutfs_key *key,
+		   void *val, unsigned val_len)
+{
+	int ret = 0;
+
+	if (key->skpe_part != 0 &&
+	    scoutfs_key_compare(key, &dec->next_key) != 0)
+		ret = -EIO;
+
+	if (key->skpe_part == 0 || ret < 0)
+		pex_decode_start(dec, le64_to_cpu(key->skpe_base));
+	pex_decode_item(dec, val, val_len);
+
+	dec->next_key = *key;
+	scoutfs_key_inc(&dec->next_key);
+	return ret;
+}
+
+void pex_encode_start(struct pex_encoder *enc, u64 base)
+{
+	enc->iblock = base << SCOUTFS_PACKEXT_BASE_SHIFT;
+	enc->blkno = 0;
+	enc->buf = NULL;
+	enc->size = 0;
+	enc->len = 0;
+}
+
+/*
+ * Encode following extents into the buffer for the value of the next
+ * part, continuing from the previous part.
+ */
+void pex_encode_item(struct pex_encoder *enc, void *buf, unsigned size)
+{
+	enc->buf = buf;
+	enc->size = size;
+	enc->len = 0;
+}
+
+/*
+ * Append an extent to the current item.  Extents must be contiguous
+ * with sparse extents filling holes.  Returns -ENOSPC if the extent
+ * doesn't fit in the item, in which case it can be encoded in the next
+ * part, or -EINVAL if it can't be encoded.
+ */
+int pex_encode_next(struct pex_encoder *enc, struct pex_extent *ext)
+{
+	struct scoutfs_packed_extent *pe;
+	unsigned db;
+	__le64 led;
+	s64 delta;
+	u64 diff;
+
+	if (ext->iblock != enc->iblock || ext->count == 0 ||
+	    ext->count > U16_MAX || ext->flags > 7)
+		return -EINVAL;
+
+	if (ext->blkno) {
+		delta = ext->blkno - enc->blkno;
+		if (delta == 0)
+			return -EINVAL;
+		diff = ((u64)delta << 1) ^ (u64)(delta >> 63);
+		db = (flsll(diff) + 7) / 8;
+	} else {
+		diff = 0;
+		db = 0;
+	}
+
+	if (enc->len + sizeof(struct scoutfs_packed_extent) + db > enc->size)
+		return -ENOSPC;
+
+	pe = (void *)(enc->buf + enc->len);
+	pe->count = cpu_to_le16(ext->count);
+	pe->diff_bytes = db;
+	pe->flags = ext->flags;
+	pe->final = !!ext->final;
+	led = cpu_to_le64(diff);
+	memcpy(pe->le_blkno_diff, &led, db);
+
+	if (ext->blkno)
+		enc->blkno = ext->blkno + ext->count - 1;
+	enc->iblock += ext->count;
+	enc->len += sizeof(struct scoutfs_packed_extent) + db;
+
+	return 0;
+}
@@ -0,0 +1,117 @@
+#ifndef _PEX_H_
+#define _PEX_H_
+
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+
+/*
+ * A decoded packed extent.  Extents without blocks have a 0 blkno,
+ * sparse extents also have 0 flags.
+ */
+struct pex_extent {
+	u64 iblock;
+	u64 blkno;
+	u32 count;
+	u8 flags;
+	bool final;
+};
+
+/*
+ * The parts of a region's packed extents are stored in a sequence of
+ * items.  The decoder and encoder carry the next logical block and the
+ * last block of the previous mapped extent from one part to the next.
+ * The decoder also remembers the key of the part that must come next.
+ * They're filled by the caller and don't allocate, decoders start
+ * zeroed.
+ */
+struct pex_decoder {
+	struct scoutfs_key next_key;
+	u64 iblock;
+	u64 blkno;
+	u8 *val;
+	unsigned val_len;
+	unsigned off;
+};
+
+struct pex_encoder {
+	u64 iblock;
+	u64 blkno;
+	u8 *buf;
+	unsigned size;
+	unsigned len;
+};
+
+extern const u64 pex_diff_masks[9];
+
+void pex_decode_start(struct pex_decoder *dec, u64 base);
+void pex_decode_item(struct pex_decoder *dec, void *val, unsigned val_len);
+int pex_decode_key(struct pex_decoder *dec, struct scoutfs_key *key,
+		   void *val, unsigned val_len);
+
+void pex_encode_start(struct pex_encoder *enc, u64 base);
+void pex_encode_item(struct pex_encoder *enc, void *buf, unsigned size);
+int pex_encode_next(struct pex_encoder *enc, struct pex_extent *ext);
+
+/*
+ * Returns 1 and fills the extent, 0 when the item has no more extents,
+ * or -EIO if the extents are malformed.
+ *
+ * Decoding is the hot path of walking file mappings so it's inlined.
+ * The difference bytes are loaded as a full word and masked when
+ * there's room in the value, and extents without blocks are handled
+ * with masks rather than branches.
+ */
+static inline int pex_decode_next(struct pex_decoder *dec,
+				  struct pex_extent *ext)
+{
+	struct scoutfs_packed_extent *pe;
+	unsigned off = dec->off;
+	unsigned db;
+	__le64 led;
+	u64 mapped;
+	u64 diff;
+	u32 count;
+
+	if (off >= dec->val_len)
+		return 0;
+
+	pe = (void *)(dec->val + off);
+	off += sizeof(struct scoutfs_packed_extent);
+	if (off > dec->val_len)
+		return -EIO;
+
+	db = pe->diff_bytes;
+	if (db > sizeof(u64) || off + db > dec->val_len)
+		return -EIO;
+
+	if (off + sizeof(u64) <= dec->val_len) {
+		memcpy(&led, pe->le_blkno_diff, sizeof(led));
+	} else {
+		led = 0;
+		memcpy(&led, pe->le_blkno_diff, db);
+	}
+	diff = le64_to_cpu(led) & pex_diff_masks[db];
+	diff = (diff >> 1) ^ (-(diff & 1));
+
+	count = le16_to_cpu(pe->count);
+	mapped = -(u64)(db != 0);
+
+	ext->iblock = dec->iblock;
+	ext->blkno = (dec->blkno + diff) & mapped;
+	ext->count = count;
+	ext->flags = pe->flags;
+	ext->final = pe->final;
+
+	/* a mapped extent can't start at 0, it would look sparse */
+	if (mapped && ext->blkno == 0)
+		return -EIO;
+
+	dec->blkno += (diff + count - 1) & mapped;
+	dec->iblock += count;
+	dec->off = off + db;
+
+	return 1;
+}
+
+#endif
@@ -0,0 +1,123 @@
+#include <unistd.h>
+
+#include "sparse.h"
+#include "util.h"
+#include "popcount.h"
+
+/*
+ * Count the set bits in an array of 64bit words.  Bitmaps in the
+ * format are little endian words but the count doesn't depend on the
+ * order of the bytes so they can be counted in place.
+ *
+ * The fastest implementation that the cpu supports is chosen as the
+ * program starts.  With avx2 each byte of 32 byte vectors is counted by
+ * looking up its nibbles in a table with a shuffle.  The byte counts
+ * are summed for a few iterations before being added into 64bit lanes
+ * with a sum of absolute differences.  Without avx2 the popcnt
+ * instruction is used on four words at a time to keep independent
+ * chains in flight.  Otherwise the compiler's generic popcount is used.
+ */
+static u64 popcount_sw(const void *words, u64 nr)
+{
+	const u64 *w = words;
+	u64 count = 0;
+	u64 i;
+
+	for (i = 0; i < nr; i++)
+		count += __builtin_popcountll(w[i]);
+
+	return count;
+}
+
+static u64 (*popcount_func)(const void *words, u64 nr) = popcount_sw;
+
+#if defined(__x86_64__)
+
+static u64 __attribute__((target("popcnt")))
+popcount_popcnt(const void *words, u64 nr)
+{
+	const u64 *w = words;
+	u64 a = 0;
+	u64 b = 0;
+	u64 c = 0;
+	u64 d = 0;
+	u64 i;
+
+	for (i = 0; i + 4 <= nr; i += 4) {
+		a += __builtin_popcountll(w[i]);
+		b += __builtin_popcountll(w[i + 1]);
+		c += __builtin_popcountll(w[i + 2]);
+		d += __builtin_popcountll(w[i + 3]);
+	}
+	for (; i < nr; i++)
+		a += __builtin_popcountll(w[i]);
+
+	return a + b + c + d;
+}
+
+typedef char popc_v32qi __attribute__((vector_size(32)));
+typedef long long popc_v4di __attribute__((vector_size(32)));
+/* words don't have to be aligned to vectors */
+typedef long long popc_v4du __attribute__((vector_size(32), aligned(8)));
+
+/* byte counts can sum 8 bits for 31 iterations without overflowing */
+#define POPCOUNT_AVX2_BATCH 31
+
+static u64 __attribute__((target("avx2,popcnt")))
+popcount_avx2(const void *words, u64 nr)
+{
+	const popc_v32qi lut = {
+		0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+		0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+	};
+	const popc_v32qi low = {
+		0xf, 0xf, 0xf, 0xf, 0xf, 0xf, 0xf, 0xf,
+		0xf, 0xf, 0xf, 0xf, 0xf, 0xf, 0xf, 0xf,
+		0xf, 0xf, 0xf, 0xf, 0xf, 0xf, 0xf, 0xf,
+		0xf, 0xf, 0xf, 0xf, 0xf, 0xf, 0xf, 0xf,
+	};
+	const popc_v32qi zero = { 0, };
+	const popc_v4du *v = words;
+	popc_v4di sums = { 0, };
+	popc_v32qi counts;
+	popc_v32qi x;
+	u64 nr_vecs = nr / 4;
+	u64 i = 0;
+	u64 end;
+
+	while (i < nr_vecs) {
+		end = min(i + POPCOUNT_AVX2_BATCH, nr_vecs);
+		counts = zero;
+		for (; i < end; i++) {
+			x = (popc_v32qi)v[i];
+			counts += __builtin_ia32_pshufb256(lut, x & low) +
+				  __builtin_ia32_pshufb256(lut,
+					(popc_v32qi)((popc_v4di)x >> 4) & low);
+		}
+		sums += (popc_v4di)__builtin_ia32_psadbw256(counts, zero);
+	}
+
+	return sums[0] + sums[1] + sums[2] + sums[3] +
+	       popcount_popcnt((const u64 *)words + (nr_vecs * 4),
+			       nr - (nr_vecs * 4));
+}
+
+#endif
+
+static void __attribute__((constructor)) popcount_ctor(void)
+{
+#if defined(__x86_64__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("popcnt")) {
+		if (__builtin_cpu_supports("avx2"))
+			popcount_func = popcount_avx2;
+		else
+			popcount_func = popcount_popcnt;
+	}
+#endif
+}
+
+u64 popcount_words(const void *words, u64 nr)
+{
+	return popcount_func(words, nr);
+}
@@ -0,0 +1,6 @@
+#ifndef _POPCOUNT_H_
+#define _POPCOUNT_H_
+
+u64 popcount_words(const void *words, u64 nr);
+
+#endif
@@ -12,6 +12,8 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <getopt.h>
+#include <stdbool.h>
 
 #include "sparse.h"
 #include "util.h"
@@ -21,26 +23,13 @@
 #include "crc.h"
 #include "key.h"
 #include "radix.h"
-
-static void *read_block(int fd, u64 blkno)
-{
-	ssize_t ret;
-	void *buf;
-
-	buf = malloc(SCOUTFS_BLOCK_SIZE);
-	if (!buf)
-		return NULL;
-
-	ret = pread(fd, buf, SCOUTFS_BLOCK_SIZE, blkno << SCOUTFS_BLOCK_SHIFT);
-	if (ret != SCOUTFS_BLOCK_SIZE) {
-		fprintf(stderr, "read blkno %llu returned %zd: %s (%d)\n",
-			blkno, ret, strerror(errno), errno);
-		free(buf);
-		buf = NULL;
-	}
-
-	return buf;
-}
+#include "block.h"
+#include "records.h"
+#include "btree.h"
+#include "parse.h"
+#include "forest.h"
+#include "pex.h"
+#include "item_type.h"
 
 static void print_block_header(struct scoutfs_block_header *hdr)
 {
@@ -58,7 +47,8 @@ static void print_block_header(struct scoutfs_block_header *hdr)
 		le64_to_cpu(hdr->seq));
 }
 
-static void print_inode(struct scoutfs_key *key, void *val, int val_len)
+void print_inode(struct scoutfs_key *key, void *val, int val_len,
+		 void *arg)
 {
 	struct scoutfs_inode *inode = val;
 
@@ -85,7 +75,8 @@ static void print_inode(struct scoutfs_key *key, void *val, int val_len)
 	       le32_to_cpu(inode->mtime.nsec));
 }
 
-static void print_orphan(struct scoutfs_key *key, void *val, int val_len)
+void print_orphan(struct scoutfs_key *key, void *val, int val_len,
+		  void *arg)
 {
 	printf("    orphan: ino %llu\n", le64_to_cpu(key->sko_ino));
 }
@@ -103,7 +94,8 @@ static u8 *global_printable_name(u8 *name, int name_len)
 	return name_buf;
 }
 
-static void print_xattr(struct scoutfs_key *key, void *val, int val_len)
+void print_xattr(struct scoutfs_key *key, void *val, int val_len,
+		 void *arg)
 {
 	struct scoutfs_xattr *xat = val;
 
@@ -117,7 +109,8 @@ static void print_xattr(struct scoutfs_key *key, void *val, int val_len)
 		       global_printable_name(xat->name, xat->name_len));
 }
 
-static void print_dirent(struct scoutfs_key *key, void *val, int val_len)
+void print_dirent(struct scoutfs_key *key, void *val, int val_len,
+		  void *arg)
 {
 	struct scoutfs_dirent *dent = val;
 	unsigned int name_len = val_len - sizeof(*dent);
@@ -130,7 +123,8 @@ static void print_dirent(struct scoutfs_key *key, void *val, int val_len)
 	       name);
 }
 
-static void print_symlink(struct scoutfs_key *key, void *val, int val_len)
+void print_symlink(struct scoutfs_key *key, void *val, int val_len,
+		   void *arg)
 {
 	u8 *frag = val;
 	u8 *name;
@@ -145,124 +139,72 @@ static void print_symlink(struct scoutfs_key *key, void *val, int val_len)
 	       le64_to_cpu(key->sks_ino), le64_to_cpu(key->sks_nr), name);
 }
 
-static void print_packed_extent(struct scoutfs_key *key, void *val, int val_len)
+/*
+ * Parts after the first in a region are decoded from where the previous
+ * part left off.  Walks print items in key order so the walk's arg is
+ * a decoder that's carried from one printed part to the next.
+ */
+void print_packed_extent(struct scoutfs_key *key, void *val,
+			 int val_len, void *arg)
 {
-	struct scoutfs_packed_extent *pe;
-	__le64 led;
-	u64 iblock;
-	u64 blkno = 0;
-	u64 diff;
-	int off = 0;
-	int i = 0;
-
-
-	/*
-	 * Ugh, this is the only item that has state between items.  It
-	 * probably shouldn't.  And I'm too lazy to plumb an arg through
-	 * all the printers.
-	 */
-	static struct scoutfs_key next_key;
-	static u64 next_blkno;
-
-	if (scoutfs_key_compare(key, &next_key) == 0)
-		blkno = next_blkno;
-
-	iblock = le64_to_cpu(key->skpe_base) << SCOUTFS_PACKEXT_BASE_SHIFT;
-
-	while (off < val_len) {
-		printf("      [%u] off %u: ibl %llu ", i, off, iblock);
-
-		if (off + sizeof(struct scoutfs_packed_extent) > val_len) {
-			printf("(packed extent struct exceeds item)\n");
-			return;
-		}
-
-		pe = val + off;
-		printf("cnt %u dfb %u fl %x fin %u ",
-			le16_to_cpu(pe->count), pe->diff_bytes, pe->flags,
-			pe->final);
+	struct pex_decoder *pp = arg;
+	struct pex_decoder dec = {{0,}};
+	struct pex_extent ext;
+	unsigned off;
+	u64 prev;
+	int ret;
+	int i;
 
-		off += sizeof(struct scoutfs_packed_extent);
+	if (pp)
+		dec = *pp;
+	pex_decode_key(&dec, key, val, val_len);
 
-		if (off + pe->diff_bytes > val_len) {
-			printf("(packed extent diff bytes exceeds item)\n");
-			return;
-		}
+	for (i = 0; ; i++) {
+		off = dec.off;
+		prev = dec.blkno;
+		ret = pex_decode_next(&dec, &ext);
+		if (ret <= 0)
+			break;
 
-		if (pe->diff_bytes) {
-			led = 0;
-			memcpy(&led, pe->le_blkno_diff, pe->diff_bytes);
-			diff = le64_to_cpu(led);
-			diff = (diff >> 1) ^ (-(diff & 1));
-			blkno += diff;
-			printf("dif %lld blk %llu\n", (s64)diff, blkno);
-			blkno += le16_to_cpu(pe->count) - 1;
-		} else {
+		printf("      [%u] off %u: ibl %llu cnt %u dfb %lu fl %x fin %u ",
+		       i, off, ext.iblock, ext.count,
+		       dec.off - off - sizeof(struct scoutfs_packed_extent),
+		       ext.flags, ext.final);
+		if (ext.blkno)
+			printf("dif %lld blk %llu\n", (s64)(ext.blkno - prev),
+			       ext.blkno);
+		else
 			printf("(sparse)\n");
-		}
-
-		iblock += le16_to_cpu(pe->count);
-		off += pe->diff_bytes;
-		i++;
 	}
 
-	next_blkno = blkno;
-	next_key = *key;
-	scoutfs_key_inc(&next_key);
+	if (ret < 0)
+		printf("      [%u] off %u: (packed extent exceeds item)\n",
+		       i, off);
+
+	if (pp)
+		*pp = dec;
 }
 
-static void print_inode_index(struct scoutfs_key *key, void *val, int val_len)
+void print_inode_index(struct scoutfs_key *key, void *val,
+		       int val_len, void *arg)
 {
 	printf("      index: major %llu ino %llu\n",
 	       le64_to_cpu(key->skii_major), le64_to_cpu(key->skii_ino));
 }
 
-static void print_xattr_index(struct scoutfs_key *key, void *val, int val_len)
+void print_xattr_index(struct scoutfs_key *key, void *val,
+		       int val_len, void *arg)
 {
 	printf("      xattr index: hash 0x%016llx ino %llu id %llu\n",
 	       le64_to_cpu(key->skxi_hash), le64_to_cpu(key->skxi_ino),
 	       le64_to_cpu(key->skxi_id));
 }
 
-typedef void (*print_func_t)(struct scoutfs_key *key, void *val, int val_len);
-
-static print_func_t find_printer(u8 zone, u8 type)
-{
-	if (zone == SCOUTFS_INODE_INDEX_ZONE &&
-	    type >= SCOUTFS_INODE_INDEX_META_SEQ_TYPE  &&
-	    type <= SCOUTFS_INODE_INDEX_DATA_SEQ_TYPE)
-		return print_inode_index;
-
-	if (zone == SCOUTFS_XATTR_INDEX_ZONE &&
-	    type >= SCOUTFS_XATTR_INDEX_NAME_TYPE)
-		return print_xattr_index;
-
-	if (zone == SCOUTFS_RID_ZONE) {
-		if (type == SCOUTFS_ORPHAN_TYPE)
-			return print_orphan;
-	}
-
-	if (zone == SCOUTFS_FS_ZONE) {
-		switch(type) {
-			case SCOUTFS_INODE_TYPE: return print_inode;
-			case SCOUTFS_XATTR_TYPE: return print_xattr;
-			case SCOUTFS_DIRENT_TYPE: return print_dirent;
-			case SCOUTFS_READDIR_TYPE: return print_dirent;
-			case SCOUTFS_SYMLINK_TYPE: return print_symlink;
-			case SCOUTFS_LINK_BACKREF_TYPE: return print_dirent;
-			case SCOUTFS_PACKED_EXTENT_TYPE:
-				return print_packed_extent;
-		}
-	}
-
-	return NULL;
-}
-
 static int print_fs_item(void *key, unsigned key_len, void *val,
 			 unsigned val_len, void *arg)
 {
 	struct scoutfs_key item_key;
-	print_func_t printer;
+	const struct item_type *ityp;
 
 	scoutfs_key_from_be(&item_key, key);
 
@@ -270,9 +212,9 @@ static int print_fs_item(void *key, unsigned key_len, void *val,
 
 	/* only items in leaf blocks have values */
 	if (val) {
-		printer = find_printer(item_key.sk_zone, item_key.sk_type);
-		if (printer)
-			printer(&item_key, val, val_len);
+		ityp = item_type_find(item_key.sk_zone, item_key.sk_type);
+		if (ityp && ityp->print)
+			ityp->print(&item_key, val, val_len, arg);
 		else
 			printf("      (unknown zone %u type %u)\n",
 			       item_key.sk_zone, item_key.sk_type);
@@ -287,7 +229,7 @@ static int print_logs_item(void *key, unsigned key_len, void *val,
 {
 	struct scoutfs_key item_key;
 	struct scoutfs_log_item_value *liv;
-	print_func_t printer;
+	const struct item_type *ityp;
 
 	scoutfs_key_from_be(&item_key, key);
 
@@ -301,11 +243,11 @@ static int print_logs_item(void *key, unsigned key_len, void *val,
 
 		/* deletion items don't have values */
 		if (!(liv->flags & SCOUTFS_LOG_ITEM_FLAG_DELETION)) {
-			printer = find_printer(item_key.sk_zone,
-					       item_key.sk_type);
-			if (printer)
-				printer(&item_key, val + sizeof(*liv),
-					val_len - sizeof(*liv));
+			ityp = item_type_find(item_key.sk_zone,
+					      item_key.sk_type);
+			if (ityp && ityp->print)
+				ityp->print(&item_key, val + sizeof(*liv),
+					    val_len - sizeof(*liv), arg);
 			else
 				printf("      (unknown zone %u type %u)\n",
 				       item_key.sk_zone, item_key.sk_type);
@@ -407,12 +349,33 @@ static int print_btree_ref(void *key, unsigned key_len, void *val,
 	return 0;
 }
 
-static int print_btree_block(int fd, struct scoutfs_super_block *super,
+/*
+ * Start reading all the child blocks referenced by a parent btree block
+ * so that the reads are in flight while we walk the children in order.
+ */
+static void readahead_btree_children(struct block_cache *bc,
+				     struct scoutfs_btree_block *bt)
+{
+	struct scoutfs_btree_item *item;
+	struct scoutfs_btree_ref *ref;
+	int i;
+
+	for (i = 0; i < le32_to_cpu(bt->nr_items); i++) {
+		item = (void *)bt + le32_to_cpu(bt->item_hdrs[i].off);
+		ref = (void *)(item + 1) + le16_to_cpu(item->key_len);
+		if (ref->blkno)
+			block_readahead(bc, le64_to_cpu(ref->blkno));
+	}
+}
+
+static int print_btree_block(struct block_cache *bc,
+			     struct scoutfs_super_block *super,
 			     char *which, struct scoutfs_btree_ref *ref,
 			     print_item_func func, void *arg, u8 level)
 {
 	struct scoutfs_btree_item *item;
 	struct scoutfs_btree_block *bt;
+	struct block *bl;
 	unsigned key_len;
 	unsigned val_len;
 	void *key;
@@ -420,9 +383,10 @@ static int print_btree_block(int fd, struct scoutfs_super_block *super,
 	int ret;
 	int i;
 
-	bt = read_block(fd, le64_to_cpu(ref->blkno));
-	if (!bt)
+	bl = block_read(bc, le64_to_cpu(ref->blkno));
+	if (!bl)
 		return -ENOMEM;
+	bt = block_data(bl);
 
 	if (bt->level == level) {
 		printf("%s btree blkno %llu\n"
@@ -438,6 +402,9 @@ static int print_btree_block(int fd, struct scoutfs_super_block *super,
 		       le32_to_cpu(bt->nr_items));
 	}
 
+	if (level < bt->level)
+		readahead_btree_children(bc, bt);
+
 	for (i = 0; i < le32_to_cpu(bt->nr_items); i++) {
 		item = (void *)bt + le32_to_cpu(bt->item_hdrs[i].off);
 		key_len = le16_to_cpu(item->key_len);
@@ -449,7 +416,7 @@ static int print_btree_block(int fd, struct scoutfs_super_block *super,
 			ref = val;
 			/* XXX check len */
 			if (ref->blkno) {
-				ret = print_btree_block(fd, super, which, ref,
+				ret = print_btree_block(bc, super, which, ref,
 							func, arg, level);
 				if (ret)
 					break;
@@ -466,7 +433,7 @@ static int print_btree_block(int fd, struct scoutfs_super_block *super,
 			func(key, key_len, val, val_len, arg);
 	}
 
-	free(bt);
+	block_put(bc, bl);
 	return 0;
 }
 
@@ -475,7 +442,8 @@ static int print_btree_block(int fd, struct scoutfs_super_block *super,
  * blocks are printed before the factor of fanout more numerous leaf
  * blocks and their included items.
  */
-static int print_btree(int fd, struct scoutfs_super_block *super, char *which,
+static int print_btree(struct block_cache *bc,
+		       struct scoutfs_super_block *super, char *which,
 		       struct scoutfs_btree_root *root,
 		       print_item_func func, void *arg)
 {
@@ -483,7 +451,7 @@ static int print_btree(int fd, struct scoutfs_super_block *super, char *which,
 	int i;
 
 	for (i = root->height - 1; i >= 0; i--) {
-		ret = print_btree_block(fd, super, which, &root->ref,
+		ret = print_btree_block(bc, super, which, &root->ref,
 					func, arg, i);
 		if (ret)
 			break;
@@ -492,9 +460,11 @@ static int print_btree(int fd, struct scoutfs_super_block *super, char *which,
 	return ret;
 }
 
-static int print_radix_block(int fd, struct scoutfs_radix_ref *par, int level)
+static int print_radix_block(struct block_cache *bc,
+			     struct scoutfs_radix_ref *par, int level)
 {
 	struct scoutfs_radix_block *rdx;
+	struct block *bl;
 	u64 blkno;
 	int prev;
 	int ret;
@@ -506,11 +476,10 @@ static int print_radix_block(int fd, struct scoutfs_radix_ref *par, int level)
 	if (blkno == 0 || blkno == U64_MAX || level == 0)
 		return 0;
 
-	rdx = read_block(fd, le64_to_cpu(par->blkno));
-	if (!rdx) {
-		ret = -ENOMEM;
-		goto out;
-	}
+	bl = block_read(bc, le64_to_cpu(par->blkno));
+	if (!bl)
+		return -ENOMEM;
+	rdx = block_data(bl);
 
 	printf("radix parent block blkno %llu\n", le64_to_cpu(par->blkno));
 	print_block_header(&rdx->hdr);
@@ -541,25 +510,33 @@ static int print_radix_block(int fd, struct scoutfs_radix_ref *par, int level)
 		printf(RADREF_F"\n", RADREF_A(&rdx->refs[i]));
 	}
 
+	/* we don't print leaves so don't read them */
+	if (level > 1) {
+		for (i = 0; i < SCOUTFS_RADIX_REFS; i++) {
+			blkno = le64_to_cpu(rdx->refs[i].blkno);
+			if (blkno != 0 && blkno != U64_MAX)
+				block_readahead(bc, blkno);
+		}
+	}
+
 	ret = 0;
 	for (i = 0; i < SCOUTFS_RADIX_REFS; i++) {
 		if (le64_to_cpu(rdx->refs[i].blkno) != 0 &&
 		    le64_to_cpu(rdx->refs[i].blkno) != U64_MAX) {
-			err = print_radix_block(fd, &rdx->refs[i], level - 1);
+			err = print_radix_block(bc, &rdx->refs[i], level - 1);
 			if (err < 0 && ret == 0)
 				ret = err;
 		}
 	}
 
-out:
-	free(rdx);
+	block_put(bc, bl);
 
 	return ret;
 }
 
 struct print_recursion_args {
 	struct scoutfs_super_block *super;
-	int fd;
+	struct block_cache *bc;
 };
 
 /* same as fs item but with a small header in the value */
@@ -569,42 +546,45 @@ static int print_log_trees_roots(void *key, unsigned key_len, void *val,
 //	struct scoutfs_log_trees_key *ltk = key;
 	struct scoutfs_log_trees_val *ltv = val;
 	struct print_recursion_args *pa = arg;
+	struct pex_decoder pex = {{0,}};
 	int ret = 0;
 	int err;
 
 	/* XXX doesn't print the bloom block */
 
-	err = print_radix_block(pa->fd, &ltv->meta_avail.ref,
+	err = print_radix_block(pa->bc, &ltv->meta_avail.ref,
 				ltv->meta_avail.height - 1);
 	if (err && !ret)
 		ret = err;
-	err = print_radix_block(pa->fd, &ltv->meta_freed.ref,
+	err = print_radix_block(pa->bc, &ltv->meta_freed.ref,
 				ltv->meta_avail.height - 1);
 	if (err && !ret)
 		ret = err;
-	err = print_radix_block(pa->fd, &ltv->data_avail.ref,
+	err = print_radix_block(pa->bc, &ltv->data_avail.ref,
 				ltv->data_avail.height - 1);
 	if (err && !ret)
 		ret = err;
-	err = print_radix_block(pa->fd, &ltv->meta_freed.ref,
+	err = print_radix_block(pa->bc, &ltv->meta_freed.ref,
 				ltv->data_avail.height - 1);
 	if (err && !ret)
 		ret = err;
 
-	err = print_btree(pa->fd, pa->super, "", &ltv->item_root,
-			  print_logs_item, NULL);
+	err = print_btree(pa->bc, pa->super, "", &ltv->item_root,
+			  print_logs_item, &pex);
 	if (err && !ret)
 		ret = err;
 
 	return ret;
 }
 
-static int print_btree_leaf_items(int fd, struct scoutfs_super_block *super,
+static int print_btree_leaf_items(struct block_cache *bc,
+				  struct scoutfs_super_block *super,
 				  struct scoutfs_btree_ref *ref,
 				  print_item_func func, void *arg)
 {
 	struct scoutfs_btree_item *item;
 	struct scoutfs_btree_block *bt;
+	struct block *bl;
 	unsigned key_len;
 	unsigned val_len;
 	void *key;
@@ -615,9 +595,13 @@ static int print_btree_leaf_items(int fd, struct scoutfs_super_block *super,
 	if (ref->blkno == 0)
 		return 0;
 
-	bt = read_block(fd, le64_to_cpu(ref->blkno));
-	if (!bt)
+	bl = block_read(bc, le64_to_cpu(ref->blkno));
+	if (!bl)
 		return -ENOMEM;
+	bt = block_data(bl);
+
+	if (bt->level > 0)
+		readahead_btree_children(bc, bt);
 
 	for (i = 0; i < le32_to_cpu(bt->nr_items); i++) {
 		item = (void *)bt + le32_to_cpu(bt->item_hdrs[i].off);
@@ -627,7 +611,7 @@ static int print_btree_leaf_items(int fd, struct scoutfs_super_block *super,
 		val = (void *)key + key_len;
 
 		if (bt->level > 0) {
-			ret = print_btree_leaf_items(fd, super, val, func, arg);
+			ret = print_btree_leaf_items(bc, super, val, func, arg);
 			if (ret)
 				break;
 			continue;
@@ -636,7 +620,7 @@ static int print_btree_leaf_items(int fd, struct scoutfs_super_block *super,
 		}
 	}
 
-	free(bt);
+	block_put(bc, bl);
 	return 0;
 }
 
@@ -666,9 +650,11 @@ static char *alloc_addr_str(struct scoutfs_inet_addr *ia)
 	return str;
 }
 
-static int print_quorum_blocks(int fd, struct scoutfs_super_block *super)
+static int print_quorum_blocks(struct block_cache *bc,
+			       struct scoutfs_super_block *super)
 {
-	struct scoutfs_quorum_block *blk = NULL;
+	struct scoutfs_quorum_block *blk;
+	struct block *bl = NULL;
 	char *log_addr = NULL;
 	u64 blkno;
 	int ret;
@@ -677,12 +663,13 @@ static int print_quorum_blocks(int fd, struct scoutfs_super_block *super)
 
 	for (i = 0; i < SCOUTFS_QUORUM_BLOCKS; i++) {
 		blkno = SCOUTFS_QUORUM_BLKNO + i;
-		free(blk);
-		blk = read_block(fd, blkno);
-		if (!blk) {
+		block_put(bc, bl);
+		bl = block_read(bc, blkno);
+		if (!bl) {
 			ret = -ENOMEM;
 			goto out;
 		}
+		blk = block_data(bl);
 
 		if (blk->voter_rid != 0) {
 			printf("quorum block blkno %llu\n"
@@ -714,6 +701,7 @@ static int print_quorum_blocks(int fd, struct scoutfs_super_block *super)
 
 	ret = 0;
 out:
+	block_put(bc, bl);
 	free(log_addr);
 
 	return ret;
@@ -784,86 +772,321 @@ static void print_super_block(struct scoutfs_super_block *super, u64 blkno)
 	free(server_addr);
 }
 
-static int print_volume(int fd)
+static int print_volume(struct block_cache *bc)
 {
 	struct scoutfs_super_block *super = NULL;
 	struct print_recursion_args pa;
+	struct pex_decoder pex = {{0,}};
+	struct block *bl;
 	int ret = 0;
 	int err;
 
-	super = read_block(fd, SCOUTFS_SUPER_BLKNO);
-	if (!super)
+	bl = block_read(bc, SCOUTFS_SUPER_BLKNO);
+	if (!bl)
 		return -ENOMEM;
+	super = block_data(bl);
 
 	print_super_block(super, SCOUTFS_SUPER_BLKNO);
 
-	ret = print_quorum_blocks(fd, super);
+	ret = print_quorum_blocks(bc, super);
 
-	err = print_btree(fd, super, "lock_clients", &super->lock_clients,
+	err = print_btree(bc, super, "lock_clients", &super->lock_clients,
 			  print_lock_clients_entry, NULL);
 	if (err && !ret)
 		ret = err;
 
-	err = print_btree(fd, super, "mounted_clients", &super->mounted_clients,
+	err = print_btree(bc, super, "mounted_clients", &super->mounted_clients,
 			  print_mounted_client_entry, NULL);
 	if (err && !ret)
 		ret = err;
 
-	err = print_btree(fd, super, "trans_seqs", &super->trans_seqs,
+	err = print_btree(bc, super, "trans_seqs", &super->trans_seqs,
 			  print_trans_seqs_entry, NULL);
 	if (err && !ret)
 		ret = err;
 
-	err = print_radix_block(fd, &super->core_meta_avail.ref,
+	err = print_radix_block(bc, &super->core_meta_avail.ref,
 				super->core_meta_avail.height - 1);
 	if (err && !ret)
 		ret = err;
-	err = print_radix_block(fd, &super->core_meta_freed.ref,
+	err = print_radix_block(bc, &super->core_meta_freed.ref,
 				super->core_meta_freed.height - 1);
 	if (err && !ret)
 		ret = err;
-	err = print_radix_block(fd, &super->core_data_avail.ref,
+	err = print_radix_block(bc, &super->core_data_avail.ref,
 				super->core_data_avail.height - 1);
 	if (err && !ret)
 		ret = err;
-	err = print_radix_block(fd, &super->core_data_freed.ref,
+	err = print_radix_block(bc, &super->core_data_freed.ref,
 				super->core_data_freed.height - 1);
 	if (err && !ret)
 		ret = err;
 
-	err = print_btree(fd, super, "logs_root", &super->logs_root,
+	err = print_btree(bc, super, "logs_root", &super->logs_root,
 			  print_log_trees_item, NULL);
 	if (err && !ret)
 		ret = err;
 
 	pa.super = super;
-	pa.fd = fd;
-	err = print_btree_leaf_items(fd, super, &super->logs_root.ref,
+	pa.bc = bc;
+	err = print_btree_leaf_items(bc, super, &super->logs_root.ref,
 				     print_log_trees_roots, &pa);
 	if (err && !ret)
 		ret = err;
 
-	err = print_btree(fd, super, "fs_root", &super->fs_root,
-			  print_fs_item, NULL);
+	err = print_btree(bc, super, "fs_root", &super->fs_root,
+			  print_fs_item, &pex);
 	if (err && !ret)
 		ret = err;
 
-	free(super);
+	block_put(bc, bl);
+
+	return ret;
+}
 
+/*
+ * Print the fs items in a range of keys in the fs_root and in all the
+ * log trees.  Only the blocks whose keys intersect the range are read.
+ * The leaf block is printed before the first item from each leaf.
+ */
+struct print_range_args {
+	struct block_cache *bc;
+	struct scoutfs_key_be first;
+	struct scoutfs_key_be last;
+	char tree[64];
+	u64 blkno;
+	u64 nr_items;
+	struct pex_decoder pex;
+};
+
+static void print_range_leaf(struct print_range_args *ra, u64 blkno)
+{
+	if (ra->blkno != blkno) {
+		printf("%s leaf blkno %llu\n", ra->tree, blkno);
+		ra->blkno = blkno;
+	}
+	ra->nr_items++;
+}
+
+static int print_range_fs_item(void *key, unsigned key_len, void *val,
+			       unsigned val_len, u64 blkno, void *arg)
+{
+	struct print_range_args *ra = arg;
+
+	print_range_leaf(ra, blkno);
+	return print_fs_item(key, key_len, val, val_len, &ra->pex);
+}
+
+static int print_range_logs_item(void *key, unsigned key_len, void *val,
+				 unsigned val_len, u64 blkno, void *arg)
+{
+	struct print_range_args *ra = arg;
+
+	print_range_leaf(ra, blkno);
+	return print_logs_item(key, key_len, val, val_len, &ra->pex);
+}
+
+static int print_range_log_tree(void *key, unsigned key_len, void *val,
+				unsigned val_len, u64 blkno, void *arg)
+{
+	struct scoutfs_log_trees_key *ltk = key;
+	struct scoutfs_log_trees_val *ltv = val;
+	struct print_range_args *ra = arg;
+
+	snprintf(ra->tree, sizeof(ra->tree), "log tree rid %016llx nr %llu",
+		 be64_to_cpu(ltk->rid), be64_to_cpu(ltk->nr));
+	ra->blkno = 0;
+	memset(&ra->pex, 0, sizeof(ra->pex));
+
+	return btree_walk(ra->bc, &ltv->item_root, &ra->first,
+			  sizeof(ra->first), &ra->last, sizeof(ra->last),
+			  print_range_logs_item, ra);
+}
+
+static int print_key_range(struct block_cache *bc, struct scoutfs_key *first,
+			   struct scoutfs_key *last, u64 *nr_items)
+{
+	struct scoutfs_super_block *super;
+	struct print_range_args ra;
+	struct block *bl;
+	int ret;
+
+	bl = block_read(bc, SCOUTFS_SUPER_BLKNO);
+	if (!bl)
+		return -ENOMEM;
+	super = block_data(bl);
+
+	memset(&ra, 0, sizeof(ra));
+	ra.bc = bc;
+	scoutfs_key_to_be(&ra.first, first);
+	scoutfs_key_to_be(&ra.last, last);
+
+	strcpy(ra.tree, "fs_root");
+	ret = btree_walk(bc, &super->fs_root, &ra.first, sizeof(ra.first),
+			 &ra.last, sizeof(ra.last), print_range_fs_item, &ra);
+	if (ret == 0)
+		ret = btree_walk(bc, &super->logs_root, NULL, 0, NULL, 0,
+				 print_range_log_tree, &ra);
+
+	block_put(bc, bl);
+	*nr_items = ra.nr_items;
 	return ret;
 }
 
+/*
+ * Print only the current version of each item in the range, as the
+ * kernel would see it after merging the log trees into the fs_root.
+ */
+static int print_merged_range(struct block_cache *bc,
+			      struct scoutfs_key *first,
+			      struct scoutfs_key *last)
+{
+	struct scoutfs_super_block *super;
+	struct forest_iter *it = NULL;
+	struct forest *fo = NULL;
+	struct scoutfs_key *key;
+	struct pex_decoder pex = {{0,}};
+	const struct item_type *ityp;
+	struct block *bl;
+	unsigned val_len;
+	void *val;
+	int ret;
+
+	bl = block_read(bc, SCOUTFS_SUPER_BLKNO);
+	if (!bl)
+		return -ENOMEM;
+	super = block_data(bl);
+
+	ret = forest_open(bc, super, &fo) ?:
+	      forest_iter_start(fo, first, last, &it);
+	if (ret < 0)
+		goto out;
+
+	printf("merged items, %llu log trees skipped by bloom filters\n",
+	       forest_iter_skipped(it));
+
+	while ((ret = forest_iter_next(it, &key, &val, &val_len)) > 0) {
+		printf("    "SK_FMT"\n", SK_ARG(key));
+		ityp = item_type_find(key->sk_zone, key->sk_type);
+		if (ityp && ityp->print)
+			ityp->print(key, val, val_len, &pex);
+		else
+			printf("      (unknown zone %u type %u)\n",
+			       key->sk_zone, key->sk_type);
+	}
+
+out:
+	forest_iter_stop(it);
+	forest_close(fo);
+	block_put(bc, bl);
+	return ret;
+}
+
+/* parse either FIRST..LAST or a single zone */
+static int parse_key_range(char *str, struct scoutfs_key *first,
+			   struct scoutfs_key *last, bool zone)
+{
+	char *dots;
+	int ret;
+
+	if (zone) {
+		if (strchr(str, '.')) {
+			fprintf(stderr, "invalid zone: '%s'\n", str);
+			return -EINVAL;
+		}
+		return parse_key(str, first, false) ?:
+		       parse_key(str, last, true);
+	}
+
+	dots = strstr(str, "..");
+	if (!dots) {
+		fprintf(stderr, "key range '%s' must be FIRST..LAST\n", str);
+		return -EINVAL;
+	}
+
+	*dots = '\0';
+	ret = parse_key(str, first, false) ?:
+	      parse_key(dots + 2, last, true);
+	*dots = '.';
+	if (ret)
+		return ret;
+
+	if (scoutfs_key_compare(first, last) > 0) {
+		fprintf(stderr, "key range first key is greater than last\n");
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+static struct option long_ops[] = {
+	{ "format", 1, NULL, 'f' },
+	{ "key-range", 1, NULL, 'k' },
+	{ "merged", 0, NULL, 'M' },
+	{ "mmap", 0, NULL, 'm' },
+	{ "zone", 1, NULL, 'z' },
+	{ NULL, 0, NULL, 0}
+};
+
 static int print_cmd(int argc, char **argv)
 {
+	struct scoutfs_key first;
+	struct scoutfs_key last;
+	struct block_cache *bc;
+	bool use_mmap = false;
+	bool merged = false;
+	bool range = false;
+	int format = 0;
+	u64 nr_items;
 	char *path;
 	int ret;
 	int fd;
+	int c;
+
+	while ((c = getopt_long(argc, argv, "f:k:Mmz:", long_ops, NULL)) != -1) {
+		switch (c) {
+		case 'f':
+			if (!strcmp(optarg, "text")) {
+				format = 0;
+			} else if (!strcmp(optarg, "jsonl")) {
+				format = RECORDS_FORMAT_JSONL;
+			} else if (!strcmp(optarg, "binary")) {
+				format = RECORDS_FORMAT_BINARY;
+			} else {
+				fprintf(stderr, "unknown format '%s', must be text, jsonl, or binary\n",
+					optarg);
+				return -EINVAL;
+			}
+			break;
+		case 'k':
+		case 'z':
+			ret = parse_key_range(optarg, &first, &last, c == 'z');
+			if (ret)
+				return ret;
+			range = true;
+			break;
+		case 'M':
+			merged = true;
+			break;
+		case 'm':
+			use_mmap = true;
+			break;
+		case '?':
+		default:
+			return -EINVAL;
+		}
+	}
 
-	if (argc != 2) {
+	if (optind != argc - 1) {
 		printf("scoutfs print: a single path argument is required\n");
 		return -EINVAL;
 	}
-	path = argv[1];
+
+	if (merged && (!range || format)) {
+		fprintf(stderr, "--merged requires a key range and the text format\n");
+		return -EINVAL;
+	}
+	path = argv[optind];
 
 	fd = open(path, O_RDONLY);
 	if (fd < 0) {
@@ -873,13 +1096,99 @@ static int print_cmd(int argc, char **argv)
 		return ret;
 	}
 
-	ret = print_volume(fd);
+	bc = block_cache_open(path, fd, use_mmap);
+	if (!bc) {
+		close(fd);
+		return -ENOMEM;
+	}
+
+	if (format)
+		ret = print_records(bc, STDOUT_FILENO, format,
+				    range ? &first : NULL,
+				    range ? &last : NULL);
+	else if (merged)
+		ret = print_merged_range(bc, &first, &last);
+	else if (range)
+		ret = print_key_range(bc, &first, &last, &nr_items);
+	else
+		ret = print_volume(bc);
+	block_cache_destroy(bc);
 	close(fd);
 	return ret;
 };
 
+static struct option get_item_ops[] = {
+	{ "mmap", 0, NULL, 'm' },
+	{ NULL, 0, NULL, 0}
+};
+
+/*
+ * Print all the versions of an item that are found in the fs_root and
+ * log trees.
+ */
+static int get_item_cmd(int argc, char **argv)
+{
+	struct scoutfs_key key;
+	struct block_cache *bc;
+	bool use_mmap = false;
+	u64 nr_items;
+	char *path;
+	int ret;
+	int fd;
+	int c;
+
+	while ((c = getopt_long(argc, argv, "m", get_item_ops, NULL)) != -1) {
+		switch (c) {
+		case 'm':
+			use_mmap = true;
+			break;
+		case '?':
+		default:
+			return -EINVAL;
+		}
+	}
+
+	if (optind != argc - 2) {
+		printf("scoutfs get-item: key and path arguments are required\n");
+		return -EINVAL;
+	}
+
+	ret = parse_key(argv[optind], &key, false);
+	if (ret)
+		return ret;
+	path = argv[optind + 1];
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		ret = -errno;
+		fprintf(stderr, "failed to open '%s': %s (%d)\n",
+			path, strerror(errno), errno);
+		return ret;
+	}
+
+	bc = block_cache_open(path, fd, use_mmap);
+	if (!bc) {
+		close(fd);
+		return -ENOMEM;
+	}
+
+	ret = print_key_range(bc, &key, &key, &nr_items);
+	if (ret == 0 && nr_items == 0) {
+		fprintf(stderr, "item "SK_FMT" not found\n", SK_ARG(&key));
+		ret = -ENOENT;
+	}
+
+	block_cache_destroy(bc);
+	close(fd);
+	return ret;
+}
+
 static void __attribute__((constructor)) print_ctor(void)
 {
-	cmd_register("print", "<device>", "print metadata structures",
-			print_cmd);
+	cmd_register("print", "[--format fmt] [--key-range first..last] "
+		     "[--zone zone] [--merged] [--mmap] <device>",
+		     "print metadata structures", print_cmd);
+	cmd_register("get-item", "[--mmap] <key> <device>",
+		     "print the versions of an fs item in all trees",
+		     get_item_cmd);
 }
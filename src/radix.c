@@ -4,6 +4,7 @@
 #include "util.h"
 #include "format.h"
 #include "radix.h"
+#include "popcount.h"
 
 /* return the height of a tree needed to store the last bit */
 u8 radix_height_from_last(u64 last)
@@ -104,3 +105,88 @@ int radix_blocks_needed(u64 a, u64 b)
 
 	return height;
 }
+
+/*
+ * Return the number of set bits in a large region of a leaf's bitmap.
+ * The region is counted from the block's bytes so that callers don't
+ * need pointers to the packed bits, individual words are read by value.
+ */
+u64 radix_leaf_region_set(struct scoutfs_radix_block *rdx, u64 r)
+{
+	u64 words = SCOUTFS_RADIX_LG_BITS / 64;
+
+	return popcount_words((void *)rdx +
+			      offsetof(struct scoutfs_radix_block, bits) +
+			      (r * words * sizeof(__le64)), words);
+}
+
+/*
+ * Calculate the totals of a leaf from its bitmap.  Each large region is
+ * counted with a vectorized popcount and is fully set if all its bits
+ * are set.  The first set bit is only searched for in the first region
+ * with set bits.  The first hints are the number of bits if none are
+ * set.
+ */
+void radix_leaf_totals(struct scoutfs_radix_block *rdx,
+		       struct radix_totals *tot)
+{
+	u64 words = SCOUTFS_RADIX_LG_BITS / 64;
+	u64 set;
+	u64 w;
+	u64 r;
+	u64 i;
+
+	tot->sm_total = 0;
+	tot->lg_total = 0;
+	tot->sm_first = SCOUTFS_RADIX_BITS;
+	tot->lg_first = SCOUTFS_RADIX_BITS;
+
+	for (r = 0; r < SCOUTFS_RADIX_BITS / SCOUTFS_RADIX_LG_BITS; r++) {
+		set = radix_leaf_region_set(rdx, r);
+		if (set == 0)
+			continue;
+
+		tot->sm_total += set;
+		if (set == SCOUTFS_RADIX_LG_BITS) {
+			tot->lg_total += SCOUTFS_RADIX_LG_BITS;
+			if (tot->lg_first == SCOUTFS_RADIX_BITS)
+				tot->lg_first = r * SCOUTFS_RADIX_LG_BITS;
+		}
+
+		if (tot->sm_first == SCOUTFS_RADIX_BITS) {
+			for (i = 0; (w = le64_to_cpu(
+					rdx->bits[(r * words) + i])) == 0; i++)
+				;
+			tot->sm_first = (r * SCOUTFS_RADIX_LG_BITS) +
+					(i * 64) + __builtin_ctzll(w);
+		}
+	}
+}
+
+/*
+ * Calculate the totals of a parent by summing its refs.  The first
+ * hints are the number of refs if no refs have set bits.
+ */
+void radix_parent_totals(struct scoutfs_radix_block *rdx,
+			 struct radix_totals *tot)
+{
+	struct scoutfs_radix_ref *ref;
+	int i;
+
+	tot->sm_total = 0;
+	tot->lg_total = 0;
+	tot->sm_first = SCOUTFS_RADIX_REFS;
+	tot->lg_first = SCOUTFS_RADIX_REFS;
+
+	for (i = 0; i < SCOUTFS_RADIX_REFS; i++) {
+		ref = &rdx->refs[i];
+
+		if (ref->sm_total != 0 && tot->sm_first == SCOUTFS_RADIX_REFS)
+			tot->sm_first = i;
+		if (ref->lg_total != 0 && tot->lg_first == SCOUTFS_RADIX_REFS)
+			tot->lg_first = i;
+
+		tot->sm_total += le64_to_cpu(ref->sm_total);
+		tot->lg_total += le64_to_cpu(ref->lg_total);
+	}
+}
@@ -3,11 +3,27 @@
 
 #include <stdbool.h>
 
+/*
+ * The totals that a radix block's parent ref and the first hints in its
+ * header are calculated from its bitmap or refs.
+ */
+struct radix_totals {
+	u64 sm_total;
+	u64 lg_total;
+	u32 sm_first;
+	u32 lg_first;
+};
+
 u8 radix_height_from_last(u64 last);
 u64 radix_full_subtree_total(int level);
 void radix_init_ref(struct scoutfs_radix_ref *ref, int level, bool full);
 void radix_calc_level_inds(int *inds, u8 height, u64 bit);
 u64 radix_calc_leaf_bit(u64 bit);
 int radix_blocks_needed(u64 a, u64 b);
+u64 radix_leaf_region_set(struct scoutfs_radix_block *rdx, u64 r);
+void radix_leaf_totals(struct scoutfs_radix_block *rdx,
+		       struct radix_totals *tot);
+void radix_parent_totals(struct scoutfs_radix_block *rdx,
+			 struct radix_totals *tot);
 
 #endif
@@ -0,0 +1,833 @@
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <stdbool.h>
+#include <uuid/uuid.h>
+
+#include "sparse.h"
+#include "util.h"
+#include "format.h"
+#include "key.h"
+#include "block.h"
+#include "writer.h"
+#include "btree.h"
+#include "records.h"
+#include "pex.h"
+#include "item_type.h"
+
+/*
+ * Output the metadata that print walks as a stream of records.  The
+ * walk visits the same structures in the same order as the text
+ * output but everything is written through a large buffered writer
+ * so that huge volumes can be streamed into other tools.
+ */
+
+struct rec_info;
+
+typedef void (*rec_item_func)(struct rec_info *ri, u64 blkno, void *key,
+			      unsigned key_len, void *val, unsigned val_len);
+
+struct rec_info {
+	struct block_cache *bc;
+	struct writer *wr;
+	int format;
+	/* the next json field doesn't need a leading comma */
+	bool first;
+
+	/* only output fs items in the range */
+	bool range;
+	struct scoutfs_key_be range_first;
+	struct scoutfs_key_be range_last;
+
+	/* the tree whose items are being output */
+	u8 tree;
+	char *tree_name;
+	rec_item_func item_func;
+	struct scoutfs_log_trees_key *ltk;
+
+	/* packed extent items continue from the end of the previous part */
+	struct pex_decoder pex_dec;
+};
+
+static void json_name(struct rec_info *ri, char *name)
+{
+	if (!ri->first)
+		writer_char(ri->wr, ',');
+	ri->first = false;
+
+	writer_char(ri->wr, '"');
+	writer_str(ri->wr, name);
+	writer_str(ri->wr, "\":");
+}
+
+static void json_u64(struct rec_info *ri, char *name, u64 val)
+{
+	json_name(ri, name);
+	writer_u64(ri->wr, val);
+}
+
+static void json_bool(struct rec_info *ri, char *name, bool val)
+{
+	json_name(ri, name);
+	writer_str(ri->wr, val ? "true" : "false");
+}
+
+/* ids and hashes are hex strings so that tools don't round them */
+static void json_hex(struct rec_info *ri, char *name, u64 val)
+{
+	json_name(ri, name);
+	writer_char(ri->wr, '"');
+	writer_hex(ri->wr, val);
+	writer_char(ri->wr, '"');
+}
+
+/*
+ * Names are arbitrary bytes.  Quotes and backslashes are escaped and
+ * control and non-ascii bytes are output as \u00XX escapes of the
+ * byte values.
+ */
+static void json_str(struct rec_info *ri, char *name, const u8 *str, int len)
+{
+	static const char digits[] = "0123456789abcdef";
+	char esc[6] = "\\u00";
+	int start;
+	int i;
+
+	json_name(ri, name);
+	writer_char(ri->wr, '"');
+
+	for (i = 0, start = 0; i < len; i++) {
+		if (str[i] >= 0x20 && str[i] < 0x7f &&
+		    str[i] != '"' && str[i] != '\\')
+			continue;
+
+		writer_bytes(ri->wr, str + start, i - start);
+		start = i + 1;
+
+		if (str[i] == '"' || str[i] == '\\') {
+			writer_char(ri->wr, '\\');
+			writer_char(ri->wr, str[i]);
+		} else {
+			esc[4] = digits[str[i] >> 4];
+			esc[5] = digits[str[i] & 0xf];
+			writer_bytes(ri->wr, esc, sizeof(esc));
+		}
+	}
+	writer_bytes(ri->wr, str + start, i - start);
+
+	writer_char(ri->wr, '"');
+}
+
+static void json_cstr(struct rec_info *ri, char *name, char *str)
+{
+	json_str(ri, name, (u8 *)str, strlen(str));
+}
+
+/* open a nested object or array, c is '{' or '[' */
+static void json_open(struct rec_info *ri, char *name, char c)
+{
+	if (name) {
+		json_name(ri, name);
+	} else if (!ri->first) {
+		writer_char(ri->wr, ',');
+	}
+
+	writer_char(ri->wr, c);
+	ri->first = true;
+}
+
+static void json_close(struct rec_info *ri, char c)
+{
+	writer_char(ri->wr, c);
+	ri->first = false;
+}
+
+static void json_begin(struct rec_info *ri, char *rec)
+{
+	writer_char(ri->wr, '{');
+	ri->first = true;
+	json_cstr(ri, "rec", rec);
+}
+
+static void json_end(struct rec_info *ri)
+{
+	writer_str(ri->wr, "}\n");
+}
+
+static void json_addr(struct rec_info *ri, char *name,
+		      struct scoutfs_inet_addr *ia)
+{
+	u32 addr = le32_to_cpu(ia->addr);
+
+	json_name(ri, name);
+	writer_char(ri->wr, '"');
+	writer_u64(ri->wr, (addr >> 24) & 0xff);
+	writer_char(ri->wr, '.');
+	writer_u64(ri->wr, (addr >> 16) & 0xff);
+	writer_char(ri->wr, '.');
+	writer_u64(ri->wr, (addr >> 8) & 0xff);
+	writer_char(ri->wr, '.');
+	writer_u64(ri->wr, addr & 0xff);
+	writer_char(ri->wr, ':');
+	writer_u64(ri->wr, le16_to_cpu(ia->port));
+	writer_char(ri->wr, '"');
+}
+
+static void json_radix_ref(struct rec_info *ri, struct scoutfs_radix_ref *ref)
+{
+	if (le64_to_cpu(ref->blkno) == U64_MAX)
+		json_bool(ri, "full", true);
+	else
+		json_u64(ri, "blkno", le64_to_cpu(ref->blkno));
+	json_u64(ri, "seq", le64_to_cpu(ref->seq));
+	json_u64(ri, "sm_total", le64_to_cpu(ref->sm_total));
+	json_u64(ri, "lg_total", le64_to_cpu(ref->lg_total));
+}
+
+static void json_radix_root(struct rec_info *ri, char *name,
+			    struct scoutfs_radix_root *root)
+{
+	json_open(ri, name, '{');
+	json_u64(ri, "height", root->height);
+	json_u64(ri, "next_find_bit", le64_to_cpu(root->next_find_bit));
+	json_radix_ref(ri, &root->ref);
+	json_close(ri, '}');
+}
+
+static void json_btree_root(struct rec_info *ri, char *name,
+			    struct scoutfs_btree_root *root)
+{
+	json_open(ri, name, '{');
+	json_u64(ri, "height", root->height);
+	json_u64(ri, "blkno", le64_to_cpu(root->ref.blkno));
+	json_u64(ri, "seq", le64_to_cpu(root->ref.seq));
+	json_close(ri, '}');
+}
+
+static void binary_record(struct rec_info *ri, u8 type, u64 blkno,
+			  void *key, unsigned key_len,
+			  void *val, unsigned val_len)
+{
+	struct record_header hdr = {
+		.len = cpu_to_le32(sizeof(hdr) + key_len + val_len),
+		.type = type,
+		.tree = ri->tree,
+		.key_len = cpu_to_le16(key_len),
+		.blkno = cpu_to_le64(blkno),
+	};
+
+	writer_bytes(ri->wr, &hdr, sizeof(hdr));
+	writer_bytes(ri->wr, key, key_len);
+	writer_bytes(ri->wr, val, val_len);
+}
+
+void json_inode(struct rec_info *ri, struct scoutfs_key *key,
+		void *val, int val_len)
+{
+	struct scoutfs_inode *inode = val;
+
+	if (val_len < sizeof(*inode))
+		return;
+
+	json_u64(ri, "ino", le64_to_cpu(key->ski_ino));
+	json_u64(ri, "size", le64_to_cpu(inode->size));
+	json_u64(ri, "nlink", le32_to_cpu(inode->nlink));
+	json_u64(ri, "uid", le32_to_cpu(inode->uid));
+	json_u64(ri, "gid", le32_to_cpu(inode->gid));
+	json_u64(ri, "mode", le32_to_cpu(inode->mode));
+	json_u64(ri, "rdev", le32_to_cpu(inode->rdev));
+	json_u64(ri, "flags", le32_to_cpu(inode->flags));
+	json_u64(ri, "next_readdir_pos", le64_to_cpu(inode->next_readdir_pos));
+	json_u64(ri, "meta_seq", le64_to_cpu(inode->meta_seq));
+	json_u64(ri, "data_seq", le64_to_cpu(inode->data_seq));
+	json_u64(ri, "data_version", le64_to_cpu(inode->data_version));
+	json_u64(ri, "online_blocks", le64_to_cpu(inode->online_blocks));
+	json_u64(ri, "offline_blocks", le64_to_cpu(inode->offline_blocks));
+	json_u64(ri, "atime_sec", le64_to_cpu(inode->atime.sec));
+	json_u64(ri, "atime_nsec", le32_to_cpu(inode->atime.nsec));
+	json_u64(ri, "ctime_sec", le64_to_cpu(inode->ctime.sec));
+	json_u64(ri, "ctime_nsec", le32_to_cpu(inode->ctime.nsec));
+	json_u64(ri, "mtime_sec", le64_to_cpu(inode->mtime.sec));
+	json_u64(ri, "mtime_nsec", le32_to_cpu(inode->mtime.nsec));
+}
+
+void json_orphan(struct rec_info *ri, struct scoutfs_key *key,
+		 void *val, int val_len)
+{
+	json_hex(ri, "rid", le64_to_cpu(key->sko_rid));
+	json_u64(ri, "ino", le64_to_cpu(key->sko_ino));
+}
+
+void json_xattr(struct rec_info *ri, struct scoutfs_key *key,
+		void *val, int val_len)
+{
+	struct scoutfs_xattr *xat = val;
+	int name_len;
+
+	json_u64(ri, "ino", le64_to_cpu(key->skx_ino));
+	json_hex(ri, "name_hash", (u32)le64_to_cpu(key->skx_name_hash));
+	json_u64(ri, "id", le64_to_cpu(key->skx_id));
+	json_u64(ri, "part", key->skx_part);
+
+	if (key->skx_part == 0 && val_len >= sizeof(*xat)) {
+		json_u64(ri, "name_len", xat->name_len);
+		json_u64(ri, "xattr_val_len", le16_to_cpu(xat->val_len));
+		name_len = min((int)xat->name_len,
+			       val_len - (int)sizeof(*xat));
+		json_str(ri, "name", xat->name, name_len);
+	}
+}
+
+void json_dirent(struct rec_info *ri, struct scoutfs_key *key,
+		 void *val, int val_len)
+{
+	struct scoutfs_dirent *dent = val;
+
+	if (val_len < sizeof(*dent))
+		return;
+
+	json_u64(ri, "dir", le64_to_cpu(key->skd_ino));
+	json_hex(ri, "hash", le64_to_cpu(dent->hash));
+	json_u64(ri, "pos", le64_to_cpu(dent->pos));
+	json_u64(ri, "type", dent->type);
+	json_u64(ri, "ino", le64_to_cpu(dent->ino));
+	json_str(ri, "name", dent->name, val_len - sizeof(*dent));
+}
+
+void json_symlink(struct rec_info *ri, struct scoutfs_key *key,
+		  void *val, int val_len)
+{
+	u8 *frag = val;
+
+	/* don't output the null term */
+	if (val_len > 0 && frag[val_len - 1] == '\0')
+		val_len--;
+
+	json_u64(ri, "ino", le64_to_cpu(key->sks_ino));
+	json_u64(ri, "nr", le64_to_cpu(key->sks_nr));
+	json_str(ri, "target", frag, val_len);
+}
+
+void json_packed_extent(struct rec_info *ri, struct scoutfs_key *key,
+			void *val, int val_len)
+{
+	struct pex_decoder *dec = &ri->pex_dec;
+	struct pex_extent ext;
+
+	/* parts that don't follow are decoded from their region's base */
+	pex_decode_key(dec, key, val, val_len);
+
+	json_u64(ri, "ino", le64_to_cpu(key->skpe_ino));
+	json_u64(ri, "base", le64_to_cpu(key->skpe_base));
+	json_u64(ri, "part", key->skpe_part);
+	json_open(ri, "extents", '[');
+
+	while (pex_decode_next(dec, &ext) > 0) {
+		json_open(ri, NULL, '{');
+		json_u64(ri, "iblock", ext.iblock);
+		json_u64(ri, "count", ext.count);
+		json_u64(ri, "flags", ext.flags);
+		json_bool(ri, "final", ext.final);
+		if (ext.blkno)
+			json_u64(ri, "blkno", ext.blkno);
+		json_close(ri, '}');
+	}
+
+	json_close(ri, ']');
+}
+
+void json_inode_index(struct rec_info *ri, struct scoutfs_key *key,
+		      void *val, int val_len)
+{
+	json_u64(ri, "major", le64_to_cpu(key->skii_major));
+	json_u64(ri, "ino", le64_to_cpu(key->skii_ino));
+}
+
+void json_xattr_index(struct rec_info *ri, struct scoutfs_key *key,
+		      void *val, int val_len)
+{
+	json_hex(ri, "hash", le64_to_cpu(key->skxi_hash));
+	json_u64(ri, "ino", le64_to_cpu(key->skxi_ino));
+	json_u64(ri, "id", le64_to_cpu(key->skxi_id));
+}
+
+static void json_item_begin(struct rec_info *ri, u64 blkno)
+{
+	json_begin(ri, "item");
+	json_cstr(ri, "tree", ri->tree_name);
+	json_u64(ri, "blkno", blkno);
+}
+
+/* fs items and log items share keys and values */
+static void json_fs_item(struct rec_info *ri, u64 blkno, void *key,
+			 unsigned key_len, void *val, unsigned val_len)
+{
+	struct scoutfs_log_item_value *liv;
+	struct scoutfs_key item_key;
+	const struct item_type *ityp;
+
+	scoutfs_key_from_be(&item_key, key);
+
+	json_item_begin(ri, blkno);
+	if (ri->ltk) {
+		json_hex(ri, "rid", be64_to_cpu(ri->ltk->rid));
+		json_u64(ri, "nr", be64_to_cpu(ri->ltk->nr));
+	}
+
+	json_open(ri, "key", '{');
+	json_u64(ri, "zone", item_key.sk_zone);
+	json_u64(ri, "first", le64_to_cpu(item_key._sk_first));
+	json_u64(ri, "type", item_key.sk_type);
+	json_u64(ri, "second", le64_to_cpu(item_key._sk_second));
+	json_u64(ri, "third", le64_to_cpu(item_key._sk_third));
+	json_u64(ri, "fourth", item_key._sk_fourth);
+	json_close(ri, '}');
+
+	json_cstr(ri, "item", sk_type_str(item_key.sk_zone, item_key.sk_type));
+
+	if (ri->ltk) {
+		liv = val;
+		if (val_len < sizeof(*liv))
+			goto out;
+
+		json_u64(ri, "vers", le64_to_cpu(liv->vers));
+		json_bool(ri, "deletion",
+			  !!(liv->flags & SCOUTFS_LOG_ITEM_FLAG_DELETION));
+
+		/* deletion items don't have values */
+		if (liv->flags & SCOUTFS_LOG_ITEM_FLAG_DELETION)
+			goto out;
+
+		val += sizeof(*liv);
+		val_len -= sizeof(*liv);
+	}
+
+	json_u64(ri, "val_len", val_len);
+
+	ityp = item_type_find(item_key.sk_zone, item_key.sk_type);
+	if (ityp && ityp->json)
+		ityp->json(ri, &item_key, val, val_len);
+out:
+	json_end(ri);
+}
+
+static void json_log_trees_item(struct rec_info *ri, u64 blkno, void *key,
+				unsigned key_len, void *val, unsigned val_len)
+{
+	struct scoutfs_log_trees_key *ltk = key;
+	struct scoutfs_log_trees_val *ltv = val;
+
+	json_item_begin(ri, blkno);
+	json_hex(ri, "rid", be64_to_cpu(ltk->rid));
+	json_u64(ri, "nr", be64_to_cpu(ltk->nr));
+	json_radix_root(ri, "meta_avail", &ltv->meta_avail);
+	json_radix_root(ri, "meta_freed", &ltv->meta_freed);
+	json_btree_root(ri, "item_root", &ltv->item_root);
+	json_open(ri, "bloom_ref", '{');
+	json_u64(ri, "blkno", le64_to_cpu(ltv->bloom_ref.blkno));
+	json_u64(ri, "seq", le64_to_cpu(ltv->bloom_ref.seq));
+	json_close(ri, '}');
+	json_radix_root(ri, "data_avail", &ltv->data_avail);
+	json_radix_root(ri, "data_freed", &ltv->data_freed);
+	json_end(ri);
+}
+
+static void json_lock_clients_item(struct rec_info *ri, u64 blkno, void *key,
+				   unsigned key_len, void *val,
+				   unsigned val_len)
+{
+	struct scoutfs_lock_client_btree_key *cbk = key;
+
+	json_item_begin(ri, blkno);
+	json_hex(ri, "rid", be64_to_cpu(cbk->rid));
+	json_end(ri);
+}
+
+static void json_trans_seqs_item(struct rec_info *ri, u64 blkno, void *key,
+				 unsigned key_len, void *val, unsigned val_len)
+{
+	struct scoutfs_trans_seq_btree_key *tsk = key;
+
+	json_item_begin(ri, blkno);
+	json_u64(ri, "trans_seq", be64_to_cpu(tsk->trans_seq));
+	json_hex(ri, "rid", be64_to_cpu(tsk->rid));
+	json_end(ri);
+}
+
+static void json_mounted_clients_item(struct rec_info *ri, u64 blkno,
+				      void *key, unsigned key_len, void *val,
+				      unsigned val_len)
+{
+	struct scoutfs_mounted_client_btree_key *mck = key;
+	struct scoutfs_mounted_client_btree_val *mcv = val;
+
+	json_item_begin(ri, blkno);
+	json_hex(ri, "rid", be64_to_cpu(mck->rid));
+	json_u64(ri, "flags", mcv->flags);
+	json_end(ri);
+}
+
+/* binary records are the same for all trees, func is only used for json */
+static int output_item(void *key, unsigned key_len, void *val,
+		       unsigned val_len, u64 blkno, void *arg)
+{
+	struct rec_info *ri = arg;
+
+	if (ri->format == RECORDS_FORMAT_BINARY)
+		binary_record(ri, RECORD_ITEM, blkno, key, key_len,
+			      val, val_len);
+	else
+		ri->item_func(ri, blkno, key, key_len, val, val_len);
+
+	return 0;
+}
+
+/* fs and log item trees only output the items in the range, if given */
+static int output_btree(struct rec_info *ri, u8 tree, char *name,
+			struct scoutfs_btree_root *root, rec_item_func func,
+			bool ranged)
+{
+	ri->tree = tree;
+	ri->tree_name = name;
+	ri->item_func = func;
+
+	if (ranged && ri->range)
+		return btree_walk(ri->bc, root, &ri->range_first,
+				  sizeof(ri->range_first), &ri->range_last,
+				  sizeof(ri->range_last), output_item, ri);
+
+	return btree_walk(ri->bc, root, NULL, 0, NULL, 0, output_item, ri);
+}
+
+/* like the text output, radix leaf bitmaps aren't output */
+static int output_radix_block(struct rec_info *ri, struct scoutfs_radix_ref *par,
+			      int level)
+{
+	struct scoutfs_radix_block *rdx;
+	struct block *bl;
+	u64 blkno;
+	int ret;
+	int err;
+	int i;
+
+	blkno = le64_to_cpu(par->blkno);
+	if (blkno == 0 || blkno == U64_MAX || level <= 0)
+		return 0;
+
+	bl = block_read(ri->bc, blkno);
+	if (!bl)
+		return -EIO;
+	rdx = block_data(bl);
+
+	if (ri->format == RECORDS_FORMAT_BINARY) {
+		binary_record(ri, RECORD_RADIX, blkno, NULL, 0, rdx,
+			      SCOUTFS_BLOCK_SIZE);
+	} else {
+		json_begin(ri, "radix");
+		json_cstr(ri, "tree", ri->tree_name);
+		if (ri->ltk) {
+			json_hex(ri, "rid", be64_to_cpu(ri->ltk->rid));
+			json_u64(ri, "nr", be64_to_cpu(ri->ltk->nr));
+		}
+		json_u64(ri, "blkno", blkno);
+		json_u64(ri, "seq", le64_to_cpu(rdx->hdr.seq));
+		json_u64(ri, "level", level);
+		json_u64(ri, "sm_first", le32_to_cpu(rdx->sm_first));
+		json_u64(ri, "lg_first", le32_to_cpu(rdx->lg_first));
+		json_open(ri, "refs", '[');
+		for (i = 0; i < SCOUTFS_RADIX_REFS; i++) {
+			if (rdx->refs[i].blkno == 0)
+				continue;
+			json_open(ri, NULL, '{');
+			json_u64(ri, "ind", i);
+			json_radix_ref(ri, &rdx->refs[i]);
+			json_close(ri, '}');
+		}
+		json_close(ri, ']');
+		json_end(ri);
+	}
+
+	if (level > 1) {
+		for (i = 0; i < SCOUTFS_RADIX_REFS; i++) {
+			blkno = le64_to_cpu(rdx->refs[i].blkno);
+			if (blkno != 0 && blkno != U64_MAX)
+				block_readahead(ri->bc, blkno);
+		}
+	}
+
+	ret = 0;
+	for (i = 0; i < SCOUTFS_RADIX_REFS; i++) {
+		err = output_radix_block(ri, &rdx->refs[i], level - 1);
+		if (err < 0 && ret == 0)
+			ret = err;
+	}
+
+	block_put(ri->bc, bl);
+	return ret;
+}
+
+static int output_radix(struct rec_info *ri, u8 tree, char *name,
+			struct scoutfs_radix_root *root)
+{
+	ri->tree = tree;
+	ri->tree_name = name;
+
+	return output_radix_block(ri, &root->ref, root->height - 1);
+}
+
+/*
+ * Each log tree's allocators and items follow its log tree record.
+ * Only the items in the range are output when a range is given.
+ */
+static int output_log_tree(void *key, unsigned key_len, void *val,
+			   unsigned val_len, u64 blkno, void *arg)
+{
+	struct scoutfs_log_trees_val *ltv = val;
+	struct rec_info *ri = arg;
+	struct rec_info log_ri = *ri;
+	int ret;
+	int err;
+
+	if (ri->format == RECORDS_FORMAT_BINARY) {
+		log_ri.tree = RECORD_TREE_LOGS_ROOT;
+		binary_record(&log_ri, RECORD_LOG_TREE, blkno, key, key_len,
+			      val, val_len);
+	}
+
+	/* packed extents don't continue from another tree's items */
+	memset(&log_ri.pex_dec, 0, sizeof(log_ri.pex_dec));
+
+	log_ri.ltk = key;
+	if (ri->range)
+		return output_btree(&log_ri, RECORD_TREE_LOG_ITEMS,
+				    "log_items", &ltv->item_root,
+				    json_fs_item, true);
+
+	ret = output_radix(&log_ri, RECORD_TREE_LOG_META_AVAIL, "meta_avail",
+			   &ltv->meta_avail);
+	err = output_radix(&log_ri, RECORD_TREE_LOG_META_FREED, "meta_freed",
+			   &ltv->meta_freed);
+	if (err && !ret)
+		ret = err;
+	err = output_radix(&log_ri, RECORD_TREE_LOG_DATA_AVAIL, "data_avail",
+			   &ltv->data_avail);
+	if (err && !ret)
+		ret = err;
+	err = output_radix(&log_ri, RECORD_TREE_LOG_DATA_FREED, "data_freed",
+			   &ltv->data_freed);
+	if (err && !ret)
+		ret = err;
+	err = output_btree(&log_ri, RECORD_TREE_LOG_ITEMS, "log_items",
+			   &ltv->item_root, json_fs_item, true);
+	if (err && !ret)
+		ret = err;
+
+	return ret;
+}
+
+static void output_super(struct rec_info *ri, struct scoutfs_super_block *super)
+{
+	char uuid_str[37];
+
+	if (ri->format == RECORDS_FORMAT_BINARY) {
+		binary_record(ri, RECORD_SUPER, SCOUTFS_SUPER_BLKNO, NULL, 0,
+			      super, sizeof(*super));
+		return;
+	}
+
+	uuid_unparse(super->uuid, uuid_str);
+
+	json_begin(ri, "super");
+	json_u64(ri, "blkno", SCOUTFS_SUPER_BLKNO);
+	json_hex(ri, "crc", le32_to_cpu(super->hdr.crc));
+	json_hex(ri, "magic", le32_to_cpu(super->hdr.magic));
+	json_hex(ri, "fsid", le64_to_cpu(super->hdr.fsid));
+	json_u64(ri, "seq", le64_to_cpu(super->hdr.seq));
+	json_hex(ri, "format_hash", le64_to_cpu(super->format_hash));
+	json_cstr(ri, "uuid", uuid_str);
+	json_u64(ri, "next_ino", le64_to_cpu(super->next_ino));
+	json_u64(ri, "next_trans_seq", le64_to_cpu(super->next_trans_seq));
+	json_u64(ri, "total_meta_blocks", le64_to_cpu(super->total_meta_blocks));
+	json_u64(ri, "first_meta_blkno", le64_to_cpu(super->first_meta_blkno));
+	json_u64(ri, "last_meta_blkno", le64_to_cpu(super->last_meta_blkno));
+	json_u64(ri, "free_meta_blocks", le64_to_cpu(super->free_meta_blocks));
+	json_u64(ri, "total_data_blocks", le64_to_cpu(super->total_data_blocks));
+	json_u64(ri, "first_data_blkno", le64_to_cpu(super->first_data_blkno));
+	json_u64(ri, "last_data_blkno", le64_to_cpu(super->last_data_blkno));
+	json_u64(ri, "free_data_blocks", le64_to_cpu(super->free_data_blocks));
+	json_u64(ri, "quorum_fenced_term",
+		 le64_to_cpu(super->quorum_fenced_term));
+	json_u64(ri, "quorum_server_term",
+		 le64_to_cpu(super->quorum_server_term));
+	json_u64(ri, "unmount_barrier", le64_to_cpu(super->unmount_barrier));
+	json_u64(ri, "quorum_count", super->quorum_count);
+	json_addr(ri, "server_addr", &super->server_addr);
+	json_radix_root(ri, "core_meta_avail", &super->core_meta_avail);
+	json_radix_root(ri, "core_meta_freed", &super->core_meta_freed);
+	json_radix_root(ri, "core_data_avail", &super->core_data_avail);
+	json_radix_root(ri, "core_data_freed", &super->core_data_freed);
+	json_btree_root(ri, "fs_root", &super->fs_root);
+	json_btree_root(ri, "logs_root", &super->logs_root);
+	json_btree_root(ri, "lock_clients", &super->lock_clients);
+	json_btree_root(ri, "trans_seqs", &super->trans_seqs);
+	json_btree_root(ri, "mounted_clients", &super->mounted_clients);
+	json_end(ri);
+}
+
+static int output_quorum_blocks(struct rec_info *ri)
+{
+	struct scoutfs_quorum_block *blk;
+	struct block *bl;
+	u64 blkno;
+	int nr;
+	int i;
+	int j;
+
+	for (i = 0; i < SCOUTFS_QUORUM_BLOCKS; i++) {
+		blkno = SCOUTFS_QUORUM_BLKNO + i;
+		bl = block_read(ri->bc, blkno);
+		if (!bl)
+			return -EIO;
+		blk = block_data(bl);
+
+		if (blk->voter_rid == 0) {
+			block_put(ri->bc, bl);
+			continue;
+		}
+
+		nr = min((int)blk->log_nr, (int)SCOUTFS_QUORUM_LOG_MAX);
+
+		if (ri->format == RECORDS_FORMAT_BINARY) {
+			binary_record(ri, RECORD_QUORUM, blkno, NULL, 0, blk,
+				      offsetof(struct scoutfs_quorum_block,
+					       log[nr]));
+		} else {
+			json_begin(ri, "quorum");
+			json_u64(ri, "blkno", blkno);
+			json_hex(ri, "fsid", le64_to_cpu(blk->fsid));
+			json_hex(ri, "crc", le32_to_cpu(blk->crc));
+			json_u64(ri, "term", le64_to_cpu(blk->term));
+			json_u64(ri, "write_nr", le64_to_cpu(blk->write_nr));
+			json_hex(ri, "voter_rid", le64_to_cpu(blk->voter_rid));
+			json_hex(ri, "vote_for_rid",
+				 le64_to_cpu(blk->vote_for_rid));
+			json_open(ri, "log", '[');
+			for (j = 0; j < nr; j++) {
+				json_open(ri, NULL, '{');
+				json_u64(ri, "term",
+					 le64_to_cpu(blk->log[j].term));
+				json_hex(ri, "rid",
+					 le64_to_cpu(blk->log[j].rid));
+				json_addr(ri, "addr", &blk->log[j].addr);
+				json_close(ri, '}');
+			}
+			json_close(ri, ']');
+			json_end(ri);
+		}
+
+		block_put(ri->bc, bl);
+	}
+
+	return 0;
+}
+
+/*
+ * Output records for all the metadata, or only for the fs items in the
+ * fs_root and log trees from first to last if they're given.
+ */
+int print_records(struct block_cache *bc, int fd, int format,
+		  struct scoutfs_key *first, struct scoutfs_key *last)
+{
+	struct scoutfs_super_block *super;
+	struct rec_info ri = {
+		.bc = bc,
+		.format = format,
+	};
+	struct block *bl;
+	int ret;
+	int err;
+
+	if (first && last) {
+		scoutfs_key_to_be(&ri.range_first, first);
+		scoutfs_key_to_be(&ri.range_last, last);
+		ri.range = true;
+	}
+
+	ri.wr = writer_create(fd, WRITER_DEFAULT_BYTES);
+	if (!ri.wr)
+		return -ENOMEM;
+
+	bl = block_read(bc, SCOUTFS_SUPER_BLKNO);
+	if (!bl) {
+		ret = -EIO;
+		goto out;
+	}
+	super = block_data(bl);
+
+	if (ri.range) {
+		ret = output_btree(&ri, RECORD_TREE_FS_ROOT, "fs_root",
+				   &super->fs_root, json_fs_item, true);
+		if (ret == 0)
+			ret = btree_walk(bc, &super->logs_root, NULL, 0,
+					 NULL, 0, output_log_tree, &ri);
+		goto put;
+	}
+
+	output_super(&ri, super);
+
+	ret = output_quorum_blocks(&ri);
+
+	err = output_btree(&ri, RECORD_TREE_LOCK_CLIENTS, "lock_clients",
+			   &super->lock_clients, json_lock_clients_item,
+			   false);
+	if (err && !ret)
+		ret = err;
+	err = output_btree(&ri, RECORD_TREE_MOUNTED_CLIENTS,
+			   "mounted_clients", &super->mounted_clients,
+			   json_mounted_clients_item, false);
+	if (err && !ret)
+		ret = err;
+	err = output_btree(&ri, RECORD_TREE_TRANS_SEQS, "trans_seqs",
+			   &super->trans_seqs, json_trans_seqs_item, false);
+	if (err && !ret)
+		ret = err;
+	err = output_radix(&ri, RECORD_TREE_CORE_META_AVAIL,
+			   "core_meta_avail", &super->core_meta_avail);
+	if (err && !ret)
+		ret = err;
+	err = output_radix(&ri, RECORD_TREE_CORE_META_FREED,
+			   "core_meta_freed", &super->core_meta_freed);
+	if (err && !ret)
+		ret = err;
+	err = output_radix(&ri, RECORD_TREE_CORE_DATA_AVAIL,
+			   "core_data_avail", &super->core_data_avail);
+	if (err && !ret)
+		ret = err;
+	err = output_radix(&ri, RECORD_TREE_CORE_DATA_FREED,
+			   "core_data_freed", &super->core_data_freed);
+	if (err && !ret)
+		ret = err;
+	err = output_btree(&ri, RECORD_TREE_LOGS_ROOT, "logs_root",
+			   &super->logs_root, json_log_trees_item, false);
+	if (err && !ret)
+		ret = err;
+	err = btree_walk(bc, &super->logs_root, NULL, 0, NULL, 0,
+			 output_log_tree, &ri);
+	if (err && !ret)
+		ret = err;
+	err = output_btree(&ri, RECORD_TREE_FS_ROOT, "fs_root",
+			   &super->fs_root, json_fs_item, false);
+	if (err && !ret)
+		ret = err;
+
+put:
+	block_put(bc, bl);
+out:
+	err = writer_destroy(ri.wr);
+	if (err && !ret)
+		ret = err;
+
+	return ret;
+}
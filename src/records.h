@@ -0,0 +1,59 @@
+#ifndef _RECORDS_H_
+#define _RECORDS_H_
+
+/*
+ * print can output the metadata as a stream of records for tools
+ * instead of formatted text.  The jsonl format outputs a json object
+ * per line with decoded fields.  The binary format is a sequence of
+ * length-prefixed records that contain the raw little endian
+ * structures from format.h.
+ */
+#define RECORDS_FORMAT_JSONL	1
+#define RECORDS_FORMAT_BINARY	2
+
+/*
+ * Each binary record starts with this header.  len includes the
+ * header.  Item records contain the key followed by the value, other
+ * records contain a single structure.
+ */
+struct record_header {
+	__le32 len;
+	__u8 type;
+	__u8 tree;
+	__le16 key_len;
+	__le64 blkno;
+} __packed;
+
+/* super block struct */
+#define RECORD_SUPER		1
+/* quorum block struct and its logs */
+#define RECORD_QUORUM		2
+/* btree item key and value */
+#define RECORD_ITEM		3
+/* all the refs in a radix parent block */
+#define RECORD_RADIX		4
+/* log trees key and value, precedes the log tree's radix and items */
+#define RECORD_LOG_TREE		5
+
+#define RECORD_TREE_NONE		0
+#define RECORD_TREE_LOCK_CLIENTS	1
+#define RECORD_TREE_MOUNTED_CLIENTS	2
+#define RECORD_TREE_TRANS_SEQS		3
+#define RECORD_TREE_LOGS_ROOT		4
+#define RECORD_TREE_LOG_ITEMS		5
+#define RECORD_TREE_FS_ROOT		6
+#define RECORD_TREE_CORE_META_AVAIL	7
+#define RECORD_TREE_CORE_META_FREED	8
+#define RECORD_TREE_CORE_DATA_AVAIL	9
+#define RECORD_TREE_CORE_DATA_FREED	10
+#define RECORD_TREE_LOG_META_AVAIL	11
+#define RECORD_TREE_LOG_META_FREED	12
+#define RECORD_TREE_LOG_DATA_AVAIL	13
+#define RECORD_TREE_LOG_DATA_FREED	14
+
+struct block_cache;
+
+int print_records(struct block_cache *bc, int fd, int format,
+		  struct scoutfs_key *first, struct scoutfs_key *last);
+
+#endif
@@ -0,0 +1,877 @@
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <getopt.h>
+#include <stdbool.h>
+#include <libgen.h>
+#include <limits.h>
+#include <pthread.h>
+
+#include "sparse.h"
+#include "util.h"
+#include "format.h"
+#include "cmd.h"
+#include "key.h"
+#include "parse.h"
+#include "dev.h"
+#include "block.h"
+#include "forest.h"
+#include "workq.h"
+#include "pex.h"
+
+/*
+ * A reverse map file translates data device blknos back to the inodes
+ * and logical blocks that reference them.  It's built offline from
+ * every inode's packed extents and is then queried without the device.
+ *
+ * The file starts with a header followed by extents sorted by blkno.
+ * Queries map the file and binary search for the extents that
+ * intersect a range of blocks.
+ *
+ * The map is built with an external merge sort so that it doesn't need
+ * memory for every extent.  The fs zone is split into pieces of whole
+ * inodes that are read by worker threads.  Each worker fills a buffer
+ * with extents and sorts and appends it to its temporary file as a run
+ * each time it fills.  The runs from all the workers are then merged
+ * into the map file.
+ */
+
+#define RMAP_MAGIC		0x50414d5253464353ULL	/* "SCFSRMAP" */
+#define RMAP_VERSION		1
+
+/* the walk is split into about this many pieces per thread */
+#define RMAP_PIECES_PER_THREAD	4
+/* all the workers share this much memory for sorting runs */
+#define RMAP_SORT_BYTES		(512ULL * 1024 * 1024)
+/* runs are read at least this many extents at a time while merging */
+#define RMAP_MERGE_MIN_EXTENTS	256
+
+struct rmap_header {
+	__le64 magic;
+	__le32 version;
+	__le32 extent_size;
+	__le64 fsid;
+	__le64 nr_extents;
+	__le64 nr_blocks;
+} __packed;
+
+struct rmap_extent {
+	__le64 blkno;
+	__le64 ino;
+	__le64 iblock;
+	__le32 count;
+	__le32 flags;
+} __packed;
+
+/* extents are sorted in native byte order before they're written */
+struct rmap_ext {
+	u64 blkno;
+	u64 ino;
+	u64 iblock;
+	u32 count;
+	u32 flags;
+};
+
+struct rmap_run {
+	int fd;
+	off_t off;
+	u64 nr;
+};
+
+struct rmap_info {
+	pthread_mutex_t mutex;
+	struct rmap_run *runs;
+	int nr_runs;
+};
+
+struct rmap_piece {
+	struct work work;
+	struct rmap_info *ri;
+	struct forest *fo;
+	u64 first_ino;
+	u64 last_ino;
+	char *tmpdir;
+	int tmp_fd;
+	off_t tmp_off;
+	int err;
+
+	struct rmap_ext *exts;
+	u64 nr;
+	u64 max;
+
+	/* the extent being joined in the current file */
+	struct rmap_ext pending;
+	struct pex_decoder dec;
+};
+
+/* indexed by the offline and unwritten flags */
+static char *flag_strs[] = {
+	"", "offline", "unwritten", "offline,unwritten",
+};
+
+struct rmap_cursor {
+	struct rmap_run *run;
+	struct rmap_ext *exts;
+	u64 max;
+	u64 read;
+	u64 nr;
+	u64 i;
+};
+
+static int cmp_ext(const void *A, const void *B)
+{
+	const struct rmap_ext *a = A;
+	const struct rmap_ext *b = B;
+
+	return a->blkno < b->blkno ? -1 : a->blkno > b->blkno ? 1 :
+	       a->ino < b->ino ? -1 : a->ino > b->ino ? 1 :
+	       a->iblock < b->iblock ? -1 : a->iblock > b->iblock ? 1 : 0;
+}
+
+/*
+ * Temporary files are unlinked as they're created so they're removed
+ * however the command exits.
+ */
+static int open_tmp(char *tmpdir)
+{
+	char path[PATH_MAX];
+	int ret;
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/scoutfs-rmap.XXXXXX", tmpdir);
+	fd = mkstemp(path);
+	if (fd < 0) {
+		ret = -errno;
+		fprintf(stderr, "failed to create temporary file in '%s': %s (%d)\n",
+			tmpdir, strerror(errno), errno);
+		return ret;
+	}
+
+	unlink(path);
+	return fd;
+}
+
+static int write_run(struct rmap_piece *rp)
+{
+	struct rmap_info *ri = rp->ri;
+	struct rmap_run *runs;
+	size_t size;
+	int ret;
+
+	if (rp->nr == 0)
+		return 0;
+
+	if (rp->tmp_fd < 0) {
+		rp->tmp_fd = open_tmp(rp->tmpdir);
+		if (rp->tmp_fd < 0)
+			return rp->tmp_fd;
+	}
+
+	qsort(rp->exts, rp->nr, sizeof(rp->exts[0]), cmp_ext);
+
+	size = rp->nr * sizeof(rp->exts[0]);
+	ret = rw_full(rp->tmp_fd, rp->exts, size, rp->tmp_off, true);
+	if (ret < 0) {
+		fprintf(stderr, "error writing sorted run: %s (%d)\n",
+			strerror(-ret), -ret);
+		return ret;
+	}
+
+	pthread_mutex_lock(&ri->mutex);
+	runs = realloc(ri->runs, (ri->nr_runs + 1) * sizeof(ri->runs[0]));
+	if (runs) {
+		ri->runs = runs;
+		ri->runs[ri->nr_runs++] = (struct rmap_run) {
+			.fd = rp->tmp_fd,
+			.off = rp->tmp_off,
+			.nr = rp->nr,
+		};
+	}
+	pthread_mutex_unlock(&ri->mutex);
+	if (!runs)
+		return -ENOMEM;
+
+	rp->tmp_off += size;
+	rp->nr = 0;
+	return 0;
+}
+
+static int add_pending(struct rmap_piece *rp)
+{
+	int ret;
+
+	if (rp->pending.count == 0)
+		return 0;
+
+	if (rp->nr == rp->max) {
+		ret = write_run(rp);
+		if (ret < 0)
+			return ret;
+	}
+
+	rp->exts[rp->nr++] = rp->pending;
+	rp->pending.count = 0;
+	return 0;
+}
+
+/* extents without blocks aren't in the map */
+static int add_extent(struct rmap_piece *rp, u64 ino, struct pex_extent *ext)
+{
+	struct rmap_ext *pend = &rp->pending;
+	int ret;
+
+	if (ext->blkno == 0)
+		return 0;
+
+	if (pend->count && pend->ino == ino &&
+	    pend->iblock + pend->count == ext->iblock &&
+	    pend->blkno + pend->count == ext->blkno &&
+	    pend->flags == ext->flags &&
+	    (u64)pend->count + ext->count <= U32_MAX) {
+		pend->count += ext->count;
+		return 0;
+	}
+
+	ret = add_pending(rp);
+	if (ret < 0)
+		return ret;
+
+	*pend = (struct rmap_ext) {
+		.blkno = ext->blkno,
+		.ino = ino,
+		.iblock = ext->iblock,
+		.count = ext->count,
+		.flags = ext->flags,
+	};
+	return 0;
+}
+
+static int add_item(struct rmap_piece *rp, struct scoutfs_key *key,
+		    void *val, unsigned val_len)
+{
+	struct pex_extent ext;
+	u64 ino;
+	int ret;
+
+	if (key->sk_type != SCOUTFS_PACKED_EXTENT_TYPE)
+		return 0;
+
+	ret = pex_decode_key(&rp->dec, key, val, val_len);
+	if (ret < 0) {
+		fprintf(stderr, "packed extent item "SK_FMT" doesn't follow previous part\n",
+			SK_ARG(key));
+		return ret;
+	}
+
+	ino = le64_to_cpu(key->skpe_ino);
+	while ((ret = pex_decode_next(&rp->dec, &ext)) > 0) {
+		ret = add_extent(rp, ino, &ext);
+		if (ret < 0)
+			return ret;
+	}
+	if (ret < 0) {
+		fprintf(stderr, "packed extent item "SK_FMT" is malformed at off %u\n",
+			SK_ARG(key), rp->dec.off);
+		return ret;
+	}
+
+	return 0;
+}
+
+static void rmap_worker(struct work *work)
+{
+	struct rmap_piece *rp = container_of(work, struct rmap_piece, work);
+	struct forest_iter *it = NULL;
+	struct scoutfs_key first;
+	struct scoutfs_key last;
+	struct scoutfs_key *key;
+	unsigned val_len;
+	void *val;
+	int ret;
+
+	scoutfs_key_set_zeros(&first);
+	first.sk_zone = SCOUTFS_FS_ZONE;
+	first._sk_first = cpu_to_le64(rp->first_ino);
+	scoutfs_key_set_ones(&last);
+	last.sk_zone = SCOUTFS_FS_ZONE;
+	last._sk_first = cpu_to_le64(rp->last_ino);
+
+	rp->exts = malloc(rp->max * sizeof(rp->exts[0]));
+	if (!rp->exts) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	ret = forest_iter_start(rp->fo, &first, &last, &it);
+	if (ret < 0)
+		goto out;
+
+	while ((ret = forest_iter_next(it, &key, &val, &val_len)) > 0) {
+		ret = add_item(rp, key, val, val_len);
+		if (ret < 0)
+			break;
+	}
+
+	if (ret == 0)
+		ret = add_pending(rp) ?: write_run(rp);
+out:
+	forest_iter_stop(it);
+	free(rp->exts);
+	rp->exts = NULL;
+	rp->err = ret;
+}
+
+/*
+ * Split the fs zone into pieces that each contain whole inodes and
+ * have workers write their sorted runs.
+ */
+static int extract_runs(struct block_cache *bc,
+			struct scoutfs_super_block *super,
+			struct rmap_info *ri, char *tmpdir, int nr_threads,
+			int **fds_ret, int *nr_fds_ret)
+{
+	struct rmap_piece *pieces = NULL;
+	struct forest *fo = NULL;
+	struct workq *wq = NULL;
+	u64 *last_inos = NULL;
+	int nr_ranges = 0;
+	int nr_pieces = 0;
+	int *fds = NULL;
+	u64 max;
+	int ret;
+	int i;
+
+	wq = workq_create(nr_threads);
+	if (!wq) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	ret = forest_open(bc, super, &fo) ?:
+	      forest_split_inodes(fo, nr_threads * RMAP_PIECES_PER_THREAD,
+				  &last_inos, &nr_ranges);
+	if (ret < 0)
+		goto out;
+
+	pieces = calloc(nr_ranges, sizeof(*pieces));
+	fds = calloc(nr_ranges, sizeof(*fds));
+	if (!pieces || !fds) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	max = RMAP_SORT_BYTES / nr_threads / sizeof(struct rmap_ext);
+
+	for (i = 0; i < nr_ranges; i++) {
+		work_init(&pieces[i].work, rmap_worker);
+		pieces[i].ri = ri;
+		pieces[i].fo = fo;
+		pieces[i].first_ino = i ? last_inos[i - 1] + 1 : 0;
+		pieces[i].last_ino = last_inos[i];
+		pieces[i].tmpdir = tmpdir;
+		pieces[i].tmp_fd = -1;
+		pieces[i].max = max;
+		workq_queue(wq, &pieces[i].work);
+		nr_pieces++;
+	}
+	workq_wait(wq);
+
+	for (i = 0; i < nr_pieces; i++) {
+		fds[i] = pieces[i].tmp_fd;
+		if (pieces[i].err < 0 && ret == 0)
+			ret = pieces[i].err;
+	}
+out:
+	if (fds) {
+		*fds_ret = fds;
+		*nr_fds_ret = nr_pieces;
+	}
+	free(pieces);
+	free(last_inos);
+	forest_close(fo);
+	workq_destroy(wq);
+	return ret;
+}
+
+static int cursor_read(struct rmap_cursor *cur)
+{
+	struct rmap_run *run = cur->run;
+	int ret;
+
+	cur->nr = min(run->nr - cur->read, cur->max);
+	cur->i = 0;
+	if (cur->nr == 0)
+		return 0;
+
+	ret = rw_full(run->fd, cur->exts, cur->nr * sizeof(cur->exts[0]),
+		      run->off + (cur->read * sizeof(cur->exts[0])), false);
+	if (ret < 0) {
+		fprintf(stderr, "error reading sorted run: %s (%d)\n",
+			strerror(-ret), -ret);
+		return ret;
+	}
+
+	cur->read += cur->nr;
+	return 0;
+}
+
+static struct rmap_ext *cursor_ext(struct rmap_cursor *cur)
+{
+	return &cur->exts[cur->i];
+}
+
+static void heap_sift_down(struct rmap_cursor **heap, int nr, int i)
+{
+	int least;
+	int c;
+
+	for (;;) {
+		least = i;
+		c = (i * 2) + 1;
+		if (c < nr && cmp_ext(cursor_ext(heap[c]),
+				      cursor_ext(heap[least])) < 0)
+			least = c;
+		if (c + 1 < nr && cmp_ext(cursor_ext(heap[c + 1]),
+					  cursor_ext(heap[least])) < 0)
+			least = c + 1;
+		if (least == i)
+			break;
+
+		swap(heap[i], heap[least]);
+		i = least;
+	}
+}
+
+/*
+ * Merge all the sorted runs into the map file after its header.  Each
+ * run has a cursor with a buffer of its next extents and the cursors
+ * are kept in a heap ordered by their current extent.  The workers'
+ * sort buffers have been freed so the cursors divide the same memory
+ * between them.
+ *
+ * Blocks shouldn't be referenced by more than one extent.  If they are
+ * the later extent is clipped to start after the blocks that have
+ * already been written, or dropped if it's entirely covered, so that
+ * the extents in the map never overlap and queries can search them by
+ * their ends.  The number of extents and blocks written are returned
+ * for the header.
+ */
+static int merge_runs(struct rmap_info *ri, FILE *fp, u64 *nr_extents,
+		      u64 *nr_blocks)
+{
+	struct rmap_cursor **heap = NULL;
+	struct rmap_cursor *curs = NULL;
+	struct rmap_cursor *cur;
+	struct rmap_extent rext;
+	struct rmap_ext ext;
+	u64 overlaps = 0;
+	u64 clipped = 0;
+	u64 end = 0;
+	u64 diff;
+	u64 max;
+	int nr = 0;
+	int ret;
+	int i;
+
+	curs = calloc(ri->nr_runs, sizeof(curs[0]));
+	heap = calloc(ri->nr_runs, sizeof(heap[0]));
+	if ((ri->nr_runs && (!curs || !heap))) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	max = RMAP_SORT_BYTES / max(ri->nr_runs, 1) / sizeof(struct rmap_ext);
+	max = max(max, RMAP_MERGE_MIN_EXTENTS);
+
+	for (i = 0; i < ri->nr_runs; i++) {
+		cur = &curs[i];
+		cur->run = &ri->runs[i];
+		cur->max = min(max, cur->run->nr);
+		cur->exts = malloc(cur->max * sizeof(cur->exts[0]));
+		if (!cur->exts) {
+			ret = -ENOMEM;
+			goto out;
+		}
+
+		ret = cursor_read(cur);
+		if (ret < 0)
+			goto out;
+		if (cur->nr)
+			heap[nr++] = cur;
+	}
+
+	for (i = (nr / 2) - 1; i >= 0; i--)
+		heap_sift_down(heap, nr, i);
+
+	while (nr > 0) {
+		cur = heap[0];
+		ext = *cursor_ext(cur);
+
+		if (ext.blkno < end) {
+			if (overlaps++ == 0)
+				fprintf(stderr, "ino %llu iblock %llu blkno %llu count %u overlaps blocks in a previous extent\n",
+					ext.ino, ext.iblock, ext.blkno,
+					ext.count);
+			diff = min(end - ext.blkno, (u64)ext.count);
+			ext.blkno += diff;
+			ext.iblock += diff;
+			ext.count -= diff;
+			clipped += diff;
+		}
+
+		if (ext.count > 0) {
+			end = ext.blkno + ext.count;
+
+			rext.blkno = cpu_to_le64(ext.blkno);
+			rext.ino = cpu_to_le64(ext.ino);
+			rext.iblock = cpu_to_le64(ext.iblock);
+			rext.count = cpu_to_le32(ext.count);
+			rext.flags = cpu_to_le32(ext.flags);
+			if (fwrite(&rext, sizeof(rext), 1, fp) != 1) {
+				ret = -EIO;
+				goto out;
+			}
+			(*nr_extents)++;
+			*nr_blocks += ext.count;
+		}
+
+		if (++cur->i == cur->nr) {
+			ret = cursor_read(cur);
+			if (ret < 0)
+				goto out;
+			if (cur->nr == 0)
+				heap[0] = heap[--nr];
+		}
+		heap_sift_down(heap, nr, 0);
+	}
+
+	if (overlaps)
+		fprintf(stderr, "%llu extents overlapped previous extents, %llu overlapping blocks were left out of the map\n",
+			overlaps, clipped);
+	ret = 0;
+out:
+	for (i = 0; curs && i < ri->nr_runs; i++)
+		free(curs[i].exts);
+	free(curs);
+	free(heap);
+	return ret;
+}
+
+static int build_rmap(struct block_cache *bc, char *path, char *tmpdir,
+		      int nr_threads)
+{
+	struct rmap_info ri = {
+		.mutex = PTHREAD_MUTEX_INITIALIZER,
+	};
+	struct rmap_header hdr = {0,};
+	struct scoutfs_super_block *super;
+	struct block *bl;
+	FILE *fp = NULL;
+	u64 nr_extents = 0;
+	u64 nr_blocks = 0;
+	int *fds = NULL;
+	int nr_fds = 0;
+	int ret;
+	int i;
+
+	bl = block_read(bc, SCOUTFS_SUPER_BLKNO);
+	if (!bl)
+		return -EIO;
+	super = block_data(bl);
+
+	if (le32_to_cpu(super->hdr.magic) != SCOUTFS_BLOCK_MAGIC_SUPER) {
+		fprintf(stderr, "super block magic %08x != expected %08x\n",
+			le32_to_cpu(super->hdr.magic),
+			SCOUTFS_BLOCK_MAGIC_SUPER);
+		ret = -EIO;
+		goto out;
+	}
+
+	ret = extract_runs(bc, super, &ri, tmpdir, nr_threads, &fds, &nr_fds);
+	if (ret < 0)
+		goto out;
+
+	fp = fopen(path, "w");
+	if (!fp) {
+		ret = -errno;
+		fprintf(stderr, "failed to create '%s': %s (%d)\n",
+			path, strerror(errno), errno);
+		goto out;
+	}
+
+	hdr.magic = cpu_to_le64(RMAP_MAGIC);
+	hdr.version = cpu_to_le32(RMAP_VERSION);
+	hdr.extent_size = cpu_to_le32(sizeof(struct rmap_extent));
+	hdr.fsid = super->hdr.fsid;
+
+	/* the header is rewritten with the totals after the extents */
+	if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1) {
+		ret = -EIO;
+		goto out;
+	}
+
+	ret = merge_runs(&ri, fp, &nr_extents, &nr_blocks);
+	if (ret < 0)
+		goto out;
+
+	hdr.nr_extents = cpu_to_le64(nr_extents);
+	hdr.nr_blocks = cpu_to_le64(nr_blocks);
+	if (fseek(fp, 0, SEEK_SET) || fwrite(&hdr, sizeof(hdr), 1, fp) != 1 ||
+	    fflush(fp) || fsync(fileno(fp))) {
+		ret = -EIO;
+		goto out;
+	}
+
+	printf("wrote %llu extents mapping %llu blocks from %d sorted runs to '%s'\n",
+	       nr_extents, nr_blocks, ri.nr_runs, path);
+	ret = 0;
+out:
+	if (ret == -EIO && fp)
+		fprintf(stderr, "error writing '%s': %s (%d)\n",
+			path, strerror(errno), errno);
+	if (fp && fclose(fp) && ret == 0)
+		ret = -EIO;
+	for (i = 0; i < nr_fds; i++) {
+		if (fds[i] >= 0)
+			close(fds[i]);
+	}
+	free(fds);
+	free(ri.runs);
+	block_put(bc, bl);
+	return ret;
+}
+
+static struct option build_ops[] = {
+	{ "mmap", 0, NULL, 'm' },
+	{ "threads", 1, NULL, 't' },
+	{ "tmpdir", 1, NULL, 'T' },
+	{ NULL, 0, NULL, 0}
+};
+
+static int rmap_build_cmd(int argc, char **argv)
+{
+	struct block_cache *bc;
+	bool use_mmap = false;
+	char *tmpdir = NULL;
+	char *dir_path = NULL;
+	int nr_threads = 0;
+	char *map_path;
+	char *path;
+	int ret;
+	int fd;
+	int c;
+
+	while ((c = getopt_long(argc, argv, "mt:T:", build_ops, NULL)) != -1) {
+		switch (c) {
+		case 'm':
+			use_mmap = true;
+			break;
+		case 't':
+			ret = parse_threads(optarg, &nr_threads);
+			if (ret)
+				return ret;
+			break;
+		case 'T':
+			tmpdir = optarg;
+			break;
+		case '?':
+		default:
+			return -EINVAL;
+		}
+	}
+
+	if (optind != argc - 2) {
+		printf("scoutfs rmap-build: device and map file arguments are required\n");
+		return -EINVAL;
+	}
+	path = argv[optind];
+	map_path = argv[optind + 1];
+
+	/* runs are written next to the map file by default */
+	if (!tmpdir) {
+		dir_path = strdup(map_path);
+		if (!dir_path)
+			return -ENOMEM;
+		tmpdir = dirname(dir_path);
+	}
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		ret = -errno;
+		fprintf(stderr, "failed to open '%s': %s (%d)\n",
+			path, strerror(errno), errno);
+		goto out;
+	}
+
+	if (nr_threads == 0)
+		nr_threads = workq_nr_threads();
+
+	bc = block_cache_open(path, fd, use_mmap);
+	if (!bc) {
+		close(fd);
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	ret = build_rmap(bc, map_path, tmpdir, nr_threads);
+
+	block_cache_destroy(bc);
+	close(fd);
+out:
+	free(dir_path);
+	return ret;
+}
+
+/*
+ * Return the index of the first extent that could contain the blkno.
+ * The build clips overlapping extents so their ends are sorted along
+ * with their starts.
+ */
+static u64 search_blkno(struct rmap_extent *exts, u64 nr, u64 blkno)
+{
+	u64 start = 0;
+	u64 end = nr;
+	u64 mid;
+
+	while (start < end) {
+		mid = start + ((end - start) / 2);
+		if (le64_to_cpu(exts[mid].blkno) +
+		    le32_to_cpu(exts[mid].count) <= blkno)
+			start = mid + 1;
+		else
+			end = mid;
+	}
+
+	return start;
+}
+
+static int query_rmap(void *map, size_t size, u64 blkno, u64 count)
+{
+	struct rmap_header *hdr = map;
+	struct rmap_extent *exts;
+	struct rmap_extent *ext;
+	u64 last = blkno + count - 1;
+	u64 found = 0;
+	u64 start;
+	u64 end;
+	u64 nr;
+	u64 i;
+
+	if (size < sizeof(*hdr) || le64_to_cpu(hdr->magic) != RMAP_MAGIC ||
+	    le32_to_cpu(hdr->version) != RMAP_VERSION ||
+	    le32_to_cpu(hdr->extent_size) != sizeof(struct rmap_extent)) {
+		fprintf(stderr, "file isn't a version %u reverse map\n",
+			RMAP_VERSION);
+		return -EINVAL;
+	}
+
+	nr = le64_to_cpu(hdr->nr_extents);
+	if (size != sizeof(*hdr) + (nr * sizeof(struct rmap_extent))) {
+		fprintf(stderr, "reverse map size %zu doesn't match %llu extents\n",
+			size, nr);
+		return -EIO;
+	}
+	exts = map + sizeof(*hdr);
+
+	printf("%16s %10s %20s %16s %s\n",
+	       "blkno", "count", "ino", "iblock", "flags");
+
+	for (i = search_blkno(exts, nr, blkno); i < nr; i++) {
+		ext = &exts[i];
+		start = le64_to_cpu(ext->blkno);
+		end = start + le32_to_cpu(ext->count) - 1;
+		if (start > last)
+			break;
+
+		/* only print the blocks in the query range */
+		start = max(start, blkno);
+		end = min(end, last);
+
+		printf("%16llu %10llu %20llu %16llu %s\n",
+		       start, end - start + 1, le64_to_cpu(ext->ino),
+		       le64_to_cpu(ext->iblock) + (start - le64_to_cpu(ext->blkno)),
+		       flag_strs[le32_to_cpu(ext->flags) &
+				 (SEF_OFFLINE | SEF_UNWRITTEN)]);
+		found += end - start + 1;
+	}
+
+	printf("%llu of %llu blocks mapped by files in fsid %016llx\n",
+	       found, count, le64_to_cpu(hdr->fsid));
+
+	return 0;
+}
+
+static int rmap_query_cmd(int argc, char **argv)
+{
+	struct stat st;
+	void *map;
+	char *path;
+	u64 blkno;
+	u64 count = 1;
+	int ret;
+	int fd;
+
+	if (argc != 3 && argc != 4) {
+		printf("scoutfs rmap-query: map file and blkno arguments are required\n");
+		return -EINVAL;
+	}
+	path = argv[1];
+
+	ret = parse_u64(argv[2], &blkno);
+	if (ret == 0 && argc == 4)
+		ret = parse_u64(argv[3], &count);
+	if (ret < 0)
+		return ret;
+	if (count == 0 || blkno + count < blkno) {
+		fprintf(stderr, "invalid range of %llu blocks at blkno %llu\n",
+			count, blkno);
+		return -EINVAL;
+	}
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		ret = -errno;
+		fprintf(stderr, "failed to open '%s': %s (%d)\n",
+			path, strerror(errno), errno);
+		return ret;
+	}
+
+	if (fstat(fd, &st)) {
+		ret = -errno;
+		fprintf(stderr, "failed to stat '%s': %s (%d)\n",
+			path, strerror(errno), errno);
+		goto out;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		ret = -errno;
+		fprintf(stderr, "failed to map '%s': %s (%d)\n",
+			path, strerror(errno), errno);
+		goto out;
+	}
+
+	ret = query_rmap(map, st.st_size, blkno, count);
+
+	munmap(map, st.st_size);
+out:
+	close(fd);
+	return ret;
+}
+
+static void __attribute__((constructor)) rmap_ctor(void)
+{
+	cmd_register("rmap-build",
+		     "[--mmap] [--threads nr] [--tmpdir dir] <device> <file>",
+		     "build a map from data blknos to the files that use them",
+		     rmap_build_cmd);
+	cmd_register("rmap-query", "<file> <blkno> [count]",
+		     "print the files that use a range of data blocks",
+		     rmap_query_cmd);
+}
@@ -15,6 +15,8 @@ extern unsigned int __builtin_ia32_crc32di(unsigned int, unsigned long long);
 extern unsigned int __builtin_ia32_crc32si(unsigned int, unsigned int);
 extern unsigned int __builtin_ia32_crc32hi(unsigned int, unsigned short);
 extern unsigned int __builtin_ia32_crc32qi(unsigned int, unsigned char);
+extern void __builtin_cpu_init(void);
+extern int __builtin_cpu_supports(const char *);
 
 #else
 # define __force
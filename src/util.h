@@ -4,6 +4,7 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdbool.h>
 #include <math.h>
 
 /*
@@ -98,4 +99,14 @@ static inline int memcmp_lens(const void *a, int a_len,
 	return memcmp(a, b, len) ?: a_len - b_len;
 }
 
+/*
+ * Dirent names read from an image are only used as single components
+ * of paths that are created if they can't escape their directory.
+ */
+static inline bool dirent_name_valid(const char *name)
+{
+	return name[0] != '\0' && strchr(name, '/') == NULL &&
+	       strcmp(name, ".") != 0 && strcmp(name, "..") != 0;
+}
+
 #endif
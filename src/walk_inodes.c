@@ -8,12 +8,20 @@
 #include <errno.h>
 #include <string.h>
 #include <limits.h>
+#include <getopt.h>
+#include <stdbool.h>
+#include <pthread.h>
 
 #include "sparse.h"
 #include "util.h"
 #include "format.h"
 #include "ioctl.h"
 #include "cmd.h"
+#include "parse.h"
+#include "key.h"
+#include "block.h"
+#include "forest.h"
+#include "workq.h"
 
 /*
  * Parse the command line specification of a walk inodes entry of the
@@ -42,7 +50,7 @@ static int parse_walk_entry(struct scoutfs_ioctl_walk_inodes_entry *ent,
 		if (*endptr != '\0' ||
 		    ((ull == LLONG_MIN || ull == LLONG_MAX) &&
 		     errno == ERANGE) ||
-		    (val == &minor && (*val < INT_MIN || *val > INT_MAX))) {
+		    (val == &minor && ull > UINT_MAX)) {
 			fprintf(stderr, "bad index pos at '%s'\n", str);
 			return -EINVAL;
 		}
@@ -66,25 +74,279 @@ static int parse_walk_entry(struct scoutfs_ioctl_walk_inodes_entry *ent,
 	return 0;
 }
 
+static void print_entry(u64 nr, struct scoutfs_ioctl_walk_inodes_entry *ent)
+{
+	if (nr % 25 == 0)
+		printf("%-20s %-20s %-10s %-20s\n",
+		       "#", "major", "minor", "ino");
+
+	printf("%-20llu %-20llu %-10u %-20llu\n",
+	       nr, ent->major, ent->minor, ent->ino);
+}
+
+/*
+ * Offline walks read the index items from the fs_root and log trees of
+ * an unmounted device or image.  The range of index keys is split into
+ * pieces at fs_root parent keys and each piece is walked by a thread.
+ * Pieces are printed in order as they finish and only a window of
+ * pieces past the one being printed are walked at a time, so only the
+ * entries of the pieces in the window are buffered.
+ */
+struct offline_walk {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+};
+
+struct offline_piece {
+	struct work work;
+	struct offline_walk *ow;
+	struct forest *fo;
+	struct scoutfs_key first;
+	struct scoutfs_key last;
+	struct scoutfs_ioctl_walk_inodes_entry *ents;
+	u64 nr;
+	u64 alloced;
+	bool done;
+	int err;
+};
+
+/* the walk is split into about this many pieces per thread */
+#define OFFLINE_PIECES_PER_THREAD 16
+/* and this many pieces per thread are walked ahead of printing */
+#define OFFLINE_WINDOW_PER_THREAD 2
+
+static void init_index_key(struct scoutfs_key *key, u8 type,
+			   struct scoutfs_ioctl_walk_inodes_entry *ent)
+{
+	memset(key, 0, sizeof(*key));
+	key->sk_zone = SCOUTFS_INODE_INDEX_ZONE;
+	key->sk_type = type;
+	key->skii_major = cpu_to_le64(ent->major);
+	key->skii_ino = cpu_to_le64(ent->ino);
+}
+
+static int add_entry(struct scoutfs_key *key, void *val, unsigned val_len,
+		     void *arg)
+{
+	struct offline_piece *op = arg;
+	struct scoutfs_ioctl_walk_inodes_entry *ents;
+
+	if (op->nr == op->alloced) {
+		op->alloced = max(op->alloced * 2, 1024ULL);
+		ents = realloc(op->ents, op->alloced * sizeof(*ents));
+		if (!ents)
+			return -ENOMEM;
+		op->ents = ents;
+	}
+
+	ents = &op->ents[op->nr++];
+	ents->major = le64_to_cpu(key->skii_major);
+	ents->minor = 0;
+	ents->ino = le64_to_cpu(key->skii_ino);
+	return 0;
+}
+
+static void offline_worker(struct work *work)
+{
+	struct offline_piece *op = container_of(work, struct offline_piece,
+						work);
+	struct offline_walk *ow = op->ow;
+	int err;
+
+	err = forest_walk(op->fo, &op->first, &op->last, add_entry, op);
+
+	pthread_mutex_lock(&ow->mutex);
+	op->err = err;
+	op->done = true;
+	pthread_cond_broadcast(&ow->cond);
+	pthread_mutex_unlock(&ow->mutex);
+}
+
+static int walk_offline(char *path, u8 type,
+			struct scoutfs_ioctl_walk_inodes_entry *first_ent,
+			struct scoutfs_ioctl_walk_inodes_entry *last_ent,
+			int nr_threads)
+{
+	struct offline_walk ow = {
+		.mutex = PTHREAD_MUTEX_INITIALIZER,
+		.cond = PTHREAD_COND_INITIALIZER,
+	};
+	struct offline_piece *pieces = NULL;
+	struct offline_piece *op;
+	struct scoutfs_super_block *super;
+	struct scoutfs_key *keys = NULL;
+	struct scoutfs_key first;
+	struct scoutfs_key last;
+	struct block_cache *bc = NULL;
+	struct forest *fo = NULL;
+	struct workq *wq = NULL;
+	struct block *bl = NULL;
+	u64 total = 0;
+	int nr_keys = 0;
+	int queued;
+	int window;
+	int ret;
+	int fd;
+	int i;
+	u64 j;
+
+	init_index_key(&first, type, first_ent);
+	init_index_key(&last, type, last_ent);
+	if (scoutfs_key_compare(&first, &last) > 0)
+		return 0;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		ret = -errno;
+		fprintf(stderr, "failed to open '%s': %s (%d)\n",
+			path, strerror(errno), errno);
+		return ret;
+	}
+
+	if (nr_threads == 0)
+		nr_threads = workq_nr_threads();
+
+	bc = block_cache_open(path, fd, false);
+	wq = workq_create(nr_threads);
+	if (!bc || !wq) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	bl = block_read(bc, SCOUTFS_SUPER_BLKNO);
+	if (!bl) {
+		ret = -EIO;
+		goto out;
+	}
+	super = block_data(bl);
+
+	if (le32_to_cpu(super->hdr.magic) != SCOUTFS_BLOCK_MAGIC_SUPER) {
+		fprintf(stderr, "super block magic %08x != expected %08x\n",
+			le32_to_cpu(super->hdr.magic),
+			SCOUTFS_BLOCK_MAGIC_SUPER);
+		ret = -EIO;
+		goto out;
+	}
+
+	ret = forest_open(bc, super, &fo) ?:
+	      forest_split(fo, &first, &last,
+			   nr_threads * OFFLINE_PIECES_PER_THREAD,
+			   &keys, &nr_keys);
+	if (ret < 0)
+		goto out;
+
+	pieces = calloc(nr_keys + 1, sizeof(*pieces));
+	if (!pieces) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	for (i = 0; i <= nr_keys; i++) {
+		work_init(&pieces[i].work, offline_worker);
+		pieces[i].ow = &ow;
+		pieces[i].fo = fo;
+		if (i == 0) {
+			pieces[i].first = first;
+		} else {
+			pieces[i].first = keys[i - 1];
+			scoutfs_key_inc(&pieces[i].first);
+		}
+		pieces[i].last = i < nr_keys ? keys[i] : last;
+	}
+
+	window = nr_threads * OFFLINE_WINDOW_PER_THREAD;
+	queued = 0;
+
+	for (i = 0; i <= nr_keys; i++) {
+		while (queued <= nr_keys && queued < i + window)
+			workq_queue(wq, &pieces[queued++].work);
+
+		op = &pieces[i];
+		pthread_mutex_lock(&ow.mutex);
+		while (!op->done)
+			pthread_cond_wait(&ow.cond, &ow.mutex);
+		pthread_mutex_unlock(&ow.mutex);
+
+		ret = op->err;
+		if (ret < 0)
+			goto out;
+
+		for (j = 0; j < op->nr; j++)
+			print_entry(total++, &op->ents[j]);
+
+		free(op->ents);
+		op->ents = NULL;
+	}
+
+	ret = 0;
+out:
+	/* finish the queued pieces before freeing them */
+	workq_destroy(wq);
+	if (pieces) {
+		for (i = 0; i <= nr_keys; i++)
+			free(pieces[i].ents);
+		free(pieces);
+	}
+	free(keys);
+	forest_close(fo);
+	if (bl)
+		block_put(bc, bl);
+	if (bc)
+		block_cache_destroy(bc);
+	close(fd);
+	return ret;
+}
+
+static struct option long_ops[] = {
+	{ "offline", 0, NULL, 'o' },
+	{ "threads", 1, NULL, 't' },
+	{ NULL, 0, NULL, 0}
+};
+
 static int walk_inodes_cmd(int argc, char **argv)
 {
 	struct scoutfs_ioctl_walk_inodes_entry ents[128];
 	struct scoutfs_ioctl_walk_inodes walk;
+	bool offline = false;
+	int nr_threads = 0;
 	u64 total = 0;
+	u8 type;
 	int ret;
 	int fd;
 	int i;
+	int c;
+
+	/* stop at the first argument, last positions can be -1 */
+	while ((c = getopt_long(argc, argv, "+ot:", long_ops, NULL)) != -1) {
+		switch (c) {
+		case 'o':
+			offline = true;
+			break;
+		case 't':
+			ret = parse_threads(optarg, &nr_threads);
+			if (ret)
+				return ret;
+			break;
+		case '?':
+		default:
+			return -EINVAL;
+		}
+	}
+	argc -= optind - 1;
+	argv += optind - 1;
 
 	if (argc != 5) {
 		fprintf(stderr, "must specify seq and path\n");
 		return -EINVAL;
 	}
 
-	if (!strcasecmp(argv[1], "meta_seq"))
+	if (!strcasecmp(argv[1], "meta_seq")) {
 		walk.index = SCOUTFS_IOC_WALK_INODES_META_SEQ;
-	else if (!strcasecmp(argv[1], "data_seq"))
+		type = SCOUTFS_INODE_INDEX_META_SEQ_TYPE;
+	} else if (!strcasecmp(argv[1], "data_seq")) {
 		walk.index = SCOUTFS_IOC_WALK_INODES_DATA_SEQ;
-	else {
+		type = SCOUTFS_INODE_INDEX_DATA_SEQ_TYPE;
+	} else {
 		fprintf(stderr, "unknown index '%s', try 'meta_seq' or "
 				"'data_seq'\n", argv[1]);
 		return -EINVAL;
@@ -106,6 +368,10 @@ static int walk_inodes_cmd(int argc, char **argv)
 
 	}
 
+	if (offline)
+		return walk_offline(argv[4], type, &walk.first, &walk.last,
+				    nr_threads);
+
 	fd = open(argv[4], O_RDONLY);
 	if (fd < 0) {
 		ret = -errno;
@@ -128,15 +394,8 @@ static int walk_inodes_cmd(int argc, char **argv)
 			break;
 		}
 
-		for (i = 0; i < ret; i++) {
-			if ((total + i) % 25 == 0)
-				printf("%-20s %-20s %-10s %-20s\n",
-				       "#", "major", "minor", "ino");
-
-			printf("%-20llu %-20llu %-10u %-20llu\n",
-			       total + i, ents[i].major, ents[i].minor,
-			       ents[i].ino);
-		}
+		for (i = 0; i < ret; i++)
+			print_entry(total + i, &ents[i]);
 
 		total += i;
 
@@ -151,6 +410,6 @@ static int walk_inodes_cmd(int argc, char **argv)
 
 static void __attribute__((constructor)) walk_inodes_ctor(void)
 {
-	cmd_register("walk-inodes", "<index> <first> <last> <path>",
+	cmd_register("walk-inodes", "[--offline] [--threads nr] <index> <first> <last> <path>",
 		     "print range of indexed inodes", walk_inodes_cmd);
 }
@@ -0,0 +1,147 @@
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "sparse.h"
+#include "util.h"
+#include "list.h"
+#include "workq.h"
+
+/*
+ * A trivial pool of threads that execute queued work.  Work is executed
+ * in the order it was queued but many work items can be executing at
+ * once so callers have to provide their own ordering if they need it.
+ */
+struct workq {
+	pthread_mutex_t mutex;
+	pthread_cond_t work_cond;
+	pthread_cond_t idle_cond;
+	struct list_head list;
+	unsigned int busy;
+	bool stopping;
+	int nr_threads;
+	pthread_t threads[0];
+};
+
+static void *workq_thread(void *arg)
+{
+	struct workq *wq = arg;
+	struct work *work;
+
+	pthread_mutex_lock(&wq->mutex);
+	for (;;) {
+		while (list_empty(&wq->list) && !wq->stopping)
+			pthread_cond_wait(&wq->work_cond, &wq->mutex);
+
+		if (list_empty(&wq->list))
+			break;
+
+		work = list_first_entry(&wq->list, struct work, head);
+		list_del_init(&work->head);
+		wq->busy++;
+		pthread_mutex_unlock(&wq->mutex);
+
+		work->func(work);
+
+		pthread_mutex_lock(&wq->mutex);
+		if (--wq->busy == 0 && list_empty(&wq->list))
+			pthread_cond_broadcast(&wq->idle_cond);
+	}
+	pthread_mutex_unlock(&wq->mutex);
+
+	return NULL;
+}
+
+struct workq *workq_create(int nr_threads)
+{
+	struct workq *wq;
+	int ret;
+	int i;
+
+	nr_threads = max(nr_threads, 1);
+
+	wq = calloc(1, offsetof(struct workq, threads[nr_threads]));
+	if (!wq)
+		return NULL;
+
+	pthread_mutex_init(&wq->mutex, NULL);
+	pthread_cond_init(&wq->work_cond, NULL);
+	pthread_cond_init(&wq->idle_cond, NULL);
+	INIT_LIST_HEAD(&wq->list);
+
+	for (i = 0; i < nr_threads; i++) {
+		ret = pthread_create(&wq->threads[i], NULL, workq_thread, wq);
+		if (ret) {
+			fprintf(stderr, "failed to create work thread: %s (%d)\n",
+				strerror(ret), ret);
+			break;
+		}
+		wq->nr_threads++;
+	}
+
+	if (wq->nr_threads == 0) {
+		free(wq);
+		return NULL;
+	}
+
+	return wq;
+}
+
+void workq_queue(struct workq *wq, struct work *work)
+{
+	pthread_mutex_lock(&wq->mutex);
+	list_add_tail(&work->head, &wq->list);
+	pthread_cond_signal(&wq->work_cond);
+	pthread_mutex_unlock(&wq->mutex);
+}
+
+/*
+ * Wait for all the queued work to finish executing.  Work that is
+ * queued by executing work is also waited for.
+ */
+void workq_wait(struct workq *wq)
+{
+	pthread_mutex_lock(&wq->mutex);
+	while (wq->busy || !list_empty(&wq->list))
+		pthread_cond_wait(&wq->idle_cond, &wq->mutex);
+	pthread_mutex_unlock(&wq->mutex);
+}
+
+/*
+ * Execute all the remaining queued work and then stop the threads.
+ */
+void workq_destroy(struct workq *wq)
+{
+	int i;
+
+	if (!wq)
+		return;
+
+	pthread_mutex_lock(&wq->mutex);
+	wq->stopping = true;
+	pthread_cond_broadcast(&wq->work_cond);
+	pthread_mutex_unlock(&wq->mutex);
+
+	for (i = 0; i < wq->nr_threads; i++)
+		pthread_join(wq->threads[i], NULL);
+
+	pthread_mutex_destroy(&wq->mutex);
+	pthread_cond_destroy(&wq->work_cond);
+	pthread_cond_destroy(&wq->idle_cond);
+	free(wq);
+}
+
+/*
+ * The default number of threads for commands that are limited by cpu
+ * rather than device latency.
+ */
+int workq_nr_threads(void)
+{
+	long nr = sysconf(_SC_NPROCESSORS_ONLN);
+
+	return nr > 0 ? nr : 1;
+}
@@ -0,0 +1,31 @@
+#ifndef _WORKQ_H_
+#define _WORKQ_H_
+
+#include "list.h"
+
+/*
+ * Work is queued on a list and executed by one of the workq's
+ * threads.  The work struct is usually embedded in a larger struct
+ * that the work function finds with container_of().
+ */
+struct work {
+	struct list_head head;
+	void (*func)(struct work *work);
+};
+
+struct workq;
+
+static inline void work_init(struct work *work,
+			     void (*func)(struct work *work))
+{
+	INIT_LIST_HEAD(&work->head);
+	work->func = func;
+}
+
+struct workq *workq_create(int nr_threads);
+void workq_queue(struct workq *wq, struct work *work);
+void workq_wait(struct workq *wq);
+void workq_destroy(struct workq *wq);
+int workq_nr_threads(void);
+
+#endif
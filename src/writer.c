@@ -0,0 +1,156 @@
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+
+#include "sparse.h"
+#include "util.h"
+#include "writer.h"
+
+/*
+ * A writer gathers small writes in a large buffer so that commands
+ * which stream enormous amounts of output make a write(2) call for
+ * every few megabytes instead of going through stdio for every field.
+ *
+ * The first error is remembered and all following writes are dropped.
+ * Callers check the error when they're done, typically as the writer
+ * is destroyed.
+ */
+struct writer {
+	int fd;
+	int err;
+	size_t size;
+	size_t len;
+	char buf[0];
+};
+
+struct writer *writer_create(int fd, size_t size)
+{
+	struct writer *wr;
+
+	wr = malloc(offsetof(struct writer, buf[size]));
+	if (!wr) {
+		fprintf(stderr, "failed to allocate %zu byte writer buffer\n",
+			size);
+		return NULL;
+	}
+
+	wr->fd = fd;
+	wr->err = 0;
+	wr->size = size;
+	wr->len = 0;
+
+	return wr;
+}
+
+int writer_flush(struct writer *wr)
+{
+	size_t off = 0;
+	ssize_t ret;
+
+	while (!wr->err && off < wr->len) {
+		ret = write(wr->fd, wr->buf + off, wr->len - off);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			wr->err = -errno;
+			fprintf(stderr, "output write failed: %s (%d)\n",
+				strerror(errno), errno);
+			break;
+		}
+		off += ret;
+	}
+
+	wr->len = 0;
+	return wr->err;
+}
+
+/*
+ * Flush any remaining buffered output and free the writer, returning
+ * the first error that was hit by any write.
+ */
+int writer_destroy(struct writer *wr)
+{
+	int ret;
+
+	if (!wr)
+		return 0;
+
+	ret = writer_flush(wr);
+	free(wr);
+
+	return ret;
+}
+
+int writer_error(struct writer *wr)
+{
+	return wr->err;
+}
+
+void writer_bytes(struct writer *wr, const void *data, size_t len)
+{
+	size_t part;
+
+	while (len && !wr->err) {
+		if (wr->len == wr->size)
+			writer_flush(wr);
+
+		part = min(len, wr->size - wr->len);
+		memcpy(wr->buf + wr->len, data, part);
+		wr->len += part;
+		data += part;
+		len -= part;
+	}
+}
+
+void writer_str(struct writer *wr, const char *str)
+{
+	writer_bytes(wr, str, strlen(str));
+}
+
+void writer_char(struct writer *wr, char c)
+{
+	if (wr->len == wr->size)
+		writer_flush(wr);
+
+	if (!wr->err)
+		wr->buf[wr->len++] = c;
+}
+
+void writer_u64(struct writer *wr, u64 val)
+{
+	char buf[20];
+	int i = sizeof(buf);
+
+	do {
+		buf[--i] = '0' + (val % 10);
+		val /= 10;
+	} while (val);
+
+	writer_bytes(wr, buf + i, sizeof(buf) - i);
+}
+
+void writer_s64(struct writer *wr, s64 val)
+{
+	if (val < 0) {
+		writer_char(wr, '-');
+		writer_u64(wr, -(u64)val);
+	} else {
+		writer_u64(wr, val);
+	}
+}
+
+void writer_hex(struct writer *wr, u64 val)
+{
+	static const char digits[] = "0123456789abcdef";
+	char buf[16];
+	int i = sizeof(buf);
+
+	do {
+		buf[--i] = digits[val & 0xf];
+		val >>= 4;
+	} while (val);
+
+	writer_bytes(wr, buf + i, sizeof(buf) - i);
+}
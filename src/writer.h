@@ -0,0 +1,26 @@
+#ifndef _WRITER_H_
+#define _WRITER_H_
+
+#include <stddef.h>
+
+/*
+ * The default size of a writer's buffer.  Output is only written to
+ * the file once this much has been buffered.
+ */
+#define WRITER_DEFAULT_BYTES (4 * 1024 * 1024)
+
+struct writer;
+
+struct writer *writer_create(int fd, size_t size);
+int writer_destroy(struct writer *wr);
+int writer_flush(struct writer *wr);
+int writer_error(struct writer *wr);
+
+void writer_bytes(struct writer *wr, const void *data, size_t len);
+void writer_str(struct writer *wr, const char *str);
+void writer_char(struct writer *wr, char c);
+void writer_u64(struct writer *wr, u64 val);
+void writer_s64(struct writer *wr, s64 val);
+void writer_hex(struct writer *wr, u64 val);
+
+#endif